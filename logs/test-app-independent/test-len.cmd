@@ -1,5 +1,5 @@
 @echo off
-For %%i In (linear rgrid fgrid kdtree sah convex convex_s) Do (
+For %%i In (linear rgrid fgrid kdtree sah convex convex_s bvh) Do (
     del len-%%i.log
     For %%j In (100 200 300 400 600 800 1000 1500 2000 3000 4000) Do (
         For /L %%k In (1, 1, 10) Do (
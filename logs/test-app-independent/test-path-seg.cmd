@@ -1,6 +1,6 @@
 @echo off
-For %%i in (rgrid fgrid kdtree sah convex convex_s) Do (
-:For %%i In (linear rgrid fgrid kdtree sah convex convex_s) Do (
+For %%i in (rgrid fgrid kdtree sah convex convex_s bvh) Do (
+:For %%i In (linear rgrid fgrid kdtree sah convex convex_s bvh) Do (
     del path-seg-%%i.log
     For %%j In (150 300 450 600 900 1200 1500 2100 3000) Do (
         For /L %%k In (1, 1, 10) Do (
@@ -12,6 +12,7 @@ public:
     Accelerator(Tunnel *tunnel) : tunnel(tunnel) {}
     virtual void init() = 0;
     virtual IntersectResult intersect(Ray &ray) = 0;
+    virtual void printStats() {} // the statistics of the traversal, if any
 };
 
 #endif
@@ -0,0 +1,432 @@
+#include "BvhAcc.h"
+#include "Utils.h"
+#include <float.h>
+#include <algorithm>
+#include <omp.h> // OpenMP
+
+const float BvhAcc::KT = 1.0f;
+const float BvhAcc::KI = 1.5f;
+
+// Half of the surface area of a box
+static float halfArea(const Point &min, const Point &max)
+{
+    Vector size(min, max);
+    return size.x * size.y + size.y * size.z + size.z * size.x;
+}
+
+static void growBox(Point &min, Point &max, const Point &p)
+{
+    min.x = std::min(min.x, p.x);
+    min.y = std::min(min.y, p.y);
+    min.z = std::min(min.z, p.z);
+
+    max.x = std::max(max.x, p.x);
+    max.y = std::max(max.y, p.y);
+    max.z = std::max(max.z, p.z);
+}
+
+// The slab test, returns whether the ray enters the box before maxDistance
+static bool intersectBox(const Point &min, const Point &max, const Ray &ray, const float invDir[3],
+                         float maxDistance, float &distance)
+{
+    float entry = 0.0f;
+    float exit = maxDistance;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float t0 = (min[axis] - ray.origin[axis]) * invDir[axis];
+        float t1 = (max[axis] - ray.origin[axis]) * invDir[axis];
+        if (invDir[axis] < 0)
+        {
+            std::swap(t0, t1);
+        }
+
+        // A NaN (the ray lies in a face of the box) keeps the old value
+        entry = (t0 > entry) ? t0 : entry;
+        exit = (t1 < exit) ? t1 : exit;
+    }
+
+    distance = entry;
+    return entry <= exit;
+}
+
+float BvhAcc::findSplit(std::vector<BvhTriangle> &list, int begin, int end, const Point &min, const Point &max,
+                        const Point &centerMin, const Point &centerMax, bool parallel, int &bestAxis, int &bestBin)
+{
+    // SA: Surface area (total)
+    // SAL: Surface area of the left child
+    // SAR: Surface area of the right child
+    // Cost = KT + KI * ((SAL / SA) * NL + (SAR / SA) * NR)
+    float SA = halfArea(min, max);
+
+    // The best plane of each axis, the axes are binned in parallel at the top of the hierarchy
+    float axisCost[3];
+    int axisBin[3];
+
+    #pragma omp parallel for if (parallel)
+    for (int axis = 0; axis < 3; axis++)
+    {
+        axisCost[axis] = FLT_MAX;
+        axisBin[axis] = 0;
+
+        float extent = centerMax[axis] - centerMin[axis];
+        if (extent <= 0.0f) // all centroids lie in a plane
+            continue;
+        float scale = NUM_BINS / extent;
+
+        // Put the centroids into the bins
+        BvhBin bins[NUM_BINS];
+        for (int i = 0; i < NUM_BINS; i++)
+        {
+            bins[i].min = Point(FLT_MAX, FLT_MAX, FLT_MAX);
+            bins[i].max = Point(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+            bins[i].count = 0;
+        }
+
+        for (int i = begin; i < end; i++)
+        {
+            int bin = std::min((int)((list[i].center[axis] - centerMin[axis]) * scale), NUM_BINS - 1);
+            bins[bin].count += 1;
+            growBox(bins[bin].min, bins[bin].max, list[i].min);
+            growBox(bins[bin].min, bins[bin].max, list[i].max);
+        }
+
+        // Sweep from the right, plane #i lies between bin #(i - 1) and bin #i
+        float rightArea[NUM_BINS];
+        int rightCount[NUM_BINS];
+        Point boxMin(FLT_MAX, FLT_MAX, FLT_MAX);
+        Point boxMax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+        int count = 0;
+
+        for (int i = NUM_BINS - 1; i > 0; i--)
+        {
+            count += bins[i].count;
+            growBox(boxMin, boxMax, bins[i].min);
+            growBox(boxMin, boxMax, bins[i].max);
+            rightArea[i] = halfArea(boxMin, boxMax);
+            rightCount[i] = count;
+        }
+
+        // Sweep from the left
+        boxMin = Point(FLT_MAX, FLT_MAX, FLT_MAX);
+        boxMax = Point(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+        count = 0;
+
+        for (int i = 1; i < NUM_BINS; i++)
+        {
+            count += bins[i - 1].count;
+            growBox(boxMin, boxMax, bins[i - 1].min);
+            growBox(boxMin, boxMax, bins[i - 1].max);
+
+            // Should not split the triangles into two parts, one empty and the other full
+            if (count == 0 || rightCount[i] == 0)
+                continue;
+
+            float SAL = halfArea(boxMin, boxMax);
+            float SAR = rightArea[i];
+            float cost = KT + KI * ((SAL / SA) * count + (SAR / SA) * rightCount[i]);
+            if (cost < axisCost[axis])
+            {
+                axisCost[axis] = cost;
+                axisBin[axis] = i;
+            }
+        }
+    }
+
+    float minCost = FLT_MAX;
+    bestAxis = NoAxis;
+    bestBin = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (axisCost[axis] < minCost)
+        {
+            minCost = axisCost[axis];
+            bestAxis = axis;
+            bestBin = axisBin[axis];
+        }
+    }
+    return minCost;
+}
+
+void BvhAcc::buildBvh(BvhBuildContext &context, std::vector<BvhTriangle> &list, int begin, int end, int depth)
+{
+    int index = context.nodes.size();
+    context.nodes.push_back(BvhNode());
+
+    // The bounding box of the triangles, and that of their centroids
+    Point min(FLT_MAX, FLT_MAX, FLT_MAX);
+    Point max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    Point centerMin = min;
+    Point centerMax = max;
+
+    for (int i = begin; i < end; i++)
+    {
+        growBox(min, max, list[i].min);
+        growBox(min, max, list[i].max);
+        growBox(centerMin, centerMax, list[i].center);
+    }
+    context.nodes[index].min = min;
+    context.nodes[index].max = max;
+
+    int numTriangles = end - begin;
+
+    // Leave the subtree to a job when the hierarchy is built in parallel
+    if (context.jobs != NULL && numTriangles <= context.jobCutoff)
+    {
+        BvhBuildJob *job = new BvhBuildJob;
+        job->begin = begin;
+        job->end = end;
+        job->depth = depth;
+
+        context.nodes[index].offset = -1 - (int)context.jobs->size();
+        context.nodes[index].flags = NoAxis;
+        context.jobs->push_back(job);
+        return;
+    }
+
+    // Find the best split plane
+    int axis = NoAxis;
+    int bin = 0;
+    float cost = FLT_MAX;
+
+    if (numTriangles > 1 && depth < MAX_DEPTH)
+    {
+        bool parallel = (context.jobs != NULL); // the top of the hierarchy
+        cost = findSplit(list, begin, end, min, max, centerMin, centerMax, parallel, axis, bin);
+    }
+
+    // Make a leaf if splitting costs more than intersecting all the triangles
+    if (numTriangles <= 1 || depth >= MAX_DEPTH ||
+        (numTriangles <= MAX_LEAF_SIZE && cost >= KI * numTriangles))
+    {
+        context.nodes[index].offset = begin;
+        context.nodes[index].flags = ((unsigned int)numTriangles << 2) | NoAxis;
+        context.numLeaves += 1;
+        return;
+    }
+
+    // Split the triangle list
+    int mid;
+    if (axis == NoAxis) // the centroids coincide, split in the middle
+    {
+        axis = XAxis;
+        mid = (begin + end) / 2;
+    }
+    else // partition the triangles in place by the bins of their centroids
+    {
+        float scale = NUM_BINS / (centerMax[axis] - centerMin[axis]);
+        int i = begin;
+        int j = end - 1;
+
+        while (i <= j)
+        {
+            if (std::min((int)((list[i].center[axis] - centerMin[axis]) * scale), NUM_BINS - 1) < bin)
+                i += 1;
+            else
+                std::swap(list[i], list[j--]);
+        }
+        mid = i;
+    }
+
+    // Build the children
+    context.nodes[index].flags = axis;
+    buildBvh(context, list, begin, mid, depth + 1);
+    context.nodes[index].offset = context.nodes.size();
+    buildBvh(context, list, mid, end, depth + 1);
+}
+
+void BvhAcc::mergeBvh(BvhBuildContext &top, int index, std::vector<BvhBuildJob *> &jobs)
+{
+    const BvhNode &node = top.nodes[index];
+
+    if (node.axis() == NoAxis && node.offset < 0) // the subtree of a job
+    {
+        std::vector<BvhNode> &subtree = jobs[-1 - node.offset]->context.nodes;
+        int nodeOffset = nodes.size();
+        for (unsigned int i = 0; i < subtree.size(); i++)
+        {
+            nodes.push_back(subtree[i]);
+            if (subtree[i].axis() != NoAxis)
+            {
+                nodes.back().offset += nodeOffset;
+            }
+        }
+    }
+    else if (node.axis() == NoAxis) // leaf
+    {
+        nodes.push_back(node);
+    }
+    else // interior node
+    {
+        int newIndex = nodes.size();
+        nodes.push_back(node);
+        mergeBvh(top, index + 1, jobs);
+        nodes[newIndex].offset = nodes.size();
+        mergeBvh(top, node.offset, jobs);
+    }
+}
+
+void BvhAcc::init()
+{
+    Utils::PrintTickCount("Initialize BVH");
+
+    // Initialize the triangle list
+    int numIds = tunnel->getTriangleId(tunnel->getSegmentCount(), 0);
+    std::vector<BvhTriangle> list;
+    list.reserve(numIds);
+
+    for (int i = 0; i < tunnel->getSegmentCount(); i++)
+    {
+        for (int j = 0; j < tunnel->getTriangleCount(i); j++)
+        {
+            Triangle triangle;
+            BvhTriangle t;
+            t.id = tunnel->getTriangleId(i, j);
+            tunnel->getTriangle(t.id, triangle);
+            triangle.getBoundingBox(t.min, t.max);
+            t.center = Point(
+                (t.min.x + t.max.x) * 0.5f,
+                (t.min.y + t.max.y) * 0.5f,
+                (t.min.z + t.max.z) * 0.5f);
+            list.push_back(t);
+        }
+    }
+
+    // Build the top of the hierarchy
+    int numThreads = omp_get_max_threads();
+    std::vector<BvhBuildJob *> jobs;
+    BvhBuildContext top;
+    top.jobs = (numThreads > 1) ? &jobs : NULL; // build serially with a single thread
+    top.jobCutoff = std::max(4096, (int)list.size() / (8 * numThreads)); // 8 jobs per thread or more
+    buildBvh(top, list, 0, list.size(), 0);
+
+    // Build the subtrees in parallel
+    #pragma omp parallel for schedule(dynamic, 1) // Enable OpenMP
+    for (int i = 0; i < (int)jobs.size(); i++)
+    {
+        BvhBuildJob *job = jobs[i];
+        buildBvh(job->context, list, job->begin, job->end, job->depth);
+    }
+
+    // Merge the subtrees into the flattened hierarchy
+    mergeBvh(top, 0, jobs);
+
+    int leaves = top.numLeaves;
+    for (unsigned int i = 0; i < jobs.size(); i++)
+    {
+        leaves += jobs[i]->context.numLeaves;
+        delete jobs[i];
+    }
+
+    // The triangles of a leaf are a range of the partitioned list, which is packed into blocks
+    // of four triangles. The offset of a leaf is then the index of its first block.
+    blocks.clear();
+    for (unsigned int i = 0; i < nodes.size(); i++)
+    {
+        if (nodes[i].axis() == NoAxis)
+        {
+            int begin = nodes[i].offset;
+            int count = nodes[i].numTriangles();
+            nodes[i].offset = blocks.size();
+            blocks.resize(blocks.size() + TriangleBlock::numBlocks(count));
+
+            for (int j = 0; j < count; j++)
+            {
+                int id = list[begin + j].id;
+                blocks[nodes[i].offset + j / TriangleBlock::SIZE].set(
+                    j % TriangleBlock::SIZE, id, tunnel->getTriangleRecord(id));
+            }
+        }
+    }
+
+    Utils::DbgPrint("Total nodes: %d (%d KB)\r\n", nodes.size(), nodes.size() * sizeof(BvhNode) / 1024);
+    Utils::DbgPrint("Total blocks: %d (%d KB)\r\n", blocks.size(), blocks.size() * sizeof(TriangleBlock) / 1024);
+    Utils::DbgPrint("Total jobs: %d\r\n", jobs.size());
+    Utils::DbgPrint("Total leaves: %d\r\n", leaves);
+    Utils::DbgPrint("Average Leaf Size: %d\r\n", list.size() / std::max(leaves, 1));
+}
+
+// Ordered traversal, the boxes of both children are tested and the nearer one is visited first.
+// The boxes beyond the nearest intersection found so far are skipped.
+IntersectResult BvhAcc::intersect(Ray &ray)
+{
+    float invDir[3] =
+    {
+        1.0f / ray.direction.x,
+        1.0f / ray.direction.y,
+        1.0f / ray.direction.z
+    };
+
+    int minId = -1;
+    float entry;
+    if (!intersectBox(nodes[0].min, nodes[0].max, ray, invDir, ray.tMax, entry))
+        return IntersectResult(false);
+
+    // Stack of the far children to be visited, one for each level at most
+    StackElem stack[MAX_DEPTH];
+    int stackSize = 0;
+
+    const BvhNode *base = &nodes[0];
+    const BvhNode *currNode = base;
+
+    while (true)
+    {
+        if (currNode->axis() != NoAxis)
+        {
+            const BvhNode *left = currNode + 1;
+            const BvhNode *right = base + currNode->offset;
+            float leftEntry;
+            float rightEntry;
+            bool leftHit = intersectBox(left->min, left->max, ray, invDir, ray.tMax, leftEntry);
+            bool rightHit = intersectBox(right->min, right->max, ray, invDir, ray.tMax, rightEntry);
+
+            if (leftHit && rightHit)
+            {
+                // Visit the near child first
+                if (rightEntry < leftEntry)
+                {
+                    std::swap(left, right);
+                    std::swap(leftEntry, rightEntry);
+                }
+                stack[stackSize].node = right;
+                stack[stackSize].t = rightEntry;
+                stackSize += 1;
+                currNode = left;
+                continue;
+            }
+            else if (leftHit)
+            {
+                currNode = left;
+                continue;
+            }
+            else if (rightHit)
+            {
+                currNode = right;
+                continue;
+            }
+        }
+        else
+        {
+            // Current node is a leaf, its triangles are tested four at a time
+            const TriangleBlock *block = &blocks[currNode->offset];
+            int numBlocks = TriangleBlock::numBlocks(currNode->numTriangles());
+            for (int i = 0; i < numBlocks; i++)
+            {
+                int lane = block[i].intersect(ray, ray.tMin, ray.tMax);
+                if (lane >= 0)
+                {
+                    minId = block[i].ids[lane];
+                }
+            }
+        }
+
+        // Pop from stack, skip the nodes entered beyond the nearest intersection
+        do
+        {
+            if (stackSize == 0)
+                return (minId >= 0) ? tunnel->getTriangleHitResult(ray, minId, ray.tMax) : IntersectResult(false);
+            stackSize -= 1;
+        } while (stack[stackSize].t > ray.tMax);
+        currNode = stack[stackSize].node;
+    }
+}
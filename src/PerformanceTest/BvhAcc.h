@@ -0,0 +1,93 @@
+#ifndef BVH_ACC_H
+#define BVH_ACC_H
+
+#include "Accelerator.h"
+#include "TriangleBlock.h"
+
+class BvhAcc : public Accelerator
+{
+private:
+    enum Axes { XAxis, YAxis, ZAxis, NoAxis }; // "NoAxis" denotes a leaf
+    enum { NUM_BINS = 16, MAX_LEAF_SIZE = 4, MAX_DEPTH = 64 };
+
+    // The hierarchy is flattened into an array of 32-byte nodes in depth-first order,
+    // so the first child of an interior node is the node right after it
+    struct BvhNode
+    {
+        Point min;  // the bounding box of the node
+        Point max;
+        int offset; // index of the second child (interior node),
+                    // or index of the first block of the enclosed triangles in blocks (leaf)
+        unsigned int flags; // bits 0-1: the split axis, NoAxis for a leaf
+                            // bits 2-31: the number of enclosed triangles (leaf)
+
+        Axes axis() const { return (Axes)(flags & 3); }
+        unsigned int numTriangles() const { return flags >> 2; }
+    };
+    std::vector<BvhNode> nodes;          // nodes[0] is the root
+    std::vector<TriangleBlock> blocks;   // the enclosed triangles of all leaves, packed by four
+
+    struct StackElem
+    {
+        const BvhNode *node; // the far child
+        float t;             // the entry signed distance of its box
+    };
+
+    // Binned SAH construction
+    // "On fast Construction of SAH-based Bounding Volume Hierarchies" by Ingo Wald
+    // The centroids of the triangles are put into NUM_BINS bins along each axis, and only
+    // the planes between the bins are evaluated. The triangles are partitioned in place, so
+    // the triangles of a leaf are a range of the triangle list.
+    static const float KT; // cost of a traversal step
+    static const float KI; // cost of a ray-triangle intersection
+
+    struct BvhTriangle
+    {
+        Point min;    // the bounding box
+        Point max;
+        Point center; // the centroid of the bounding box
+        int id;
+    };
+    struct BvhBin
+    {
+        Point min;
+        Point max;
+        int count;
+    };
+
+    // Parallel construction, the same as the k-d tree
+    // The top of the hierarchy is built first, and the subtrees that are small enough are left
+    // to jobs. The jobs are built in parallel, each into its own node array, and then merged
+    // in depth-first order. The subtree of a job is represented in the top of the hierarchy by
+    // a placeholder leaf, whose offset is -1 - (index of the job).
+    struct BvhBuildJob;
+    struct BvhBuildContext
+    {
+        std::vector<BvhNode> nodes;
+        std::vector<BvhBuildJob *> *jobs; // where the subtrees are left to, NULL in a job
+        int jobCutoff;                    // the max number of triangles in a subtree left to a job
+        int numLeaves;
+
+        BvhBuildContext() : jobs(NULL), jobCutoff(0), numLeaves(0) {}
+    };
+    struct BvhBuildJob
+    {
+        int begin; // the range of the triangle list
+        int end;
+        int depth;
+        BvhBuildContext context; // the subtree
+    };
+
+private:
+    void buildBvh(BvhBuildContext &context, std::vector<BvhTriangle> &list, int begin, int end, int depth);
+    float findSplit(std::vector<BvhTriangle> &list, int begin, int end, const Point &min, const Point &max,
+        const Point &centerMin, const Point &centerMax, bool parallel, int &bestAxis, int &bestBin);
+    void mergeBvh(BvhBuildContext &top, int index, std::vector<BvhBuildJob *> &jobs);
+
+public:
+    BvhAcc(Tunnel *tunnel) : Accelerator(tunnel) {}
+    virtual void init();
+    virtual IntersectResult intersect(Ray &ray);
+};
+
+#endif
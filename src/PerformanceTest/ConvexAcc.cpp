@@ -1,24 +1,32 @@
 #include "ConvexAcc.h"
-#include "Matrix.h"
 #include "Utils.h"
 
 #include <map>
+#include <malloc.h>
+
+ConvexAcc::~ConvexAcc()
+{
+    if (frames != NULL)
+    {
+        _aligned_free(frames);
+    }
+}
 
 bool ConvexAcc::intersectWithPolygon(Ray &ray, int index, Point &origin, Vector &dir, float &distance)
 {
-    Point p = tunnel->path[index];
-    Vector n = tunnel->nvs[index];
+    const NodeFrame &f = frames[index];
+    const Point &o = ray.origin;
+    const Vector &d = ray.direction;
 
     // By transformaton and rotation, map (ray, p, n) to (ray', (0, 0, 0), (0, 0, -1))
-    // See http://en.wikipedia.org/wiki/Rotation_matrix
-    float theta = PI - atan2(n.x, n.z);
-    Matrix matrix(
-        cos(theta), 0, sin(theta),
-        0,          1, 0,
-       -sin(theta), 0, cos(theta));
-    Vector offset = Vector(p, Point(0, 0, 0));
-    Point newOrigin = matrix * (ray.origin + offset);
-    Vector newDir = matrix * ray.direction;
+    Point newOrigin(
+        f.cosTheta * o.x + f.sinTheta * o.z + f.tx,
+        o.y + f.ty,
+       -f.sinTheta * o.x + f.cosTheta * o.z + f.tz);
+    Vector newDir(
+        f.cosTheta * d.x + f.sinTheta * d.z,
+        d.y,
+       -f.sinTheta * d.x + f.cosTheta * d.z);
 
     bool intersect = intersectWithPolygonAtOrigin(Ray(newOrigin, newDir), distance);
     if (!intersect) // with polygon, but intersect with wall
@@ -175,6 +183,46 @@ ConvexAcc::IntersectionTableResult ConvexAcc::calcCellStatus(
 
 void ConvexAcc::init()
 {
+    // Initialize node frames
+    // See http://en.wikipedia.org/wiki/Rotation_matrix
+    frames = (NodeFrame *)_aligned_malloc(tunnel->path.size() * sizeof(NodeFrame), 64);
+    for (unsigned int i = 0; i < tunnel->path.size(); i++)
+    {
+        const Point &p = tunnel->path[i];
+        const Vector &n = tunnel->nvs[i];
+
+        float theta = PI - atan2(n.x, n.z);
+        float c = cos(theta);
+        float s = sin(theta);
+
+        NodeFrame &f = frames[i];
+        f.cosTheta = c;
+        f.sinTheta = s;
+        f.tx = -(c * p.x + s * p.z);
+        f.ty = -p.y;
+        f.tz = s * p.x - c * p.z;
+        f.reserved[0] = f.reserved[1] = f.reserved[2] = 0.0f;
+    }
+
+    // Pack the triangles of each segment into blocks
+    blocksPerSegment = TriangleBlock::numBlocks(2 * tunnel->crossSection.vertices.size());
+    if (!tunnel->procedural)
+    {
+        int numSegments = tunnel->getSegmentCount();
+        wallBlocks.resize(numSegments * blocksPerSegment);
+
+        #pragma omp parallel for // Enable OpenMP
+        for (int i = 0; i < numSegments; i++)
+        {
+            for (int j = 0; j < tunnel->getTriangleCount(i); j++)
+            {
+                int id = tunnel->getTriangleId(i, j);
+                wallBlocks[i * blocksPerSegment + j / TriangleBlock::SIZE].set(
+                    j % TriangleBlock::SIZE, id, tunnel->getTriangleRecord(id));
+            }
+        }
+    }
+
     // Initialize edge params
     //
     // Given P1(x1, y1), P2(x2, y2) and TARGET(x, y)
@@ -287,24 +335,105 @@ void ConvexAcc::init()
                     mapping.insert(std::multimap<float, int>::value_type(delta, i));
                 }
 
+                // The blocks are tested in the order of their first edge in the mapping
+                std::vector<char> added(blocksPerSegment, 0);
                 std::multimap<float, int>::iterator it;
                 for (it = mapping.begin(); it != mapping.end(); ++it)
                 {
-                    int index = it->second;
-                    intersectionTableYAxis[y][iAngle].push_back(index * 2);
-                    intersectionTableYAxis[y][iAngle].push_back(index * 2 + 1);
+                    int block = it->second * 2 / TriangleBlock::SIZE;
+                    if (!added[block])
+                    {
+                        added[block] = 1;
+                        intersectionTableYAxis[y][iAngle].push_back(block);
+                    }
                 }
             }
         }
     }
 }
 
+bool ConvexAcc::intersectWithWall(Ray &ray, int segment, const Point &origin, const Vector &dir, IntersectResult &result)
+{
+    if (tunnel->algorithm == Tunnel::ConvexSimple) // linear search in the segment
+    {
+        for (int j = 0; j < blocksPerSegment; j++)
+        {
+            if (intersectWithWallBlock(ray, segment, j, result))
+            {
+                return true;
+            }
+        }
+    }
+    else // fast intersect
+    {
+        // (origin, dir) is the ray projected onto the cross section, which is the same
+        // for both directions, so a single table serves the forward and backward walk
+        float y = origin.y - origin.x * dir.y / dir.x;
+        int index = (int)(99.0f * y / tunnel->height + 0.5f);
+        index = std::max(0, index);
+        index = std::min(99, index);
+
+        float fAngle = atan2(dir.y, dir.x);
+        fAngle = (fAngle < 0) ? fAngle + PI * 2 : fAngle;
+        int iAngle = (int)(fAngle / PI * 180.0f + 0.5f) % 360;
+        iAngle = std::max(0, iAngle);
+        iAngle = std::min(359, iAngle);
+
+        for (unsigned int j = 0; j < intersectionTableYAxis[index][iAngle].size(); j++)
+        {
+            if (intersectWithWallBlock(ray, segment, intersectionTableYAxis[index][iAngle][j], result))
+            {
+                //Utils::DbgPrint("Intersect with triangle %d / %d\n", 
+                //    j, intersectionTableYAxis[index][iAngle].size());
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Tests the triangles of a block on the wall of a segment four at a time. As the segment is
+// convex, the ray leaves it through a single triangle, so the first block hit is enough.
+bool ConvexAcc::intersectWithWallBlock(Ray &ray, int segment, int index, IntersectResult &result)
+{
+    float distance = ray.tMax;
+    int id = -1;
+
+    if (!tunnel->procedural)
+    {
+        const TriangleBlock &block = wallBlocks[segment * blocksPerSegment + index];
+        int lane = block.intersect(ray, ray.tMin, distance);
+        id = (lane >= 0) ? block.ids[lane] : -1;
+    }
+    else
+    {
+        TriangleBlock block;
+        int first = index * TriangleBlock::SIZE;
+        int count = std::min((int)TriangleBlock::SIZE, tunnel->getTriangleCount(segment) - first);
+        for (int i = 0; i < count; i++)
+        {
+            int triangleId = tunnel->getTriangleId(segment, first + i);
+            block.set(i, triangleId, tunnel->getTriangleRecord(triangleId));
+        }
+        int lane = block.intersect(ray, ray.tMin, distance);
+        id = (lane >= 0) ? block.ids[lane] : -1;
+    }
+
+    if (id < 0)
+    {
+        return false;
+    }
+    result = tunnel->getTriangleHitResult(ray, id, distance);
+    return true;
+}
+
 IntersectResult ConvexAcc::intersect(Ray &ray)
 {
     RayContext &context = ray.context;
 
     Ray advRay = ray; // the advanced ray
     float distance; // the advanced distance
+    float travelled = 0; // the signed distance from ray.origin to advRay.origin
 
     if (!context.inTunnel)
     {
@@ -318,6 +447,7 @@ IntersectResult ConvexAcc::intersect(Ray &ray)
             context.segment = 0;
             advRay.origin = ray.getPoint(distance);
             advRay.direction = ray.direction;
+            travelled = distance;
         }
         else if (intersectWithPolygon(ray, tunnel->path.size() - 1, newOrigin, newDir, distance) && 
             ray.direction.dot(tunnel->nvs[tunnel->path.size() - 1]) < 0) // into the exit of the tunnel
@@ -326,88 +456,92 @@ IntersectResult ConvexAcc::intersect(Ray &ray)
             context.segment = tunnel->path.size() - 2;
             advRay.origin = ray.getPoint(distance);
             advRay.direction = ray.direction;
+            travelled = distance;
         }
         else // the origin of the ray is not in the tunnel, and it does not gets into the tunnel
         {
             return tunnel->linearIntersect(ray);
         }
+
+        // The tunnel is entered beyond the nearest intersection found so far
+        if (travelled > ray.tMax)
+        {
+            context.inTunnel = false;
+            return IntersectResult(false);
+        }
     }
 
     if (context.inTunnel)
     {
         int N = tunnel->path.size() - 1; // a path with with N segments has N + 1 nodes (range: 0 to N)
         int begin = context.segment; // the current segment (range: 0 to N - 1)
-        enum RayDir dir = ray.direction.dot(tunnel->nvs[begin]) > 0 ? Forward : Backward;
+        // A ray along the normal of node begin is walked forward. Otherwise, as each segment of
+        // a curved path is a wedge, the ray may still head for both bounding polygons, and it
+        // is walked backward only if it does not leave through the polygon of node begin + 1
+        enum RayDir dir = Forward;
+        if (ray.direction.dot(tunnel->nvs[begin]) <= 0)
+        {
+            Point newOrigin;
+            Vector newDir;
+
+            if (ray.direction.dot(tunnel->nvs[begin + 1]) <= 0 || 
+                !intersectWithPolygon(advRay, begin + 1, newOrigin, newDir, distance))
+            {
+                dir = Backward;
+            }
+        }
+
+        //   segment:      0     1     2    ...    N - 1
+        //   path:      o-----o-----o-----o-----o-----o
+        //   node:      0     1     2     3    ...    N
+        //
+        // Segment i lies between node i and node i + 1. A forward ray in segment i 
+        // leaves through node i + 1, and a backward ray leaves through node i.
+        int step = (dir == Forward) ? 1 : -1;
+        int node = (dir == Forward) ? begin + 1 : begin;
 
-        if (dir == Forward)
+        for (; node >= 0 && node <= N; node += step)
         {
-            for (int i = begin + 1; i <= N; i++)
+            int segment = (dir == Forward) ? node - 1 : node;
+            Point newOrigin;
+            Vector newDir;
+
+            if (!intersectWithPolygon(advRay, node, newOrigin, newDir, distance)) // intersect with wall
             {
-                Point newOrigin;
-                Vector newDir;
+                IntersectResult result;
 
-                if (!intersectWithPolygon(advRay, i, newOrigin, newDir, distance)) // intersect with wall
+                if (intersectWithWall(ray, segment, newOrigin, newDir, result))
                 {
-                    if (tunnel->algorithm == Tunnel::ConvexSimple) // linear search in the current segment
-                    {
-                        for (unsigned int j = 0; j < tunnel->surface[i - 1].size(); j++)
-                        {
-                            IntersectResult result = tunnel->surface[i - 1][j]->intersect(ray);
-                            if (result.hit)
-                            {
-                                context.segment = i - 1;
-                                return result;
-                            }
-                        }
-                    }
-                    else // fast intersect
-                    {
-                        float y = newOrigin.y - newOrigin.x * newDir.y / newDir.x;
-                        int index = (int)(99.0f * y / tunnel->height + 0.5f);
-                        index = std::max(0, index);
-                        index = std::min(99, index);
-
-                        float fAngle = atan2(newDir.y, newDir.x);
-                        fAngle = (fAngle < 0) ? fAngle + PI * 2 : fAngle;
-                        int iAngle = (int)(fAngle / PI * 180.0f + 0.5f) % 360;
-                        iAngle = std::max(0, iAngle);
-                        iAngle = std::min(359, iAngle);
-
-                        for (unsigned int j = 0; j < intersectionTableYAxis[index][iAngle].size(); j++)
-                        {
-                            int segmentIndex = intersectionTableYAxis[index][iAngle][j];
-
-                            IntersectResult result = tunnel->surface[i - 1][segmentIndex]->intersect(ray);
-                            if (result.hit)
-                            {
-                                //Utils::DbgPrint("Intersect with triangle %d / %d\n", 
-                                //    j, intersectionTableYAxis[index][iAngle].size());
-                                context.segment = i - 1;
-                                return result;
-                            }
-                        }
-
-                        // As float point numbers are not accurate by nature, it's not a problem
-                        // when it gets here. Now advance the ray to the next polygon and try again.
-                        advRay.origin = advRay.getPoint(distance);
-                    }
+                    context.segment = segment;
+                    return result;
                 }
-                else // intersect with polygon
+
+                if (tunnel->algorithm == Tunnel::Convex)
                 {
+                    // As float point numbers are not accurate by nature, it's not a problem
+                    // when it gets here. Now advance the ray to the next polygon and try again.
                     advRay.origin = advRay.getPoint(distance);
+                    travelled += distance;
                 }
             }
+            else // intersect with polygon
+            {
+                advRay.origin = advRay.getPoint(distance);
+                travelled += distance;
+            }
 
-            // The ray intersects with all the polygons on the way
-            context.inTunnel = false;
-            return IntersectResult(false);
-        }
-        else if (dir == Backward)
-        {
-            // It's unlikely to get here (to be implemented)
-            Utils::DbgPrint("Backward");
-            return IntersectResult(false);
+            // The nearest intersection found so far (e.g., a ball in the tunnel) lies
+            // in this segment, and the rest of the tunnel is not walked through
+            if (travelled > ray.tMax)
+            {
+                context.segment = segment;
+                return IntersectResult(false);
+            }
         }
+
+        // The ray intersects with all the polygons on the way
+        context.inTunnel = false;
+        return IntersectResult(false);
     }
 
     // Just to avoid warnings. It's impossible to get here
@@ -2,6 +2,7 @@
 #define CONVEX_ACC_H
 
 #include "Accelerator.h"
+#include "TriangleBlock.h"
 
 class ConvexAcc : public Accelerator
 {
@@ -24,18 +25,40 @@ private:
     IntersectionTableResult intersectionTable[CONVEX_TABLE_SIZE][CONVEX_TABLE_SIZE];
     EdgeRange edgeRangeTable[CONVEX_TABLE_SIZE][CONVEX_TABLE_SIZE];
     std::vector<EdgeParam> edgeParams;
-    std::vector<int> intersectionTableYAxis[100][360];
+    std::vector<int> intersectionTableYAxis[100][360]; // the blocks of a segment in the order of testing
+
+    // The triangles of each segment packed by four, so that block i of a segment holds the
+    // triangles of the edges 2 * i and 2 * i + 1 of the cross section. A procedural surface
+    // is not stored, and its blocks are rebuilt on the fly.
+    std::vector<TriangleBlock> wallBlocks;
+    int blocksPerSegment;
+
+    // Maps a point / vector into the local frame of a path node, in which
+    // the node is at the origin and the polygon normal is (0, 0, -1):
+    //     x' =  cosTheta * x + sinTheta * z + tx
+    //     y' =  y + ty
+    //     z' = -sinTheta * x + cosTheta * z + tz
+    struct NodeFrame
+    {
+        float cosTheta, sinTheta;
+        float tx, ty, tz;
+        float reserved[3]; // pad to 32 bytes, two frames per cache line
+    };
+    NodeFrame *frames; // one per path node, 64-byte aligned
 
 private:
     bool intersectWithPolygon(Ray &ray, int index, Point &origin, Vector &dir, float &distance);
     bool intersectWithPolygonAtOrigin(Ray &ray, float &distance);
     bool inPolygon(const Point &p, int begin, int end);
+    bool intersectWithWall(Ray &ray, int segment, const Point &origin, const Vector &dir, IntersectResult &result);
+    bool intersectWithWallBlock(Ray &ray, int segment, int index, IntersectResult &result);
     IntersectionTableResult calcCellStatus(
         const Point &p1, const Point &p2, const Point &p3, const Point &p4, 
         short &minIndex, short &maxIndex);
 
 public:
-    ConvexAcc(Tunnel *tunnel) : Accelerator(tunnel) {}
+    ConvexAcc(Tunnel *tunnel) : Accelerator(tunnel), blocksPerSegment(0), frames(NULL) {}
+    ~ConvexAcc();
     virtual void init();
     virtual IntersectResult intersect(Ray &ray);
 };
@@ -34,15 +34,16 @@ void GeometrySet::clear()
 
 IntersectResult GeometrySet::intersect(Ray &ray)
 {
-    float minDistance = FLT_MAX;
     IntersectResult minResult(false);
 
+    // A geometry only reports a hit within [ray.tMin, ray.tMax], which is always the closest
+    // so far. ray.tMax is then shrunk, so the following geometries only look for closer ones.
     for (unsigned int i = 0; i < geometries.size(); i++)
     {
         IntersectResult result = geometries[i]->intersect(ray);
-        if (result.hit && (result.distance < minDistance)) 
+        if (result.hit) 
         {
-            minDistance = result.distance;
+            ray.tMax = result.distance;
             minResult = result;
         }
     }
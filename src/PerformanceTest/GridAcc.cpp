@@ -1,10 +1,9 @@
 #include "GridAcc.h"
 #include "Utils.h"
+#include <algorithm>
 
-std::vector<Triangle *> &GridAcc::get(int x, int y, int z)
-{
-    return data[(x * yLength + y) * zLength + z];
-}
+const float GridAcc::TOP_DENSITY = 0.03125f;
+const float GridAcc::SUB_DENSITY = 2.0f;
 
 void GridAcc::getIndexInGrid(const Point &p, int &i, int &j, int&k)
 {
@@ -27,13 +26,14 @@ void GridAcc::init()
     float min_x = FLT_MAX, min_y = FLT_MAX, min_z = FLT_MAX;
     float max_x = -FLT_MAX, max_y = -FLT_MAX, max_z = -FLT_MAX;
 
-    for (unsigned int i = 0; i < tunnel->surface.size(); i++)
+    Triangle t;
+    for (int i = 0; i < tunnel->getSegmentCount(); i++)
     {
-        for (unsigned int j = 0; j < tunnel->surface[i].size(); j++)
+        for (int j = 0; j < tunnel->getTriangleCount(i); j++)
         {
             Point min, max;
-            Triangle *t = tunnel->surface[i][j];
-            t->getBoundingBox(min, max);
+            tunnel->getTriangle(tunnel->getTriangleId(i, j), t);
+            t.getBoundingBox(min, max);
 
             min_x = std::min(min_x, min.x);
             min_y = std::min(min_y, min.y);
@@ -49,12 +49,25 @@ void GridAcc::init()
     float height = max_y - min_y;
     float depth = max_z - min_z;
 
-    if (tunnel->algorithm == Tunnel::RegularGrid)
+    if (tunnel->algorithm == Tunnel::RegularGrid || tunnel->algorithm == Tunnel::HierarchicalGrid)
     {
         float maxLength = std::max(std::max(width, height), depth);
+        float size;
+
+        if (tunnel->algorithm == Tunnel::RegularGrid)
+        {
+            // Cut the longest dimension into gridResolution pieces
+            size = maxLength / (tunnel->gridResolution - 1);
+        }
+        else
+        {
+            // Cubic cells, about TOP_DENSITY for each triangle
+            int numTriangles = tunnel->getTriangleId(tunnel->getSegmentCount(), 0);
+            float volume = std::max(width, maxLength / 1024) * std::max(height, maxLength / 1024) *
+                std::max(depth, maxLength / 1024);
+            size = pow(volume / (TOP_DENSITY * numTriangles), 1.0f / 3);
+        }
 
-        // Cut the longest dimension into 400 pieces
-        float size = maxLength / 399;
         origin = Point(min_x - size / 2, min_y - size / 2, min_z - size / 2);
         cellSizeX = size;
         cellSizeY = size;
@@ -62,85 +75,243 @@ void GridAcc::init()
         xLength = (int)(width / cellSizeX + 1.5f);
         yLength = (int)(height / cellSizeY + 1.5f);
         zLength = (int)(depth / cellSizeZ + 1.5f);
-        data.clear();
-        data.resize(xLength * yLength * zLength);
     }
     else // FlatGrid
     {
-        // Cut each dimension into 400 pieces
-        cellSizeX = width / 399;
-        cellSizeY = height / 399;
-        cellSizeZ = depth / 399;
+        // Cut each dimension into gridResolution pieces
+        cellSizeX = width / (tunnel->gridResolution - 1);
+        cellSizeY = height / (tunnel->gridResolution - 1);
+        cellSizeZ = depth / (tunnel->gridResolution - 1);
         origin = Point(
             min_x - cellSizeX / 2, 
             min_y - cellSizeY / 2,
             min_z - cellSizeZ / 2);
-        xLength = 400;
-        yLength = 400;
-        zLength = 400;
-        data.clear();
-        data.resize(xLength * yLength * zLength);
+        xLength = tunnel->gridResolution;
+        yLength = tunnel->gridResolution;
+        zLength = tunnel->gridResolution;
     }
 
     Utils::DbgPrint("Grid Size: %d x %d x %d\n", xLength, yLength, zLength);
 
-    // For each triangle
-    for (unsigned int m = 0; m < tunnel->surface.size(); m++)
+    // 2. Get the cells overlapped by the bounding box of each triangle
+    std::vector<CellBox> boxes;
+    for (int m = 0; m < tunnel->getSegmentCount(); m++)
     {
-        for (unsigned int n = 0; n < tunnel->surface[m].size(); n++)
+        for (int n = 0; n < tunnel->getTriangleCount(m); n++)
         {
-            Triangle *t = tunnel->surface[m][n];
-            Point min, max;
-            t->getBoundingBox(min, max);
+            CellBox box;
+            box.id = tunnel->getTriangleId(m, n);
+            boxes.push_back(box);
+        }
+    }
+
+    #pragma omp parallel for // OpenMP
+
+    for (int b = 0; b < (int)boxes.size(); b++)
+    {
+        Triangle t;
+        Point min, max;
+        tunnel->getTriangle(boxes[b].id, t);
+        t.getBoundingBox(min, max);
+
+        CellBox &box = boxes[b];
+        box.xBegin = std::max((int)((min.x - origin.x) / cellSizeX), 0);
+        box.yBegin = std::max((int)((min.y - origin.y) / cellSizeY), 0);
+        box.zBegin = std::max((int)((min.z - origin.z) / cellSizeZ), 0);
+        box.xEnd = std::min((int)((max.x - origin.x) / cellSizeX), xLength - 1);
+        box.yEnd = std::min((int)((max.y - origin.y) / cellSizeY), yLength - 1);
+        box.zEnd = std::min((int)((max.z - origin.z) / cellSizeZ), zLength - 1);
+    }
 
-            int x_begin = (int)((min.x - origin.x) / cellSizeX);
-            int y_begin = (int)((min.y - origin.y) / cellSizeY);
-            int z_begin = (int)((min.z - origin.z) / cellSizeZ);
+    // 3. Test the cells in each bounding box against the triangle, so that a triangle is only
+    //    added to the cells it overlaps, which makes the traversal about 20% faster
+    int numFlags = 0;
+    for (unsigned int b = 0; b < boxes.size(); b++)
+    {
+        boxes[b].firstFlag = numFlags;
+        numFlags += boxes[b].getCellCount();
+    }
+    std::vector<char> flags(numFlags);
+    Vector halfSize(cellSizeX / 2, cellSizeY / 2, cellSizeZ / 2);
 
-            int x_end = (int)((max.x - origin.x) / cellSizeX);
-            int y_end = (int)((max.y - origin.y) / cellSizeY);
-            int z_end = (int)((max.z - origin.z) / cellSizeZ);
+    #pragma omp parallel for // OpenMP
+
+    for (int b = 0; b < (int)boxes.size(); b++)
+    {
+        const CellBox &box = boxes[b];
+        Triangle t;
+        tunnel->getTriangle(box.id, t);
+        TriangleBoxTest test(t.a, t.b, t.c, halfSize);
 
-            // Traverse the grid
-            for (int i = x_begin; i <= x_end; i++)
+        int flag = box.firstFlag;
+        for (int i = box.xBegin; i <= box.xEnd; i++)
+        {
+            for (int j = box.yBegin; j <= box.yEnd; j++)
             {
-                for (int j = y_begin; j <= y_end; j++)
+                for (int k = box.zBegin; k <= box.zEnd; k++)
                 {
-                    for (int k = z_begin; k <= z_end; k++)
+                    Point center = origin + Vector(
+                        (i + 0.5f) * cellSizeX, 
+                        (j + 0.5f) * cellSizeY, 
+                        (k + 0.5f) * cellSizeZ);
+                    flags[flag++] = test.overlaps(center);
+                }
+            }
+        }
+    }
+
+    // 4. Build the triangle lists of the cells
+    cells.build(xLength, yLength, zLength, boxes, flags);
+
+    Utils::DbgPrint("Non-empty Cells: %d (%.1f MB)\n", 
+        cells.getNonEmptyCount(), cells.getMemorySize() / (1024 * 1024));
+
+    // 5. Cut the non-empty cells into sub-grids
+    if (tunnel->algorithm == Tunnel::HierarchicalGrid)
+    {
+        initSubGrids();
+    }
+}
+
+void GridAcc::initSubGrids()
+{
+    int numSubGrids = cells.getNonEmptyCount();
+    subGrids.resize(numSubGrids);
+
+    // Size the sub-grids by the number of triangles in the top cells
+    int numCells = 0;
+    for (int i = 0; i < xLength; i++)
+    {
+        for (int j = 0; j < yLength; j++)
+        {
+            for (int k = 0; k < zLength; k++)
+            {
+                int index = cells.getIndex(i, j, k);
+                if (index < 0)
+                    continue;
+
+                const int *list;
+                int count = cells.getList(index, list);
+                int length = (int)ceil(pow(SUB_DENSITY * count, 1.0f / 3));
+                length = std::min(std::max(length, 1), (int)MAX_SUB_RESOLUTION);
+
+                SubGrid &sub = subGrids[index];
+                sub.origin = origin + Vector(
+                    i * cellSizeX, 
+                    j * cellSizeY, 
+                    k * cellSizeZ);
+                sub.cellSize = cellSizeX / length;
+                sub.length = length;
+                sub.firstCell = numCells;
+                numCells += length * length * length;
+            }
+        }
+    }
+
+    // Bin the triangles of each top cell with two passes like GridCells::build(), but each
+    // sub-grid is handled by one thread. The overlaps are tested again in the second pass
+    // instead of keeping the flags, as a top cell holds few triangles.
+    subOffsets.assign(numCells + 1, 0);
+
+    #pragma omp parallel for schedule(dynamic, 16) // OpenMP
+
+    for (int s = 0; s < numSubGrids; s++)
+    {
+        const SubGrid &sub = subGrids[s];
+        Vector halfSize(sub.cellSize / 2, sub.cellSize / 2, sub.cellSize / 2);
+        const int *list;
+        int count = cells.getList(s, list);
+
+        for (int n = 0; n < count; n++)
+        {
+            Triangle t;
+            CellBox box;
+            tunnel->getTriangle(list[n], t);
+            getSubGridBox(sub, t, box);
+            TriangleBoxTest test(t.a, t.b, t.c, halfSize);
+
+            for (int i = box.xBegin; i <= box.xEnd; i++)
+            {
+                for (int j = box.yBegin; j <= box.yEnd; j++)
+                {
+                    for (int k = box.zBegin; k <= box.zEnd; k++)
                     {
-#if 0
-                        Grid cell(grid.origin + Vector(i * size, j * size, k * size), Vector(size, size, size));
-                        if (t->intersectWithGrid(cell))
-                        {
-                            grid.get(i, j, k).push_back(t);
-                        }
-#else
-                        // Use a simple way to construct the grid, which is about 8 times faster.
-                        // However, grid traversing is 20% slower
-                        get(i, j, k).push_back(t);
-#endif
+                        Point center = sub.origin + Vector(
+                            (i + 0.5f) * sub.cellSize, 
+                            (j + 0.5f) * sub.cellSize, 
+                            (k + 0.5f) * sub.cellSize);
+                        if (test.overlaps(center))
+                            subOffsets[sub.firstCell + (i * sub.length + j) * sub.length + k + 1]++;
                     }
                 }
             }
         }
     }
 
-#if 0 // Debug output
-    for (int i = 0; i < grid.xLength; i++)
+    for (int c = 0; c < numCells; c++)
     {
-        for (int j = 0; j < grid.yLength; j++)
+        subOffsets[c + 1] += subOffsets[c];
+    }
+    subIds.resize(subOffsets[numCells]);
+
+    #pragma omp parallel for schedule(dynamic, 16) // OpenMP
+
+    for (int s = 0; s < numSubGrids; s++)
+    {
+        const SubGrid &sub = subGrids[s];
+        Vector halfSize(sub.cellSize / 2, sub.cellSize / 2, sub.cellSize / 2);
+        const int *list;
+        int count = cells.getList(s, list);
+        int numSubCells = sub.length * sub.length * sub.length;
+        std::vector<int> cursors(subOffsets.begin() + sub.firstCell, 
+            subOffsets.begin() + sub.firstCell + numSubCells);
+
+        for (int n = 0; n < count; n++)
         {
-            Utils::DbgPrint("\n[%d, %d]", i, j);
-            for (int k = 0; k < grid.zLength; k++)
+            Triangle t;
+            CellBox box;
+            tunnel->getTriangle(list[n], t);
+            getSubGridBox(sub, t, box);
+            TriangleBoxTest test(t.a, t.b, t.c, halfSize);
+
+            for (int i = box.xBegin; i <= box.xEnd; i++)
             {
-                Utils::DbgPrint(" %d", grid.get(i, j, k).size());
+                for (int j = box.yBegin; j <= box.yEnd; j++)
+                {
+                    for (int k = box.zBegin; k <= box.zEnd; k++)
+                    {
+                        Point center = sub.origin + Vector(
+                            (i + 0.5f) * sub.cellSize, 
+                            (j + 0.5f) * sub.cellSize, 
+                            (k + 0.5f) * sub.cellSize);
+                        if (test.overlaps(center))
+                            subIds[cursors[(i * sub.length + j) * sub.length + k]++] = list[n];
+                    }
+                }
             }
         }
     }
-#endif
+
+    double memory = subGrids.size() * sizeof(SubGrid) + 
+        (subOffsets.size() + subIds.size()) * sizeof(int);
+    Utils::DbgPrint("Sub-grids: %d, Sub-grid Cells: %d (%.1f MB)\n", 
+        numSubGrids, numCells, memory / (1024 * 1024));
 }
 
-IntersectResult GridAcc::intersect(Ray &ray)
+void GridAcc::getSubGridBox(const SubGrid &sub, Triangle &t, CellBox &box)
+{
+    Point min, max;
+    t.getBoundingBox(min, max);
+
+    box.xBegin = std::max((int)((min.x - sub.origin.x) / sub.cellSize), 0);
+    box.yBegin = std::max((int)((min.y - sub.origin.y) / sub.cellSize), 0);
+    box.zBegin = std::max((int)((min.z - sub.origin.z) / sub.cellSize), 0);
+    box.xEnd = std::min((int)((max.x - sub.origin.x) / sub.cellSize), sub.length - 1);
+    box.yEnd = std::min((int)((max.y - sub.origin.y) / sub.cellSize), sub.length - 1);
+    box.zEnd = std::min((int)((max.z - sub.origin.z) / sub.cellSize), sub.length - 1);
+}
+
+IntersectResult GridAcc::hierarchicalIntersect(Ray &ray)
 {
     Point near = origin;
     Point far = origin + Vector(
@@ -148,7 +319,7 @@ IntersectResult GridAcc::intersect(Ray &ray)
         cellSizeY * yLength, 
         cellSizeZ * zLength);
 
-    // Current traversal state
+    // Current traversal state in the top grid
     int cur_i, cur_j, cur_k; // the index in the grid
     float cur_d; // distance along the ray
     Point cur_p; // position
@@ -164,7 +335,7 @@ IntersectResult GridAcc::intersect(Ray &ray)
             cellSizeY * yLength, 
             cellSizeZ * zLength));
 
-        if (sceneBox.intersect(ray, entryDistance, exitDistance))
+        if (sceneBox.intersect(ray, entryDistance, exitDistance) && entryDistance <= ray.tMax)
         {
             // Advance the ray to a grid boundary
             cur_d = entryDistance;
@@ -183,112 +354,167 @@ IntersectResult GridAcc::intersect(Ray &ray)
         getIndexInGrid(ray.origin, cur_i, cur_j, cur_k);
     }
 
-    // Start traversing the grid
+    // Start traversing the top grid
+    // The closest hit is kept until the ray leaves the cells that may contain a closer one,
+    // because a triangle overlapping a cell may be hit outside of it.
+    float invDir[3] = { 1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z };
+    float sizes[3] = { cellSizeX, cellSizeY, cellSizeZ };
+    int length[3] = { xLength, yLength, zLength };
+    GridWalk walk(ray, invDir, origin, sizes, length, cur_i, cur_j, cur_k);
+    Mailbox mailbox;
+    int minId = -1;
+
     while (true)
     {
-        // See if the ray intersects with some triangle in the current cell
-        std::vector<Triangle *> &list = get(cur_i, cur_j, cur_k);
-        IntersectResult minResult(false);
-        float minDistance = FLT_MAX;
+        // Descend into the sub-grid of the current cell
+        int index = cells.getIndex(walk.cell[0], walk.cell[1], walk.cell[2]);
+        if (index >= 0)
+        {
+            subGridIntersect(ray, invDir, subGrids[index], cur_d, mailbox, minId);
+        }
+
+        // Advance to the next cell, unless the ray leaves the grid or the cell lies beyond
+        // the nearest intersection found so far
+        if (!walk.next(cur_d) || cur_d > ray.tMax)
+            break;
+    }
+
+    numTests += mailbox.numTests;
+    numSkippedTests += mailbox.numSkipped;
 
-        for (unsigned int i = 0; i < list.size(); i++)
+    if (minId >= 0)
+        return tunnel->getTriangleHitResult(ray, minId, ray.tMax);
+
+    return IntersectResult(false);
+}
+
+void GridAcc::subGridIntersect(Ray &ray, const float invDir[3], const SubGrid &sub, float entryDistance, 
+    Mailbox &mailbox, int &minId)
+{
+    // The cell of the entry point
+    Point entry = ray.getPoint(entryDistance);
+    int i = (int)((entry.x - sub.origin.x) / sub.cellSize);
+    int j = (int)((entry.y - sub.origin.y) / sub.cellSize);
+    int k = (int)((entry.z - sub.origin.z) / sub.cellSize);
+    i = std::min(std::max(i, 0), sub.length - 1);
+    j = std::min(std::max(j, 0), sub.length - 1);
+    k = std::min(std::max(k, 0), sub.length - 1);
+
+    float cellSize[3] = { sub.cellSize, sub.cellSize, sub.cellSize };
+    int length[3] = { sub.length, sub.length, sub.length };
+    GridWalk walk(ray, invDir, sub.origin, cellSize, length, i, j, k);
+    float distance;
+
+    while (true)
+    {
+        // See if the ray intersects with some triangle in the current cell
+        int cell = sub.firstCell + (walk.cell[0] * sub.length + walk.cell[1]) * sub.length + walk.cell[2];
+        for (int n = subOffsets[cell]; n < subOffsets[cell + 1]; n++)
         {
-            IntersectResult result = list[i]->intersect(ray);
-            if (result.hit && result.distance < minDistance)
+            if (mailbox.check(subIds[n]) && 
+                tunnel->intersectTriangleDistance(ray, subIds[n], distance) && distance < ray.tMax)
             {
-                minResult = result;
-                minDistance = result.distance;
+                minId = subIds[n];
+                ray.tMax = distance;
             }
         }
 
-        if (minResult.hit)
-            return minResult;
-
-        // Advance to the next cell with the 3D version of the DDA algorithm
-        // http://en.wikipedia.org/wiki/Digital_differential_analyzer_(graphics_algorithm)
-        Point p1 = origin + Vector(
-            cur_i * cellSizeX, 
-            cur_j * cellSizeY, 
-            cur_k * cellSizeZ);
-        Point p2 = origin + Vector(
-            (cur_i + 1) * cellSizeX, 
-            (cur_j + 1) * cellSizeY, 
-            (cur_k + 1) * cellSizeZ);
-
-        float dx = 0; // this is not delta_x, but is distance_on_x_axis
-        float dy = 0; 
-        float dz = 0;
-        int di = 0;
-        int dj = 0;
-        int dk = 0;
-
-        if (ray.direction.x > 0) // Plane x = p2.x
-        {
-            float cos_theta = ray.direction.x;
-            dx = (p2.x - cur_p.x) / cos_theta;
-            di = 1;
-        }
-        else // Plane x = p1.x
-        {
-            float cos_theta = -ray.direction.x;
-            dx = (cur_p.x - p1.x) / cos_theta;
-            di = -1;
-        }
+        // Leave the sub-grid, or the next cell lies beyond the nearest intersection
+        if (!walk.next(distance) || distance > ray.tMax)
+            break;
+    }
+}
 
-        if (ray.direction.y > 0) // Plane y = p2.y
-        {
-            float cos_theta = ray.direction.y;
-            dy = (p2.y - cur_p.y) / cos_theta;
-            dj = 1;
-        }
-        else // Plane y = p1.y
-        {
-            float cos_theta = -ray.direction.y;
-            dy = (cur_p.y - p1.y) / cos_theta;
-            dj = -1;
-        }
+IntersectResult GridAcc::intersect(Ray &ray)
+{
+    if (tunnel->algorithm == Tunnel::HierarchicalGrid)
+        return hierarchicalIntersect(ray);
+
+    Point near = origin;
+    Point far = origin + Vector(
+        cellSizeX * xLength, 
+        cellSizeY * yLength, 
+        cellSizeZ * zLength);
+
+    // Current traversal state
+    int cur_i, cur_j, cur_k; // the index in the grid
+    float cur_d; // distance along the ray
+    Point cur_p; // position
+
+    // Is the origin of the ray outside of the grid?
+    if (ray.origin.x < near.x || ray.origin.x > far.x ||
+        ray.origin.y < near.y || ray.origin.y > far.y ||
+        ray.origin.z < near.z || ray.origin.z > far.z)
+    {
+        float entryDistance, exitDistance;
+        Grid sceneBox(origin, Vector(
+            cellSizeX * xLength, 
+            cellSizeY * yLength, 
+            cellSizeZ * zLength));
 
-        if (ray.direction.z > 0) // Plane z = p2.z
+        if (sceneBox.intersect(ray, entryDistance, exitDistance) && entryDistance <= ray.tMax)
         {
-            float cos_theta = ray.direction.z;
-            dz = (p2.z - cur_p.z) / cos_theta;
-            dk = 1;
+            // Advance the ray to a grid boundary
+            cur_d = entryDistance;
+            cur_p = ray.getPoint(entryDistance);
+            getIndexInGrid(cur_p, cur_i, cur_j, cur_k);
         }
         else
         {
-            float cos_theta = -ray.direction.z;
-            dz = (cur_p.z - p1.z) / cos_theta;
-            dk = -1;
+            return IntersectResult(false);
         }
+    }
+    else // the origin of the ray is in the grid
+    {
+        cur_p = ray.origin;
+        cur_d = 0;
+        getIndexInGrid(ray.origin, cur_i, cur_j, cur_k);
+    }
 
-        // Advance
-        if (dx < dy && dx < dz) // min = dx
-        {
-            cur_i += di;
-            cur_d += dx;
-            cur_p = ray.getPoint(cur_d);
-        }
-        else if (dy < dz) // min = dy
-        {
-            cur_j += dj;
-            cur_d += dy;
-            cur_p = ray.getPoint(cur_d);
-        }
-        else // min = dz
+    // Start traversing the grid
+    float invDir[3] = { 1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z };
+    float sizes[3] = { cellSizeX, cellSizeY, cellSizeZ };
+    int length[3] = { xLength, yLength, zLength };
+    GridWalk walk(ray, invDir, origin, sizes, length, cur_i, cur_j, cur_k);
+    Mailbox mailbox;
+    int minId = -1;
+
+    while (true)
+    {
+        // See if the ray intersects with some triangle in the current cell
+        const int *list;
+        int count = cells.get(walk.cell[0], walk.cell[1], walk.cell[2], list);
+
+        for (int i = 0; i < count; i++)
         {
-            cur_k += dk;
-            cur_d += dz;
-            cur_p = ray.getPoint(cur_d);
+            float distance;
+            if (mailbox.check(list[i]) && 
+                tunnel->intersectTriangleDistance(ray, list[i], distance) && distance < ray.tMax)
+            {
+                minId = list[i];
+                ray.tMax = distance;
+            }
         }
 
-        // Leave the grid
-        if (cur_i < 0 || cur_i > xLength - 1 ||
-            cur_j < 0 || cur_j > yLength - 1 ||
-            cur_k < 0 || cur_k > zLength - 1)
-        {
+        // Advance to the next cell, unless the ray leaves the grid or the cell lies beyond
+        // the nearest intersection found so far. A hit outside of the current cell is kept
+        // until then, as a triangle in the cells between may be closer.
+        if (!walk.next(cur_d) || cur_d > ray.tMax)
             break;
-        }
     }
 
+    numTests += mailbox.numTests;
+    numSkippedTests += mailbox.numSkipped;
+
+    if (minId >= 0)
+        return tunnel->getTriangleHitResult(ray, minId, ray.tMax);
+
     return IntersectResult(false);
 }
+
+void GridAcc::printStats()
+{
+    long long total = numTests + numSkippedTests;
+    Utils::DbgPrint("Triangle Tests: %lld, Skipped by Mailboxing: %lld (%.1f%%)\n", 
+        numTests, numSkippedTests, total > 0 ? 100.0 * numSkippedTests / total : 0.0);
+}
@@ -2,6 +2,7 @@
 #define GRID_ACC_H
 
 #include "Accelerator.h"
+#include "GridCells.h"
 
 class GridAcc : public Accelerator
 {
@@ -13,16 +14,43 @@ private:
     int xLength;
     int yLength;
     int zLength;
-    std::vector<std::vector<Triangle *>> data;
+    GridCells cells; // triangle ids
+
+    // Two-level grid
+    // The top grid has large cubic cells, and each non-empty cell is cut again into a
+    // sub-grid, whose resolution follows the number of triangles in the cell.
+    static const float TOP_DENSITY; // the top cells for each triangle
+    static const float SUB_DENSITY; // the sub-grid cells for each triangle in a top cell
+    enum { MAX_SUB_RESOLUTION = 32 };
+
+    struct SubGrid
+    {
+        Point origin;
+        float cellSize;
+        int length;    // the cells along each axis
+        int firstCell; // the index of cell (0, 0, 0) in subOffsets
+    };
+    std::vector<SubGrid> subGrids; // in the order of GridCells::getIndex() of the top cells
+    std::vector<int> subOffsets;   // the first id of each sub-grid cell, and the end
+    std::vector<int> subIds;       // the triangle ids
+
+    // Statistics of the traversal
+    long long numTests;        // the ray-triangle tests
+    long long numSkippedTests; // the repeated tests skipped by mailboxing
 
 private:
-    std::vector<Triangle *> &get(int x, int y, int z);
+    void initSubGrids();
+    void getSubGridBox(const SubGrid &sub, Triangle &t, CellBox &box);
+    IntersectResult hierarchicalIntersect(Ray &ray);
+    void subGridIntersect(Ray &ray, const float invDir[3], const SubGrid &sub, float entryDistance, 
+        Mailbox &mailbox, int &minId);
     void getIndexInGrid(const Point &p, int &i, int &j, int&k);
 
 public:
-    GridAcc(Tunnel *tunnel) : Accelerator(tunnel) {}
+    GridAcc(Tunnel *tunnel) : Accelerator(tunnel), numTests(0), numSkippedTests(0) {}
     virtual void init();
     virtual IntersectResult intersect(Ray &ray);
+    virtual void printStats();
 };
 
 #endif
@@ -0,0 +1,133 @@
+#include "GridCells.h"
+
+void GridCells::build(int xLength, int yLength, int zLength, const std::vector<CellBox> &boxes, 
+    const std::vector<char> &flags)
+{
+    this->xLength = xLength;
+    this->yLength = yLength;
+    this->zLength = zLength;
+
+    // The cells of a slice (the cells with the same x index) are only written by the thread
+    // of the slice, so the boxes are first listed by slice
+    std::vector<int> sliceOffsets(xLength + 1, 0);
+    for (unsigned int b = 0; b < boxes.size(); b++)
+    {
+        for (int x = boxes[b].xBegin; x <= boxes[b].xEnd; x++)
+        {
+            sliceOffsets[x + 1]++;
+        }
+    }
+    for (int x = 0; x < xLength; x++)
+    {
+        sliceOffsets[x + 1] += sliceOffsets[x];
+    }
+
+    std::vector<int> sliceBoxes(sliceOffsets[xLength]);
+    std::vector<int> sliceCursors(sliceOffsets.begin(), sliceOffsets.end() - 1);
+    for (unsigned int b = 0; b < boxes.size(); b++)
+    {
+        for (int x = boxes[b].xBegin; x <= boxes[b].xEnd; x++)
+        {
+            sliceBoxes[sliceCursors[x]++] = b;
+        }
+    }
+
+    // 1. Mark the non-empty cells
+    // The words on the boundary of two slices are shared, so the bits are set atomically.
+    int numCells = xLength * yLength * zLength;
+    int numWords = (numCells + 31) / 32;
+    occupied.assign(numWords, 0);
+
+    #pragma omp parallel for schedule(dynamic, 1) // OpenMP
+
+    for (int x = 0; x < xLength; x++)
+    {
+        for (int s = sliceOffsets[x]; s < sliceOffsets[x + 1]; s++)
+        {
+            const CellBox &box = boxes[sliceBoxes[s]];
+            for (int y = box.yBegin; y <= box.yEnd; y++)
+            {
+                for (int z = box.zBegin; z <= box.zEnd; z++)
+                {
+                    if (!box.contains(x, y, z, flags))
+                        continue;
+
+                    int cell = (x * yLength + y) * zLength + z;
+                    #pragma omp atomic
+                    occupied[cell >> 5] |= 1u << (cell & 31);
+                }
+            }
+        }
+    }
+
+    ranks.resize(numWords + 1);
+    ranks[0] = 0;
+    for (int w = 0; w < numWords; w++)
+    {
+        ranks[w + 1] = ranks[w] + BitCount(occupied[w]);
+    }
+    int numNonEmpty = ranks[numWords];
+
+    // 2. Count the triangles of each non-empty cell
+    offsets.assign(numNonEmpty + 1, 0);
+
+    #pragma omp parallel for schedule(dynamic, 1) // OpenMP
+
+    for (int x = 0; x < xLength; x++)
+    {
+        for (int s = sliceOffsets[x]; s < sliceOffsets[x + 1]; s++)
+        {
+            const CellBox &box = boxes[sliceBoxes[s]];
+            for (int y = box.yBegin; y <= box.yEnd; y++)
+            {
+                for (int z = box.zBegin; z <= box.zEnd; z++)
+                {
+                    if (!box.contains(x, y, z, flags))
+                        continue;
+
+                    int cell = (x * yLength + y) * zLength + z;
+                    unsigned int bit = 1u << (cell & 31);
+                    int rank = ranks[cell >> 5] + BitCount(occupied[cell >> 5] & (bit - 1));
+                    offsets[rank + 1]++;
+                }
+            }
+        }
+    }
+
+    for (int r = 0; r < numNonEmpty; r++)
+    {
+        offsets[r + 1] += offsets[r];
+    }
+
+    // 3. Scatter the ids
+    ids.resize(offsets[numNonEmpty]);
+    std::vector<int> cursors(offsets.begin(), offsets.end() - 1);
+
+    #pragma omp parallel for schedule(dynamic, 1) // OpenMP
+
+    for (int x = 0; x < xLength; x++)
+    {
+        for (int s = sliceOffsets[x]; s < sliceOffsets[x + 1]; s++)
+        {
+            const CellBox &box = boxes[sliceBoxes[s]];
+            for (int y = box.yBegin; y <= box.yEnd; y++)
+            {
+                for (int z = box.zBegin; z <= box.zEnd; z++)
+                {
+                    if (!box.contains(x, y, z, flags))
+                        continue;
+
+                    int cell = (x * yLength + y) * zLength + z;
+                    unsigned int bit = 1u << (cell & 31);
+                    int rank = ranks[cell >> 5] + BitCount(occupied[cell >> 5] & (bit - 1));
+                    ids[cursors[rank]++] = box.id;
+                }
+            }
+        }
+    }
+}
+
+double GridCells::getMemorySize() const
+{
+    return (double)(occupied.size() + ranks.size() + offsets.size() + ids.size()) * 4;
+}
@@ -2,11 +2,10 @@
 #include "Utils.h"
 
 #include <algorithm>
+#include <omp.h> // OpenMP
 
-KdTreeAcc::~KdTreeAcc()
-{
-    deleteTree(root);
-}
+const float KdTreeAcc::KT = 1.0f;
+const float KdTreeAcc::KI = 1.5f;
 
 bool cmpTriangleXAxis(const Triangle *t1, const Triangle *t2)
 {
@@ -35,10 +34,15 @@ bool cmpKdEvent(const KdTreeAcc::KdEvent a, const KdTreeAcc::KdEvent b)
         ((a.position == b.position) && (int)a.type < (int)b.type);
 }
 
-void KdTreeAcc::buildKdTree(KdNode *node, std::vector<Triangle *> &list, int depth, int &numLeaves, int &leafElements)
+void KdTreeAcc::buildKdTree(KdBuildContext &context, const Point &min, const Point &max, 
+                            std::vector<Triangle *> &list, int depth)
 {
 #define DUMP_TREE 0
 
+    // The node is appended to the array before its subtrees
+    int index = context.nodes.size();
+    context.nodes.push_back(KdNode());
+
     if (list.size() <= 8 || depth > 18) // This should be leaf node
     {
 #if DUMP_TREE
@@ -49,61 +53,33 @@ void KdTreeAcc::buildKdTree(KdNode *node, std::vector<Triangle *> &list, int dep
         }
         Utils::SysDbgPrint("Leaf (%d)\n", list.size());
 #endif
-        node->axis = NoAxis;
-        node->splitPlane = 0.0f; // whatever
-        node->left = NULL;
-        node->right = NULL;
-        node->list.assign(list.begin(), list.end());
-        numLeaves += 1;
-        leafElements += list.size();
+        initLeaf(context, index, list);
         return;
     }
 
-    // Split the triangle list
-    int axis;
-    float median;
-    float sah;
-
-    if (tunnel->algorithm == Tunnel::KdTreeStandard)
+    // Leave the subtree to a job when the tree is built in parallel
+    if (context.jobs != NULL && list.size() <= context.jobCutoff)
     {
-        // Select axis based on depth so that axis cycles through all valid values
-        // use order x -> y -> z -> x ...
-        axis = depth % 3;
-        median = split(node, axis, list); // the list may be sorted in split(), 
-                                          // but no element would be deleted
+        KdBuildJob *job = addJob(context, index, min, max, depth);
+        job->list.swap(list);
+        return;
     }
-    else // KdTreeSAH
-    {
-        median = splitSAH(node, list, axis, sah);
 
-        // Automatic termination
-        if (sah > 1.5f * list.size())
-        {
-            node->axis = NoAxis;
-            node->splitPlane = 0.0f; // whatever
-            node->left = NULL;
-            node->right = NULL;
-            node->list.assign(list.begin(), list.end());
-            numLeaves += 1;
-            leafElements += list.size();
-            return;
-        }
-    }
+    // Split the triangle list
+    // Select axis based on depth so that axis cycles through all valid values
+    // use order x -> y -> z -> x ...
+    int axis = depth % 3;
+    float median = split(axis, list); // the list may be sorted in split(), 
+                                      // but no element would be deleted
 
     // Create node and construct subtrees
-    node->axis = (Axes)axis;
-    node->splitPlane = median;
-    node->left = new KdNode();
-    node->right = new KdNode();
-    // node->list remains empty
-
-    node->left->min = node->min;
-    node->left->max = node->max;
-    node->right->min = node->min;
-    node->right->max = node->max;
+    context.nodes[index].splitPlane = median;
+    context.nodes[index].flags = axis; // the right child is set when the left subtree is built
 
-    node->left->max[axis] = median;
-    node->right->min[axis] = median;
+    Point leftMax = max;
+    Point rightMin = min;
+    leftMax[axis] = median;
+    rightMin[axis] = median;
 
 #if DUMP_TREE
     Utils::SysDbgPrint("%02d ", depth);
@@ -139,20 +115,24 @@ void KdTreeAcc::buildKdTree(KdNode *node, std::vector<Triangle *> &list, int dep
         }
     }
 
-    buildKdTree(node->left, leftPart, depth + 1, numLeaves, leafElements);
-    buildKdTree(node->right, rightPart, depth + 1, numLeaves, leafElements);
+    buildKdTree(context, min, leftMax, leftPart, depth + 1);
+    context.nodes[index].flags |= (unsigned int)context.nodes.size() << 2;
+    buildKdTree(context, rightMin, max, rightPart, depth + 1);
 }
 
-void KdTreeAcc::deleteTree(KdNode *node)
+void KdTreeAcc::initLeaf(KdBuildContext &context, int index, std::vector<Triangle *> &list)
 {
-    if (node->left != NULL)
-        deleteTree(node->left);
-    if (node->right != NULL)
-        deleteTree(node->right);
-    delete node;
+    context.nodes[index].offset = (int)context.triangleIds.size();
+    context.nodes[index].flags = ((unsigned int)list.size() << 2) | NoAxis;
+    for (unsigned int i = 0; i < list.size(); i++)
+    {
+        context.triangleIds.push_back(list[i] - triangles);
+    }
+    context.numLeaves += 1;
+    context.leafElements += list.size();
 }
 
-float KdTreeAcc::split(KdNode *node, int axis, std::vector<Triangle *> &list)
+float KdTreeAcc::split(int axis, std::vector<Triangle *> &list)
 {
     // simple split: sort the triangle by barycenter, and select the mid value in the sorted list
     if (axis == XAxis)
@@ -174,121 +154,347 @@ float KdTreeAcc::split(KdNode *node, int axis, std::vector<Triangle *> &list)
     return median;
 }
 
-float KdTreeAcc::splitSAH(KdNode *node, std::vector<Triangle *> &list, int &bestAxis, float &minSAH)
+void KdTreeAcc::addEvents(int id, const Point &min, const Point &max, std::vector<KdEvent> events[3])
 {
-    minSAH = FLT_MAX;
-    float minPosition;
-
     for (int axis = 0; axis < 3; axis++)
     {
-        // Generate event list
-        std::vector<KdEvent> events;
-
-        for (unsigned int i = 0; i < list.size(); i++)
+        if (min[axis] == max[axis])
         {
-            // Clip triangle to box
-            Point min, max;
-            list[i]->getBoundingBox(min, max);
-
-            if (min[axis] == max[axis])
-            {
-                events.push_back(KdEvent(list[i], min[axis], Planar));
-            }
-            else
-            {
-                events.push_back(KdEvent(list[i], min[axis], Start));
-                events.push_back(KdEvent(list[i], max[axis], End));
-            }
+            events[axis].push_back(KdEvent(id, min[axis], Planar));
         }
+        else
+        {
+            events[axis].push_back(KdEvent(id, min[axis], Start));
+            events[axis].push_back(KdEvent(id, max[axis], End));
+        }
+    }
+}
 
-        // Sort event list
-        std::sort(events.begin(), events.end(), cmpKdEvent);
+float KdTreeAcc::findPlane(const Point &min, const Point &max, std::vector<KdEvent> events[3], int numTriangles, 
+                           bool parallel, int &bestAxis, bool &planarLeft, float &minCost)
+{
+    // SA: Surface area (total)
+    // SAL: Surface area (left)
+    // SAR: Surface area (right)
+    // Cost = KT + KI * ((SAL / SA) * (NL + NP) + (SAR / SA) * NR), 
+    //     or KT + KI * ((SAL / SA) * NL + (SAR / SA) * (NR + NP)),
+    // depending on which side the triangles lying in the plane are put in
+    Vector boxSize = Vector(min, max);
+    float SA = boxSize.x * boxSize.y + boxSize.y * boxSize.z + boxSize.z * boxSize.x;
+
+    // The best plane of each axis, the axes are swept in parallel at the top of the tree
+    float axisCost[3];
+    float axisPosition[3];
+    bool axisPlanarLeft[3];
+
+    #pragma omp parallel for if (parallel)
+    for (int axis = 0; axis < 3; axis++)
+    {
+        std::vector<KdEvent> &e = events[axis];
+        int nextAxis = (axis + 1) % 3; // x -> y -> z -> x ...
+        int prevAxis = (axis + 2) % 3; // z -> y -> x -> z ...
+        float height = boxSize[nextAxis];
+        float depth = boxSize[prevAxis];
+
+        axisCost[axis] = FLT_MAX;
+        axisPosition[axis] = 0.0f;
+        axisPlanarLeft[axis] = false;
 
         // Sweep all candidate split planes
         int NL = 0;
         int NP = 0;
-        int NR = list.size();
+        int NR = numTriangles;
 
-        for (unsigned int i = 0; i < events.size(); )
+        for (unsigned int i = 0; i < e.size(); )
         {
-            float position = events[i].position;
+            float position = e[i].position;
             int PS = 0; // p(+) p_start
             int PE = 0; // p(-) p_end
             int PP = 0; // p(|) p_planar
 
-            while (i < events.size() && 
-                events[i].position == position && events[i].type == End)
+            while (i < e.size() && e[i].position == position && e[i].type == End)
             {
                 PE += 1; i += 1;
             }
 
-            while (i < events.size() && 
-                events[i].position == position && events[i].type == Planar)
+            while (i < e.size() && e[i].position == position && e[i].type == Planar)
             {
                 PP += 1; i += 1;
             }
 
-            while (i < events.size() && 
-                events[i].position == position && events[i].type == Start)
+            while (i < e.size() && e[i].position == position && e[i].type == Start)
             {
                 PS += 1; i += 1;
             }
 
             // Move plane onto p
             NP = PP; NR -= PP; NR -= PE;
-            
-            // Calculate SAH
-            // KT: Traversal constant (1)
-            // KI: Intersection constant (1.5)
-            // SA: Surface area (total)
-            // SAL: Surface area (left)
-            // SAR: Surface area (right)
-            // Cost = KT + KI * ((SAL / SA) * (NL + NP) + (SAR / SA) * NR)
-            int nextAxis = (axis + 1) % 3; // x -> y -> z -> x ...
-            int prevAxis = (axis + 2) % 3; // z -> y -> x -> z ...
-            Vector boxSize = Vector(node->min, node->max);
 
-            float width = node->max[axis] - node->min[axis];
-            float leftWidth = position - node->min[axis];
-            float rightWidth = node->max[axis] - position;
-            float height = boxSize[nextAxis];
-            float depth = boxSize[prevAxis];
+            // Should not split space into two part, one 0% and the other 100%
+            if (position > min[axis] && position < max[axis])
+            {
+                float leftWidth = position - min[axis];
+                float rightWidth = max[axis] - position;
+                float SAL = leftWidth * height + leftWidth * depth + height * depth;
+                float SAR = rightWidth * height + rightWidth * depth + height * depth;
 
-            float SAL = leftWidth * height + leftWidth * depth + height * depth;
-            float SAR = rightWidth * height + rightWidth * depth + height * depth;
-            float SA = width * height + width * depth + height * depth;
+                float costLeft = KT + KI * ((SAL / SA) * (NL + NP) + (SAR / SA) * NR);
+                float costRight = KT + KI * ((SAL / SA) * NL + (SAR / SA) * (NR + NP));
 
-            float SAH = 1 + 1.5f * ((SAL / SA) * NL + SAR / SA * (NR + NP));
-            if (SAH < minSAH)
-            {
-                minSAH = SAH;
-                minPosition = position;
-                bestAxis = axis;
+                if (costLeft < axisCost[axis])
+                {
+                    axisCost[axis] = costLeft;
+                    axisPosition[axis] = position;
+                    axisPlanarLeft[axis] = true;
+                }
+                if (costRight < axisCost[axis])
+                {
+                    axisCost[axis] = costRight;
+                    axisPosition[axis] = position;
+                    axisPlanarLeft[axis] = false;
+                }
             }
 
             NL += PS; NL += PP; NP = 0;
         }
     }
 
+    minCost = FLT_MAX;
+    float minPosition = 0.0f;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (axisCost[axis] < minCost)
+        {
+            minCost = axisCost[axis];
+            minPosition = axisPosition[axis];
+            bestAxis = axis;
+            planarLeft = axisPlanarLeft[axis];
+        }
+    }
     return minPosition;
 }
 
+void KdTreeAcc::buildKdTreeSAH(KdBuildContext &context, const Point &min, const Point &max, 
+                               std::vector<KdEvent> events[3], int depth)
+{
+    // The node is appended to the array before its subtrees
+    int index = context.nodes.size();
+    context.nodes.push_back(KdNode());
+
+    // Each triangle has exactly one start or planar event on an axis
+    std::vector<Triangle *> list;
+    for (unsigned int i = 0; i < events[XAxis].size(); i++)
+    {
+        if (events[XAxis][i].type != End)
+        {
+            list.push_back(&triangles[events[XAxis][i].triangle]);
+        }
+    }
+
+    if (list.size() <= 8 || depth > 18) // This should be leaf node
+    {
+        initLeaf(context, index, list);
+        return;
+    }
+
+    // Leave the subtree to a job when the tree is built in parallel
+    if (context.jobs != NULL && list.size() <= context.jobCutoff)
+    {
+        KdBuildJob *job = addJob(context, index, min, max, depth);
+        for (int k = 0; k < 3; k++)
+        {
+            job->events[k].swap(events[k]);
+        }
+        return;
+    }
+
+    // Find the best split plane
+    int axis;
+    bool planarLeft;
+    float cost;
+    bool parallel = (context.jobs != NULL); // the top of the tree
+    float position = findPlane(min, max, events, list.size(), parallel, axis, planarLeft, cost);
+
+    // Automatic termination, when it is cheaper not to split
+    if (cost > KI * list.size())
+    {
+        initLeaf(context, index, list);
+        return;
+    }
+
+    // Classify the triangles
+    std::vector<char> &sides = *context.sides;
+    for (unsigned int i = 0; i < list.size(); i++)
+    {
+        sides[list[i] - triangles] = Both;
+    }
+
+    std::vector<KdEvent> &e = events[axis];
+    for (unsigned int i = 0; i < e.size(); i++)
+    {
+        if (e[i].type == End && e[i].position <= position)
+        {
+            sides[e[i].triangle] = LeftOnly;
+        }
+        else if (e[i].type == Start && e[i].position >= position)
+        {
+            sides[e[i].triangle] = RightOnly;
+        }
+        else if (e[i].type == Planar)
+        {
+            bool left = (e[i].position < position) || (e[i].position == position && planarLeft);
+            sides[e[i].triangle] = left ? LeftOnly : RightOnly;
+        }
+    }
+
+    // Create node
+    context.nodes[index].splitPlane = position;
+    context.nodes[index].flags = axis; // the right child is set when the left subtree is built
+
+    Point leftMax = max;
+    Point rightMin = min;
+    leftMax[axis] = position;
+    rightMin[axis] = position;
+
+    // Split the sorted event lists, which keeps them sorted
+    std::vector<KdEvent> leftEvents[3];
+    std::vector<KdEvent> rightEvents[3];
+
+    #pragma omp parallel for if (parallel)
+    for (int k = 0; k < 3; k++)
+    {
+        for (unsigned int i = 0; i < events[k].size(); i++)
+        {
+            if (sides[events[k][i].triangle] == LeftOnly)
+            {
+                leftEvents[k].push_back(events[k][i]);
+            }
+            else if (sides[events[k][i].triangle] == RightOnly)
+            {
+                rightEvents[k].push_back(events[k][i]);
+            }
+        }
+        std::vector<KdEvent>().swap(events[k]); // not used any more
+    }
+
+    // The triangles overlapping both sides get new events, clipped to the children
+    std::vector<KdEvent> leftNew[3];
+    std::vector<KdEvent> rightNew[3];
+
+    for (unsigned int i = 0; i < list.size(); i++)
+    {
+        int id = list[i] - triangles;
+        if (sides[id] == Both)
+        {
+            Point tmin, tmax;
+            list[i]->getBoundingBox(tmin, tmax);
+
+            Point leftTMin, leftTMax, rightTMin, rightTMax;
+            for (int k = 0; k < 3; k++)
+            {
+                leftTMin[k] = std::max(tmin[k], min[k]);
+                leftTMax[k] = std::min(tmax[k], leftMax[k]);
+                rightTMin[k] = std::max(tmin[k], rightMin[k]);
+                rightTMax[k] = std::min(tmax[k], max[k]);
+            }
+            addEvents(id, leftTMin, leftTMax, leftNew);
+            addEvents(id, rightTMin, rightTMax, rightNew);
+        }
+    }
+
+    #pragma omp parallel for if (parallel)
+    for (int k = 0; k < 3; k++)
+    {
+        std::sort(leftNew[k].begin(), leftNew[k].end(), cmpKdEvent);
+        std::sort(rightNew[k].begin(), rightNew[k].end(), cmpKdEvent);
+
+        int leftSize = leftEvents[k].size();
+        int rightSize = rightEvents[k].size();
+        leftEvents[k].insert(leftEvents[k].end(), leftNew[k].begin(), leftNew[k].end());
+        rightEvents[k].insert(rightEvents[k].end(), rightNew[k].begin(), rightNew[k].end());
+        std::inplace_merge(leftEvents[k].begin(), leftEvents[k].begin() + leftSize, leftEvents[k].end(), cmpKdEvent);
+        std::inplace_merge(rightEvents[k].begin(), rightEvents[k].begin() + rightSize, rightEvents[k].end(), cmpKdEvent);
+    }
+
+    // Construct subtrees
+    buildKdTreeSAH(context, min, leftMax, leftEvents, depth + 1);
+    context.nodes[index].flags |= (unsigned int)context.nodes.size() << 2;
+    buildKdTreeSAH(context, rightMin, max, rightEvents, depth + 1);
+}
+
+KdTreeAcc::KdBuildJob *KdTreeAcc::addJob(KdBuildContext &context, int index, const Point &min, const Point &max, int depth)
+{
+    KdBuildJob *job = new KdBuildJob();
+    job->min = min;
+    job->max = max;
+    job->depth = depth;
+
+    // A placeholder leaf, replaced by the subtree of the job when merging
+    context.nodes[index].offset = -1 - (int)context.jobs->size();
+    context.nodes[index].flags = NoAxis;
+    context.jobs->push_back(job);
+    return job;
+}
+
+void KdTreeAcc::mergeKdTree(KdBuildContext &top, int index, std::vector<KdBuildJob *> &jobs)
+{
+    const KdNode &node = top.nodes[index];
+
+    if (node.axis() != NoAxis) // interior node
+    {
+        int i = nodes.size();
+        nodes.push_back(node);
+        mergeKdTree(top, index + 1, jobs);
+        nodes[i].flags = node.axis() | ((unsigned int)nodes.size() << 2);
+        mergeKdTree(top, node.rightChild(), jobs);
+    }
+    else if (node.offset >= 0) // leaf
+    {
+        KdNode leaf = node;
+        leaf.offset = (int)triangleIds.size();
+        nodes.push_back(leaf);
+        triangleIds.insert(triangleIds.end(), 
+            top.triangleIds.begin() + node.offset, 
+            top.triangleIds.begin() + node.offset + node.numTriangles());
+    }
+    else // placeholder of a job
+    {
+        // Append the subtree, with the indices offset by where it is placed
+        KdBuildContext &subtree = jobs[-1 - node.offset]->context;
+        unsigned int nodeOffset = nodes.size();
+        int triangleOffset = (int)triangleIds.size();
+
+        for (unsigned int i = 0; i < subtree.nodes.size(); i++)
+        {
+            KdNode n = subtree.nodes[i];
+            if (n.axis() == NoAxis)
+                n.offset += triangleOffset;
+            else
+                n.flags += nodeOffset << 2;
+            nodes.push_back(n);
+        }
+        triangleIds.insert(triangleIds.end(), subtree.triangleIds.begin(), subtree.triangleIds.end());
+    }
+}
+
 void KdTreeAcc::init()
 {
     Utils::PrintTickCount("Initialize k-d tree");
 
-    root = new KdNode();
-
     // Initialize the geometry list
+    int numIds = tunnel->getTriangleId(tunnel->getSegmentCount(), 0);
+    std::vector<Triangle> buffer(numIds);
     std::vector<Triangle *> list;
-    list.reserve(tunnel->surface.size() * tunnel->surface[0].size());
+    list.reserve(numIds);
+    triangles = &buffer[0];
 
-    for (unsigned int i = 0; i < tunnel->surface.size(); i++)
+    for (int i = 0; i < tunnel->getSegmentCount(); i++)
     {
-        for (unsigned int j = 0; j < tunnel->surface[i].size(); j++)
+        for (int j = 0; j < tunnel->getTriangleCount(i); j++)
         {
-            // Only triangles are supported temporarily
-            list.push_back((Triangle *)tunnel->surface[i][j]);
+            int id = tunnel->getTriangleId(i, j);
+            tunnel->getTriangle(id, triangles[id]);
+            list.push_back(&triangles[id]);
         }
     }
 
@@ -296,31 +502,113 @@ void KdTreeAcc::init()
     float min_x = FLT_MAX, min_y = FLT_MAX, min_z = FLT_MAX;
     float max_x = -FLT_MAX, max_y = -FLT_MAX, max_z = -FLT_MAX;
 
-    for (unsigned int i = 0; i < tunnel->surface.size(); i++)
+    for (unsigned int i = 0; i < list.size(); i++)
     {
-        for (unsigned int j = 0; j < tunnel->surface[i].size(); j++)
+        Point min, max;
+        list[i]->getBoundingBox(min, max);
+
+        min_x = std::min(min_x, min.x);
+        min_y = std::min(min_y, min.y);
+        min_z = std::min(min_z, min.z);
+
+        max_x = std::max(max_x, max.x);
+        max_y = std::max(max_y, max.y);
+        max_z = std::max(max_z, max.z);
+    }
+
+    sceneMin = Point(min_x, min_y, min_z);
+    sceneMax = Point(max_x, max_y, max_z);
+
+    // Build the top of the tree
+    int numThreads = omp_get_max_threads();
+    std::vector<KdBuildJob *> jobs;
+    std::vector<char> sides;
+    KdBuildContext top;
+    top.jobs = (numThreads > 1) ? &jobs : NULL; // build serially with a single thread
+    top.jobCutoff = std::max(4096, numIds / (8 * numThreads)); // 8 jobs per thread or more
+
+    if (tunnel->algorithm == Tunnel::KdTreeSAH)
+    {
+        std::vector<KdEvent> events[3];
+        for (unsigned int i = 0; i < list.size(); i++)
         {
             Point min, max;
-            Triangle *t = tunnel->surface[i][j];
-            t->getBoundingBox(min, max);
+            list[i]->getBoundingBox(min, max);
+            addEvents(list[i] - triangles, min, max, events);
+        }
 
-            min_x = std::min(min_x, min.x);
-            min_y = std::min(min_y, min.y);
-            min_z = std::min(min_z, min.z);
+        #pragma omp parallel for
+        for (int axis = 0; axis < 3; axis++)
+        {
+            std::sort(events[axis].begin(), events[axis].end(), cmpKdEvent);
+        }
 
-            max_x = std::max(max_x, max.x);
-            max_y = std::max(max_y, max.y);
-            max_z = std::max(max_z, max.z);
+        sides.resize(numIds);
+        top.sides = &sides;
+        buildKdTreeSAH(top, sceneMin, sceneMax, events, 0);
+    }
+    else
+    {
+        buildKdTree(top, sceneMin, sceneMax, list, 0);
+    }
+
+    // Build the subtrees in parallel
+    std::vector<std::vector<char>> threadSides(numThreads);
+
+    #pragma omp parallel for schedule(dynamic, 1) // Enable OpenMP
+    for (int i = 0; i < (int)jobs.size(); i++)
+    {
+        KdBuildJob *job = jobs[i];
+        if (tunnel->algorithm == Tunnel::KdTreeSAH)
+        {
+            std::vector<char> &sides = threadSides[omp_get_thread_num()];
+            sides.resize(numIds);
+            job->context.sides = &sides;
+            buildKdTreeSAH(job->context, job->min, job->max, job->events, job->depth);
+        }
+        else
+        {
+            buildKdTree(job->context, job->min, job->max, job->list, job->depth);
         }
     }
 
-    root->min = Point(min_x, min_y, min_z);
-    root->max = Point(max_x, max_y, max_z);
+    // Merge the subtrees into the flattened tree
+    mergeKdTree(top, 0, jobs);
+
+    // The triangles of each leaf are packed into blocks of four triangles, and the offset of
+    // a leaf is then the index of its first block
+    blocks.clear();
+    for (unsigned int i = 0; i < nodes.size(); i++)
+    {
+        if (nodes[i].axis() == NoAxis)
+        {
+            int begin = nodes[i].offset;
+            int count = nodes[i].numTriangles();
+            nodes[i].offset = blocks.size();
+            blocks.resize(blocks.size() + TriangleBlock::numBlocks(count));
+
+            for (int j = 0; j < count; j++)
+            {
+                int id = triangleIds[begin + j];
+                blocks[nodes[i].offset + j / TriangleBlock::SIZE].set(
+                    j % TriangleBlock::SIZE, id, tunnel->getTriangleRecord(id));
+            }
+        }
+    }
+    std::vector<int>().swap(triangleIds);
 
-    // Build the tree
-    int leaves = 0;
-    int leafElements = 0;
-    buildKdTree(root, list, 0, leaves, leafElements);
+    int leaves = top.numLeaves;
+    int leafElements = top.leafElements;
+    for (unsigned int i = 0; i < jobs.size(); i++)
+    {
+        leaves += jobs[i]->context.numLeaves;
+        leafElements += jobs[i]->context.leafElements;
+        delete jobs[i];
+    }
+    triangles = NULL;
+    Utils::DbgPrint("Total nodes: %d (%d KB)\r\n", nodes.size(), nodes.size() * sizeof(KdNode) / 1024);
+    Utils::DbgPrint("Total blocks: %d (%d KB)\r\n", blocks.size(), blocks.size() * sizeof(TriangleBlock) / 1024);
+    Utils::DbgPrint("Total jobs: %d\r\n", jobs.size());
     Utils::DbgPrint("Total leaves: %d\r\n", leaves);
     Utils::DbgPrint("Average Leaf Size: %d\r\n", leafElements / leaves);
 }
@@ -335,17 +623,18 @@ IntersectResult KdTreeAcc::intersect(Ray &ray)
     float t; // signed distance to the splitting plane
 
     // Intersect ray with sceneBox, find the entry and exit signed distance
-    Grid sceneBox(root->min, root->max);
-    if (!sceneBox.intersect(ray, a, b))
+    Grid sceneBox(sceneMin, sceneMax);
+    if (!sceneBox.intersect(ray, a, b) || a > ray.tMax)
         return IntersectResult(false);
 
     // Stack required for traversal to store far children
     StackElem stack[50];
 
     // Pointers to the far child node and current node
-    KdNode *farChild;
-    KdNode *currNode;
-    currNode = root;
+    const KdNode *farChild;
+    const KdNode *currNode;
+    const KdNode *base = &nodes[0];
+    currNode = base;
 
     // Setup initial entry point
     int enPt = 0;
@@ -367,13 +656,13 @@ IntersectResult KdTreeAcc::intersect(Ray &ray)
     while (currNode != NULL)
     {
         // Loop until a leaf is found
-        while (currNode->axis != NoAxis)
+        while (currNode->axis() != NoAxis)
         {
             // Retrive position of splitting plane
             float splitVal = currNode->splitPlane;
 
             // The current axis
-            int axis = (int)currNode->axis;
+            int axis = (int)currNode->axis();
             int nextAxis = (axis + 1) % 3; // x -> y -> z -> x ...
             int prevAxis = (axis + 2) % 3; // z -> y -> x -> z ...
 
@@ -382,33 +671,33 @@ IntersectResult KdTreeAcc::intersect(Ray &ray)
                 // Case N1, N2, N3, P5, Z2 and Z3
                 if (stack[exPt].pb[axis] <= splitVal)
                 {
-                    currNode = currNode->left;
+                    currNode = currNode + 1;
                     continue;
                 }
 
                 // Case Z1
                 if (stack[exPt].pb[axis] == splitVal)
                 {
-                    currNode = currNode->right;
+                    currNode = base + currNode->rightChild();
                     continue;
                 }
 
                 // Case N4
-                farChild = currNode->right;
-                currNode = currNode->left;
+                farChild = base + currNode->rightChild();
+                currNode = currNode + 1;
             }
             else // stack[enPt].pb[axis] > splitVal
             {
                 // Case P1, P2, P3 and N5
                 if (splitVal < stack[exPt].pb[axis])
                 {
-                    currNode = currNode->right;
+                    currNode = base + currNode->rightChild();
                     continue;
                 }
 
                 // Case P4
-                farChild = currNode->left;
-                currNode = currNode->right;
+                farChild = currNode + 1;
+                currNode = base + currNode->rightChild();
             }
             // Case P4 or N4 (traverse both children)
 
@@ -429,29 +718,36 @@ IntersectResult KdTreeAcc::intersect(Ray &ray)
             stack[exPt].pb[prevAxis] = ray.origin[prevAxis] + t * ray.direction[prevAxis];
         }
 
-        // Current node is the leaf, empty or full
-        float minDistance = FLT_MAX;
-        IntersectResult minResult(false);
+        // Current node is the leaf, empty or full. Its triangles are tested four at a time,
+        // and only the hits in the leaf are accepted
+        int minId = -1;
+        float tMin = std::max(ray.tMin, stack[enPt].t - 0.001f);
+        float tMax = std::min(ray.tMax, stack[exPt].t + 0.001f);
 
-        for (unsigned int i = 0; i < currNode->list.size(); i++)
+        const TriangleBlock *block = &blocks[currNode->offset];
+        int numBlocks = TriangleBlock::numBlocks(currNode->numTriangles());
+        for (int i = 0; i < numBlocks; i++)
         {
-            IntersectResult result = currNode->list[i]->intersect(ray);
-            if (result.hit && 
-                result.distance >= stack[enPt].t - 0.001f && 
-                result.distance <= stack[exPt].t + 0.001f &&
-                result.distance < minDistance)
+            int lane = block[i].intersect(ray, tMin, tMax);
+            if (lane >= 0)
             {
-                minResult = result;
-                minDistance = result.distance;
+                minId = block[i].ids[lane];
             }
         }
         
-        if (minResult.hit)
-            return minResult;
+        if (minId >= 0)
+        {
+            ray.tMax = tMax;
+            return tunnel->getTriangleHitResult(ray, minId, ray.tMax);
+        }
 
         // Pop from stack
         enPt = exPt; // The signed distance intervals are adjacent
 
+        // The remaining part of the ray lies beyond the nearest intersection found so far
+        if (stack[enPt].t > ray.tMax)
+            break;
+
         // Retrieve the pointer to the next node,
         // it is possible that ray traversal terminates
         currNode = stack[exPt].node;
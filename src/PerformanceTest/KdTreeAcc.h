@@ -2,6 +2,7 @@
 #define KD_TREE_ACC_H
 
 #include "Accelerator.h"
+#include "TriangleBlock.h"
 
 class KdTreeAcc : public Accelerator
 {
@@ -9,47 +10,109 @@ private:
     enum Axes { XAxis, YAxis, ZAxis, NoAxis }; // "NoAxis" denotes a leaf
     enum KdEventType { End, Planar, Start };
 
+    // The tree is flattened into an array of 8-byte nodes in depth-first order,
+    // so the left child of an interior node is the node right after it
     struct KdNode
     {
-        std::vector<Geometry *> list; // list of enclosed objects
-        KdNode *left;  // pointer to the left child
-        KdNode *right; // pointer to the right child
-        Axes axis;         // orientation of the splitting plane
-        float splitPlane;  // position of the splitting plane
+        union
+        {
+            float splitPlane;  // position of the splitting plane (interior node)
+            int offset;        // offset of the enclosed triangles in triangleIds while building,
+                               // then index of the first block of them in blocks (leaf)
+        };
+        unsigned int flags; // bits 0-1: orientation of the splitting plane, NoAxis for a leaf
+                            // bits 2-31: index of the right child (interior node),
+                            //            or the number of enclosed triangles (leaf)
 
-        Point min;
-        Point max;
+        Axes axis() const { return (Axes)(flags & 3); }
+        unsigned int rightChild() const { return flags >> 2; }
+        unsigned int numTriangles() const { return flags >> 2; }
     };
-    KdNode *root;
+    std::vector<KdNode> nodes;         // nodes[0] is the root
+    std::vector<int> triangleIds;      // the enclosed triangles of all leaves, only used while building
+    std::vector<TriangleBlock> blocks; // the enclosed triangles of all leaves, packed by four
+
+    // The bounding box of the root node
+    Point sceneMin;
+    Point sceneMax;
+
+    // The triangles of the tunnel indexed by id, which are rebuilt temporarily
+    // as the tunnel may not store them. Only valid while building the tree.
+    Triangle *triangles;
 
     struct StackElem
     {
-        KdNode *node;  // pointer of far child
+        const KdNode *node; // pointer of far child
         float t;           // the entry / exit signed distance
         Point pb;          // the coordinates of entry / exit point
         int prev;          // the pointer to the previous stack item
     };
 
+    // SAH construction in O(N log N)
+    // "On building fast kd-Trees for Ray Tracing, and on doing that in O(N log N)"
+    // by Ingo Wald and Vlastimil Havran
+    // The events of each axis are sorted only once for the root. The sorted lists of a node
+    // are split into those of its children, and only the events of the triangles overlapping
+    // both children are created and sorted again.
+    static const float KT; // cost of a traversal step
+    static const float KI; // cost of a ray-triangle intersection
+
+    enum KdSide { LeftOnly, RightOnly, Both };
+
 public: // should be exposed to the compare functions for sorting
     struct KdEvent
     {
-        Triangle *triangle;
+        int triangle; // triangle id
         float position;
         KdEventType type;
 
-        KdEvent(Triangle *triangle, float position, KdEventType type) : 
+        KdEvent(int triangle, float position, KdEventType type) : 
             triangle(triangle), position(position), type(type) {}
     };
 
 private:
-    void buildKdTree(KdNode *node, std::vector<Triangle *> &list, int depth, int &numLeaves, int &leafElements);
-    void deleteTree(KdNode *node);
-    float split(KdNode *node, int axis, std::vector<Triangle *> &list);
-    float splitSAH(KdNode *node, std::vector<Triangle *> &list, int &bestAxis, float &minSAH);
+    // Parallel construction
+    // The top of the tree is built first, and the subtrees that are small enough are left to
+    // jobs. The jobs are built in parallel, each into its own node array, and then merged into
+    // the flattened tree in depth-first order. The subtree of a job is represented in the top
+    // of the tree by a placeholder leaf, whose offset is -1 - (index of the job).
+    struct KdBuildJob;
+    struct KdBuildContext
+    {
+        std::vector<KdNode> nodes;
+        std::vector<int> triangleIds;
+        std::vector<char> *sides;        // the side of each triangle in the current split (SAH only)
+        std::vector<KdBuildJob *> *jobs; // where the subtrees are left to, NULL in a job
+        unsigned int jobCutoff;          // the max number of triangles in a subtree left to a job
+        int numLeaves;
+        int leafElements;
+
+        KdBuildContext() : sides(NULL), jobs(NULL), jobCutoff(0), numLeaves(0), leafElements(0) {}
+    };
+    struct KdBuildJob
+    {
+        Point min;
+        Point max;
+        int depth;
+        std::vector<Triangle *> list;   // the enclosed triangles (median split)
+        std::vector<KdEvent> events[3]; // the sorted events (SAH)
+        KdBuildContext context;         // the subtree
+    };
+
+    void buildKdTree(KdBuildContext &context, const Point &min, const Point &max, 
+        std::vector<Triangle *> &list, int depth);
+    void initLeaf(KdBuildContext &context, int index, std::vector<Triangle *> &list);
+    KdBuildJob *addJob(KdBuildContext &context, int index, const Point &min, const Point &max, int depth);
+    void mergeKdTree(KdBuildContext &top, int index, std::vector<KdBuildJob *> &jobs);
+    float split(int axis, std::vector<Triangle *> &list);
+    void buildKdTreeSAH(KdBuildContext &context, const Point &min, const Point &max, 
+        std::vector<KdEvent> events[3], int depth);
+    void addEvents(int id, const Point &min, const Point &max, std::vector<KdEvent> events[3]);
+    float findPlane(const Point &min, const Point &max, std::vector<KdEvent> events[3], int numTriangles, 
+        bool parallel, int &bestAxis, bool &planarLeft, float &minCost);
 
 public:
-    KdTreeAcc(Tunnel *tunnel) : Accelerator(tunnel) {}
-    ~KdTreeAcc();
+    KdTreeAcc(Tunnel *tunnel) : Accelerator(tunnel), triangles(NULL) {}
     virtual void init();
     virtual IntersectResult intersect(Ray &ray);
 };
@@ -22,7 +22,7 @@ IntersectResult Plane::intersect(Ray &ray)
     if (n.dot(ray.direction) > 0)
     {
         float distance = op.dot(n) / ray.direction.dot(n);
-        if (distance >= 0.0005f)
+        if (distance >= ray.tMin && distance <= ray.tMax)
         {
             result.hit = true;
             result.geometry = this;
@@ -3,6 +3,7 @@
 
 #include "Vector.h"
 #include "RayContext.h"
+#include <float.h>
 
 struct Ray
 {
@@ -16,8 +17,15 @@ struct Ray
     //    - Do not modify this member elsewhere unless you know what you're doing
     RayContext context;
 
+    // The valid interval of the signed distance
+    //    - tMin rejects self-intersections at the origin of a reflected ray
+    //    - tMax is shrunk to the distance of the closest hit found so far, so that
+    //      farther primitives and cells are culled during the traversal
+    float tMin;
+    float tMax;
+
     Ray(const Point &origin, const Vector &direction) 
-        : origin(origin), direction(direction), context(RayContext())
+        : origin(origin), direction(direction), context(RayContext()), tMin(0.0005f), tMax(FLT_MAX)
     {
     }
 
@@ -4,6 +4,45 @@
 #include "Geometry.h"
 #include "Grid.h"
 
+// The triangle in the form used by the ray-triangle test (Moller-Trumbore), where the edges
+// are precomputed. The accelerators keep an array of them, indexed by the triangle id.
+struct TriangleRecord
+{
+    Point a;
+    Vector e1; // b - a
+    Vector e2; // c - a
+
+    TriangleRecord() {}
+    TriangleRecord(const Point &a, const Point &b, const Point &c);
+    bool intersect(const Ray &ray, float &distance) const;
+};
+
+// The separating axis test of a triangle against the cells of a grid, which all have the
+// same size (Akenine-Moller, "Fast 3D Triangle-Box Overlap Testing"). The projection of
+// the triangle and the radius of a cell on each axis are computed once, so testing a cell
+// only takes a dot product with its center for each axis, in a loop without branches.
+// The x, y and z axes are left out, as the cells are taken from the bounding box.
+struct TriangleBoxTest
+{
+    enum { NUM_AXES = 10 }; // the normal, and the cross products of x, y, z and the edges
+    float ax[NUM_AXES], ay[NUM_AXES], az[NUM_AXES];
+    float lower[NUM_AXES]; // the projection of the triangle, extended by the radius of a cell
+    float upper[NUM_AXES];
+
+    TriangleBoxTest(const Point &a, const Point &b, const Point &c, const Vector &halfSize);
+
+    bool overlaps(const Point &center) const
+    {
+        int result = 1;
+        for (int i = 0; i < NUM_AXES; i++)
+        {
+            float d = ax[i] * center.x + ay[i] * center.y + az[i] * center.z;
+            result &= (d >= lower[i]) & (d <= upper[i]);
+        }
+        return result != 0;
+    }
+};
+
 class Triangle : public Geometry
 {
 public:
@@ -15,6 +54,7 @@ public:
     Triangle(const Point &a, const Point &b, const Point &c, const Vector &normal);
     Triangle(const Point &a, const Point &b, const Point &c);
     virtual IntersectResult intersect(Ray &ray);
+    static bool intersect(const Point &a, const Point &b, const Point &c, Ray &ray, float &distance);
     bool intersectWithGrid(const Grid &grid);
     void getBoundingBox(Point &min, Point &max);
 };
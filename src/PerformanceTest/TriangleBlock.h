@@ -0,0 +1,35 @@
+#ifndef TRIANGLE_BLOCK_H
+#define TRIANGLE_BLOCK_H
+
+#include "Triangle.h"
+
+// The SSE kernel is used when the compiler targets SSE (the default of VC++ 2012, /arch:SSE2),
+// otherwise the triangles of a block are tested one by one
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1) || defined(__SSE__)
+#define TRIANGLE_BLOCK_SSE
+#endif
+
+// Four triangles in the SoA layout (one array for each component), which are tested
+// against a ray at once. The leaves of the accelerators store their triangles in blocks,
+// and the unused lanes of the last block of a leaf are degenerate triangles.
+struct TriangleBlock
+{
+    enum { SIZE = 4 };
+
+    float ax[SIZE], ay[SIZE], az[SIZE];    // vertex a
+    float e1x[SIZE], e1y[SIZE], e1z[SIZE]; // b - a
+    float e2x[SIZE], e2y[SIZE], e2z[SIZE]; // c - a
+    int ids[SIZE];                         // the triangle ids, -1 for an unused lane
+
+    TriangleBlock();
+    void set(int lane, int id, const TriangleRecord &record);
+    TriangleRecord getRecord(int lane) const;
+
+    // Returns the lane of the nearest hit in [tMin, tMax), and shrinks tMax to its signed
+    // distance. Returns -1 if no triangle of the block is hit.
+    int intersect(const Ray &ray, float tMin, float &tMax) const;
+
+    static int numBlocks(int numTriangles) { return (numTriangles + SIZE - 1) / SIZE; }
+};
+
+#endif
@@ -4,12 +4,16 @@
 #include "GridAcc.h"
 #include "KdTreeAcc.h"
 #include "ConvexAcc.h"
+#include "BvhAcc.h"
 
 Tunnel::Tunnel()
 {
     accConvex = NULL;
     accGrid = NULL;
     accKdTree = NULL;
+    accBvh = NULL;
+    procedural = false;
+    gridResolution = 400;
 
     type = GeometryType::TUNNEL;
 }
@@ -17,7 +21,7 @@ Tunnel::Tunnel()
 Tunnel::~Tunnel()
 {
     // Delete accelerators
-    if (algorithm == RegularGrid || algorithm == FlatGrid)
+    if (algorithm == RegularGrid || algorithm == FlatGrid || algorithm == HierarchicalGrid)
     {
         delete accGrid;
     }
@@ -29,6 +33,10 @@ Tunnel::~Tunnel()
     {
         delete accConvex;
     }
+    else if (algorithm == Bvh)
+    {
+        delete accBvh;
+    }
 
     // Delete triangles
     for (unsigned int i = 0; i < surface.size(); i++)
@@ -42,7 +50,12 @@ Tunnel::~Tunnel()
 
 void Tunnel::init()
 {
-    if (algorithm == RegularGrid || algorithm == FlatGrid)
+    if (!procedural)
+    {
+        initRecords();
+    }
+
+    if (algorithm == RegularGrid || algorithm == FlatGrid || algorithm == HierarchicalGrid)
     {
         accGrid = new GridAcc(this);
         accGrid->init();
@@ -57,39 +70,218 @@ void Tunnel::init()
         accConvex = new ConvexAcc(this);
         accConvex->init();
     }
+    else if (algorithm == Bvh)
+    {
+        accBvh = new BvhAcc(this);
+        accBvh->init();
+    }
     // else: nothing to do
 
     Utils::PrintTickCount("Initialization Finished");
 }
 
+void Tunnel::initRecords()
+{
+    // Precompute the triangles in the form used by the ray-triangle test, shared by
+    // all the algorithms. A procedural surface rebuilds them on the fly instead.
+    int n = 2 * crossSection.vertices.size();
+    records.clear();
+    records.resize(getSegmentCount() * n);
+
+    for (int segment = 0; segment < getSegmentCount(); segment++)
+    {
+        for (int i = 0; i < getTriangleCount(segment); i++)
+        {
+            const Triangle *t = surface[segment][i];
+            records[getTriangleId(segment, i)] = TriangleRecord(t->a, t->b, t->c);
+        }
+    }
+}
+
+int Tunnel::getSegmentCount()
+{
+    return path.size() - 1;
+}
+
+int Tunnel::getTriangleCount(int segment)
+{
+    if (!procedural)
+    {
+        return surface[segment].size();
+    }
+    return (segmentPatterns[segment] < 0) ? 0 : 2 * crossSection.vertices.size();
+}
+
+int Tunnel::getTriangleId(int segment, int index)
+{
+    return segment * 2 * crossSection.vertices.size() + index;
+}
+
+// Rotate a point on the cross section around the y axis, and move it to a path node
+static Point transform(const Point &p, float cosAngle, float sinAngle, const Point &node)
+{
+    return Point(
+        p.x * cosAngle - p.z * sinAngle,
+        p.y,
+        p.x * sinAngle + p.z * cosAngle) + Vector(Point(0, 0, 0), node);
+}
+
+void Tunnel::getVertices(int segment, int index, Point &a, Point &b, Point &c)
+{
+    if (!procedural)
+    {
+        Triangle *t = surface[segment][index];
+        a = t->a;
+        b = t->b;
+        c = t->c;
+        return;
+    }
+
+    // The same as the triangles created by TunnelGenerator
+    //
+    //   A  B    front polygon (path node i)
+    //   o--o
+    //   |  |
+    //   o--o
+    //   C  D    rear polygon (path node i + 1)
+    int n = crossSection.vertices.size();
+    int j = index / 2;
+    const SegmentFrame &f = segmentFrames[segment];
+    const Point &p1 = crossSection.vertices[j];
+    const Point &p2 = crossSection.vertices[(j + 1) % n];
+
+    Point A = transform(p1, f.cosFront, f.sinFront, path[segment]);
+    Point B = transform(p2, f.cosFront, f.sinFront, path[segment]);
+    Point C = transform(p1, f.cosRear, f.sinRear, path[segment + 1]);
+    Point D = transform(p2, f.cosRear, f.sinRear, path[segment + 1]);
+
+    if (connectionPatterns[segmentPatterns[segment]][j] == Polyhedron::AD) // ACD and ADB
+    {
+        a = A;
+        b = (index % 2 == 0) ? C : D;
+        c = (index % 2 == 0) ? D : B;
+    }
+    else // BC or Both, CDB and CBA
+    {
+        a = C;
+        b = (index % 2 == 0) ? D : B;
+        c = (index % 2 == 0) ? B : A;
+    }
+}
+
+void Tunnel::getTriangle(int id, Triangle &triangle)
+{
+    int n = 2 * crossSection.vertices.size();
+    getVertices(id / n, id % n, triangle.a, triangle.b, triangle.c);
+    triangle.normal = Vector(triangle.a, triangle.b).cross(Vector(triangle.b, triangle.c)).norm();
+}
+
+TriangleRecord Tunnel::getTriangleRecord(int id)
+{
+    if (!procedural)
+    {
+        return records[id];
+    }
+
+    int n = 2 * crossSection.vertices.size();
+    Point a, b, c;
+    getVertices(id / n, id % n, a, b, c);
+    return TriangleRecord(a, b, c);
+}
+
+IntersectResult Tunnel::intersectTriangle(Ray &ray, int segment, int index)
+{
+    return intersectTriangle(ray, getTriangleId(segment, index));
+}
+
+IntersectResult Tunnel::intersectTriangle(Ray &ray, int id)
+{
+    float distance;
+
+    if (!intersectTriangleDistance(ray, id, distance))
+    {
+        return IntersectResult(false);
+    }
+    return getTriangleHitResult(ray, id, distance);
+}
+
+bool Tunnel::intersectTriangleDistance(Ray &ray, int id, float &distance)
+{
+    if (!procedural)
+    {
+        return records[id].intersect(ray, distance);
+    }
+
+    int n = 2 * crossSection.vertices.size();
+    Point a, b, c;
+    getVertices(id / n, id % n, a, b, c);
+    return Triangle::intersect(a, b, c, ray, distance);
+}
+
+IntersectResult Tunnel::getTriangleHitResult(Ray &ray, int id, float distance)
+{
+    int n = 2 * crossSection.vertices.size();
+    IntersectResult result(true);
+    result.distance = distance;
+    result.position = ray.getPoint(distance);
+
+    if (!procedural)
+    {
+        Triangle *t = surface[id / n][id % n];
+        result.geometry = t;
+        result.normal = t->normal;
+        return result;
+    }
+
+    Point a, b, c;
+    getVertices(id / n, id % n, a, b, c);
+    result.geometry = this;
+    result.normal = Vector(a, b).cross(Vector(b, c)).norm();
+    return result;
+}
+
 IntersectResult Tunnel::linearIntersect(Ray &ray)
 {
-    float minDistance = FLT_MAX;
-    IntersectResult minResult(false);
+    int minId = -1;
 
-    for (unsigned int segment = 0; segment < surface.size(); segment++)
+    for (int segment = 0; segment < getSegmentCount(); segment++)
     {
-        for (unsigned int i = 0; i < surface[segment].size(); i++)
+        for (int i = 0; i < getTriangleCount(segment); i++)
         {
-            IntersectResult result = surface[segment][i]->intersect(ray);
-            if (result.hit && (result.distance < minDistance)) 
+            int id = getTriangleId(segment, i);
+            float distance;
+            if (intersectTriangleDistance(ray, id, distance) && distance < ray.tMax) 
             {
-                minDistance = result.distance;
-                minResult = result;
+                ray.tMax = distance;
+                minId = id;
             }
         }
     }
-    return minResult;
+    return (minId >= 0) ? getTriangleHitResult(ray, minId, ray.tMax) : IntersectResult(false);
 }
 
 IntersectResult Tunnel::intersect(Ray &ray)
 {
-    if (algorithm == RegularGrid || algorithm == FlatGrid)
+    if (algorithm == RegularGrid || algorithm == FlatGrid || algorithm == HierarchicalGrid)
         return accGrid->intersect(ray);
     else if (algorithm == KdTreeSAH || algorithm == KdTreeStandard)
         return accKdTree->intersect(ray);
     else if (algorithm == Convex || algorithm == ConvexSimple)
         return accConvex->intersect(ray);
+    else if (algorithm == Bvh)
+        return accBvh->intersect(ray);
     else
         return linearIntersect(ray);
 }
+
+void Tunnel::printStats()
+{
+    if (algorithm == RegularGrid || algorithm == FlatGrid || algorithm == HierarchicalGrid)
+        accGrid->printStats();
+    else if (algorithm == KdTreeSAH || algorithm == KdTreeStandard)
+        accKdTree->printStats();
+    else if (algorithm == Convex || algorithm == ConvexSimple)
+        accConvex->printStats();
+    else if (algorithm == Bvh)
+        accBvh->printStats();
+}
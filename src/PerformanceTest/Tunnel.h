@@ -3,20 +3,40 @@
 
 #include <vector>
 #include "Polygon.h"
+#include "Polyhedron.h"
 #include "Triangle.h"
 
 class GridAcc;
 class KdTreeAcc;
 class ConvexAcc;
+class BvhAcc;
 
 class Tunnel : public Geometry
 {
 public:
     Polygon crossSection; // the cross section at the origin
     std::vector<Point> path;
-    std::vector<std::vector<Triangle *>> surface;
+    std::vector<std::vector<Triangle *>> surface; // empty if the surface is procedural
+    std::vector<TriangleRecord> records; // the surface triangles indexed by id, built by init()
     std::vector<Vector> nvs; // normal vectors of the polygons
 
+    // Procedural surface
+    // ------------------------------------------------------------------------------------
+    // Instead of storing the triangles, rebuild them on the fly from the cross section and
+    // the path. The triangles of segment i connect the front polygon (at path node i) and
+    // the rear polygon (at path node i + 1), which are the cross section rotated around the
+    // y axis. How the two polygons are connected is the same for most segments, so only the
+    // distinct connection patterns are stored.
+    struct SegmentFrame
+    {
+        float cosFront, sinFront;
+        float cosRear, sinRear;
+    };
+    bool procedural;
+    std::vector<SegmentFrame> segmentFrames;
+    std::vector<short> segmentPatterns; // index in connectionPatterns, -1 if not convex
+    std::vector<std::vector<Polyhedron::ConnectionType>> connectionPatterns;
+
     // Size of the bounding rectangle of the tunnel's cross section
     float height;
     float width;
@@ -27,20 +47,48 @@ public:
         Linear = 0,
         RegularGrid = 1, FlatGrid = 2, 
         KdTreeStandard = 3, KdTreeSAH = 4, 
-        Convex = 5, ConvexSimple = 6 // the same order with the combobox items
+        Convex = 5, ConvexSimple = 6, 
+        Bvh = 7,
+        HierarchicalGrid = 8 // the same order with the combobox items
     } algorithm;
 
+    // The number of cells along the longest axis (regular grid) or each axis (flat grid)
+    int gridResolution;
+
 private:
     GridAcc *accGrid;
     KdTreeAcc *accKdTree;
     ConvexAcc *accConvex;
+    BvhAcc *accBvh;
+
+private:
+    void initRecords();
+    void getVertices(int segment, int index, Point &a, Point &b, Point &c);
 
 public:
     Tunnel();
     ~Tunnel();
     void init();
+
+    // Triangle #index (0 <= index < getTriangleCount(segment)) of a segment is also
+    // identified by id = segment * 2 * crossSection.vertices.size() + index
+    int getSegmentCount();
+    int getTriangleCount(int segment);
+    int getTriangleId(int segment, int index);
+    void getTriangle(int id, Triangle &triangle);
+    TriangleRecord getTriangleRecord(int id);
+    IntersectResult intersectTriangle(Ray &ray, int segment, int index);
+    IntersectResult intersectTriangle(Ray &ray, int id);
+
+    // Deferred shading, used in the inner loops of the accelerators
+    // Only the signed distance of a hit is computed for each candidate triangle, and the
+    // position and the normal are computed once for the closest hit.
+    bool intersectTriangleDistance(Ray &ray, int id, float &distance);
+    IntersectResult getTriangleHitResult(Ray &ray, int id, float distance);
+
     IntersectResult linearIntersect(Ray &ray);
     virtual IntersectResult intersect(Ray &ray);
+    void printStats();
 };
 
 #endif
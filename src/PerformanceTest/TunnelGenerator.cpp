@@ -174,17 +174,34 @@ bool TunnelGenerator::createPolyhedron(
     return connInvalid == 0;
 }
 
+short TunnelGenerator::addConnectionPattern(
+    Tunnel *tunnel, const std::vector<Polyhedron::ConnectionType> &connections)
+{
+    // There are only a few distinct patterns, a linear search is enough
+    for (unsigned int i = 0; i < tunnel->connectionPatterns.size(); i++)
+    {
+        if (tunnel->connectionPatterns[i] == connections)
+        {
+            return (short)i;
+        }
+    }
+    tunnel->connectionPatterns.push_back(connections);
+    return (short)(tunnel->connectionPatterns.size() - 1);
+}
+
 bool TunnelGenerator::create(
     float rectWidth, float rectHeight, float archHeight, // cross section attributes
     float pathRadius, float pathAngle, // path attributes
     int archSegments, int pathSegments, // tessellation attributes
     GeometrySet &scene, 
-    Tunnel::Algorithm algorithm)
+    Tunnel::Algorithm algorithm,
+    bool procedural)
 {
     Tunnel *tunnel = new Tunnel();
     tunnel->height = rectHeight + archHeight;
     tunnel->width = rectWidth;
     tunnel->algorithm = algorithm;
+    tunnel->procedural = procedural;
 
     // 1. Create the cross section at the origin
     // ------------------------------------------------------------------------------------
@@ -237,7 +254,16 @@ bool TunnelGenerator::create(
             tunnel->path.push_back(p2);
         }
 
-        tunnel->surface.push_back(std::vector<Triangle *>());
+        if (!procedural)
+        {
+            tunnel->surface.push_back(std::vector<Triangle *>());
+        }
+    }
+
+    if (procedural)
+    {
+        tunnel->segmentFrames.resize(pathSegments);
+        tunnel->segmentPatterns.resize(pathSegments, -1);
     }
 
     // 2.1 Initialize normal vectors
@@ -311,6 +337,15 @@ bool TunnelGenerator::create(
             fprintf(stderr, "Polyhedron %d is not convex!\n", i + 1);
             // return false; // when OpenMP is enabled, there should not be returns
         }
+        else if (procedural) // 3.3 Record how to rebuild the triangles
+        {
+            Tunnel::SegmentFrame &frame = tunnel->segmentFrames[i];
+            frame.cosFront = cos(offsetAngle1);
+            frame.sinFront = sin(offsetAngle1);
+            frame.cosRear = cos(offsetAngle2);
+            frame.sinRear = sin(offsetAngle2);
+            tunnel->segmentPatterns[i] = addConnectionPattern(tunnel, polyhedron.connections);
+        }
         else // 3.3 Add to scene
         {
             for (unsigned int j = 0; j < tunnel->crossSection.vertices.size(); j++)
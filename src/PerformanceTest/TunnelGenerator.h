@@ -12,6 +12,7 @@ private:
     bool createPolyhedron(
         Polygon &front, Polygon &rear, Polyhedron &polyhedron,
         int &connBC, int &connAD, int &connBoth, int &connInvalid);
+    short addConnectionPattern(Tunnel *tunnel, const std::vector<Polyhedron::ConnectionType> &connections);
 
 public:
     bool create(
@@ -19,7 +20,8 @@ public:
         float pathRadius, float pathAngle, // path attributes
         int archSegments, int pathSegments, // tessellation attributes
         GeometrySet &scene, 
-        Tunnel::Algorithm algorithm);
+        Tunnel::Algorithm algorithm,
+        bool procedural = false); // rebuild the triangles on the fly instead of storing them
 };
 
 #endif
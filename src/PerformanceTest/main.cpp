@@ -6,6 +6,9 @@
 // the scene
 GeometrySet scene;
 Tunnel::Algorithm algorithm;
+bool procedural = false; // rebuild the tunnel triangles on the fly
+int gridResolution = 400; // cells along the longest axis (rgrid) or each axis (fgrid)
+bool verify = false; // compare the hits of the secondary rays with the linear scan
 
 // (fixed) cross section attributes
 const float RECT_WIDTH = 50;
@@ -64,7 +67,7 @@ Tunnel *init_scene()
     TunnelGenerator g;
     Tunnel *tunnel;
     g.create(RECT_WIDTH, RECT_HEIGHT, ARCH_HEIGHT, 
-        PATH_RADIUS, PATH_ANGLE, ARCH_SEG, PATH_SEG, scene, algorithm);
+        PATH_RADIUS, PATH_ANGLE, ARCH_SEG, PATH_SEG, scene, algorithm, procedural);
     tunnel = (Tunnel *)scene.last();
 
     // place a plane at the exit of the tunnel
@@ -80,12 +83,87 @@ Tunnel *init_scene()
     return tunnel;
 }
 
+// Follows diffuse bounces of a camera ray inside the tunnel, and compares each hit of the
+// accelerator with the linear scan. Unlike the mirror reflections in trace(), the bounces
+// leave in any direction, including backward rays and the rays across the wedge between
+// two polygons on a curved path. Returns whether a hit differs.
+bool verify_bounces(Tunnel *tunnel, Ray ray, int &numTests)
+{
+    const int MAX_BOUNCES = 8;
+    const float OFFSET = 1e-3f; // keeps the next ray from hitting the same triangle
+    for (int depth = 0; depth < MAX_BOUNCES; depth++)
+    {
+        Ray reference(ray.origin, ray.direction);
+        IntersectResult result = tunnel->intersect(ray);
+        IntersectResult expected = tunnel->linearIntersect(reference);
+        numTests++;
+
+        // The convex accelerator finds the triangles of the cross section in a table, which
+        // may give a neighbour of the exact one at a grazing angle, so the hits only need to
+        // be close to each other
+        if (result.hit != expected.hit || 
+            (result.hit && Vector(result.position, expected.position).length() > 0.01f * tunnel->width))
+        {
+            return true;
+        }
+        if (!expected.hit)
+        {
+            break;
+        }
+
+        // Continue from the expected hit in a random direction of the hemisphere
+        Vector &n = expected.normal;
+        Vector nl = (n.dot(ray.direction) < 0) ? n : n * -1;
+        Vector v;
+        do
+        {
+            v = Vector(rand() / (float)RAND_MAX - 0.5f, rand() / (float)RAND_MAX - 0.5f, 
+                rand() / (float)RAND_MAX - 0.5f);
+        } while (v.dot(v) > 0.25f || v.dot(v) < 1e-4f);
+        v.norm();
+        if (v.dot(nl) < 0)
+        {
+            v = v * -1;
+        }
+
+        Ray newRay(expected.position + nl * OFFSET, v);
+        newRay.context = ray.context;
+        ray = newRay;
+    }
+    return false;
+}
+
+bool parse_option(const char *option)
+{
+    if (strcmp(option, "procedural") == 0)
+    {
+        procedural = true;
+        return true;
+    }
+    else if (strncmp(option, "grid=", 5) == 0)
+    {
+        return sscanf_s(option + 5, "%d", &gridResolution) == 1 && gridResolution >= 2;
+    }
+    else if (strcmp(option, "verify") == 0)
+    {
+        verify = true;
+        return true;
+    }
+    return false;
+}
+
 void parse_params(int argc, char *argv[])
 {
-    if (argc != 7)
+    bool valid = (argc >= 7);
+    for (int i = 7; i < argc && valid; i++)
+    {
+        valid = parse_option(argv[i]);
+    }
+
+    if (!valid)
     {
         fprintf(stderr, "Usage:\n");
-        fprintf(stderr, "   - PerformaceTest PathRadius PathAngle ArchSeg PathSeg N Algorithm\n");
+        fprintf(stderr, "   - PerformaceTest PathRadius PathAngle ArchSeg PathSeg N Algorithm [procedural] [grid=N] [verify]\n");
         fprintf(stderr, "Algorithms:\n");
         fprintf(stderr, "   - linear (Linear)\n");
         fprintf(stderr, "   - rgrid (Regular Grid)\n");
@@ -94,6 +172,12 @@ void parse_params(int argc, char *argv[])
         fprintf(stderr, "   - sah (K-d Tree (SAH))\n");
         fprintf(stderr, "   - convex (Convex)\n");
         fprintf(stderr, "   - convex_s (Convex Simple)\n");
+        fprintf(stderr, "   - bvh (BVH)\n");
+        fprintf(stderr, "   - hgrid (Hierarchical Grid)\n");
+        fprintf(stderr, "Options:\n");
+        fprintf(stderr, "   - procedural (rebuild the tunnel triangles on the fly instead of storing them)\n");
+        fprintf(stderr, "   - grid=N (cells along the longest axis of rgrid or each axis of fgrid, 400 by default)\n");
+        fprintf(stderr, "   - verify (compare the hits of diffuse bounces with linear, e.g. on a curved path: 100 1.309 30 30)\n");
         fprintf(stderr, "Example:\n");
         fprintf(stderr, "   - PerformaceTest 1000 1.5708 150 150 1000 convex");
 
@@ -119,8 +203,13 @@ void parse_params(int argc, char *argv[])
             algorithm = Tunnel::Convex;
         else if (strcmp(argv[6], "convex_s") == 0)
             algorithm = Tunnel::ConvexSimple;
+        else if (strcmp(argv[6], "bvh") == 0)
+            algorithm = Tunnel::Bvh;
+        else if (strcmp(argv[6], "hgrid") == 0)
+            algorithm = Tunnel::HierarchicalGrid;
         else
             algorithm = Tunnel::Linear;
+
     }
 }
 
@@ -132,6 +221,7 @@ int main(int argc, char *argv[])
     // create scene
     int t0 = Utils::GetTickCount();
     Tunnel *tunnel = init_scene();
+    tunnel->gridResolution = gridResolution;
 
     // preprocess
     int s0 = Utils::GetMemorySize();
@@ -161,6 +251,28 @@ int main(int argc, char *argv[])
         }
     }
     int t4 = Utils::GetTickCount();
+    tunnel->printStats();
+
+    // regression check of the secondary rays
+    if (verify)
+    {
+        int mismatches = 0;
+        int numTests = 0;
+        for (int i = 0; i < N; i++)
+        {
+            float dx = rand() / (float)RAND_MAX;
+            float dy = rand() / (float)RAND_MAX;
+            if (verify_bounces(tunnel, camera.generateRay(dx, dy), numTests))
+            {
+                mismatches++;
+            }
+        }
+        Utils::DbgPrint("Mismatches against Linear: %d paths (%d rays tested)\n", mismatches, numTests);
+        if (mismatches > 0)
+        {
+            return 1;
+        }
+    }
 
     // output
     printf(
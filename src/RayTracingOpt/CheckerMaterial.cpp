@@ -21,3 +21,25 @@ Color CheckerMaterial::local(const Ray &ray, const Point &position, const Vector
     d = fmod(d, 2);
     return  (d < 1) ? Color(0.15f, 0.15f, 0.15f) /*Color::Black()*/ : Color::White();
 }
+
+// The same as local(), with the plane of the checker chosen once for the batch
+// For an integer d >= 0, fmod(d, 2) is d - 2 * floor(d / 2).
+void CheckerMaterial::shade(const ShadingBatch &batch, int begin, int end)
+{
+    const float *u = (dir == yoz) ? batch.py : batch.px;
+    const float *v = (dir == xoy) ? batch.py : batch.pz;
+
+    for (int i = begin; i < end; i++)
+    {
+        float d = fabs(floor(u[i] * scale) + floor(v[i] * scale));
+        d = d - 2 * floor(d * 0.5f);
+
+        float c = (d < 1) ? 0.15f : 1.0f;
+        batch.lr[i] = c;
+        batch.lg[i] = c;
+        batch.lb[i] = c;
+        batch.er[i] = 0;
+        batch.eg[i] = 0;
+        batch.eb[i] = 0;
+    }
+}
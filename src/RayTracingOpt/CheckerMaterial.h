@@ -15,6 +15,7 @@ private:
 public:
     CheckerMaterial(float scale, enum checker_dir_t dir = xoz, float reflectiveness = 0);
     virtual Color local(const Ray &ray, const Point &position, const Vector &normal);
+    virtual void shade(const ShadingBatch &batch, int begin, int end);
 };
 
 #endif
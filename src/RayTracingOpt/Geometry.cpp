@@ -1,8 +1,7 @@
 #include "Geometry.h"
+#include "RayPacket.h"
 
-#define NULL 0
-
-Geometry::Geometry() : material(NULL)
+Geometry::Geometry() : material(0)
 {
 }
 
@@ -10,7 +9,35 @@ Geometry::~Geometry()
 {
 }
 
-void Geometry::setMaterial(const Ptr<Material> &materail)
+bool Geometry::getBoundingBox(Point &min, Point &max)
+{
+    return false;
+}
+
+bool Geometry::intersectDistance(Ray &ray, float &distance)
+{
+    IntersectResult result = intersect(ray);
+    distance = result.distance;
+    return result.hit;
+}
+
+IntersectResult Geometry::getHitResult(Ray &ray, float distance)
+{
+    // Intersect again, the closest hit is the only one left in [ray.tMin, distance]
+    Ray closest = ray;
+    closest.tMax = distance;
+    return intersect(closest);
+}
+
+void Geometry::intersectPacket(RayPacket &packet, IntersectResult results[])
+{
+    for (int i = 0; i < RayPacket::SIZE; i++)
+    {
+        results[i] = intersect(*packet.rays[i]);
+    }
+}
+
+void Geometry::setMaterial(unsigned short material)
 {
     this->material = material;
 }
@@ -3,19 +3,30 @@
 
 #include "Ray.h"
 #include "IntersectResult.h"
-#include "Material.h"
-#include "SmartPointer.h"
+
+struct RayPacket;
 
 class Geometry
 {
 public:
-    Ptr<Material> material;
+    unsigned short material; // index in the material table of the scene
 
 public:
     Geometry();
     virtual ~Geometry();
     virtual IntersectResult intersect(Ray &ray) = 0;
-    void setMaterial(const Ptr<Material> &materail);
+    virtual bool getBoundingBox(Point &min, Point &max); // false if the geometry is unbounded
+
+    // Deferred shading, used in the traversal of a GeometrySet
+    // Only the signed distance of a hit is computed for each candidate, and the position and
+    // the normal are computed once for the closest hit by getHitResult().
+    virtual bool intersectDistance(Ray &ray, float &distance);
+    virtual IntersectResult getHitResult(Ray &ray, float distance);
+
+    // Packet tracing, fills the results of the rays of a packet (see RayPacket)
+    // The default implementation intersects the rays one by one.
+    virtual void intersectPacket(RayPacket &packet, IntersectResult results[]);
+    void setMaterial(unsigned short material);
 };
 
 #endif
@@ -1,7 +1,55 @@
 #include "GeometrySet.h"
 #include "Triangle.h"
+#include "RayPacket.h"
+#include "Utils.h"
 #include <float.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+
+// Half of the surface area of a box
+static float halfArea(const Point &min, const Point &max)
+{
+    Vector size(min, max);
+    return size.x * size.y + size.y * size.z + size.z * size.x;
+}
+
+static void growBox(Point &min, Point &max, const Point &p)
+{
+    min.x = std::min(min.x, p.x);
+    min.y = std::min(min.y, p.y);
+    min.z = std::min(min.z, p.z);
+
+    max.x = std::max(max.x, p.x);
+    max.y = std::max(max.y, p.y);
+    max.z = std::max(max.z, p.z);
+}
+
+// The slab test, returns whether the ray enters the box before maxDistance
+static bool intersectBox(const Point &min, const Point &max, const Ray &ray, const float invDir[3],
+                         float maxDistance, float &distance)
+{
+    float entry = 0.0f;
+    float exit = maxDistance;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float t0 = (min[axis] - ray.origin[axis]) * invDir[axis];
+        float t1 = (max[axis] - ray.origin[axis]) * invDir[axis];
+        if (invDir[axis] < 0)
+        {
+            std::swap(t0, t1);
+        }
+
+        // A NaN (the ray lies in a face of the box) keeps the old value
+        entry = (t0 > entry) ? t0 : entry;
+        exit = (t1 < exit) ? t1 : exit;
+    }
+
+    distance = entry;
+    return entry <= exit;
+}
 
 GeometrySet::~GeometrySet()
 {
@@ -11,6 +59,7 @@ GeometrySet::~GeometrySet()
 void GeometrySet::add(Geometry* geometry)
 {
     geometries.push_back(geometry);
+    built = false;
 }
 
 Geometry *GeometrySet::last()
@@ -20,7 +69,20 @@ Geometry *GeometrySet::last()
     return geometries.back();
 }
 
-bool GeometrySet::addStlFile(const char *filename, Ptr<Material> material)
+unsigned short GeometrySet::addMaterial(Material *material)
+{
+    // The geometries reference the materials by a 16-bit index, which must not wrap
+    if (materials.size() > USHRT_MAX)
+    {
+        Utils::DbgPrint("Error: a scene holds at most %d materials\n", USHRT_MAX + 1);
+        abort();
+    }
+
+    materials.push_back(material);
+    return (unsigned short)(materials.size() - 1);
+}
+
+bool GeometrySet::addStlFile(const char *filename, unsigned short material)
 {
     Matrix matrix(
         1, 0, 0, 
@@ -30,7 +92,7 @@ bool GeometrySet::addStlFile(const char *filename, Ptr<Material> material)
     return addStlFile(filename, material, matrix, offset);
 }
 
-bool GeometrySet::addStlFile(const char *filename, Ptr<Material> material, const Matrix &matrix, const Vector &offset)
+bool GeometrySet::addStlFile(const char *filename, unsigned short material, const Matrix &matrix, const Vector &offset)
 {
     // Open file
     FILE *fp = NULL;
@@ -75,13 +137,11 @@ bool GeometrySet::addStlFile(const char *filename, Ptr<Material> material, const
 
         Triangle *t = new Triangle(p1, p2, p3, n);
 
-        // Each geometry object has a pointer to a material object.
-        // To avoid deleting a same material object twice in the destructors of the geometry objects, 
-        // they're first cloned here.
-        // Smart pointer also works, but it's not used here.
+        // All the triangles share a same material in the material table
         t->material = material;
         geometries.push_back(t);
     }
+    built = false;
     return true;
 }
 
@@ -90,21 +150,335 @@ void GeometrySet::clear()
     for (unsigned int i = 0; i < geometries.size(); i++)
         delete geometries[i];
     geometries.clear();
+
+    nodes.clear();
+    bounded.clear();
+    unbounded.clear();
+    built = false;
+
+    for (unsigned int i = 0; i < materials.size(); i++)
+        delete materials[i];
+    materials.clear();
+}
+
+void GeometrySet::build()
+{
+    std::vector<BvhEntry> list;
+    nodes.clear();
+    bounded.clear();
+    unbounded.clear();
+
+    for (unsigned int i = 0; i < geometries.size(); i++)
+    {
+        BvhEntry entry;
+        if (geometries[i]->getBoundingBox(entry.min, entry.max))
+        {
+            entry.center = Point(
+                (entry.min.x + entry.max.x) * 0.5f,
+                (entry.min.y + entry.max.y) * 0.5f,
+                (entry.min.z + entry.max.z) * 0.5f);
+            entry.geometry = geometries[i];
+            list.push_back(entry);
+        }
+        else
+        {
+            unbounded.push_back(geometries[i]);
+        }
+    }
+
+    if (!list.empty())
+    {
+        buildNode(list, 0, list.size(), 0);
+
+        // The geometries of a leaf are a range of the partitioned list
+        bounded.resize(list.size());
+        for (unsigned int i = 0; i < list.size(); i++)
+        {
+            bounded[i] = list[i].geometry;
+        }
+    }
+}
+
+// Binned SAH construction along the axis in which the centroids spread the most
+// "On fast Construction of SAH-based Bounding Volume Hierarchies" by Ingo Wald
+void GeometrySet::buildNode(std::vector<BvhEntry> &list, int begin, int end, int depth)
+{
+    int index = nodes.size();
+    nodes.push_back(BvhNode());
+
+    // The bounding box of the geometries, and that of their centroids
+    Point min(FLT_MAX, FLT_MAX, FLT_MAX);
+    Point max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    Point centerMin = min;
+    Point centerMax = max;
+
+    for (int i = begin; i < end; i++)
+    {
+        growBox(min, max, list[i].min);
+        growBox(min, max, list[i].max);
+        growBox(centerMin, centerMax, list[i].center);
+    }
+    nodes[index].min = min;
+    nodes[index].max = max;
+
+    if (end - begin <= MAX_LEAF_SIZE || depth >= MAX_DEPTH)
+    {
+        nodes[index].offset = begin;
+        nodes[index].count = end - begin;
+        return;
+    }
+
+    // Select the axis
+    Vector extent(centerMin, centerMax);
+    int axis = 0;
+    if (extent.y > extent[axis]) axis = 1;
+    if (extent.z > extent[axis]) axis = 2;
+
+    int mid = (begin + end) / 2; // split in the middle if the centroids coincide
+    if (extent[axis] > 0.0f)
+    {
+        float scale = NUM_BINS / extent[axis];
+
+        // Put the centroids into the bins
+        Point binMin[NUM_BINS];
+        Point binMax[NUM_BINS];
+        int binCount[NUM_BINS];
+        for (int i = 0; i < NUM_BINS; i++)
+        {
+            binMin[i] = Point(FLT_MAX, FLT_MAX, FLT_MAX);
+            binMax[i] = Point(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+            binCount[i] = 0;
+        }
+
+        for (int i = begin; i < end; i++)
+        {
+            int bin = std::min((int)((list[i].center[axis] - centerMin[axis]) * scale), NUM_BINS - 1);
+            binCount[bin] += 1;
+            growBox(binMin[bin], binMax[bin], list[i].min);
+            growBox(binMin[bin], binMax[bin], list[i].max);
+        }
+
+        // Sweep from the right, plane #i lies between bin #(i - 1) and bin #i
+        float rightArea[NUM_BINS];
+        int rightCount[NUM_BINS];
+        Point boxMin(FLT_MAX, FLT_MAX, FLT_MAX);
+        Point boxMax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+        int count = 0;
+
+        for (int i = NUM_BINS - 1; i > 0; i--)
+        {
+            count += binCount[i];
+            growBox(boxMin, boxMax, binMin[i]);
+            growBox(boxMin, boxMax, binMax[i]);
+            rightArea[i] = halfArea(boxMin, boxMax);
+            rightCount[i] = count;
+        }
+
+        // Sweep from the left, minimize SAL * NL + SAR * NR
+        boxMin = Point(FLT_MAX, FLT_MAX, FLT_MAX);
+        boxMax = Point(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+        count = 0;
+
+        float minCost = FLT_MAX;
+        int bestBin = 1;
+        for (int i = 1; i < NUM_BINS; i++)
+        {
+            count += binCount[i - 1];
+            growBox(boxMin, boxMax, binMin[i - 1]);
+            growBox(boxMin, boxMax, binMax[i - 1]);
+
+            if (count == 0 || rightCount[i] == 0)
+                continue;
+
+            float cost = halfArea(boxMin, boxMax) * count + rightArea[i] * rightCount[i];
+            if (cost < minCost)
+            {
+                minCost = cost;
+                bestBin = i;
+            }
+        }
+
+        // Partition the geometries in place by the bins of their centroids
+        int i = begin;
+        int j = end - 1;
+        while (i <= j)
+        {
+            if (std::min((int)((list[i].center[axis] - centerMin[axis]) * scale), NUM_BINS - 1) < bestBin)
+                i += 1;
+            else
+                std::swap(list[i], list[j--]);
+        }
+        mid = i;
+    }
+
+    // Build the children
+    nodes[index].count = 0;
+    buildNode(list, begin, mid, depth + 1);
+    nodes[index].offset = nodes.size();
+    buildNode(list, mid, end, depth + 1);
+}
+
+// Returns the geometry of the closest hit, whose signed distance is left in ray.tMax
+Geometry *GeometrySet::intersectNodes(Ray &ray)
+{
+    // Ordered traversal, the boxes of both children are tested and the nearer one is visited
+    // first. The boxes beyond the nearest intersection found so far (ray.tMax) are skipped.
+    // Only the signed distances of the hits are computed during the traversal.
+    float invDir[3] =
+    {
+        1.0f / ray.direction.x,
+        1.0f / ray.direction.y,
+        1.0f / ray.direction.z
+    };
+
+    Geometry *closest = NULL;
+    float entry;
+    if (!intersectBox(nodes[0].min, nodes[0].max, ray, invDir, ray.tMax, entry))
+        return closest;
+
+    // Stack of the far children to be visited, one for each level at most
+    const BvhNode *stackNodes[MAX_DEPTH];
+    float stackEntries[MAX_DEPTH];
+    int stackSize = 0;
+
+    const BvhNode *base = &nodes[0];
+    const BvhNode *currNode = base;
+
+    while (true)
+    {
+        if (currNode->count == 0)
+        {
+            const BvhNode *left = currNode + 1;
+            const BvhNode *right = base + currNode->offset;
+            float leftEntry;
+            float rightEntry;
+            bool leftHit = intersectBox(left->min, left->max, ray, invDir, ray.tMax, leftEntry);
+            bool rightHit = intersectBox(right->min, right->max, ray, invDir, ray.tMax, rightEntry);
+
+            if (leftHit && rightHit)
+            {
+                // Visit the near child first
+                if (rightEntry < leftEntry)
+                {
+                    std::swap(left, right);
+                    std::swap(leftEntry, rightEntry);
+                }
+                stackNodes[stackSize] = right;
+                stackEntries[stackSize] = rightEntry;
+                stackSize += 1;
+                currNode = left;
+                continue;
+            }
+            else if (leftHit)
+            {
+                currNode = left;
+                continue;
+            }
+            else if (rightHit)
+            {
+                currNode = right;
+                continue;
+            }
+        }
+        else
+        {
+            // Current node is a leaf
+            for (int i = 0; i < currNode->count; i++)
+            {
+                float distance;
+                if (bounded[currNode->offset + i]->intersectDistance(ray, distance))
+                {
+                    ray.tMax = distance;
+                    closest = bounded[currNode->offset + i];
+                }
+            }
+        }
+
+        // Pop from stack, skip the nodes entered beyond the nearest intersection
+        do
+        {
+            if (stackSize == 0)
+                return closest;
+            stackSize -= 1;
+        } while (stackEntries[stackSize] > ray.tMax);
+        currNode = stackNodes[stackSize];
+    }
+}
+
+void GeometrySet::buildIfChanged()
+{
+    // Build the BVH on the first intersection, by only one of the rendering threads
+    if (!built.load(std::memory_order_acquire))
+    {
+        #pragma omp critical (GeometrySetBuild)
+        {
+            if (!built.load(std::memory_order_relaxed))
+            {
+                build();
+                built.store(true, std::memory_order_release);
+            }
+        }
+    }
 }
 
 IntersectResult GeometrySet::intersect(Ray &ray)
 {
-    float minDistance = FLT_MAX;
+    buildIfChanged();
+
     IntersectResult minResult(false);
 
-    for (unsigned int i = 0; i < geometries.size(); i++)
+    // A geometry only reports a hit within [ray.tMin, ray.tMax], which is always the closest
+    // so far. The cheap bounded geometries are tested first, so that a close hit shrinks
+    // ray.tMax and terminates the walk through the unbounded ones (e.g., a tunnel) early.
+    if (!nodes.empty())
+    {
+        Geometry *closest = intersectNodes(ray);
+        if (closest != NULL)
+            minResult = closest->getHitResult(ray, ray.tMax);
+    }
+
+    for (unsigned int i = 0; i < unbounded.size(); i++)
     {
-        IntersectResult result = geometries[i]->intersect(ray);
-        if (result.hit && (result.distance < minDistance)) 
+        IntersectResult result = unbounded[i]->intersect(ray);
+        if (result.hit) 
         {
-            minDistance = result.distance;
+            ray.tMax = result.distance;
             minResult = result;
         }
     }
     return minResult;
 }
+
+// The same order as intersect(), the bounded geometries are tested ray by ray, 
+// and the packet is passed to each of the unbounded geometries
+void GeometrySet::intersectPacket(RayPacket &packet, IntersectResult results[])
+{
+    buildIfChanged();
+
+    for (int i = 0; i < RayPacket::SIZE; i++)
+    {
+        results[i] = IntersectResult(false);
+        if (!nodes.empty())
+        {
+            Ray &ray = *packet.rays[i];
+            Geometry *closest = intersectNodes(ray);
+            if (closest != NULL)
+                results[i] = closest->getHitResult(ray, ray.tMax);
+        }
+    }
+
+    for (unsigned int i = 0; i < unbounded.size(); i++)
+    {
+        IntersectResult packetResults[RayPacket::SIZE];
+        unbounded[i]->intersectPacket(packet, packetResults);
+
+        for (int j = 0; j < RayPacket::SIZE; j++)
+        {
+            if (packetResults[j].hit)
+            {
+                packet.rays[j]->tMax = packetResults[j].distance;
+                results[j] = packetResults[j];
+            }
+        }
+    }
+}
@@ -2,7 +2,9 @@
 #define GEOMETRY_SET_H
 
 #include <vector>
+#include <atomic>
 #include "Geometry.h"
+#include "Material.h"
 #include "Matrix.h"
 
 class GeometrySet : public Geometry
@@ -10,14 +12,58 @@ class GeometrySet : public Geometry
 private:
     std::vector<Geometry *> geometries;
 
+    // The materials used by the geometries, which only store the indices.
+    // Materials are shared by many geometries (e.g., all the triangles of the tunnel wall).
+    std::vector<Material *> materials;
+
+    // Top-level acceleration
+    // A BVH over the geometries with a bounding box (e.g., the triangles of an STL mesh),
+    // which is built on the first intersection after the scene is changed. The unbounded
+    // geometries (e.g., planes and tunnels) are kept in a separate list and tested after it.
+    enum { NUM_BINS = 16, MAX_LEAF_SIZE = 4, MAX_DEPTH = 64 };
+
+    // The hierarchy is flattened into an array in depth-first order,
+    // so the first child of an interior node is the node right after it
+    struct BvhNode
+    {
+        Point min;  // the bounding box of the node
+        Point max;
+        int offset; // index of the second child (interior node),
+                    // or offset of the enclosed geometries in bounded (leaf)
+        int count;  // the number of enclosed geometries (leaf), 0 for an interior node
+    };
+    struct BvhEntry
+    {
+        Point min;    // the bounding box
+        Point max;
+        Point center; // the centroid of the bounding box
+        Geometry *geometry;
+    };
+    std::vector<BvhNode> nodes;        // nodes[0] is the root
+    std::vector<Geometry *> bounded;   // the geometries of a leaf are adjacent
+    std::vector<Geometry *> unbounded;
+    std::atomic<bool> built;           // whether the BVH is up to date
+
+    void build();
+    void buildIfChanged();
+    void buildNode(std::vector<BvhEntry> &list, int begin, int end, int depth);
+    Geometry *intersectNodes(Ray &ray);
+
 public:
+    GeometrySet() : built(false) {}
     void add(Geometry* geometry);
     Geometry *last();
-    bool addStlFile(const char *filename, Ptr<Material> material);
-    bool addStlFile(const char *filename, Ptr<Material> material, const Matrix &matrix, const Vector &offset);
+    // The material is deleted with the scene. A scene holds at most 65536 materials, as the
+    // geometries store a 16-bit index, and adding one more is a fatal error.
+    unsigned short addMaterial(Material *material);
+    Material *getMaterial(unsigned short index) { return materials[index]; }
+    int getNumMaterials() const { return (int)materials.size(); }
+    bool addStlFile(const char *filename, unsigned short material);
+    bool addStlFile(const char *filename, unsigned short material, const Matrix &matrix, const Vector &offset);
     void clear();
 
     virtual IntersectResult intersect(Ray &ray);
+    virtual void intersectPacket(RayPacket &packet, IntersectResult results[]);
     virtual ~GeometrySet();
 };
 
@@ -0,0 +1,191 @@
+#ifndef GRID_CELLS_H
+#define GRID_CELLS_H
+
+#include <vector>
+#include "Ray.h"
+
+// The range of cells overlapped by the bounding box of a triangle, both ends included
+struct CellBox
+{
+    int id; // the triangle id
+    int xBegin, yBegin, zBegin;
+    int xEnd, yEnd, zEnd;
+    int firstFlag; // the first of the flags that tell which cells of the range the triangle
+                   // overlaps, or -1 if it is added to all of them
+
+    int getCellCount() const
+    {
+        return (xEnd - xBegin + 1) * (yEnd - yBegin + 1) * (zEnd - zBegin + 1);
+    }
+
+    // Whether the triangle is added to cell (x, y, z) of the range
+    bool contains(int x, int y, int z, const std::vector<char> &flags) const
+    {
+        if (firstFlag < 0)
+            return true;
+
+        int cell = ((x - xBegin) * (yEnd - yBegin + 1) + (y - yBegin)) * (zEnd - zBegin + 1) + (z - zBegin);
+        return flags[firstFlag + cell] != 0;
+    }
+};
+
+// The triangle lists of the cells of a grid in the compressed sparse row (CSR) layout
+// ------------------------------------------------------------------------------------------
+// Instead of one std::vector for each cell, the triangle ids of all the cells are stored in
+// a single array, and the list of a cell is a range of it. Only the non-empty cells have
+// an offset, which is found by the rank of the cell in a bitmap of the non-empty cells:
+//     rank = ranks[cell / 32] + (the number of set bits below the cell in its word)
+// So an empty cell costs one bit plus 1/32 of the rank table, which makes the flat grids of
+// 600 x 600 x 600 and 800 x 800 x 800 cells fit in the memory of a 32-bit process.
+class GridCells
+{
+private:
+    int xLength;
+    int yLength;
+    int zLength;
+    std::vector<unsigned int> occupied; // one bit for each cell, set if the cell is not empty
+    std::vector<int> ranks;             // the number of non-empty cells before each word
+    std::vector<int> offsets;           // the first id of each non-empty cell, and the end
+    std::vector<int> ids;               // the triangle ids
+
+public:
+    static int BitCount(unsigned int v)
+    {
+        v = v - ((v >> 1) & 0x55555555);
+        v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+        return (((v + (v >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+    }
+
+    // Builds the lists in parallel with two passes over the boxes, which count the triangles
+    // of each cell and then scatter their ids. The ids of a cell keep the order of the boxes.
+    // The cells of a box are skipped if their flags are zero (see CellBox::firstFlag).
+    void build(int xLength, int yLength, int zLength, const std::vector<CellBox> &boxes, 
+        const std::vector<char> &flags);
+
+    // Returns the index of cell (x, y, z) among the non-empty cells, or -1 if it is empty
+    int getIndex(int x, int y, int z) const
+    {
+        int cell = (x * yLength + y) * zLength + z;
+        unsigned int word = occupied[cell >> 5];
+        unsigned int bit = 1u << (cell & 31);
+        if ((word & bit) == 0)
+            return -1;
+
+        return ranks[cell >> 5] + BitCount(word & (bit - 1));
+    }
+
+    // Returns the number of triangles in the non-empty cell #index, and points list to their ids
+    int getList(int index, const int *&list) const
+    {
+        list = &ids[offsets[index]];
+        return offsets[index + 1] - offsets[index];
+    }
+
+    // Returns the number of triangles in cell (x, y, z), and points list to their ids
+    int get(int x, int y, int z, const int *&list) const
+    {
+        int index = getIndex(x, y, z);
+        return (index >= 0) ? getList(index, list) : 0;
+    }
+
+    int getNonEmptyCount() const { return ranks.empty() ? 0 : ranks.back(); }
+    double getMemorySize() const; // in bytes
+};
+
+// The incremental 3D-DDA of "A Fast Voxel Traversal Algorithm for Ray Tracing" by John
+// Amanatides and Andrew Woo
+// The step of each axis, the distance between two planes of the axis along the ray (tDelta)
+// and the distance to the next plane (tNext) are computed once for each ray. Then a step
+// takes the smallest tNext, moves to the neighbor cell along its axis and adds one tDelta,
+// without divisions.
+struct GridWalk
+{
+    int cell[3];     // the current cell
+    int step[3];     // 1, -1 or 0
+    int end[3];      // the index beyond the grid
+    float tNext[3];  // the distance to the next plane of each axis, which is where the ray
+                     // leaves the current cell along the axis
+    float tDelta[3]; // the distance between two planes of each axis
+
+    // Starts in cell (i, j, k) of the grid, where invDir is the inverse of the ray direction
+    GridWalk(const Ray &ray, const float invDir[3], const Point &origin, const float cellSize[3], 
+        const int length[3], int i, int j, int k)
+    {
+        cell[0] = i;
+        cell[1] = j;
+        cell[2] = k;
+
+        for (int a = 0; a < 3; a++)
+        {
+            if (ray.direction[a] > 0)
+            {
+                step[a] = 1;
+                end[a] = length[a];
+                tNext[a] = (origin[a] + (cell[a] + 1) * cellSize[a] - ray.origin[a]) * invDir[a];
+                tDelta[a] = cellSize[a] * invDir[a];
+            }
+            else if (ray.direction[a] < 0)
+            {
+                step[a] = -1;
+                end[a] = -1;
+                tNext[a] = (origin[a] + cell[a] * cellSize[a] - ray.origin[a]) * invDir[a];
+                tDelta[a] = -cellSize[a] * invDir[a];
+            }
+            else // the ray never leaves the cell along this axis
+            {
+                step[a] = 0;
+                end[a] = -1;
+                tNext[a] = FLT_MAX;
+                tDelta[a] = 0;
+            }
+        }
+    }
+
+    // Moves to the next cell and sets t to the distance where the ray enters it, or returns
+    // false if the ray leaves the grid
+    bool next(float &t)
+    {
+        int a = (tNext[0] < tNext[1]) ? ((tNext[0] < tNext[2]) ? 0 : 2) : ((tNext[1] < tNext[2]) ? 1 : 2);
+        t = tNext[a];
+        cell[a] += step[a];
+        tNext[a] += tDelta[a];
+        return cell[a] != end[a];
+    }
+};
+
+// Mailboxing for the grid traversal
+// A triangle overlapping several cells would be tested in each of them. The ids tested for
+// a ray are kept in a small direct-mapped table, which catches most of the repeated tests
+// as the cells sharing a triangle are visited one after another. A collision only costs
+// a test, so the table needs no per-thread state and lives on the stack of the traversal.
+struct Mailbox
+{
+    enum { SIZE = 64 };
+    int ids[SIZE];
+    int numTests;   // the triangles tested
+    int numSkipped; // the tests skipped as the triangles were already tested
+
+    Mailbox() : numTests(0), numSkipped(0)
+    {
+        for (int i = 0; i < SIZE; i++)
+        {
+            ids[i] = -1;
+        }
+    }
+
+    // Returns false if triangle #id has been tested for the ray, and records it otherwise
+    bool check(int id)
+    {
+        int &slot = ids[id & (SIZE - 1)];
+        if (slot == id)
+        {
+            numSkipped++;
+            return false;
+        }
+        slot = id;
+        numTests++;
+        return true;
+    }
+};
+
+#endif
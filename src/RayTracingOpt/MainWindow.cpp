@@ -7,12 +7,15 @@
 #include <stdio.h>
 #include <tchar.h>
 #include <math.h>
+#include <vector>
 #include <omp.h> // OpenMP
 
 #include "GeometrySet.h"
+#include "RayPacket.h"
 #include "RenderSetting.h"
 #include "Scripts.h"
 #include "Utils.h"
+#include "WavefrontRenderer.h"
 #include "erand48.h"
 #include "resource.h"
 
@@ -36,6 +39,8 @@ static int segments;
 static int samples;
 static int repeat;
 static int algorithm;
+static int renderMode;
+static int preset;
 
 // GDI objects
 static HDC hdcBuffer = 0;
@@ -60,210 +65,347 @@ const char *algorithms[] =
     "k-d Tree",
     "k-d Tree (SAH)",
     "Convex",
-    "Convex Simple"
+    "Convex Simple",
+    "BVH",
+    "Hierarchical Grid"
+};
+
+// The render mode list
+// The wavefront modes are used by the Monte Carlo scripts, and the row loops are
+// specialized for the presets of RenderSetting unless the generic one is selected.
+const char *renderModes[] = 
+{
+    "Row Loop",
+    "Wavefront",
+    "Wavefront (Sorted)",
+    "Row Loop (Generic)"
+};
+
+// The preset list, which replaces the render setting of the script
+const char *presets[] = 
+{
+    "Script Default",
+    "High Speed",
+    "High Quality",
+    "Default",
+    "Simple"
 };
 
 // user defined messages
 #define WM_RENDER_FINISH    (WM_USER + 1)
 
-Color trace(GeometrySet &scene, Ray &r, int depth, unsigned short *Xi, RenderSetting &setting)
+// A ray left to be traced by the iterative integrators below, with the weight of its
+// radiance in the pixel and the depth of its origin
+struct PendingRay
 {
-    IntersectResult result = scene.intersect(r);
-    if (!result.hit)
-    {
-        return Color::Black();
-    }
+    Ray ray;
+    Color weight;
+    int depth;
 
-    Geometry *obj = result.geometry;
-    Point &p = result.position;
-    Vector &n = result.normal; // points to the outside
-    Vector nl = (n.dot(r.direction) < 0) ? n : n * -1; // points to the ray
-    Color local = obj->material->local(r, p, result.normal);
+    PendingRay(const Ray &ray, const Color &weight, int depth) 
+        : ray(ray), weight(weight), depth(depth) {}
+};
 
-    if (++depth > setting.maxDepth)
-        return Color::Black();
+// The integrators follow one path at a time. Where a path splits (e.g., the reflected and
+// refracted rays of a refractive material), one of the rays is followed at once and the
+// other ones are pushed to a small work stack, which holds at most two rays per depth.
+// Popping the stack visits the rays in the same order as a recursive implementation.
+// The stack is empty between two calls, and is kept by the caller to reuse its memory.
+static const int MAX_DEPTH = 100; // a hard limit of depth
+
+// The integrators and the render loops below are templates on a policy (see RenderSetting.h),
+// which is chosen once for each render by Render().
+
+// Ray tracing without Monte Carlo, result is the intersection of the primary ray r,
+// which is traced alone (the overload below) or in a packet (RenderPackets)
+template <class Policy>
+Color trace(GeometrySet &scene, Ray &r, IntersectResult &result, RenderSetting &setting, 
+            std::vector<PendingRay> &stack)
+{
+    Color color = Color::Black();
+    Ray ray = r;
+    Color weight = Color::White();
+    int depth = 0;
 
-    if (depth > 100) // add a hard limit and avoid stack overflow
-        return Color::Black();
+    while (true)
+    {
+        if (result.hit && ++depth <= Policy::maxDepth(setting) && depth <= MAX_DEPTH)
+        {
+            Geometry *obj = result.geometry;
+            Material *material = scene.getMaterial(obj->material);
+            Point &p = result.position;
+            Vector &n = result.normal; // points to the outside
+            Vector nl = (n.dot(ray.direction) < 0) ? n : n * -1; // points to the ray
 
-    float diffusiveness = obj->material->diffusiveness;
-    float reflectiveness = obj->material->reflectiveness;
-    float refractiveness = obj->material->refractiveness;
-    Color diffusive;
-    Color reflective;
-    Color refractive;
+            float diffusiveness = material->diffusiveness;
+            float reflectiveness = material->reflectiveness;
+            float refractiveness = material->refractiveness;
 
-    if (diffusiveness > 0)
-    {
-        diffusive = local;
-    }
-    
-    if (reflectiveness > 0)
-    {
-        Vector v = r.direction - nl * 2 * nl.dot(r.direction);
-        Ray newRay(p, v);
-        newRay.context = r.context;
-        reflective = trace(scene, newRay, depth, Xi, setting);
-    }
+            if (diffusiveness > 0)
+            {
+                Color local = material->local(ray, p, result.normal);
+                color = color + local.mult(weight * diffusiveness);
+            }
 
-    if (refractiveness > 0)
-    {
-        Ray reflRay(p, r.direction - n * 2 * n.dot(r.direction));
-        bool into = n.dot(nl) > 0;
-        float nc = 1;
-        float nt = obj->material->refractive_index;
-        float nnt = into ? nc / nt : nt / nc;
-        float ddn = r.direction.dot(nl);
-        float cos2t = 1 - nnt * nnt * (1 - ddn * ddn);
-        if (cos2t < 0) // total internal reflection
-        {
-            refractive = trace(scene, reflRay, depth, Xi, setting);
-        }
-        else
-        {
-            Vector tdir = (r.direction * nnt - n * ((into ? 1 : -1) * (ddn * nnt + sqrt(cos2t)))).norm();
-            float a = nt - nc;
-            float b = nt + nc;
-            float R0 = a * a / (b * b);
-            float c = 1 - (into ? -ddn : tdir.dot(n));
-            float Re = R0 + (1 - R0) * c * c * c * c * c;
-            float Tr = 1 - Re;
-            float P = 0.25f + 0.5f * Re;
-            float RP = Re / P;
-            float TP = Tr / (1 - P);
-
-            refractive = trace(scene, reflRay, depth, Xi, setting) * Re + 
-                trace(scene, Ray(p, tdir), depth, Xi, setting)*Tr;
+            if (reflectiveness > 0)
+            {
+                Ray newRay(p, ray.direction - nl * 2 * nl.dot(ray.direction));
+                newRay.context = ray.context;
+                stack.push_back(PendingRay(newRay, weight * reflectiveness, depth));
+            }
+
+            if (refractiveness > 0)
+            {
+                Ray reflRay(p, ray.direction - n * 2 * n.dot(ray.direction));
+                bool into = n.dot(nl) > 0;
+                float nc = 1;
+                float nt = material->refractive_index;
+                float nnt = into ? nc / nt : nt / nc;
+                float ddn = ray.direction.dot(nl);
+                float cos2t = 1 - nnt * nnt * (1 - ddn * ddn);
+                if (cos2t < 0) // total internal reflection
+                {
+                    stack.push_back(PendingRay(reflRay, weight * refractiveness, depth));
+                }
+                else
+                {
+                    Vector tdir = (ray.direction * nnt - n * ((into ? 1 : -1) * (ddn * nnt + sqrt(cos2t)))).norm();
+                    float a = nt - nc;
+                    float b = nt + nc;
+                    float R0 = a * a / (b * b);
+                    float c = 1 - (into ? -ddn : tdir.dot(n));
+                    float Re = R0 + (1 - R0) * c * c * c * c * c;
+                    float Tr = 1 - Re;
+
+                    stack.push_back(PendingRay(Ray(p, tdir), weight * (refractiveness * Tr), depth));
+                    stack.push_back(PendingRay(reflRay, weight * (refractiveness * Re), depth));
+                }
+            }
         }
-    }
 
-    return diffusive * diffusiveness + 
-        reflective * reflectiveness +
-        refractive * refractiveness;
+        if (stack.empty())
+            break;
+
+        ray = stack.back().ray;
+        weight = stack.back().weight;
+        depth = stack.back().depth;
+        stack.pop_back();
+        result = scene.intersect(ray);
+    }
+    return color;
 }
 
-Color radiance(GeometrySet &scene, Ray &r, int depth, unsigned short *Xi, RenderSetting &setting)
+template <class Policy>
+Color trace(GeometrySet &scene, Ray &r, RenderSetting &setting, std::vector<PendingRay> &stack)
 {
     IntersectResult result = scene.intersect(r);
-    if (!result.hit)
+    return trace<Policy>(scene, r, result, setting, stack);
+}
+
+// Monte Carlo path tracing
+// The radiance of a path is the sum of the emissions along it, each weighted by the product
+// of the local colors before it (the throughput).
+template <class Policy>
+Color radiance(GeometrySet &scene, Ray &r, unsigned short *Xi, RenderSetting &setting, 
+               std::vector<PendingRay> &stack)
+{
+    Color color = Color::Black();
+    Ray ray = r;
+    Color weight = Color::White();
+    int depth = 0;
+
+    while (true)
     {
-        return Color(0, 0, 0);
-    }
+        IntersectResult result = scene.intersect(ray);
+        bool terminated = !result.hit;
 
-    Geometry *obj = result.geometry;
-    Point &p = result.position;
-    Vector &n = result.normal; // points to the outside
-    Vector nl = (n.dot(r.direction) < 0) ? n : n * -1; // points to the ray
-    Color local = obj->material->local(r, p, result.normal);
-    Color emission = obj->material->emission(p);
+        if (result.hit)
+        {
+            Geometry *obj = result.geometry;
+            Material *material = scene.getMaterial(obj->material);
+            Point &p = result.position;
+            Vector &n = result.normal; // points to the outside
+            Vector nl = (n.dot(ray.direction) < 0) ? n : n * -1; // points to the ray
+            Color local = material->local(ray, p, result.normal);
+            Color emission = material->emission(p);
+
+            float maxColor = (local.r + local.g + local.b) * 0.333333f;
+
+            if (++depth > Policy::maxDepth(setting))
+                terminated = true;
+            else if (depth > Policy::terminationDepth(setting) && !(erand48(Xi) < maxColor))
+                terminated = true;
+            else if (depth > MAX_DEPTH)
+                terminated = true;
+            else if (depth > Policy::terminationDepth(setting))
+                local = local * (1 / maxColor);
+
+            float diffusiveness = material->diffusiveness;
+            float reflectiveness = material->reflectiveness;
+            float refractiveness = material->refractiveness;
+
+            // A material may have multiple reflection types, 
+            // e.g., 10% diffuse, 5% specular and 85% refractive.
+            // Only one type is used for each sample.
+            float p_type = terminated ? 0 : (float)erand48(Xi);
+
+            if (terminated)
+            {
+                color = color + weight.mult(emission);
+            }
+            else if (diffusiveness > 0 && p_type < diffusiveness)
+            {
+                // Pick a random point on the surface of a unit sphere
+                // http://mathworld.wolfram.com/SpherePointPicking.html
+                float r1 = (float)erand48(Xi);
+                float r2 = (float)erand48(Xi);
+                float theta = 2 * PI * r1;
+                float phi = acos(r2);
+
+                Vector w = nl;
+                Vector u = (fabs(w.x) > 0.1) ? 
+                    Vector(0, 1, 0).cross(w).norm() : Vector(1, 0, 0).cross(w).norm();
+                Vector v = w.cross(u);
+                Vector dir = u * (cos(theta) * sin(phi)) + v * (sin(theta) * sin(phi)) + w * cos(phi);
+
+                color = color + weight.mult(emission);
+                weight = weight.mult(local);
+                ray = Ray(p, dir);
+            }
+            else if (reflectiveness > 0 && 
+                p_type >= diffusiveness && 
+                p_type <= diffusiveness + reflectiveness)
+            {
+                Vector v = ray.direction - nl * 2 * nl.dot(ray.direction);
 
-    float maxColor = (local.r + local.g + local.b) * 0.333333f;
+                color = color + weight.mult(emission);
+                weight = weight.mult(local);
+                ray = Ray(p, v);
+            }
+            else if (refractiveness > 0 && p_type > diffusiveness + reflectiveness)
+            {
+                Ray reflRay(p, ray.direction - n * 2 * n.dot(ray.direction));
+                bool into = n.dot(nl) > 0;
+                float nc = 1;
+                float nt = material->refractive_index;
+                float nnt = into ? nc / nt : nt / nc;
+                float ddn = ray.direction.dot(nl);
+                float cos2t = 1 - nnt * nnt * (1 - ddn * ddn);
+                if (cos2t < 0) // total internal reflection
+                {
+                    color = color + weight.mult(emission);
+                    weight = weight.mult(local);
+                    ray = reflRay;
+                }
+                else
+                {
+                    Vector tdir = (ray.direction * nnt - n * ((into ? 1 : -1) * (ddn * nnt + sqrt(cos2t)))).norm();
+                    float a = nt - nc;
+                    float b = nt + nc;
+                    float R0 = a * a / (b * b);
+                    float c = 1 - (into ? -ddn : tdir.dot(n));
+                    float Re = R0 + (1 - R0) * c * c * c * c * c;
+                    float Tr = 1 - Re;
+                    float P = 0.25f + 0.5f * Re;
+                    float RP = Re / P;
+                    float TP = Tr / (1 - P);
+
+                    // Neither the emission nor the local color is taken at a refraction
+                    if (depth > Policy::singleTracingDepth(setting))
+                    {
+                        if ((float)erand48(Xi) < P)
+                        {
+                            weight = weight * RP;
+                            ray = reflRay;
+                        }
+                        else
+                        {
+                            weight = weight * TP;
+                            ray = Ray(p, tdir);
+                        }
+                    }
+                    else
+                    {
+                        // Follow the reflected ray first, and the refracted one later
+                        stack.push_back(PendingRay(Ray(p, tdir), weight * Tr, depth));
+
+                        weight = weight * Re;
+                        ray = reflRay;
+                    }
+                }
+            }
+            else
+            {
+                // Impossible to reach here
+                color = color + weight.mult(emission);
+                terminated = true;
+            }
+        }
 
-    if (++depth > setting.maxDepth)
-        return emission;
+        if (!terminated)
+            continue;
 
-    if (depth > setting.terminationDepth)
-    { 
-        if (erand48(Xi) < maxColor) 
-            local = local * (1 / maxColor); 
-        else
-            return emission;
-    }
+        if (stack.empty())
+            break;
 
-    if (depth > 100) // avoid stack overflow
-        return emission;
+        ray = stack.back().ray;
+        weight = stack.back().weight;
+        depth = stack.back().depth;
+        stack.pop_back();
+    }
+    return color;
+}
 
-    float diffusiveness = obj->material->diffusiveness;
-    float reflectiveness = obj->material->reflectiveness;
-    float refractiveness = obj->material->refractiveness;
+// Traces the primary rays in packets of 2 x 2 pixels, two rows at a time
+template <class Policy>
+void RenderPackets(GeometrySet &scene, PerspectiveCamera &camera, RenderSetting &setting,
+                   ProgressCallback progress, Color *colors)
+{
+    const float dx = 1.0f / height;
+    const float dy = 1.0f / height;
 
-    // A material may have multiple reflection types, 
-    // e.g., 10% diffuse, 5% specular and 85% refractive.
-    // Only one type is used for each sample.
-    float p_type = (float)erand48(Xi);
+    #pragma omp parallel for schedule(dynamic, 1) // OpenMP
 
-    if (diffusiveness > 0 && p_type < diffusiveness)
-    {
-        // Pick a random point on the surface of a unit sphere
-        // http://mathworld.wolfram.com/SpherePointPicking.html
-        float r1 = (float)erand48(Xi);
-        float r2 = (float)erand48(Xi);
-        float theta = 2 * PI * r1;
-        float phi = acos(r2);
-
-        Vector w = nl;
-        Vector u = (fabs(w.x) > 0.1) ? 
-            Vector(0, 1, 0).cross(w).norm() : Vector(1, 0, 0).cross(w).norm();
-        Vector v = w.cross(u);
-        Vector dir = u * (cos(theta) * sin(phi)) + v * (sin(theta) * sin(phi)) + w * cos(phi);
-        return emission + local.mult(radiance(scene, Ray(p, dir), depth, Xi, setting));
-    }
-    
-    if (reflectiveness > 0 && 
-        p_type >= diffusiveness && 
-        p_type <= diffusiveness + reflectiveness)
+    for (int y = 0; y < height; y += 2)
     {
-        Vector v = r.direction - nl * 2 * nl.dot(r.direction);
-        return emission + local.mult(radiance(scene, Ray(p, v), depth, Xi, setting));
-    }
+        progress((y + 2 < height) ? y + 2 : height, height);
 
-    if (refractiveness > 0 && p_type > diffusiveness + reflectiveness)
-    {
-        Ray reflRay(p, r.direction - n * 2 * n.dot(r.direction));
-        bool into = n.dot(nl) > 0;
-        float nc = 1;
-        float nt = obj->material->refractive_index;
-        float nnt = into ? nc / nt : nt / nc;
-        float ddn = r.direction.dot(nl);
-        float cos2t = 1 - nnt * nnt * (1 - ddn * ddn);
-        if (cos2t < 0) // total internal reflection
-            return emission + local.mult(radiance(scene, reflRay, depth, Xi, setting));
-
-        Vector tdir = (r.direction * nnt - n * ((into ? 1 : -1) * (ddn * nnt + sqrt(cos2t)))).norm();
-        float a = nt - nc;
-        float b = nt + nc;
-        float R0 = a * a / (b * b);
-        float c = 1 - (into ? -ddn : tdir.dot(n));
-        float Re = R0 + (1 - R0) * c * c * c * c * c;
-        float Tr = 1 - Re;
-        float P = 0.25f + 0.5f * Re;
-        float RP = Re / P;
-        float TP = Tr / (1 - P);
-
-        if (depth > setting.singleTracingDepth)
+        std::vector<PendingRay> stack;
+        for (int x = 0; x < width; x += 2)
         {
-            if ((float)erand48(Xi) < P)
-                return radiance(scene, reflRay, depth, Xi, setting) * RP;
-            else
-                return radiance(scene, Ray(p,tdir), depth, Xi, setting) * TP;
-        }
-        else
-        {
-            return radiance(scene, reflRay, depth, Xi, setting) * Re + 
-                radiance(scene, Ray(p, tdir), depth, Xi, setting)*Tr;
+            // The pixels out of the image (with an odd width or height) are traced but discarded
+            int px[RayPacket::SIZE] = { x, x + 1, x, x + 1 };
+            int py[RayPacket::SIZE] = { y, y, y + 1, y + 1 };
+
+            Ray r0(camera.generateRay((px[0] + 0.5f) * dx, 1 - (py[0] + 0.5f) * dy));
+            Ray r1(camera.generateRay((px[1] + 0.5f) * dx, 1 - (py[1] + 0.5f) * dy));
+            Ray r2(camera.generateRay((px[2] + 0.5f) * dx, 1 - (py[2] + 0.5f) * dy));
+            Ray r3(camera.generateRay((px[3] + 0.5f) * dx, 1 - (py[3] + 0.5f) * dy));
+            RayPacket packet(&r0, &r1, &r2, &r3);
+
+            IntersectResult results[RayPacket::SIZE];
+            scene.intersectPacket(packet, results);
+
+            for (int i = 0; i < RayPacket::SIZE; i++)
+            {
+                if (px[i] < width && py[i] < height)
+                {
+                    colors[px[i] * height + py[i]] = 
+                        trace<Policy>(scene, *packet.rays[i], results[i], setting, stack);
+                }
+            }
         }
     }
-
-    // Impossible to reach here
-    return emission; // simply to avoid compiling warnings
 }
 
-int Render(GeometrySet &scene, PerspectiveCamera &camera, RenderSetting &setting,
-           ProgressCallback progress)
+// Traces the pixels one by one, a row at a time
+template <class Policy>
+void RenderRows(GeometrySet &scene, PerspectiveCamera &camera, RenderSetting &setting,
+                ProgressCallback progress, Color *colors)
 {
     const float dx = 1.0f / height;
     const float dy = 1.0f / height;
 
-    Color *colors = new Color[width * height];
-    for (int i = 0; i < width * height; i++)
-    {
-        colors[i].r = 0;
-        colors[i].g = 0;
-        colors[i].b = 0;
-    }
-
-    int t1 = Utils::GetTickCount();
-
     #pragma omp parallel for schedule(dynamic, 1) // OpenMP
 
     for (int y = 0; y < height; y++)
@@ -271,10 +413,11 @@ int Render(GeometrySet &scene, PerspectiveCamera &camera, RenderSetting &setting
         progress(y + 1, height);
 
         unsigned short Xi[3] = { 0, 0, y * y * y };
+        std::vector<PendingRay> stack;
         for (int x = 0; x < width; x++)
         {
             int index = x * height + y;
-            if (setting.enableMonteCarlo)
+            if (Policy::enableMonteCarlo(setting))
             {
                 Color r = Color::Black();
                 for (int i = 0; i < samples; i++)
@@ -285,7 +428,7 @@ int Render(GeometrySet &scene, PerspectiveCamera &camera, RenderSetting &setting
                     float sy = 1 - (y + r2) * dy;
 
                     Ray ray(camera.generateRay(sx, sy));
-                    r = r + radiance(scene, ray, 0, Xi, setting) * (1.0f / samples);
+                    r = r + radiance<Policy>(scene, ray, Xi, setting, stack) * (1.0f / samples);
                 }
                 colors[index] = r;
             }
@@ -295,13 +438,93 @@ int Render(GeometrySet &scene, PerspectiveCamera &camera, RenderSetting &setting
                 float sy = 1 - (y + 0.5f) * dy;
 
                 Ray ray(camera.generateRay(sx, sy));
-                colors[index] = trace(scene, ray, 0, Xi, setting);
+                colors[index] = trace<Policy>(scene, ray, setting, stack);
             }
         }
     }
+}
+
+template <class Policy>
+const char *RenderWithPolicy(GeometrySet &scene, PerspectiveCamera &camera, RenderSetting &setting,
+                             ProgressCallback progress, Color *colors)
+{
+    if (!Policy::enableMonteCarlo(setting) && Policy::enableRayPackets(setting))
+        RenderPackets<Policy>(scene, camera, setting, progress, colors);
+    else
+        RenderRows<Policy>(scene, camera, setting, progress, colors);
+    return Policy::Name();
+}
+
+int Render(GeometrySet &scene, PerspectiveCamera &camera, RenderSetting &setting,
+           ProgressCallback progress)
+{
+    // Replace the setting of the script with the selected preset
+    if (preset == 1)
+        setting = RenderSetting::HighSpeed();
+    else if (preset == 2)
+        setting = RenderSetting::HighQuality();
+    else if (preset == 3)
+        setting = RenderSetting::Default();
+    else if (preset == 4)
+        setting = RenderSetting::Simple();
+
+    Color *colors = new Color[width * height];
+    for (int i = 0; i < width * height; i++)
+    {
+        colors[i].r = 0;
+        colors[i].g = 0;
+        colors[i].b = 0;
+    }
+
+    long long numRays = 0;   // only counted by the wavefront renderer
+    const char *policy = ""; // the policy of the row loop
+    int t1 = Utils::GetTickCount();
+
+    if (setting.enableMonteCarlo && (renderMode == 1 || renderMode == 2))
+    {
+        WavefrontRenderer renderer(scene, camera, setting, width, height, samples, renderMode == 2);
+        renderer.render(colors, progress);
+        numRays = renderer.getNumRays();
+    }
+    else if (renderMode == 3)
+    {
+        policy = RenderWithPolicy<DynamicPolicy>(scene, camera, setting, progress, colors);
+    }
+    else if (setting.is<HighSpeedPreset>())
+    {
+        policy = RenderWithPolicy<PresetPolicy<HighSpeedPreset> >(scene, camera, setting, progress, colors);
+    }
+    else if (setting.is<HighQualityPreset>())
+    {
+        policy = RenderWithPolicy<PresetPolicy<HighQualityPreset> >(scene, camera, setting, progress, colors);
+    }
+    else if (setting.is<DefaultPreset>())
+    {
+        policy = RenderWithPolicy<PresetPolicy<DefaultPreset> >(scene, camera, setting, progress, colors);
+    }
+    else if (setting.is<SimplePreset>())
+    {
+        policy = RenderWithPolicy<PresetPolicy<SimplePreset> >(scene, camera, setting, progress, colors);
+    }
+    else
+    {
+        policy = RenderWithPolicy<DynamicPolicy>(scene, camera, setting, progress, colors);
+    }
 
     int t2 = Utils::GetTickCount();
 
+    if (t2 > t1)
+    {
+        double seconds = (t2 - t1) / 1000.0;
+        int pixelSamples = setting.enableMonteCarlo ? samples : 1;
+        Utils::DbgPrint("%s%s%s: %.0f samples/s\r\n", renderModes[renderMode], 
+            (policy[0] != 0) ? ", " : "", policy, (double)width * height * pixelSamples / seconds);
+        if (numRays > 0)
+        {
+            Utils::DbgPrint("%s: %.0f rays/s\r\n", renderModes[renderMode], numRays / seconds);
+        }
+    }
+
     for (int i = 0; i < width * height; i++)
     {
         colors[i].saturate();
@@ -319,6 +542,8 @@ void EnableControls(BOOL enable)
 {
     EnableWindow(GetDlgItem(hDialog, IDC_LIST), enable);
     EnableWindow(GetDlgItem(hDialog, IDC_TUNNEL_ALGORITHM), enable);
+    EnableWindow(GetDlgItem(hDialog, IDC_RENDER_MODE), enable);
+    EnableWindow(GetDlgItem(hDialog, IDC_PRESET), enable);
     EnableWindow(GetDlgItem(hDialog, IDC_TUNNEL_TESSELLATION), enable);
     EnableWindow(GetDlgItem(hDialog, IDC_IMAGE_WIDTH), enable);
     EnableWindow(GetDlgItem(hDialog, IDC_REPEAT), enable);
@@ -416,7 +641,7 @@ INT_PTR CALLBACK ProcDlgMain(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
     if (uMsg == WM_INITDIALOG)
     {
         // Initialize window size
-        MoveWindow(hWnd, 100, 100, 740, 400, FALSE);
+        MoveWindow(hWnd, 100, 100, 740, 440, FALSE);
 
         // Initialize the up-down controls
         SendMessage(GetDlgItem(hWnd, IDC_SPIN_TUNNEL_TESSELLATION), UDM_SETRANGE, 0, 
@@ -464,6 +689,20 @@ INT_PTR CALLBACK ProcDlgMain(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
         }
         ComboBox_SetCurSel(GetDlgItem(hWnd, IDC_TUNNEL_ALGORITHM), 0);
 
+        // Initialize the render mode list
+        for (int i = 0; i < _countof(renderModes); i++)
+        {
+            ComboBox_AddString(GetDlgItem(hWnd, IDC_RENDER_MODE), (LPARAM)renderModes[i]);
+        }
+        ComboBox_SetCurSel(GetDlgItem(hWnd, IDC_RENDER_MODE), 0);
+
+        // Initialize the preset list
+        for (int i = 0; i < _countof(presets); i++)
+        {
+            ComboBox_AddString(GetDlgItem(hWnd, IDC_PRESET), (LPARAM)presets[i]);
+        }
+        ComboBox_SetCurSel(GetDlgItem(hWnd, IDC_PRESET), 0);
+
         // Initialize critical sections
         InitializeCriticalSection(&csLog);
         InitializeCriticalSection(&csProgress);
@@ -524,7 +763,7 @@ INT_PTR CALLBACK ProcDlgMain(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
         const int SETTING_X = LEFT_MARGIN + LABEL_WIDTH + COL_SPACING;
         const int SPIN_X = LEFT_MARGIN + LABEL_WIDTH + COL_SPACING + SETTING_WIDTH - SPIN_WIDTH;
         const int LOG_WIDTH = LABEL_WIDTH + COL_SPACING + SETTING_WIDTH;
-        const int LOG_HEIGHT = height - TOP_MARGIN - BOTTOM_MARGIN - (LINE_HEIGHT + ROW_SPACING) * 8;
+        const int LOG_HEIGHT = height - TOP_MARGIN - BOTTOM_MARGIN - (LINE_HEIGHT + ROW_SPACING) * 10;
         const int BUTTON_Y = height - BOTTOM_MARGIN - LINE_HEIGHT;
         const int IMAGE_X = LEFT_MARGIN + LABEL_WIDTH + COL_SPACING + SETTING_WIDTH + COL_SPACING;
         const int IMAGE_WIDTH = width - IMAGE_X - RIGHT_MARGIN;
@@ -541,10 +780,14 @@ INT_PTR CALLBACK ProcDlgMain(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
             LEFT_MARGIN, TOP_MARGIN + (LINE_HEIGHT + ROW_SPACING) * 3 + 3, LABEL_WIDTH, LINE_HEIGHT, FALSE);
         MoveWindow(GetDlgItem(hWnd, IDL_REPEAT), 
             LEFT_MARGIN, TOP_MARGIN + (LINE_HEIGHT + ROW_SPACING) * 4 + 3, LABEL_WIDTH, LINE_HEIGHT, FALSE);
-        MoveWindow(GetDlgItem(hWnd, IDL_PROGRESS), 
+        MoveWindow(GetDlgItem(hWnd, IDL_RENDER_MODE), 
             LEFT_MARGIN, TOP_MARGIN + (LINE_HEIGHT + ROW_SPACING) * 5 + 3, LABEL_WIDTH, LINE_HEIGHT, FALSE);
-        MoveWindow(GetDlgItem(hWnd, IDL_OVERALL_PROGRESS), 
+        MoveWindow(GetDlgItem(hWnd, IDL_PRESET), 
             LEFT_MARGIN, TOP_MARGIN + (LINE_HEIGHT + ROW_SPACING) * 6 + 3, LABEL_WIDTH, LINE_HEIGHT, FALSE);
+        MoveWindow(GetDlgItem(hWnd, IDL_PROGRESS), 
+            LEFT_MARGIN, TOP_MARGIN + (LINE_HEIGHT + ROW_SPACING) * 7 + 3, LABEL_WIDTH, LINE_HEIGHT, FALSE);
+        MoveWindow(GetDlgItem(hWnd, IDL_OVERALL_PROGRESS), 
+            LEFT_MARGIN, TOP_MARGIN + (LINE_HEIGHT + ROW_SPACING) * 8 + 3, LABEL_WIDTH, LINE_HEIGHT, FALSE);
 
         // Settings on the right
         MoveWindow(GetDlgItem(hWnd, IDC_LIST),
@@ -557,10 +800,14 @@ INT_PTR CALLBACK ProcDlgMain(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
             SETTING_X, TOP_MARGIN + (LINE_HEIGHT + ROW_SPACING) * 3, SETTING_WIDTH, LINE_HEIGHT, FALSE);
         MoveWindow(GetDlgItem(hWnd, IDC_REPEAT),
             SETTING_X, TOP_MARGIN + (LINE_HEIGHT + ROW_SPACING) * 4, SETTING_WIDTH, LINE_HEIGHT, FALSE);
+        MoveWindow(GetDlgItem(hWnd, IDC_RENDER_MODE),
+            SETTING_X, TOP_MARGIN + (LINE_HEIGHT + ROW_SPACING) * 5, SETTING_WIDTH, LINE_HEIGHT, FALSE);
+        MoveWindow(GetDlgItem(hWnd, IDC_PRESET),
+            SETTING_X, TOP_MARGIN + (LINE_HEIGHT + ROW_SPACING) * 6, SETTING_WIDTH, LINE_HEIGHT, FALSE);
         MoveWindow(GetDlgItem(hWnd, IDC_PROGRESS),
-            SETTING_X, TOP_MARGIN + (LINE_HEIGHT + ROW_SPACING) * 5 + 2, SETTING_WIDTH, LINE_HEIGHT - 4, FALSE);
+            SETTING_X, TOP_MARGIN + (LINE_HEIGHT + ROW_SPACING) * 7 + 2, SETTING_WIDTH, LINE_HEIGHT - 4, FALSE);
         MoveWindow(GetDlgItem(hWnd, IDC_OVERALL_PROGRESS),
-            SETTING_X, TOP_MARGIN + (LINE_HEIGHT + ROW_SPACING) * 6 + 2, SETTING_WIDTH, LINE_HEIGHT - 4, FALSE);
+            SETTING_X, TOP_MARGIN + (LINE_HEIGHT + ROW_SPACING) * 8 + 2, SETTING_WIDTH, LINE_HEIGHT - 4, FALSE);
 
         // Up-down controls
         SendMessage(GetDlgItem(hWnd, IDC_SPIN_TUNNEL_TESSELLATION), UDM_SETBUDDY, 
@@ -572,7 +819,7 @@ INT_PTR CALLBACK ProcDlgMain(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 
         // Log
         MoveWindow(GetDlgItem(hWnd, IDC_LOG),
-            LEFT_MARGIN, TOP_MARGIN + (LINE_HEIGHT + ROW_SPACING) * 7, LOG_WIDTH, LOG_HEIGHT, FALSE);
+            LEFT_MARGIN, TOP_MARGIN + (LINE_HEIGHT + ROW_SPACING) * 9, LOG_WIDTH, LOG_HEIGHT, FALSE);
 
         // Bottons
         MoveWindow(GetDlgItem(hWnd, IDC_RENDER),
@@ -598,7 +845,7 @@ INT_PTR CALLBACK ProcDlgMain(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
         mmi->ptMaxPosition.y = 0;
 
         mmi->ptMinTrackSize.x = 740;
-        mmi->ptMinTrackSize.y = 400;
+        mmi->ptMinTrackSize.y = 440;
 
         mmi->ptMaxTrackSize.x = GetSystemMetrics(SM_CXFULLSCREEN);
         mmi->ptMaxTrackSize.y = GetSystemMetrics(SM_CXFULLSCREEN);    
@@ -614,6 +861,8 @@ INT_PTR CALLBACK ProcDlgMain(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
             segments = GetDlgItemInt(hWnd, IDC_TUNNEL_TESSELLATION, NULL, FALSE);
             repeat = GetDlgItemInt(hWnd, IDC_REPEAT, NULL, FALSE);
             algorithm = ComboBox_GetCurSel(GetDlgItem(hWnd, IDC_TUNNEL_ALGORITHM));
+            renderMode = ComboBox_GetCurSel(GetDlgItem(hWnd, IDC_RENDER_MODE));
+            preset = ComboBox_GetCurSel(GetDlgItem(hWnd, IDC_PRESET));
 
             if (width < MIN_WIDTH || width > MAX_WIDTH)
             {
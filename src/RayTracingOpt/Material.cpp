@@ -19,4 +19,23 @@ Material::~Material()
 Color Material::emission(const Point &position)
 {
     return Color::Black();
+}
+
+void Material::shade(const ShadingBatch &batch, int begin, int end)
+{
+    for (int i = begin; i < end; i++)
+    {
+        Point position(batch.px[i], batch.py[i], batch.pz[i]);
+        Vector normal(batch.nx[i], batch.ny[i], batch.nz[i]);
+        Ray ray(position, Vector(batch.dx[i], batch.dy[i], batch.dz[i]));
+
+        Color l = local(ray, position, normal);
+        Color e = emission(position);
+        batch.lr[i] = l.r;
+        batch.lg[i] = l.g;
+        batch.lb[i] = l.b;
+        batch.er[i] = e.r;
+        batch.eg[i] = e.g;
+        batch.eb[i] = e.b;
+    }
 }
\ No newline at end of file
@@ -4,6 +4,16 @@
 #include "Color.h"
 #include "Ray.h"
 
+// The hits of a batch in the SoA layout, which are shaded by Material::shade()
+struct ShadingBatch
+{
+    const float *px, *py, *pz; // the position
+    const float *nx, *ny, *nz; // the normal, which points to the outside
+    const float *dx, *dy, *dz; // the direction of the ray
+    float *lr, *lg, *lb;       // the local color (output)
+    float *er, *eg, *eb;       // the emission color (output)
+};
+
 class Material
 {
 public:
@@ -35,6 +45,11 @@ public:
 
     // Get the emission color of the material at a certain position
     virtual Color emission(const Point &position);
+
+    // Get the local and emission colors of the hits [begin, end) of a batch
+    // The default implementation calls local() and emission() for each hit, and the
+    // materials override it with loops free of virtual calls.
+    virtual void shade(const ShadingBatch &batch, int begin, int end);
 };
 
 #endif
@@ -27,3 +27,34 @@ Color PhongMaterial::local(const Ray &ray, const Point &position, const Vector &
     Color specularTerm = specular * pow(NdotH, shininess);
     return lightColor.mult(diffuseTerm + specularTerm);
 }
+
+// The same as local(), with the vectors expanded into their components
+void PhongMaterial::shade(const ShadingBatch &batch, int begin, int end)
+{
+    const Vector lightDir = Vector(-1, 1, 1).norm();
+
+    for (int i = begin; i < end; i++)
+    {
+        float nx = batch.nx[i];
+        float ny = batch.ny[i];
+        float nz = batch.nz[i];
+
+        float NdotL = nx * lightDir.x + ny * lightDir.y + nz * lightDir.z;
+        NdotL = (NdotL < 0.0f) ? 0.0f : NdotL;
+
+        float hx = lightDir.x - batch.dx[i];
+        float hy = lightDir.y - batch.dy[i];
+        float hz = lightDir.z - batch.dz[i];
+        float inv = 1 / sqrt(hx * hx + hy * hy + hz * hz);
+        float NdotH = nx * (hx * inv) + ny * (hy * inv) + nz * (hz * inv);
+        NdotH = (NdotH < 0.0f) ? 0.0f : NdotH;
+
+        float s = pow(NdotH, shininess);
+        batch.lr[i] = diffuse.r * NdotL + specular.r * s;
+        batch.lg[i] = diffuse.g * NdotL + specular.g * s;
+        batch.lb[i] = diffuse.b * NdotL + specular.b * s;
+        batch.er[i] = 0;
+        batch.eg[i] = 0;
+        batch.eb[i] = 0;
+    }
+}
@@ -14,6 +14,7 @@ public:
     PhongMaterial(
         const Color &diffuse, const Color &specular, float shininess, float reflectiveness = 0);
     virtual Color local(const Ray &ray, const Point &position, const Vector &normal);
+    virtual void shade(const ShadingBatch &batch, int begin, int end);
 };
 
 #endif
@@ -27,3 +27,24 @@ Color RadianceCheckerMaterial::emission(const Point &position)
     d = fmod(d, 2);
     return  (d < 1) ? Color(radiance, radiance, radiance) : Color::Black();
 }
+
+// The same as local() and emission(), see CheckerMaterial::shade()
+void RadianceCheckerMaterial::shade(const ShadingBatch &batch, int begin, int end)
+{
+    const float *u = (dir == yoz) ? batch.py : batch.px;
+    const float *v = (dir == xoy) ? batch.py : batch.pz;
+
+    for (int i = begin; i < end; i++)
+    {
+        float d = fabs(floor(u[i] * scale) + floor(v[i] * scale));
+        d = d - 2 * floor(d * 0.5f);
+
+        float e = (d < 1) ? radiance : 0.0f;
+        batch.lr[i] = 0.15f;
+        batch.lg[i] = 0.15f;
+        batch.lb[i] = 0.15f;
+        batch.er[i] = e;
+        batch.eg[i] = e;
+        batch.eb[i] = e;
+    }
+}
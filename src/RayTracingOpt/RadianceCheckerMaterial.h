@@ -17,6 +17,7 @@ public:
     RadianceCheckerMaterial(float radiance, float scale, enum checker_dir_t dir = xoz);
     virtual Color local(const Ray &ray, const Point &position, const Vector &normal);
     virtual Color emission(const Point &position);
+    virtual void shade(const ShadingBatch &batch, int begin, int end);
 };
 
 #endif
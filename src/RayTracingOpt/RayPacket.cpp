@@ -0,0 +1,137 @@
+#include "RayPacket.h"
+
+#ifdef TRIANGLE_BLOCK_SSE
+#include <xmmintrin.h>
+#endif
+
+RayPacket::RayPacket(Ray *r0, Ray *r1, Ray *r2, Ray *r3)
+{
+    rays[0] = r0;
+    rays[1] = r1;
+    rays[2] = r2;
+    rays[3] = r3;
+
+    for (int i = 0; i < SIZE; i++)
+    {
+        ox[i] = rays[i]->origin.x;
+        oy[i] = rays[i]->origin.y;
+        oz[i] = rays[i]->origin.z;
+        dx[i] = rays[i]->direction.x;
+        dy[i] = rays[i]->direction.y;
+        dz[i] = rays[i]->direction.z;
+    }
+}
+
+bool RayPacket::isCoherent() const
+{
+    for (int i = 0; i < SIZE; i++)
+    {
+        if (dx[i] == 0 || dy[i] == 0 || dz[i] == 0 ||
+            (dx[i] > 0) != (dx[0] > 0) || 
+            (dy[i] > 0) != (dy[0] > 0) || 
+            (dz[i] > 0) != (dz[0] > 0))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef TRIANGLE_BLOCK_SSE
+
+// The same Moller-Trumbore test as TriangleRecord::intersect(), with one triangle and four
+// rays instead of four triangles and one ray (TriangleBlock::intersect)
+int RayPacket::intersect(const TriangleRecord &record, int mask, const float lo[], const float hi[],
+                         float tMax[]) const
+{
+    const __m128 dX = _mm_loadu_ps(dx);
+    const __m128 dY = _mm_loadu_ps(dy);
+    const __m128 dZ = _mm_loadu_ps(dz);
+
+    const __m128 e1X = _mm_set1_ps(record.e1.x);
+    const __m128 e1Y = _mm_set1_ps(record.e1.y);
+    const __m128 e1Z = _mm_set1_ps(record.e1.z);
+    const __m128 e2X = _mm_set1_ps(record.e2.x);
+    const __m128 e2Y = _mm_set1_ps(record.e2.y);
+    const __m128 e2Z = _mm_set1_ps(record.e2.z);
+
+    // P = DIR x E2
+    __m128 px = _mm_sub_ps(_mm_mul_ps(dY, e2Z), _mm_mul_ps(dZ, e2Y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(dZ, e2X), _mm_mul_ps(dX, e2Z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(dX, e2Y), _mm_mul_ps(dY, e2X));
+
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1X, px), _mm_mul_ps(e1Y, py)), _mm_mul_ps(e1Z, pz));
+    __m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+    __m128 hits = _mm_cmpge_ps(absDet, _mm_set1_ps(1e-10f));
+    __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+    // T = O - A
+    __m128 tx = _mm_sub_ps(_mm_loadu_ps(ox), _mm_set1_ps(record.a.x));
+    __m128 ty = _mm_sub_ps(_mm_loadu_ps(oy), _mm_set1_ps(record.a.y));
+    __m128 tz = _mm_sub_ps(_mm_loadu_ps(oz), _mm_set1_ps(record.a.z));
+
+    __m128 beta = _mm_mul_ps(_mm_add_ps(_mm_add_ps(
+        _mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+
+    // Q = T x E1
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1Z), _mm_mul_ps(tz, e1Y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1X), _mm_mul_ps(tx, e1Z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1Y), _mm_mul_ps(ty, e1X));
+
+    __m128 gamma = _mm_mul_ps(_mm_add_ps(_mm_add_ps(
+        _mm_mul_ps(dX, qx), _mm_mul_ps(dY, qy)), _mm_mul_ps(dZ, qz)), invDet);
+    __m128 alpha = _mm_sub_ps(_mm_sub_ps(_mm_set1_ps(1.0f), beta), gamma);
+
+    __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(
+        _mm_mul_ps(e2X, qx), _mm_mul_ps(e2Y, qy)), _mm_mul_ps(e2Z, qz)), invDet);
+
+    // The same tolerances as the scalar test, to avoid leaks
+    const __m128 lower = _mm_set1_ps(-0.0001f);
+    const __m128 upper = _mm_set1_ps(1.0001f);
+    hits = _mm_and_ps(hits, _mm_and_ps(_mm_cmpge_ps(beta, lower), _mm_cmple_ps(beta, upper)));
+    hits = _mm_and_ps(hits, _mm_and_ps(_mm_cmpge_ps(gamma, lower), _mm_cmple_ps(gamma, upper)));
+    hits = _mm_and_ps(hits, _mm_and_ps(_mm_cmpge_ps(alpha, lower), _mm_cmple_ps(alpha, upper)));
+
+    __m128 maxDistance = _mm_loadu_ps(tMax);
+    hits = _mm_and_ps(hits, _mm_and_ps(_mm_cmpge_ps(t, _mm_loadu_ps(lo)), _mm_cmple_ps(t, _mm_loadu_ps(hi))));
+    hits = _mm_and_ps(hits, _mm_cmplt_ps(t, maxDistance));
+
+    int result = _mm_movemask_ps(hits) & mask;
+    if (result != 0)
+    {
+        float distances[SIZE];
+        _mm_storeu_ps(distances, t);
+        for (int i = 0; i < SIZE; i++)
+        {
+            if (result & (1 << i))
+                tMax[i] = distances[i];
+        }
+    }
+    return result;
+}
+
+#else
+
+int RayPacket::intersect(const TriangleRecord &record, int mask, const float lo[], const float hi[],
+                         float tMax[]) const
+{
+    int result = 0;
+    for (int i = 0; i < SIZE; i++)
+    {
+        if ((mask & (1 << i)) == 0)
+        {
+            continue;
+        }
+
+        float distance;
+        if (record.intersect(*rays[i], distance) && 
+            distance >= lo[i] && distance <= hi[i] && distance < tMax[i])
+        {
+            tMax[i] = distance;
+            result |= 1 << i;
+        }
+    }
+    return result;
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include "Ray.h"
+#include "TriangleBlock.h"
+
+// A packet of four coherent rays (the primary rays of a 2 x 2 pixel block), which are traced
+// together through the grid and the k-d tree of a tunnel. A lane of the packet is a lane of
+// the SSE registers. The origins and the directions are copied in the SoA layout, while the
+// intervals [tMin, tMax] are kept in the rays.
+struct RayPacket
+{
+    enum { SIZE = 4 };
+    enum { ALL_LANES = (1 << SIZE) - 1 };
+
+    Ray *rays[SIZE];
+    float ox[SIZE], oy[SIZE], oz[SIZE];
+    float dx[SIZE], dy[SIZE], dz[SIZE];
+
+    RayPacket(Ray *r0, Ray *r1, Ray *r2, Ray *r3);
+
+    // Whether the directions of all rays have the same (nonzero) sign on each axis,
+    // which is required by the packet traversal algorithms
+    bool isCoherent() const;
+
+    // Tests a triangle against the lanes in mask. For each lane i whose signed distance
+    // of the hit is in [lo[i], hi[i]] and less than tMax[i], tMax[i] is shrunk to it.
+    // Returns the mask of these lanes. lo[i] should not be less than rays[i]->tMin.
+    int intersect(const TriangleRecord &record, int mask, const float lo[], const float hi[],
+        float tMax[]) const;
+};
+
+#endif
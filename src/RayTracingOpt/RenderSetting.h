@@ -3,6 +3,31 @@
 
 #include <limits.h>
 
+// The presets of RenderSetting as compile-time constants (see PresetPolicy)
+struct HighSpeedPreset
+{
+    enum { MONTE_CARLO = 1, MAX_DEPTH = 6, TERMINATION_DEPTH = 2, SINGLE_TRACING_DEPTH = 0, RAY_PACKETS = 0 };
+    static const char *Name() { return "High Speed"; }
+};
+
+struct HighQualityPreset
+{
+    enum { MONTE_CARLO = 1, MAX_DEPTH = 8, TERMINATION_DEPTH = INT_MAX, SINGLE_TRACING_DEPTH = INT_MAX, RAY_PACKETS = 0 };
+    static const char *Name() { return "High Quality"; }
+};
+
+struct DefaultPreset
+{
+    enum { MONTE_CARLO = 1, MAX_DEPTH = INT_MAX, TERMINATION_DEPTH = 5, SINGLE_TRACING_DEPTH = 2, RAY_PACKETS = 0 };
+    static const char *Name() { return "Default"; }
+};
+
+struct SimplePreset
+{
+    enum { MONTE_CARLO = 0, MAX_DEPTH = 20, TERMINATION_DEPTH = INT_MAX, SINGLE_TRACING_DEPTH = 0, RAY_PACKETS = 1 };
+    static const char *Name() { return "Simple"; }
+};
+
 struct RenderSetting
 {
     // Enable Monte Carlo path tracing.
@@ -37,45 +62,62 @@ struct RenderSetting
     // Set this value to 0 to always generate one ray.
     int singleTracingDepth;
 
-    static RenderSetting HighSpeed()
-    {
-        RenderSetting setting;
-        setting.enableMonteCarlo = true;
-        setting.maxDepth = 6;
-        setting.terminationDepth = 2;
-        setting.singleTracingDepth = 0;
-        return setting;
-    }
+    // Trace the primary rays in packets of 2 x 2 pixels (see RayPacket), which is faster with
+    // the grid and the k-d tree of a tunnel. Only used when Monte Carlo path tracing is disabled.
+    bool enableRayPackets;
 
-    static RenderSetting HighQuality()
+    template <class Preset>
+    static RenderSetting FromPreset()
     {
         RenderSetting setting;
-        setting.enableMonteCarlo = true;
-        setting.maxDepth = 8;
-        setting.terminationDepth = INT_MAX;
-        setting.singleTracingDepth = INT_MAX;
+        setting.enableMonteCarlo = Preset::MONTE_CARLO != 0;
+        setting.maxDepth = Preset::MAX_DEPTH;
+        setting.terminationDepth = Preset::TERMINATION_DEPTH;
+        setting.singleTracingDepth = Preset::SINGLE_TRACING_DEPTH;
+        setting.enableRayPackets = Preset::RAY_PACKETS != 0;
         return setting;
     }
 
-    static RenderSetting Default()
+    // Whether the setting is the same as a preset
+    template <class Preset>
+    bool is() const
     {
-        RenderSetting setting;
-        setting.enableMonteCarlo = true;
-        setting.maxDepth = INT_MAX;
-        setting.terminationDepth = 5;
-        setting.singleTracingDepth = 2;
-        return setting;
+        return enableMonteCarlo == (Preset::MONTE_CARLO != 0) &&
+            maxDepth == Preset::MAX_DEPTH &&
+            terminationDepth == Preset::TERMINATION_DEPTH &&
+            singleTracingDepth == Preset::SINGLE_TRACING_DEPTH &&
+            enableRayPackets == (Preset::RAY_PACKETS != 0);
     }
 
-    static RenderSetting Simple()
-    {
-        RenderSetting setting;
-        setting.enableMonteCarlo = false;
-        setting.maxDepth = 20;
-        setting.terminationDepth = INT_MAX;
-        setting.singleTracingDepth = 0;
-        return setting;
-    }
+    static RenderSetting HighSpeed()   { return FromPreset<HighSpeedPreset>(); }
+    static RenderSetting HighQuality() { return FromPreset<HighQualityPreset>(); }
+    static RenderSetting Default()     { return FromPreset<DefaultPreset>(); }
+    static RenderSetting Simple()      { return FromPreset<SimplePreset>(); }
+};
+
+// Policies of the integrators, which read the parameters of a RenderSetting
+// The integrators are templates on a policy and are instantiated once for each preset.
+// The parameters of a PresetPolicy are constants, so the checks of depth are folded by
+// the compiler, and DynamicPolicy is used for the other settings.
+template <class Preset>
+struct PresetPolicy
+{
+    static bool enableMonteCarlo(const RenderSetting &)  { return Preset::MONTE_CARLO != 0; }
+    static int maxDepth(const RenderSetting &)           { return Preset::MAX_DEPTH; }
+    static int terminationDepth(const RenderSetting &)   { return Preset::TERMINATION_DEPTH; }
+    static int singleTracingDepth(const RenderSetting &) { return Preset::SINGLE_TRACING_DEPTH; }
+    static bool enableRayPackets(const RenderSetting &)  { return Preset::RAY_PACKETS != 0; }
+    static const char *Name() { return Preset::Name(); }
+};
+
+struct DynamicPolicy
+{
+    static bool enableMonteCarlo(const RenderSetting &s)  { return s.enableMonteCarlo; }
+    static int maxDepth(const RenderSetting &s)           { return s.maxDepth; }
+    static int terminationDepth(const RenderSetting &s)   { return s.terminationDepth; }
+    static int singleTracingDepth(const RenderSetting &s) { return s.singleTracingDepth; }
+    static bool enableRayPackets(const RenderSetting &s)  { return s.enableRayPackets; }
+    static const char *Name() { return "Generic"; }
 };
 
 #endif
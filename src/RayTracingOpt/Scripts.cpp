@@ -29,9 +29,9 @@ void Script1::Run(RenderProc render, int tunnelAlgorithm, LogCallback log, Progr
     Sphere *sphere1 = new Sphere(Point(-10, 15, -30), 15);
     Sphere *sphere2 = new Sphere(Point(20, 10, -20), 10);
 
-    plane->material = Ptr<Material>(new RadianceCheckerMaterial(1.2f, 0.025f));
-    sphere1->material = Ptr<Material>(new SolidColorMaterial(Color::White(), Color::Black(), 1, 0, 0));
-    sphere2->material = Ptr<Material>(new SolidColorMaterial(Color::White(), Color::Black(), 1, 0, 0));
+    plane->material = scene.addMaterial(new RadianceCheckerMaterial(1.2f, 0.025f));
+    sphere1->material = scene.addMaterial(new SolidColorMaterial(Color::White(), Color::Black(), 1, 0, 0));
+    sphere2->material = scene.addMaterial(new SolidColorMaterial(Color::White(), Color::Black(), 1, 0, 0));
 
     scene.add(plane);
     scene.add(sphere1);
@@ -71,16 +71,16 @@ void Script2::Run(RenderProc render, int tunnelAlgorithm, LogCallback log, Progr
     Sphere *sphere2 = new Sphere(Point(27, 16.5f, 47), 16.5f);           // Mirror
     Sphere *sphere3 = new Sphere(Point(73, 16.5f, 78), 16.5f);           // Glass
 
-    plane1->material = Ptr<Material>(new SolidColorMaterial(Color(0.75f, 0.25f, 0.25f), Color::Black(), 1, 0, 0));
-    plane2->material = Ptr<Material>(new SolidColorMaterial(Color(0.25f, 0.25f, 0.75f), Color::Black(), 1, 0, 0));
-    plane3->material = Ptr<Material>(new SolidColorMaterial(Color(0.75f, 0.75f, 0.75f), Color::Black(), 1, 0, 0));
-    plane4->material = Ptr<Material>(new SolidColorMaterial(Color(0.75f, 0.75f, 0.75f), Color::Black(), 1, 0, 0));
-    plane5->material = Ptr<Material>(new SolidColorMaterial(Color(0.75f, 0.75f, 0.75f), Color::Black(), 1, 0, 0));
-    plane6->material = Ptr<Material>(new SolidColorMaterial(Color(0, 0, 0),             Color::Black(), 1, 0, 0));
+    plane1->material = scene.addMaterial(new SolidColorMaterial(Color(0.75f, 0.25f, 0.25f), Color::Black(), 1, 0, 0));
+    plane2->material = scene.addMaterial(new SolidColorMaterial(Color(0.25f, 0.25f, 0.75f), Color::Black(), 1, 0, 0));
+    plane3->material = scene.addMaterial(new SolidColorMaterial(Color(0.75f, 0.75f, 0.75f), Color::Black(), 1, 0, 0));
+    plane4->material = scene.addMaterial(new SolidColorMaterial(Color(0.75f, 0.75f, 0.75f), Color::Black(), 1, 0, 0));
+    plane5->material = scene.addMaterial(new SolidColorMaterial(Color(0.75f, 0.75f, 0.75f), Color::Black(), 1, 0, 0));
+    plane6->material = scene.addMaterial(new SolidColorMaterial(Color(0, 0, 0),             Color::Black(), 1, 0, 0));
 
-    sphere1->material = Ptr<Material>(new SolidColorMaterial(Color::Black(), Color(24, 24, 24), 1, 0, 0));
-    sphere2->material = Ptr<Material>(new SolidColorMaterial(Color::White(), Color::Black(), 0, 1, 0));
-    sphere3->material = Ptr<Material>(new GlassMaterial());
+    sphere1->material = scene.addMaterial(new SolidColorMaterial(Color::Black(), Color(24, 24, 24), 1, 0, 0));
+    sphere2->material = scene.addMaterial(new SolidColorMaterial(Color::White(), Color::Black(), 0, 1, 0));
+    sphere3->material = scene.addMaterial(new GlassMaterial());
 
     scene.add(plane1);
     scene.add(plane2);
@@ -125,14 +125,14 @@ void Script3::Run(RenderProc render, int tunnelAlgorithm, LogCallback log, Progr
 
     Sphere *sphere1 = new Sphere(Point(50, 681.6f - 0.27f, 81.6f), 600); // Light
 
-    plane1->material = Ptr<Material>(new SolidColorMaterial(Color(0.75f, 0.25f, 0.25f), Color::Black(), 1, 0, 0));
-    plane2->material = Ptr<Material>(new SolidColorMaterial(Color(0.25f, 0.25f, 0.75f), Color::Black(), 1, 0, 0));
-    plane3->material = Ptr<Material>(new SolidColorMaterial(Color(0.75f, 0.75f, 0.75f), Color::Black(), 1, 0, 0));
-    plane4->material = Ptr<Material>(new SolidColorMaterial(Color(0.75f, 0.75f, 0.75f), Color::Black(), 1, 0, 0));
-    plane5->material = Ptr<Material>(new SolidColorMaterial(Color(0.75f, 0.75f, 0.75f), Color::Black(), 1, 0, 0));
-    plane6->material = Ptr<Material>(new SolidColorMaterial(Color(0, 0, 0),             Color::Black(), 1, 0, 0));
+    plane1->material = scene.addMaterial(new SolidColorMaterial(Color(0.75f, 0.25f, 0.25f), Color::Black(), 1, 0, 0));
+    plane2->material = scene.addMaterial(new SolidColorMaterial(Color(0.25f, 0.25f, 0.75f), Color::Black(), 1, 0, 0));
+    plane3->material = scene.addMaterial(new SolidColorMaterial(Color(0.75f, 0.75f, 0.75f), Color::Black(), 1, 0, 0));
+    plane4->material = scene.addMaterial(new SolidColorMaterial(Color(0.75f, 0.75f, 0.75f), Color::Black(), 1, 0, 0));
+    plane5->material = scene.addMaterial(new SolidColorMaterial(Color(0.75f, 0.75f, 0.75f), Color::Black(), 1, 0, 0));
+    plane6->material = scene.addMaterial(new SolidColorMaterial(Color(0, 0, 0),             Color::Black(), 1, 0, 0));
 
-    sphere1->material = Ptr<Material>(new SolidColorMaterial(Color::Black(), Color(24, 24, 24), 1, 0, 0));
+    sphere1->material = scene.addMaterial(new SolidColorMaterial(Color::Black(), Color(24, 24, 24), 1, 0, 0));
 
     scene.add(plane1);
     scene.add(plane2);
@@ -148,7 +148,7 @@ void Script3::Run(RenderProc render, int tunnelAlgorithm, LogCallback log, Progr
         0, 1, 0,
         0, 0, 1);
     Vector offset(50, 0, 40);
-    scene.addStlFile("ball.stl", Ptr<Material>(new GlassMaterial()), matrix, offset);
+    scene.addStlFile("ball.stl", scene.addMaterial(new GlassMaterial()), matrix, offset);
 
     // 2. Prepare camera
     PerspectiveCamera camera(
@@ -178,23 +178,23 @@ void Script4::Run(RenderProc render, int tunnelAlgorithm, LogCallback log, Progr
     Utils::PrintTickCount("Current Time");
 
     Sphere *ball = new Sphere(Point(74.12f, 15, -96.59f), 15);
-    ball->material = Ptr<Material>(new PhongMaterial(Color(1, 0, 0), Color::White(), 16));
+    ball->material = scene.addMaterial(new PhongMaterial(Color(1, 0, 0), Color::White(), 16));
     scene.add(ball);
 
     Plane *ground = new Plane(Vector(0, 1, 0), -0.01f);
-    ground->material = Ptr<Material>(new SolidColorMaterial(Color(0.25, 0.25, 0.25), Color::Black(), 1, 0, 0));
+    ground->material = scene.addMaterial(new SolidColorMaterial(Color(0.25, 0.25, 0.25), Color::Black(), 1, 0, 0));
     scene.add(ground);
 
     Plane *sky = new Plane(Vector(0, 1, 0), 1000);
-    sky->material = Ptr<Material>(new SolidColorMaterial(Color::White(), Color::Black(), 1, 0, 0));
+    sky->material = scene.addMaterial(new SolidColorMaterial(Color::White(), Color::Black(), 1, 0, 0));
     scene.add(sky);
 
     Utils::PrintTickCount("Creating Tunnel");
 
     TunnelGenerator g; // Add a tunnel
     g.create(50, 25, 25, 100, PI * 0.416667f, tunnelSegments, tunnelSegments, scene, 
-        Ptr<Material>(new CheckerMaterial(0.05f)), // ground material
-        Ptr<Material>(new SolidColorMaterial(Color::Black(), Color::Black(), 0.333f, 0.667f, 0)), // wall material
+        scene.addMaterial(new CheckerMaterial(0.05f)), // ground material
+        scene.addMaterial(new SolidColorMaterial(Color::Black(), Color::Black(), 0.333f, 0.667f, 0)), // wall material
         (Tunnel::Algorithm)tunnelAlgorithm); // accellaration algorithm
 
     int t1 = Utils::GetTickCount();
@@ -233,23 +233,23 @@ void Script5::Run(RenderProc render, int tunnelAlgorithm, LogCallback log, Progr
     Utils::PrintTickCount("Current Time");
 
     Sphere *ball = new Sphere(Point(5000, 15, -5000), 15);
-    ball->material = Ptr<Material>(new PhongMaterial(Color(1, 0, 0), Color::White(), 16));
+    ball->material = scene.addMaterial(new PhongMaterial(Color(1, 0, 0), Color::White(), 16));
     scene.add(ball);
 
     Plane *ground = new Plane(Vector(0, 1, 0), -0.01f);
-    ground->material = Ptr<Material>(new SolidColorMaterial(Color(0.25, 0.25, 0.25), Color::Black(), 1, 0, 0));
+    ground->material = scene.addMaterial(new SolidColorMaterial(Color(0.25, 0.25, 0.25), Color::Black(), 1, 0, 0));
     scene.add(ground);
 
     Plane *sky = new Plane(Vector(0, 1, 0), 1000);
-    sky->material = Ptr<Material>(new SolidColorMaterial(Color::White(), Color::Black(), 1, 0, 0));
+    sky->material = scene.addMaterial(new SolidColorMaterial(Color::White(), Color::Black(), 1, 0, 0));
     scene.add(sky);
 
     Utils::PrintTickCount("Creating Tunnel");
 
     TunnelGenerator g; // Add a tunnel
     g.create(50, 25, 25, 5000, PI * 0.5f, tunnelSegments, tunnelSegments, scene, 
-        Ptr<Material>(new CheckerMaterial(0.05f)), // ground material
-        Ptr<Material>(new SolidColorMaterial(Color::Black(), Color::Black(), 0.333f, 0.667f, 0)), // wall material
+        scene.addMaterial(new CheckerMaterial(0.05f)), // ground material
+        scene.addMaterial(new SolidColorMaterial(Color::Black(), Color::Black(), 0.333f, 0.667f, 0)), // wall material
         (Tunnel::Algorithm)tunnelAlgorithm); // accellaration algorithm
 
     int t1 = Utils::GetTickCount();
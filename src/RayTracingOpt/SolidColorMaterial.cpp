@@ -17,3 +17,16 @@ Color SolidColorMaterial::emission(const Point &position)
 {
     return emissionColor;
 }
+
+void SolidColorMaterial::shade(const ShadingBatch &batch, int begin, int end)
+{
+    for (int i = begin; i < end; i++)
+    {
+        batch.lr[i] = localColor.r;
+        batch.lg[i] = localColor.g;
+        batch.lb[i] = localColor.b;
+        batch.er[i] = emissionColor.r;
+        batch.eg[i] = emissionColor.g;
+        batch.eb[i] = emissionColor.b;
+    }
+}
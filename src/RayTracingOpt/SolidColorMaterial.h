@@ -14,6 +14,7 @@ public:
         float diffusiveness, float reflectiveness, float refractiveness);
     virtual Color local(const Ray &ray, const Point &position, const Vector &normal);
     virtual Color emission(const Point &position);
+    virtual void shade(const ShadingBatch &batch, int begin, int end);
 };
 
 #endif
@@ -9,8 +9,17 @@ Sphere::Sphere(const Point &center, float radius)
 
 IntersectResult Sphere::intersect(Ray &ray)
 { 
-    IntersectResult result(false);
+    float distance;
 
+    if (!intersectDistance(ray, distance))
+    {
+        return IntersectResult(false);
+    }
+    return getHitResult(ray, distance);
+}
+
+bool Sphere::intersectDistance(Ray &ray, float &distance)
+{
     // Solve:
     //   | (o + t * dir) - c | = radius
     //  ==> ( co + t * dir ) ^ 2 - radius ^ 2 = 0
@@ -21,17 +30,29 @@ IntersectResult Sphere::intersect(Ray &ray)
     float b = ray.direction.dot(co);
     float delta = b * b - (co.dot(co) - radius * radius);
 
-    if (delta >= 0)
+    if (delta < 0)
     {
-        delta = sqrt(delta);
-        if (-b + delta >= 0.0005f)
-        {
-            result.hit = true;
-            result.geometry = this;
-            result.distance = (-b - delta >= 0.0005f) ? -b - delta : -b + delta;
-            result.position = ray.getPoint(result.distance);
-            result.normal = Vector(center, result.position).norm();
-        }
+        return false;
     }
+
+    delta = sqrt(delta);
+    distance = (-b - delta >= ray.tMin) ? -b - delta : -b + delta;
+    return distance >= ray.tMin && distance <= ray.tMax;
+}
+
+IntersectResult Sphere::getHitResult(Ray &ray, float distance)
+{
+    IntersectResult result(true);
+    result.geometry = this;
+    result.distance = distance;
+    result.position = ray.getPoint(distance);
+    result.normal = Vector(center, result.position).norm();
     return result;
 }
+
+bool Sphere::getBoundingBox(Point &min, Point &max)
+{
+    min = Point(center.x - radius, center.y - radius, center.z - radius);
+    max = Point(center.x + radius, center.y + radius, center.z + radius);
+    return true;
+}
@@ -12,6 +12,9 @@ private:
 public:
     Sphere(const Point &center, float radius);
     virtual IntersectResult intersect(Ray &ray);
+    virtual bool intersectDistance(Ray &ray, float &distance);
+    virtual IntersectResult getHitResult(Ray &ray, float distance);
+    virtual bool getBoundingBox(Point &min, Point &max);
 };
 
 #endif
@@ -22,23 +22,21 @@ Triangle::Triangle(const Point &a, const Point &b, const Point &c)
     this->normal = Vector(a, b).cross(Vector(b, c)).norm();
 }
 
-static float det(float a11, float a12, float a13, 
-                 float a21, float a22, float a23, 
-                 float a31, float a32, float a33)
+bool Triangle::intersect(const Point &a, const Point &b, const Point &c, Ray &ray, float &distance)
 {
-    return 
-        a11 * a22 * a33 + 
-        a12 * a23 * a31 + 
-        a13 * a21 * a32 - 
-        a13 * a22 * a31 - 
-        a11 * a23 * a32 - 
-        a12 * a21 * a33;
+    TriangleRecord record(a, b, c);
+    return record.intersect(ray, distance);
 }
 
-IntersectResult Triangle::intersect(Ray &ray)
-{ 
-    IntersectResult result(false);
+TriangleRecord::TriangleRecord(const Point &a, const Point &b, const Point &c)
+{
+    this->a = a;
+    this->e1 = Vector(a, b);
+    this->e2 = Vector(a, c);
+}
 
+bool TriangleRecord::intersect(const Ray &ray, float &distance) const
+{ 
     // A point P in triangle ABC:
     //  - P = alpha * A + beta * B + gamma * C
     //   (0 <= alpha <= 1, 0 <= beta <= 1, 0 <= gamma <= 1, and alpha + beta + gamma = 1)
@@ -48,78 +46,121 @@ IntersectResult Triangle::intersect(Ray &ray)
     // Solve:
     //   O + t * DIR = (1 - beta - gamma) * A + beta * B + gamma * C
     //  ==> O + t * DIR = A + beta * (B - A) + gamma * (C - A)
-    //  ==> (A - B) * beta + (A - C) * gamma + DIR * t = A - O
-    //      [ x(A)-x(B)  x(A)-x(C)  x(DIR) ]   [ beta  ]   [ x(A) - x(O) ]
-    //  ==> [ y(A)-y(B)  y(A)-y(C)  y(DIR) ] * [ gamma ] = [ y(A) - y(O) ]
-    //      [ z(A)-z(B)  z(A)-z(C)  z(DIR) ]   [ t     ]   [ z(A) - z(O) ]
-    //      [ m11  m12  m13 ]   [ beta  ]   [ b1 ]
-    //  ==> [ m21  m22  m23 ] * [ gamma ] = [ b2 ]
-    //      [ m31  m32  m33 ]   [ t     ]   [ b3 ]
-    //  ==> M * [ beta  gamma  t ] ^ -1 = [ b1  b2  b3 ] ^ -1
-    // 
-    // According to the Cramer's Rule
-    // http://en.wikipedia.org/wiki/Cramer%27s_rule
-    //         | b1  m12  m13 |
-    //  beta = | b2  m22  m23 | / | M |
-    //         | b3  m32  m33 |
+    //  ==> -DIR * t + E1 * beta + E2 * gamma = T    (E1 = B - A, E2 = C - A, T = O - A)
     //
-    //          | m11  b1  m13 |
-    //  gamma = | m21  b2  m23 | / | M |
-    //          | m31  b3  m33 |
+    // According to the Cramer's Rule, with the determinants written as scalar triple products
+    // http://en.wikipedia.org/wiki/Cramer%27s_rule
+    //  ==> [ t  beta  gamma ] = [ Q.E2  P.T  Q.DIR ] / P.E1    (P = DIR x E2, Q = T x E1)
     //
-    //      | m11  m12  b1 |
-    //  t = | m21  m22  b2 | / | M |
-    //      | m31  m32  b3 |
-    float m11 = a.x - b.x;
-    float m21 = a.y - b.y;
-    float m31 = a.z - b.z;
-
-    float m12 = a.x - c.x;
-    float m22 = a.y - c.y;
-    float m32 = a.z - c.z;
-
-    float m13 = ray.direction.x;
-    float m23 = ray.direction.y;
-    float m33 = ray.direction.z;
-
-    float b1 = a.x - ray.origin.x;
-    float b2 = a.y - ray.origin.y;
-    float b3 = a.z - ray.origin.z;
-
-    float det_m = det(m11, m12, m13, m21, m22, m23, m31, m32, m33);
-    if (fabs(det_m) < 1e-10)
-    {
-        return result;
-    }
+    // Only two cross products and one division are needed, see
+    // "Fast, Minimum Storage Ray/Triangle Intersection" by Tomas Moller and Ben Trumbore
+    const Vector &d = ray.direction;
+
+    // P = DIR x E2
+    float px = d.y * e2.z - d.z * e2.y;
+    float py = d.z * e2.x - d.x * e2.z;
+    float pz = d.x * e2.y - d.y * e2.x;
 
-    float t = det(m11, m12, b1, m21, m22, b2, m31, m32, b3) / det_m;
-    if (t < 0.0005f)
+    float det = e1.x * px + e1.y * py + e1.z * pz;
+    if (fabs(det) < 1e-10)
     {
-        return result;
+        return false;
     }
+    float invDet = 1.0f / det;
 
-    float beta = det(b1, m12, m13, b2, m22, m23, b3, m32, m33) / det_m;
+    // T = O - A
+    float tx = ray.origin.x - a.x;
+    float ty = ray.origin.y - a.y;
+    float tz = ray.origin.z - a.z;
+
+    float beta = (tx * px + ty * py + tz * pz) * invDet;
     if (beta < -0.0001f || beta > 1.0001f) // avoid leaks
     {
-        return result;
+        return false;
     }
 
-    float gamma = det(m11, b1, m13, m21, b2, m23, m31, b3, m33) / det_m;
+    // Q = T x E1
+    float qx = ty * e1.z - tz * e1.y;
+    float qy = tz * e1.x - tx * e1.z;
+    float qz = tx * e1.y - ty * e1.x;
+
+    float gamma = (d.x * qx + d.y * qy + d.z * qz) * invDet;
     if (gamma < -0.0001f || gamma > 1.0001f ||
         1 - beta - gamma < -0.0001f || 1 - beta - gamma > 1.0001f)
     {
-        return result;
+        return false;
+    }
+
+    float t = (e2.x * qx + e2.y * qy + e2.z * qz) * invDet;
+    if (t < ray.tMin || t > ray.tMax)
+    {
+        return false;
+    }
+
+    distance = t;
+    return true;
+}
+
+IntersectResult Triangle::intersect(Ray &ray)
+{
+    float t;
+
+    if (!intersect(a, b, c, ray, t))
+    {
+        return IntersectResult(false);
     }
+    return getHitResult(ray, t);
+}
 
-    result.hit = true;
+bool Triangle::intersectDistance(Ray &ray, float &distance)
+{
+    return intersect(a, b, c, ray, distance);
+}
+
+IntersectResult Triangle::getHitResult(Ray &ray, float distance)
+{
+    IntersectResult result(true);
     result.geometry = this;
-    result.distance = t;
-    result.position = ray.getPoint(t);
+    result.distance = distance;
+    result.position = ray.getPoint(distance);
     result.normal = normal;
-
     return result;
 }
 
+TriangleBoxTest::TriangleBoxTest(const Point &a, const Point &b, const Point &c, const Vector &halfSize)
+{
+    Vector edges[3] = { Vector(a, b), Vector(b, c), Vector(c, a) };
+    Vector units[3] = { Vector(1, 0, 0), Vector(0, 1, 0), Vector(0, 0, 1) };
+    Vector axes[NUM_AXES];
+
+    axes[0] = edges[0].cross(edges[1]);
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            axes[1 + i * 3 + j] = units[i].cross(edges[j]);
+        }
+    }
+
+    // The cells are enlarged a little, so that the triangles on their faces are kept
+    Vector h = halfSize * 1.001f;
+
+    for (int i = 0; i < NUM_AXES; i++)
+    {
+        const Vector &axis = axes[i];
+        float pa = axis.dot(a);
+        float pb = axis.dot(b);
+        float pc = axis.dot(c);
+        float r = h.x * fabs(axis.x) + h.y * fabs(axis.y) + h.z * fabs(axis.z);
+
+        ax[i] = axis.x;
+        ay[i] = axis.y;
+        az[i] = axis.z;
+        lower[i] = std::min(std::min(pa, pb), pc) - r;
+        upper[i] = std::max(std::max(pa, pb), pc) + r;
+    }
+}
+
 // Utils used by intersectWithGrid()
 float getMin(const std::vector<Point> &points, Vector axis)
 {
@@ -198,7 +239,7 @@ bool Triangle::intersectWithGrid(const Grid &grid)
     return true;
 }
 
-void Triangle::getBoundingBox(Point &min, Point &max)
+bool Triangle::getBoundingBox(Point &min, Point &max)
 {
     float min_x = FLT_MAX, min_y = FLT_MAX, min_z = FLT_MAX;
     float max_x = -FLT_MAX, max_y = -FLT_MAX, max_z = -FLT_MAX; 
@@ -234,4 +275,5 @@ void Triangle::getBoundingBox(Point &min, Point &max)
     max.x = max_x;
     max.y = max_y;
     max.z = max_z;
+    return true;
 }
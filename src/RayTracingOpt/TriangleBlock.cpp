@@ -0,0 +1,143 @@
+#include "TriangleBlock.h"
+#include <float.h>
+#include <math.h>
+
+#ifdef TRIANGLE_BLOCK_SSE
+#include <xmmintrin.h>
+#endif
+
+TriangleBlock::TriangleBlock()
+{
+    // The unused lanes are degenerate triangles (e1 = e2 = 0), which are never hit
+    for (int i = 0; i < SIZE; i++)
+    {
+        ax[i] = ay[i] = az[i] = 0;
+        e1x[i] = e1y[i] = e1z[i] = 0;
+        e2x[i] = e2y[i] = e2z[i] = 0;
+        ids[i] = -1;
+    }
+}
+
+void TriangleBlock::set(int lane, int id, const TriangleRecord &record)
+{
+    ax[lane] = record.a.x;
+    ay[lane] = record.a.y;
+    az[lane] = record.a.z;
+    e1x[lane] = record.e1.x;
+    e1y[lane] = record.e1.y;
+    e1z[lane] = record.e1.z;
+    e2x[lane] = record.e2.x;
+    e2y[lane] = record.e2.y;
+    e2z[lane] = record.e2.z;
+    ids[lane] = id;
+}
+
+TriangleRecord TriangleBlock::getRecord(int lane) const
+{
+    TriangleRecord record;
+    record.a = Point(ax[lane], ay[lane], az[lane]);
+    record.e1 = Vector(e1x[lane], e1y[lane], e1z[lane]);
+    record.e2 = Vector(e2x[lane], e2y[lane], e2z[lane]);
+    return record;
+}
+
+#ifdef TRIANGLE_BLOCK_SSE
+
+// The same Moller-Trumbore test as TriangleRecord::intersect(), with the operations in the same
+// order, so that both return exactly the same signed distances
+int TriangleBlock::intersect(const Ray &ray, float tMin, float &tMax) const
+{
+    const __m128 dx = _mm_set1_ps(ray.direction.x);
+    const __m128 dy = _mm_set1_ps(ray.direction.y);
+    const __m128 dz = _mm_set1_ps(ray.direction.z);
+
+    const __m128 e1X = _mm_loadu_ps(e1x);
+    const __m128 e1Y = _mm_loadu_ps(e1y);
+    const __m128 e1Z = _mm_loadu_ps(e1z);
+    const __m128 e2X = _mm_loadu_ps(e2x);
+    const __m128 e2Y = _mm_loadu_ps(e2y);
+    const __m128 e2Z = _mm_loadu_ps(e2z);
+
+    // P = DIR x E2
+    __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2Z), _mm_mul_ps(dz, e2Y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2X), _mm_mul_ps(dx, e2Z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2Y), _mm_mul_ps(dy, e2X));
+
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1X, px), _mm_mul_ps(e1Y, py)), _mm_mul_ps(e1Z, pz));
+    __m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+    __m128 mask = _mm_cmpge_ps(absDet, _mm_set1_ps(1e-10f));
+    __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+    // T = O - A
+    __m128 tx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_loadu_ps(ax));
+    __m128 ty = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_loadu_ps(ay));
+    __m128 tz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_loadu_ps(az));
+
+    __m128 beta = _mm_mul_ps(_mm_add_ps(_mm_add_ps(
+        _mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+
+    // Q = T x E1
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1Z), _mm_mul_ps(tz, e1Y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1X), _mm_mul_ps(tx, e1Z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1Y), _mm_mul_ps(ty, e1X));
+
+    __m128 gamma = _mm_mul_ps(_mm_add_ps(_mm_add_ps(
+        _mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+    __m128 alpha = _mm_sub_ps(_mm_sub_ps(_mm_set1_ps(1.0f), beta), gamma);
+
+    __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(
+        _mm_mul_ps(e2X, qx), _mm_mul_ps(e2Y, qy)), _mm_mul_ps(e2Z, qz)), invDet);
+
+    // The same tolerances as the scalar test, to avoid leaks
+    const __m128 lower = _mm_set1_ps(-0.0001f);
+    const __m128 upper = _mm_set1_ps(1.0001f);
+    mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(beta, lower), _mm_cmple_ps(beta, upper)));
+    mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(gamma, lower), _mm_cmple_ps(gamma, upper)));
+    mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(alpha, lower), _mm_cmple_ps(alpha, upper)));
+    mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(t, _mm_set1_ps(tMin)), _mm_cmplt_ps(t, _mm_set1_ps(tMax))));
+
+    int hits = _mm_movemask_ps(mask);
+    if (hits == 0)
+    {
+        return -1;
+    }
+
+    // The nearest hit, the first lane wins a tie like the scalar loops
+    float distances[SIZE];
+    _mm_storeu_ps(distances, t);
+
+    int lane = -1;
+    for (int i = 0; i < SIZE; i++)
+    {
+        if ((hits & (1 << i)) && distances[i] < tMax)
+        {
+            tMax = distances[i];
+            lane = i;
+        }
+    }
+    return lane;
+}
+
+#else
+
+int TriangleBlock::intersect(const Ray &ray, float tMin, float &tMax) const
+{
+    Ray clipped = ray;
+    clipped.tMin = tMin;
+    clipped.tMax = tMax;
+
+    int lane = -1;
+    for (int i = 0; i < SIZE && ids[i] >= 0; i++)
+    {
+        float distance;
+        if (getRecord(i).intersect(clipped, distance) && distance < tMax)
+        {
+            tMax = distance;
+            clipped.tMax = distance;
+            lane = i;
+        }
+    }
+    return lane;
+}
+
+#endif
@@ -1,21 +1,32 @@
 #include "Tunnel.h"
-#include "Matrix.h"
 #include "Utils.h"
 #include "Grid.h"
 #include <queue>
 #include <map>
+#include <malloc.h>
 #include <algorithm>
+#include <limits.h>
+#include <omp.h> // OpenMP
+
+const float Tunnel::KT = 1.0f;
+const float Tunnel::KI = 1.5f;
+const float Tunnel::GRID_TOP_DENSITY = 0.03125f;
+const float Tunnel::GRID_SUB_DENSITY = 2.0f;
 
 Tunnel::Tunnel()
 {
-    root = NULL;
+    frames = NULL;
+    triangles = NULL;
+    procedural = false;
+    gridResolution = 400;
+    blocksPerSegment = 0;
 }
 
 Tunnel::~Tunnel()
 {
-    if (root != NULL)
+    if (frames != NULL)
     {
-        deleteTree(root);
+        _aligned_free(frames);
     }
 
     for (unsigned int i = 0; i < surface.size(); i++)
@@ -29,19 +40,19 @@ Tunnel::~Tunnel()
 
 bool Tunnel::intersectWithPolygon(Ray &ray, int index, Point &origin, Vector &dir, float &distance)
 {
-    Point p = path[index];
-    Vector n = nvs[index];
+    const NodeFrame &f = frames[index];
+    const Point &o = ray.origin;
+    const Vector &d = ray.direction;
 
     // By transformaton and rotation, map (ray, p, n) to (ray', (0, 0, 0), (0, 0, -1))
-    // See http://en.wikipedia.org/wiki/Rotation_matrix
-    float theta = PI - atan2(n.x, n.z);
-    Matrix matrix(
-        cos(theta), 0, sin(theta),
-        0,          1, 0,
-       -sin(theta), 0, cos(theta));
-    Vector offset = Vector(p, Point(0, 0, 0));
-    Point newOrigin = matrix * (ray.origin + offset);
-    Vector newDir = matrix * ray.direction;
+    Point newOrigin(
+        f.cosTheta * o.x + f.sinTheta * o.z + f.tx,
+        o.y + f.ty,
+       -f.sinTheta * o.x + f.cosTheta * o.z + f.tz);
+    Vector newDir(
+        f.cosTheta * d.x + f.sinTheta * d.z,
+        d.y,
+       -f.sinTheta * d.x + f.cosTheta * d.z);
 
     bool intersect = intersectWithPolygonAtOrigin(Ray(newOrigin, newDir), distance);
     if (!intersect) // with polygon, but intersect with wall
@@ -115,7 +126,12 @@ bool Tunnel::inPolygon(const Point &p)
 
 void Tunnel::init()
 {
-    if (algorithm == RegularGrid || algorithm == FlatGrid)
+    if (!procedural)
+    {
+        initRecords();
+    }
+
+    if (algorithm == RegularGrid || algorithm == FlatGrid || algorithm == HierarchicalGrid)
     {
         initGrid();
     }
@@ -127,11 +143,33 @@ void Tunnel::init()
     {
         initConvex();
     }
+    else if (algorithm == Bvh)
+    {
+        initBvh();
+    }
     // else: nothing to do
 
     Utils::PrintTickCount("Initialization Finished");
 }
 
+void Tunnel::initRecords()
+{
+    // Precompute the triangles in the form used by the ray-triangle test, shared by
+    // all the algorithms. A procedural surface rebuilds them on the fly instead.
+    int n = 2 * crossSection.vertices.size();
+    records.clear();
+    records.resize(getSegmentCount() * n);
+
+    for (int segment = 0; segment < getSegmentCount(); segment++)
+    {
+        for (int i = 0; i < getTriangleCount(segment); i++)
+        {
+            const Triangle *t = surface[segment][i];
+            records[getTriangleId(segment, i)] = TriangleRecord(t->a, t->b, t->c);
+        }
+    }
+}
+
 void Tunnel::initConvex()
 {
     Utils::PrintTickCount("Initialize Normal Vectors");
@@ -149,6 +187,48 @@ void Tunnel::initConvex()
         }
     }
 
+    // Initialize node frames
+    // See http://en.wikipedia.org/wiki/Rotation_matrix
+    Utils::PrintTickCount("Initialize Node Frames");
+
+    frames = (NodeFrame *)_aligned_malloc(path.size() * sizeof(NodeFrame), 64);
+    for (unsigned int i = 0; i < path.size(); i++)
+    {
+        const Point &p = path[i];
+        const Vector &n = nvs[i];
+
+        float theta = PI - atan2(n.x, n.z);
+        float c = cos(theta);
+        float s = sin(theta);
+
+        NodeFrame &f = frames[i];
+        f.cosTheta = c;
+        f.sinTheta = s;
+        f.tx = -(c * p.x + s * p.z);
+        f.ty = -p.y;
+        f.tz = s * p.x - c * p.z;
+        f.reserved[0] = f.reserved[1] = f.reserved[2] = 0.0f;
+    }
+
+    // Pack the triangles of each segment into blocks
+    blocksPerSegment = TriangleBlock::numBlocks(2 * crossSection.vertices.size());
+    if (!procedural)
+    {
+        int numSegments = getSegmentCount();
+        wallBlocks.resize(numSegments * blocksPerSegment);
+
+        #pragma omp parallel for // Enable OpenMP
+        for (int i = 0; i < numSegments; i++)
+        {
+            for (int j = 0; j < getTriangleCount(i); j++)
+            {
+                int id = getTriangleId(i, j);
+                wallBlocks[i * blocksPerSegment + j / TriangleBlock::SIZE].set(
+                    j % TriangleBlock::SIZE, id, getTriangleRecord(id));
+            }
+        }
+    }
+
     // Initialize edge params
     //
     // Given P1(x1, y1), P2(x2, y2) and TARGET(x, y)
@@ -331,12 +411,17 @@ void Tunnel::initConvex()
                     mapping.insert(std::multimap<float, int>::value_type(delta, i));
                 }
 
+                // The blocks are tested in the order of their first edge in the mapping
+                std::vector<char> added(blocksPerSegment, 0);
                 std::multimap<float, int>::iterator it;
                 for (it = mapping.begin(); it != mapping.end(); ++it)
                 {
-                    int index = it->second;
-                    intersectionTableYAxis[y][iAngle].push_back(index * 2);
-                    intersectionTableYAxis[y][iAngle].push_back(index * 2 + 1);
+                    int block = it->second * 2 / TriangleBlock::SIZE;
+                    if (!added[block])
+                    {
+                        added[block] = 1;
+                        intersectionTableYAxis[y][iAngle].push_back(block);
+                    }
                 }
             }
         }
@@ -351,13 +436,14 @@ void Tunnel::initGrid()
     float min_x = FLT_MAX, min_y = FLT_MAX, min_z = FLT_MAX;
     float max_x = -FLT_MAX, max_y = -FLT_MAX, max_z = -FLT_MAX;
 
-    for (unsigned int i = 0; i < surface.size(); i++)
+    Triangle t;
+    for (int i = 0; i < getSegmentCount(); i++)
     {
-        for (unsigned int j = 0; j < surface[i].size(); j++)
+        for (int j = 0; j < getTriangleCount(i); j++)
         {
             Point min, max;
-            Triangle *t = surface[i][j];
-            t->getBoundingBox(min, max);
+            getTriangle(getTriangleId(i, j), t);
+            t.getBoundingBox(min, max);
 
             min_x = std::min(min_x, min.x);
             min_y = std::min(min_y, min.y);
@@ -373,12 +459,25 @@ void Tunnel::initGrid()
     float height = max_y - min_y;
     float depth = max_z - min_z;
 
-    if (algorithm == RegularGrid)
+    if (algorithm == RegularGrid || algorithm == HierarchicalGrid)
     {
         float maxLength = std::max(std::max(width, height), depth);
+        float size;
+
+        if (algorithm == RegularGrid)
+        {
+            // Cut the longest dimension into gridResolution pieces
+            size = maxLength / (gridResolution - 1);
+        }
+        else
+        {
+            // Cubic cells, about GRID_TOP_DENSITY for each triangle
+            int numTriangles = getTriangleId(getSegmentCount(), 0);
+            float volume = std::max(width, maxLength / 1024) * std::max(height, maxLength / 1024) *
+                std::max(depth, maxLength / 1024);
+            size = pow(volume / (GRID_TOP_DENSITY * numTriangles), 1.0f / 3);
+        }
 
-        // Cut the longest dimension into 400 pieces
-        float size = maxLength / 399;
         grid.origin = Point(min_x - size / 2, min_y - size / 2, min_z - size / 2);
         grid.cellSizeX = size;
         grid.cellSizeY = size;
@@ -386,100 +485,266 @@ void Tunnel::initGrid()
         grid.xLength = (int)(width / grid.cellSizeX + 1.5f);
         grid.yLength = (int)(height / grid.cellSizeY + 1.5f);
         grid.zLength = (int)(depth / grid.cellSizeZ + 1.5f);
-        grid.data.clear();
-        grid.data.resize(grid.xLength * grid.yLength * grid.zLength);
     }
     else // FlatGrid
     {
-        // Cut each dimension into 400 pieces
-        grid.cellSizeX = width / 399;
-        grid.cellSizeY = height / 399;
-        grid.cellSizeZ = depth / 399;
+        // Cut each dimension into gridResolution pieces
+        grid.cellSizeX = width / (gridResolution - 1);
+        grid.cellSizeY = height / (gridResolution - 1);
+        grid.cellSizeZ = depth / (gridResolution - 1);
         grid.origin = Point(
             min_x - grid.cellSizeX / 2, 
             min_y - grid.cellSizeY / 2,
             min_z - grid.cellSizeZ / 2);
-        grid.xLength = 400;
-        grid.yLength = 400;
-        grid.zLength = 400;
-        grid.data.clear();
-        grid.data.resize(grid.xLength * grid.yLength * grid.zLength);
+        grid.xLength = gridResolution;
+        grid.yLength = gridResolution;
+        grid.zLength = gridResolution;
     }
 
     Utils::DbgPrint("Grid Size: %d x %d x %d\n", grid.xLength, grid.yLength, grid.zLength);
 
-    // For each triangle
-    for (unsigned int m = 0; m < surface.size(); m++)
+    // 2. Get the cells overlapped by the bounding box of each triangle
+    std::vector<CellBox> boxes;
+    for (int m = 0; m < getSegmentCount(); m++)
     {
-        for (unsigned int n = 0; n < surface[m].size(); n++)
+        for (int n = 0; n < getTriangleCount(m); n++)
         {
-            Triangle *t = surface[m][n];
-            Point min, max;
-            t->getBoundingBox(min, max);
+            CellBox box;
+            box.id = getTriangleId(m, n);
+            boxes.push_back(box);
+        }
+    }
+
+    #pragma omp parallel for // OpenMP
+
+    for (int b = 0; b < (int)boxes.size(); b++)
+    {
+        Triangle t;
+        Point min, max;
+        getTriangle(boxes[b].id, t);
+        t.getBoundingBox(min, max);
+
+        CellBox &box = boxes[b];
+        box.xBegin = std::max((int)((min.x - grid.origin.x) / grid.cellSizeX), 0);
+        box.yBegin = std::max((int)((min.y - grid.origin.y) / grid.cellSizeY), 0);
+        box.zBegin = std::max((int)((min.z - grid.origin.z) / grid.cellSizeZ), 0);
+        box.xEnd = std::min((int)((max.x - grid.origin.x) / grid.cellSizeX), grid.xLength - 1);
+        box.yEnd = std::min((int)((max.y - grid.origin.y) / grid.cellSizeY), grid.yLength - 1);
+        box.zEnd = std::min((int)((max.z - grid.origin.z) / grid.cellSizeZ), grid.zLength - 1);
+    }
+
+    // 3. Test the cells in each bounding box against the triangle, so that a triangle is only
+    //    added to the cells it overlaps, which makes the traversal about 20% faster
+    int numFlags = 0;
+    for (unsigned int b = 0; b < boxes.size(); b++)
+    {
+        boxes[b].firstFlag = numFlags;
+        numFlags += boxes[b].getCellCount();
+    }
+    std::vector<char> flags(numFlags);
+    Vector halfSize(grid.cellSizeX / 2, grid.cellSizeY / 2, grid.cellSizeZ / 2);
 
-            int x_begin = (int)((min.x - grid.origin.x) / grid.cellSizeX);
-            int y_begin = (int)((min.y - grid.origin.y) / grid.cellSizeY);
-            int z_begin = (int)((min.z - grid.origin.z) / grid.cellSizeZ);
+    #pragma omp parallel for // OpenMP
 
-            int x_end = (int)((max.x - grid.origin.x) / grid.cellSizeX);
-            int y_end = (int)((max.y - grid.origin.y) / grid.cellSizeY);
-            int z_end = (int)((max.z - grid.origin.z) / grid.cellSizeZ);
+    for (int b = 0; b < (int)boxes.size(); b++)
+    {
+        const CellBox &box = boxes[b];
+        Triangle t;
+        getTriangle(box.id, t);
+        TriangleBoxTest test(t.a, t.b, t.c, halfSize);
 
-            // Traverse the grid
-            for (int i = x_begin; i <= x_end; i++)
+        int flag = box.firstFlag;
+        for (int i = box.xBegin; i <= box.xEnd; i++)
+        {
+            for (int j = box.yBegin; j <= box.yEnd; j++)
             {
-                for (int j = y_begin; j <= y_end; j++)
+                for (int k = box.zBegin; k <= box.zEnd; k++)
                 {
-                    for (int k = z_begin; k <= z_end; k++)
-                    {
-#if 0
-                        Grid cell(grid.origin + Vector(i * size, j * size, k * size), Vector(size, size, size));
-                        if (t->intersectWithGrid(cell))
-                        {
-                            grid.get(i, j, k).push_back(t);
-                        }
-#else
-                        // Use a simple way to construct the grid, which is about 8 times faster.
-                        // However, grid traversing is 20% slower
-                        grid.get(i, j, k).push_back(t);
-#endif
-                    }
+                    Point center = grid.origin + Vector(
+                        (i + 0.5f) * grid.cellSizeX, 
+                        (j + 0.5f) * grid.cellSizeY, 
+                        (k + 0.5f) * grid.cellSizeZ);
+                    flags[flag++] = test.overlaps(center);
                 }
             }
         }
     }
 
-#if 0 // Debug output
+    // 4. Build the triangle lists of the cells
+    grid.cells.build(grid.xLength, grid.yLength, grid.zLength, boxes, flags);
+
+    Utils::DbgPrint("Non-empty Cells: %d (%.1f MB)\n", 
+        grid.cells.getNonEmptyCount(), grid.cells.getMemorySize() / (1024 * 1024));
+
+    // 5. Cut the non-empty cells into sub-grids
+    if (algorithm == HierarchicalGrid)
+    {
+        initSubGrids();
+    }
+}
+
+void Tunnel::initSubGrids()
+{
+    int numSubGrids = grid.cells.getNonEmptyCount();
+    hgrid.subGrids.resize(numSubGrids);
+
+    // Size the sub-grids by the number of triangles in the top cells
+    int numCells = 0;
     for (int i = 0; i < grid.xLength; i++)
     {
         for (int j = 0; j < grid.yLength; j++)
         {
-            Utils::DbgPrint("\n[%d, %d]", i, j);
             for (int k = 0; k < grid.zLength; k++)
             {
-                Utils::DbgPrint(" %d", grid.get(i, j, k).size());
+                int index = grid.cells.getIndex(i, j, k);
+                if (index < 0)
+                    continue;
+
+                const int *list;
+                int count = grid.cells.getList(index, list);
+                int length = (int)ceil(pow(GRID_SUB_DENSITY * count, 1.0f / 3));
+                length = std::min(std::max(length, 1), (int)GRID_MAX_SUB_RESOLUTION);
+
+                SubGrid &sub = hgrid.subGrids[index];
+                sub.origin = grid.origin + Vector(
+                    i * grid.cellSizeX, 
+                    j * grid.cellSizeY, 
+                    k * grid.cellSizeZ);
+                sub.cellSize = grid.cellSizeX / length;
+                sub.length = length;
+                sub.firstCell = numCells;
+                numCells += length * length * length;
+            }
+        }
+    }
+
+    // Bin the triangles of each top cell with two passes like GridCells::build(), but each
+    // sub-grid is handled by one thread. The overlaps are tested again in the second pass
+    // instead of keeping the flags, as a top cell holds few triangles.
+    hgrid.offsets.assign(numCells + 1, 0);
+
+    #pragma omp parallel for schedule(dynamic, 16) // OpenMP
+
+    for (int s = 0; s < numSubGrids; s++)
+    {
+        const SubGrid &sub = hgrid.subGrids[s];
+        Vector halfSize(sub.cellSize / 2, sub.cellSize / 2, sub.cellSize / 2);
+        const int *list;
+        int count = grid.cells.getList(s, list);
+
+        for (int n = 0; n < count; n++)
+        {
+            Triangle t;
+            CellBox box;
+            getTriangle(list[n], t);
+            getSubGridBox(sub, t, box);
+            TriangleBoxTest test(t.a, t.b, t.c, halfSize);
+
+            for (int i = box.xBegin; i <= box.xEnd; i++)
+            {
+                for (int j = box.yBegin; j <= box.yEnd; j++)
+                {
+                    for (int k = box.zBegin; k <= box.zEnd; k++)
+                    {
+                        Point center = sub.origin + Vector(
+                            (i + 0.5f) * sub.cellSize, 
+                            (j + 0.5f) * sub.cellSize, 
+                            (k + 0.5f) * sub.cellSize);
+                        if (test.overlaps(center))
+                            hgrid.offsets[sub.firstCell + (i * sub.length + j) * sub.length + k + 1]++;
+                    }
+                }
             }
         }
     }
-#endif
+
+    for (int c = 0; c < numCells; c++)
+    {
+        hgrid.offsets[c + 1] += hgrid.offsets[c];
+    }
+    hgrid.ids.resize(hgrid.offsets[numCells]);
+
+    #pragma omp parallel for schedule(dynamic, 16) // OpenMP
+
+    for (int s = 0; s < numSubGrids; s++)
+    {
+        const SubGrid &sub = hgrid.subGrids[s];
+        Vector halfSize(sub.cellSize / 2, sub.cellSize / 2, sub.cellSize / 2);
+        const int *list;
+        int count = grid.cells.getList(s, list);
+        int numSubCells = sub.length * sub.length * sub.length;
+        std::vector<int> cursors(hgrid.offsets.begin() + sub.firstCell, 
+            hgrid.offsets.begin() + sub.firstCell + numSubCells);
+
+        for (int n = 0; n < count; n++)
+        {
+            Triangle t;
+            CellBox box;
+            getTriangle(list[n], t);
+            getSubGridBox(sub, t, box);
+            TriangleBoxTest test(t.a, t.b, t.c, halfSize);
+
+            for (int i = box.xBegin; i <= box.xEnd; i++)
+            {
+                for (int j = box.yBegin; j <= box.yEnd; j++)
+                {
+                    for (int k = box.zBegin; k <= box.zEnd; k++)
+                    {
+                        Point center = sub.origin + Vector(
+                            (i + 0.5f) * sub.cellSize, 
+                            (j + 0.5f) * sub.cellSize, 
+                            (k + 0.5f) * sub.cellSize);
+                        if (test.overlaps(center))
+                            hgrid.ids[cursors[(i * sub.length + j) * sub.length + k]++] = list[n];
+                    }
+                }
+            }
+        }
+    }
+
+    double memory = hgrid.subGrids.size() * sizeof(SubGrid) + 
+        (hgrid.offsets.size() + hgrid.ids.size()) * sizeof(int);
+    Utils::DbgPrint("Sub-grids: %d, Sub-grid Cells: %d (%.1f MB)\n", 
+        numSubGrids, numCells, memory / (1024 * 1024));
+}
+
+void Tunnel::getSubGridBox(const SubGrid &sub, Triangle &t, CellBox &box)
+{
+    Point min, max;
+    t.getBoundingBox(min, max);
+
+    box.xBegin = std::max((int)((min.x - sub.origin.x) / sub.cellSize), 0);
+    box.yBegin = std::max((int)((min.y - sub.origin.y) / sub.cellSize), 0);
+    box.zBegin = std::max((int)((min.z - sub.origin.z) / sub.cellSize), 0);
+    box.xEnd = std::min((int)((max.x - sub.origin.x) / sub.cellSize), sub.length - 1);
+    box.yEnd = std::min((int)((max.y - sub.origin.y) / sub.cellSize), sub.length - 1);
+    box.zEnd = std::min((int)((max.z - sub.origin.z) / sub.cellSize), sub.length - 1);
+}
+
+bool cmpKdEvent(const Tunnel::KdEvent a, const Tunnel::KdEvent b)
+{
+    return (a.position < b.position) || 
+        ((a.position == b.position) && (int)a.type < (int)b.type);
 }
 
 void Tunnel::initKdTree()
 {
     Utils::PrintTickCount("Initialize k-d tree");
 
-    root = new KdNode();
-
     // Initialize the geometry list
+    int numIds = getTriangleId(getSegmentCount(), 0);
+    std::vector<Triangle> buffer(numIds);
     std::vector<Triangle *> list;
-    list.reserve(surface.size() * surface[0].size());
+    list.reserve(numIds);
+    triangles = &buffer[0];
 
-    for (unsigned int i = 0; i < surface.size(); i++)
+    for (int i = 0; i < getSegmentCount(); i++)
     {
-        for (unsigned int j = 0; j < surface[i].size(); j++)
+        for (int j = 0; j < getTriangleCount(i); j++)
         {
-            // Only triangles are supported temporarily
-            list.push_back((Triangle *)surface[i][j]);
+            int id = getTriangleId(i, j);
+            getTriangle(id, triangles[id]);
+            list.push_back(&triangles[id]);
         }
     }
 
@@ -487,31 +752,113 @@ void Tunnel::initKdTree()
     float min_x = FLT_MAX, min_y = FLT_MAX, min_z = FLT_MAX;
     float max_x = -FLT_MAX, max_y = -FLT_MAX, max_z = -FLT_MAX;
 
-    for (unsigned int i = 0; i < surface.size(); i++)
+    for (unsigned int i = 0; i < list.size(); i++)
     {
-        for (unsigned int j = 0; j < surface[i].size(); j++)
+        Point min, max;
+        list[i]->getBoundingBox(min, max);
+
+        min_x = std::min(min_x, min.x);
+        min_y = std::min(min_y, min.y);
+        min_z = std::min(min_z, min.z);
+
+        max_x = std::max(max_x, max.x);
+        max_y = std::max(max_y, max.y);
+        max_z = std::max(max_z, max.z);
+    }
+
+    kdMin = Point(min_x, min_y, min_z);
+    kdMax = Point(max_x, max_y, max_z);
+
+    // Build the top of the tree
+    int numThreads = omp_get_max_threads();
+    std::vector<KdBuildJob *> jobs;
+    std::vector<char> sides;
+    KdBuildContext top;
+    top.jobs = (numThreads > 1) ? &jobs : NULL; // build serially with a single thread
+    top.jobCutoff = std::max(4096, numIds / (8 * numThreads)); // 8 jobs per thread or more
+
+    if (algorithm == KdTreeSAH)
+    {
+        std::vector<KdEvent> events[3];
+        for (unsigned int i = 0; i < list.size(); i++)
         {
             Point min, max;
-            Triangle *t = surface[i][j];
-            t->getBoundingBox(min, max);
+            list[i]->getBoundingBox(min, max);
+            addEvents(list[i] - triangles, min, max, events);
+        }
 
-            min_x = std::min(min_x, min.x);
-            min_y = std::min(min_y, min.y);
-            min_z = std::min(min_z, min.z);
+        #pragma omp parallel for
+        for (int axis = 0; axis < 3; axis++)
+        {
+            std::sort(events[axis].begin(), events[axis].end(), cmpKdEvent);
+        }
 
-            max_x = std::max(max_x, max.x);
-            max_y = std::max(max_y, max.y);
-            max_z = std::max(max_z, max.z);
+        sides.resize(numIds);
+        top.sides = &sides;
+        buildKdTreeSAH(top, kdMin, kdMax, events, 0);
+    }
+    else
+    {
+        buildKdTree(top, kdMin, kdMax, list, 0);
+    }
+
+    // Build the subtrees in parallel
+    std::vector<std::vector<char>> threadSides(numThreads);
+
+    #pragma omp parallel for schedule(dynamic, 1) // Enable OpenMP
+    for (int i = 0; i < (int)jobs.size(); i++)
+    {
+        KdBuildJob *job = jobs[i];
+        if (algorithm == KdTreeSAH)
+        {
+            std::vector<char> &sides = threadSides[omp_get_thread_num()];
+            sides.resize(numIds);
+            job->context.sides = &sides;
+            buildKdTreeSAH(job->context, job->min, job->max, job->events, job->depth);
+        }
+        else
+        {
+            buildKdTree(job->context, job->min, job->max, job->list, job->depth);
         }
     }
 
-    root->min = Point(min_x, min_y, min_z);
-    root->max = Point(max_x, max_y, max_z);
+    // Merge the subtrees into the flattened tree
+    mergeKdTree(top, 0, jobs);
+
+    // The triangles of each leaf are packed into blocks of four triangles, and the offset of
+    // a leaf is then the index of its first block
+    kdBlocks.clear();
+    for (unsigned int i = 0; i < nodes.size(); i++)
+    {
+        if (nodes[i].axis() == NoAxis)
+        {
+            int begin = nodes[i].offset;
+            int count = nodes[i].numTriangles();
+            nodes[i].offset = kdBlocks.size();
+            kdBlocks.resize(kdBlocks.size() + TriangleBlock::numBlocks(count));
+
+            for (int j = 0; j < count; j++)
+            {
+                int id = triangleIds[begin + j];
+                kdBlocks[nodes[i].offset + j / TriangleBlock::SIZE].set(
+                    j % TriangleBlock::SIZE, id, getTriangleRecord(id));
+            }
+        }
+    }
+    std::vector<int>().swap(triangleIds);
 
-    // Build the tree
-    int leaves = 0;
-    int leafElements = 0;
-    buildKdTree(root, list, 0, leaves, leafElements);
+    int leaves = top.numLeaves;
+    int leafElements = top.leafElements;
+    for (unsigned int i = 0; i < jobs.size(); i++)
+    {
+        leaves += jobs[i]->context.numLeaves;
+        leafElements += jobs[i]->context.leafElements;
+        delete jobs[i];
+    }
+    triangles = NULL;
+    Utils::DbgPrint("Total nodes: %d (%d KB)\r\n", nodes.size(), nodes.size() * sizeof(KdNode) / 1024);
+    Utils::DbgPrint("Total kdBlocks: %d (%d KB)\r\n", kdBlocks.size(), kdBlocks.size() * sizeof(TriangleBlock) / 1024);
+    Utils::DbgPrint("Total jobs: %d\r\n", jobs.size());
     Utils::DbgPrint("Total leaves: %d\r\n", leaves);
     Utils::DbgPrint("Average Leaf Size: %d\r\n", leafElements / leaves);
 }
@@ -543,10 +890,15 @@ bool cmpTriangleZAxis(const Triangle *t1, const Triangle *t2)
     return z1 < z2;
 }
 
-void Tunnel::buildKdTree(KdNode *node, std::vector<Triangle *> &list, int depth, int &numLeaves, int &leafElements)
+void Tunnel::buildKdTree(KdBuildContext &context, const Point &min, const Point &max, 
+                         std::vector<Triangle *> &list, int depth)
 {
 #define DUMP_TREE 0
 
+    // The node is appended to the array before its subtrees
+    int index = context.nodes.size();
+    context.nodes.push_back(KdNode());
+
     if (list.size() <= 8 || depth > 18) // This should be leaf node
     {
 #if DUMP_TREE
@@ -557,47 +909,33 @@ void Tunnel::buildKdTree(KdNode *node, std::vector<Triangle *> &list, int depth,
         }
         Utils::SysDbgPrint("Leaf (%d)\n", list.size());
 #endif
-        node->axis = NoAxis;
-        node->splitPlane = 0.0f; // whatever
-        node->left = NULL;
-        node->right = NULL;
-        node->list.assign(list.begin(), list.end());
-        numLeaves += 1;
-        leafElements += list.size();
+        initLeaf(context, index, list);
         return;
     }
 
-    // Split the triangle list
-    int axis;
-    float median;
-
-    if (algorithm == KdTreeStandard)
+    // Leave the subtree to a job when the tree is built in parallel
+    if (context.jobs != NULL && list.size() <= context.jobCutoff)
     {
-        // Select axis based on depth so that axis cycles through all valid values
-        // use order x -> y -> z -> x ...
-        axis = depth % 3;
-        median = split(node, axis, list); // the list may be sorted in split(), 
-                                          // but no element would be deleted
-    }
-    else // KdTreeSAH
-    {
-        median = splitSAH(node, list, axis);
+        KdBuildJob *job = addJob(context, index, min, max, depth);
+        job->list.swap(list);
+        return;
     }
 
-    // Create node and construct subtrees
-    node->axis = (Axes)axis;
-    node->splitPlane = median;
-    node->left = new KdNode();
-    node->right = new KdNode();
-    // node->list remains empty
+    // Split the triangle list
+    // Select axis based on depth so that axis cycles through all valid values
+    // use order x -> y -> z -> x ...
+    int axis = depth % 3;
+    float median = split(axis, list); // the list may be sorted in split(), 
+                                      // but no element would be deleted
 
-    node->left->min = node->min;
-    node->left->max = node->max;
-    node->right->min = node->min;
-    node->right->max = node->max;
+    // Create node and construct subtrees
+    context.nodes[index].splitPlane = median;
+    context.nodes[index].flags = axis; // the right child is set when the left subtree is built
 
-    node->left->max[axis] = median;
-    node->right->min[axis] = median;
+    Point leftMax = max;
+    Point rightMin = min;
+    leftMax[axis] = median;
+    rightMin[axis] = median;
 
 #if DUMP_TREE
     Utils::SysDbgPrint("%02d ", depth);
@@ -633,20 +971,24 @@ void Tunnel::buildKdTree(KdNode *node, std::vector<Triangle *> &list, int depth,
         }
     }
 
-    buildKdTree(node->left, leftPart, depth + 1, numLeaves, leafElements);
-    buildKdTree(node->right, rightPart, depth + 1, numLeaves, leafElements);
+    buildKdTree(context, min, leftMax, leftPart, depth + 1);
+    context.nodes[index].flags |= (unsigned int)context.nodes.size() << 2;
+    buildKdTree(context, rightMin, max, rightPart, depth + 1);
 }
 
-void Tunnel::deleteTree(KdNode *node)
+void Tunnel::initLeaf(KdBuildContext &context, int index, std::vector<Triangle *> &list)
 {
-    if (node->left != NULL)
-        deleteTree(node->left);
-    if (node->right != NULL)
-        deleteTree(node->right);
-    delete node;
+    context.nodes[index].offset = (int)context.triangleIds.size();
+    context.nodes[index].flags = ((unsigned int)list.size() << 2) | NoAxis;
+    for (unsigned int i = 0; i < list.size(); i++)
+    {
+        context.triangleIds.push_back(list[i] - triangles);
+    }
+    context.numLeaves += 1;
+    context.leafElements += list.size();
 }
 
-float Tunnel::split(KdNode *node, int axis, std::vector<Triangle *> &list)
+float Tunnel::split(int axis, std::vector<Triangle *> &list)
 {
     // simple split: sort the triangle by barycenter, and select the mid value in the sorted list
     if (axis == XAxis)
@@ -668,642 +1010,1813 @@ float Tunnel::split(KdNode *node, int axis, std::vector<Triangle *> &list)
     return median;
 }
 
-float Tunnel::splitSAH(KdNode *node, std::vector<Triangle *> &list, int &bestAxis)
+void Tunnel::addEvents(int id, const Point &min, const Point &max, std::vector<KdEvent> events[3])
 {
-    float minSAH = FLT_MAX;
-    float minSplitValue;
-
     for (int axis = 0; axis < 3; axis++)
     {
-        // Make a list of possible split values
-        const int N = 100;
-        std::vector<float> possibleValues; // Select not more than (N = 100) values
-
-#if 1
-        // Use a simple way to select possible values
-        for (int i = 1; i < N; i++)
-        {
-            possibleValues.push_back(
-                node->min[axis] + (node->max[axis] - node->min[axis]) * i / N);
-        }
-#else
-        // Here's a more complex way:
-        if (list.size() <= N)
+        if (min[axis] == max[axis])
         {
-            for (unsigned int i = 0; i < list.size(); i++)
-            {
-                float min = std::min(std::min(list[i]->a[axis], list[i]->b[axis]), list[i]->c[axis]);
-                float max = std::max(std::max(list[i]->a[axis], list[i]->b[axis]), list[i]->c[axis]);
-                possibleValues.push_back(min);
-                possibleValues.push_back(max);
-            }
+            events[axis].push_back(KdEvent(id, min[axis], Planar));
         }
         else
         {
-            float step = list.size() / (float)N;
-            for (int i = 0; i < N; i++)
-            {
-                int index = (int)(i * step);
-                float min = std::min(std::min(list[index]->a[axis], list[index]->b[axis]), list[index]->c[axis]);
-                float max = std::max(std::max(list[index]->a[axis], list[index]->b[axis]), list[index]->c[axis]);
-                possibleValues.push_back(min);
-                possibleValues.push_back(max);
-            }
+            events[axis].push_back(KdEvent(id, min[axis], Start));
+            events[axis].push_back(KdEvent(id, max[axis], End));
         }
+    }
+}
+
+float Tunnel::findPlane(const Point &min, const Point &max, std::vector<KdEvent> events[3], int numTriangles, 
+                        bool parallel, int &bestAxis, bool &planarLeft, float &minCost)
+{
+    // SA: Surface area (total)
+    // SAL: Surface area (left)
+    // SAR: Surface area (right)
+    // Cost = KT + KI * ((SAL / SA) * (NL + NP) + (SAR / SA) * NR), 
+    //     or KT + KI * ((SAL / SA) * NL + (SAR / SA) * (NR + NP)),
+    // depending on which side the triangles lying in the plane are put in
+    Vector boxSize = Vector(min, max);
+    float SA = boxSize.x * boxSize.y + boxSize.y * boxSize.z + boxSize.z * boxSize.x;
+
+    // The best plane of each axis, the axes are swept in parallel at the top of the tree
+    float axisCost[3];
+    float axisPosition[3];
+    bool axisPlanarLeft[3];
+
+    #pragma omp parallel for if (parallel)
+    for (int axis = 0; axis < 3; axis++)
+    {
+        std::vector<KdEvent> &e = events[axis];
+        int nextAxis = (axis + 1) % 3; // x -> y -> z -> x ...
+        int prevAxis = (axis + 2) % 3; // z -> y -> x -> z ...
+        float height = boxSize[nextAxis];
+        float depth = boxSize[prevAxis];
+
+        axisCost[axis] = FLT_MAX;
+        axisPosition[axis] = 0.0f;
+        axisPlanarLeft[axis] = false;
+
+        // Sweep all candidate split planes
+        int NL = 0;
+        int NP = 0;
+        int NR = numTriangles;
 
-        // Should not split space into two part, one 0% and the other 100%
-        for (int i = (int)possibleValues.size() - 1; i >= 0; i--)
+        for (unsigned int i = 0; i < e.size(); )
         {
-            if (possibleValues[i] == node->min[axis] ||
-                possibleValues[i] == node->max[axis])
+            float position = e[i].position;
+            int PS = 0; // p(+) p_start
+            int PE = 0; // p(-) p_end
+            int PP = 0; // p(|) p_planar
+
+            while (i < e.size() && e[i].position == position && e[i].type == End)
             {
-                possibleValues.erase(possibleValues.begin() + i);
+                PE += 1; i += 1;
             }
-        }
 
-        // We get an empty list as a result
-        if (possibleValues.size() == 0)
-        {
-            // probably because all the elements share a same min / max value
-            // In this case, it's impossible to do spliting. 
-            // Select the median point in the standard way.
-            Triangle *t = list[list.size() / 2];
-            float median = (t->a[axis] + t->b[axis] + t->c[axis]) / 3;
-            return median;
-        }
-#endif
-        // Test each value
-        int nextAxis = (axis + 1) % 3; // x -> y -> z -> x ...
-        int prevAxis = (axis + 2) % 3; // z -> y -> x -> z ...
+            while (i < e.size() && e[i].position == position && e[i].type == Planar)
+            {
+                PP += 1; i += 1;
+            }
 
-        for (unsigned int i = 0; i < possibleValues.size(); i++)
-        {
-            Vector boxSize = Vector(node->min, node->max);
-            float leftWidth = possibleValues[i] - node->min[axis];
-            float rightWidth = node->max[axis] - possibleValues[i];
-            float height = boxSize[nextAxis];
-            float depth = boxSize[prevAxis];
+            while (i < e.size() && e[i].position == position && e[i].type == Start)
+            {
+                PS += 1; i += 1;
+            }
 
-            // Count triangles in the left / right sub tree
-            float splitValue = possibleValues[i];
-            int leftCount = 0;
-            int rightCount = 0;
+            // Move plane onto p
+            NP = PP; NR -= PP; NR -= PE;
 
-            for (unsigned int j = 0; j < list.size(); j++)
+            // Should not split space into two part, one 0% and the other 100%
+            if (position > min[axis] && position < max[axis])
             {
-                if (list[j]->a[axis] < splitValue || 
-                    list[j]->b[axis] < splitValue ||
-                    list[j]->c[axis] < splitValue)
+                float leftWidth = position - min[axis];
+                float rightWidth = max[axis] - position;
+                float SAL = leftWidth * height + leftWidth * depth + height * depth;
+                float SAR = rightWidth * height + rightWidth * depth + height * depth;
+
+                float costLeft = KT + KI * ((SAL / SA) * (NL + NP) + (SAR / SA) * NR);
+                float costRight = KT + KI * ((SAL / SA) * NL + (SAR / SA) * (NR + NP));
+
+                if (costLeft < axisCost[axis])
                 {
-                    leftCount += 1;
+                    axisCost[axis] = costLeft;
+                    axisPosition[axis] = position;
+                    axisPlanarLeft[axis] = true;
                 }
-
-                if (list[j]->a[axis] >= splitValue ||
-                    list[j]->b[axis] >= splitValue ||
-                    list[j]->c[axis] >= splitValue)
+                if (costRight < axisCost[axis])
                 {
-                    rightCount += 1;
+                    axisCost[axis] = costRight;
+                    axisPosition[axis] = position;
+                    axisPlanarLeft[axis] = false;
                 }
             }
 
-            // Calculate SAH value
-            float SAH = 
-                (leftWidth * height + leftWidth * depth + height * depth) * leftCount +
-                (rightWidth * height + rightWidth * depth + height * depth) * rightCount;
-
-            if (SAH < minSAH)
-            {
-                minSAH = SAH;
-                minSplitValue = splitValue;
-                bestAxis = axis;
-            }
+            NL += PS; NL += PP; NP = 0;
         }
     }
 
-    return minSplitValue;
-}
-
-IntersectResult Tunnel::linearIntersect(Ray &ray)
-{
-    float minDistance = FLT_MAX;
-    IntersectResult minResult(false);
-
-    for (unsigned int segment = 0; segment < surface.size(); segment++)
+    minCost = FLT_MAX;
+    float minPosition = 0.0f;
+    for (int axis = 0; axis < 3; axis++)
     {
-        for (unsigned int i = 0; i < surface[segment].size(); i++)
+        if (axisCost[axis] < minCost)
         {
-            IntersectResult result = surface[segment][i]->intersect(ray);
-            if (result.hit && (result.distance < minDistance)) 
-            {
-                minDistance = result.distance;
-                minResult = result;
-            }
+            minCost = axisCost[axis];
+            minPosition = axisPosition[axis];
+            bestAxis = axis;
+            planarLeft = axisPlanarLeft[axis];
         }
     }
-    return minResult;
-}
-
-void Tunnel::getIndexInGrid(const Point &p, int &i, int &j, int&k)
-{
-    i = (int)((p.x - grid.origin.x) / grid.cellSizeX);
-    j = (int)((p.y - grid.origin.y) / grid.cellSizeY);
-    k = (int)((p.z - grid.origin.z) / grid.cellSizeZ);
-    if (i < 0) i = 0;
-    if (j < 0) j = 0;
-    if (k < 0) k = 0;
-    if (i > grid.xLength - 1) i = grid.xLength - 1;
-    if (j > grid.yLength - 1) j = grid.yLength - 1;
-    if (k > grid.zLength - 1) k = grid.zLength - 1;
+    return minPosition;
 }
 
-IntersectResult Tunnel::gridIntersect(Ray &ray)
+void Tunnel::buildKdTreeSAH(KdBuildContext &context, const Point &min, const Point &max, 
+                            std::vector<KdEvent> events[3], int depth)
 {
-    Point near = grid.origin;
-    Point far = grid.origin + Vector(
-        grid.cellSizeX * grid.xLength, 
-        grid.cellSizeY * grid.yLength, 
-        grid.cellSizeZ * grid.zLength);
-
-    // Current traversal state
-    int cur_i, cur_j, cur_k; // the index in the grid
-    float cur_d; // distance along the ray
-    Point cur_p; // position
+    // The node is appended to the array before its subtrees
+    int index = context.nodes.size();
+    context.nodes.push_back(KdNode());
 
-    // Is the origin of the ray outside of the grid?
-    if (ray.origin.x < near.x || ray.origin.x > far.x ||
-        ray.origin.y < near.y || ray.origin.y > far.y ||
-        ray.origin.z < near.z || ray.origin.z > far.z)
+    // Each triangle has exactly one start or planar event on an axis
+    std::vector<Triangle *> list;
+    for (unsigned int i = 0; i < events[XAxis].size(); i++)
     {
-        float entryDistance, exitDistance;
-        Grid sceneBox(grid.origin, Vector(
-            grid.cellSizeX * grid.xLength, 
-            grid.cellSizeY * grid.yLength, 
-            grid.cellSizeZ * grid.zLength));
-
-        if (sceneBox.intersect(ray, entryDistance, exitDistance))
-        {
-            // Advance the ray to a grid boundary
-            cur_d = entryDistance;
-            cur_p = ray.getPoint(entryDistance);
-            getIndexInGrid(cur_p, cur_i, cur_j, cur_k);
-        }
-        else
+        if (events[XAxis][i].type != End)
         {
-            return IntersectResult(false);
+            list.push_back(&triangles[events[XAxis][i].triangle]);
         }
     }
-    else // the origin of the ray is in the grid
+
+    if (list.size() <= 8 || depth > 18) // This should be leaf node
     {
-        cur_p = ray.origin;
-        cur_d = 0;
-        getIndexInGrid(ray.origin, cur_i, cur_j, cur_k);
+        initLeaf(context, index, list);
+        return;
+    }
+
+    // Leave the subtree to a job when the tree is built in parallel
+    if (context.jobs != NULL && list.size() <= context.jobCutoff)
+    {
+        KdBuildJob *job = addJob(context, index, min, max, depth);
+        for (int k = 0; k < 3; k++)
+        {
+            job->events[k].swap(events[k]);
+        }
+        return;
+    }
+
+    // Find the best split plane
+    int axis;
+    bool planarLeft;
+    float cost;
+    bool parallel = (context.jobs != NULL); // the top of the tree
+    float position = findPlane(min, max, events, list.size(), parallel, axis, planarLeft, cost);
+
+    // Automatic termination, when it is cheaper not to split
+    if (cost > KI * list.size())
+    {
+        initLeaf(context, index, list);
+        return;
+    }
+
+    // Classify the triangles
+    std::vector<char> &sides = *context.sides;
+    for (unsigned int i = 0; i < list.size(); i++)
+    {
+        sides[list[i] - triangles] = Both;
+    }
+
+    std::vector<KdEvent> &e = events[axis];
+    for (unsigned int i = 0; i < e.size(); i++)
+    {
+        if (e[i].type == End && e[i].position <= position)
+        {
+            sides[e[i].triangle] = LeftOnly;
+        }
+        else if (e[i].type == Start && e[i].position >= position)
+        {
+            sides[e[i].triangle] = RightOnly;
+        }
+        else if (e[i].type == Planar)
+        {
+            bool left = (e[i].position < position) || (e[i].position == position && planarLeft);
+            sides[e[i].triangle] = left ? LeftOnly : RightOnly;
+        }
+    }
+
+    // Create node
+    context.nodes[index].splitPlane = position;
+    context.nodes[index].flags = axis; // the right child is set when the left subtree is built
+
+    Point leftMax = max;
+    Point rightMin = min;
+    leftMax[axis] = position;
+    rightMin[axis] = position;
+
+    // Split the sorted event lists, which keeps them sorted
+    std::vector<KdEvent> leftEvents[3];
+    std::vector<KdEvent> rightEvents[3];
+
+    #pragma omp parallel for if (parallel)
+    for (int k = 0; k < 3; k++)
+    {
+        for (unsigned int i = 0; i < events[k].size(); i++)
+        {
+            if (sides[events[k][i].triangle] == LeftOnly)
+            {
+                leftEvents[k].push_back(events[k][i]);
+            }
+            else if (sides[events[k][i].triangle] == RightOnly)
+            {
+                rightEvents[k].push_back(events[k][i]);
+            }
+        }
+        std::vector<KdEvent>().swap(events[k]); // not used any more
+    }
+
+    // The triangles overlapping both sides get new events, clipped to the children
+    std::vector<KdEvent> leftNew[3];
+    std::vector<KdEvent> rightNew[3];
+
+    for (unsigned int i = 0; i < list.size(); i++)
+    {
+        int id = list[i] - triangles;
+        if (sides[id] == Both)
+        {
+            Point tmin, tmax;
+            list[i]->getBoundingBox(tmin, tmax);
+
+            Point leftTMin, leftTMax, rightTMin, rightTMax;
+            for (int k = 0; k < 3; k++)
+            {
+                leftTMin[k] = std::max(tmin[k], min[k]);
+                leftTMax[k] = std::min(tmax[k], leftMax[k]);
+                rightTMin[k] = std::max(tmin[k], rightMin[k]);
+                rightTMax[k] = std::min(tmax[k], max[k]);
+            }
+            addEvents(id, leftTMin, leftTMax, leftNew);
+            addEvents(id, rightTMin, rightTMax, rightNew);
+        }
+    }
+
+    #pragma omp parallel for if (parallel)
+    for (int k = 0; k < 3; k++)
+    {
+        std::sort(leftNew[k].begin(), leftNew[k].end(), cmpKdEvent);
+        std::sort(rightNew[k].begin(), rightNew[k].end(), cmpKdEvent);
+
+        int leftSize = leftEvents[k].size();
+        int rightSize = rightEvents[k].size();
+        leftEvents[k].insert(leftEvents[k].end(), leftNew[k].begin(), leftNew[k].end());
+        rightEvents[k].insert(rightEvents[k].end(), rightNew[k].begin(), rightNew[k].end());
+        std::inplace_merge(leftEvents[k].begin(), leftEvents[k].begin() + leftSize, leftEvents[k].end(), cmpKdEvent);
+        std::inplace_merge(rightEvents[k].begin(), rightEvents[k].begin() + rightSize, rightEvents[k].end(), cmpKdEvent);
+    }
+
+    // Construct subtrees
+    buildKdTreeSAH(context, min, leftMax, leftEvents, depth + 1);
+    context.nodes[index].flags |= (unsigned int)context.nodes.size() << 2;
+    buildKdTreeSAH(context, rightMin, max, rightEvents, depth + 1);
+}
+
+Tunnel::KdBuildJob *Tunnel::addJob(KdBuildContext &context, int index, const Point &min, const Point &max, int depth)
+{
+    KdBuildJob *job = new KdBuildJob();
+    job->min = min;
+    job->max = max;
+    job->depth = depth;
+
+    // A placeholder leaf, replaced by the subtree of the job when merging
+    context.nodes[index].offset = -1 - (int)context.jobs->size();
+    context.nodes[index].flags = NoAxis;
+    context.jobs->push_back(job);
+    return job;
+}
+
+void Tunnel::mergeKdTree(KdBuildContext &top, int index, std::vector<KdBuildJob *> &jobs)
+{
+    const KdNode &node = top.nodes[index];
+
+    if (node.axis() != NoAxis) // interior node
+    {
+        int i = nodes.size();
+        nodes.push_back(node);
+        mergeKdTree(top, index + 1, jobs);
+        nodes[i].flags = node.axis() | ((unsigned int)nodes.size() << 2);
+        mergeKdTree(top, node.rightChild(), jobs);
+    }
+    else if (node.offset >= 0) // leaf
+    {
+        KdNode leaf = node;
+        leaf.offset = (int)triangleIds.size();
+        nodes.push_back(leaf);
+        triangleIds.insert(triangleIds.end(), 
+            top.triangleIds.begin() + node.offset, 
+            top.triangleIds.begin() + node.offset + node.numTriangles());
+    }
+    else // placeholder of a job
+    {
+        // Append the subtree, with the indices offset by where it is placed
+        KdBuildContext &subtree = jobs[-1 - node.offset]->context;
+        unsigned int nodeOffset = nodes.size();
+        int triangleOffset = (int)triangleIds.size();
+
+        for (unsigned int i = 0; i < subtree.nodes.size(); i++)
+        {
+            KdNode n = subtree.nodes[i];
+            if (n.axis() == NoAxis)
+                n.offset += triangleOffset;
+            else
+                n.flags += nodeOffset << 2;
+            nodes.push_back(n);
+        }
+        triangleIds.insert(triangleIds.end(), subtree.triangleIds.begin(), subtree.triangleIds.end());
+    }
+}
+
+int Tunnel::getSegmentCount()
+{
+    return path.size() - 1;
+}
+
+int Tunnel::getTriangleCount(int segment)
+{
+    if (!procedural)
+    {
+        return surface[segment].size();
+    }
+    return (segmentPatterns[segment] < 0) ? 0 : 2 * crossSection.vertices.size();
+}
+
+int Tunnel::getTriangleId(int segment, int index)
+{
+    return segment * 2 * crossSection.vertices.size() + index;
+}
+
+// Rotate a point on the cross section around the y axis, and move it to a path node
+static Point transform(const Point &p, float cosAngle, float sinAngle, const Point &node)
+{
+    return Point(
+        p.x * cosAngle - p.z * sinAngle,
+        p.y,
+        p.x * sinAngle + p.z * cosAngle) + Vector(Point(0, 0, 0), node);
+}
+
+void Tunnel::getVertices(int segment, int index, Point &a, Point &b, Point &c)
+{
+    if (!procedural)
+    {
+        Triangle *t = surface[segment][index];
+        a = t->a;
+        b = t->b;
+        c = t->c;
+        return;
+    }
+
+    // The same as the triangles created by TunnelGenerator
+    //
+    //   A  B    front polygon (path node i)
+    //   o--o
+    //   |  |
+    //   o--o
+    //   C  D    rear polygon (path node i + 1)
+    int n = crossSection.vertices.size();
+    int j = index / 2;
+    const SegmentFrame &f = segmentFrames[segment];
+    const Point &p1 = crossSection.vertices[j];
+    const Point &p2 = crossSection.vertices[(j + 1) % n];
+
+    Point A = transform(p1, f.cosFront, f.sinFront, path[segment]);
+    Point B = transform(p2, f.cosFront, f.sinFront, path[segment]);
+    Point C = transform(p1, f.cosRear, f.sinRear, path[segment + 1]);
+    Point D = transform(p2, f.cosRear, f.sinRear, path[segment + 1]);
+
+    if (connectionPatterns[segmentPatterns[segment]][j] == Polyhedron::AD) // ACD and ADB
+    {
+        a = A;
+        b = (index % 2 == 0) ? C : D;
+        c = (index % 2 == 0) ? D : B;
+    }
+    else // BC or Both, CDB and CBA
+    {
+        a = C;
+        b = (index % 2 == 0) ? D : B;
+        c = (index % 2 == 0) ? B : A;
+    }
+}
+
+void Tunnel::getTriangle(int id, Triangle &triangle)
+{
+    int n = 2 * crossSection.vertices.size();
+    getVertices(id / n, id % n, triangle.a, triangle.b, triangle.c);
+    triangle.normal = Vector(triangle.a, triangle.b).cross(Vector(triangle.b, triangle.c)).norm();
+}
+
+TriangleRecord Tunnel::getTriangleRecord(int id)
+{
+    if (!procedural)
+    {
+        return records[id];
+    }
+
+    int n = 2 * crossSection.vertices.size();
+    Point a, b, c;
+    getVertices(id / n, id % n, a, b, c);
+    return TriangleRecord(a, b, c);
+}
+
+IntersectResult Tunnel::intersectTriangle(Ray &ray, int segment, int index)
+{
+    return intersectTriangle(ray, getTriangleId(segment, index));
+}
+
+IntersectResult Tunnel::intersectTriangle(Ray &ray, int id)
+{
+    float distance;
+
+    if (!intersectTriangleDistance(ray, id, distance))
+    {
+        return IntersectResult(false);
+    }
+    return getTriangleHitResult(ray, id, distance);
+}
+
+bool Tunnel::intersectTriangleDistance(Ray &ray, int id, float &distance)
+{
+    if (!procedural)
+    {
+        return records[id].intersect(ray, distance);
+    }
+
+    int n = 2 * crossSection.vertices.size();
+    Point a, b, c;
+    getVertices(id / n, id % n, a, b, c);
+    return Triangle::intersect(a, b, c, ray, distance);
+}
+
+IntersectResult Tunnel::getTriangleHitResult(Ray &ray, int id, float distance)
+{
+    int n = 2 * crossSection.vertices.size();
+
+    if (!procedural)
+    {
+        return surface[id / n][id % n]->getHitResult(ray, distance);
+    }
+
+    Point a, b, c;
+    getVertices(id / n, id % n, a, b, c);
+
+    // The last edge of the cross section is the ground
+    bool ground = ((id % n) / 2 == crossSection.vertices.size() - 1);
+
+    IntersectResult result(true);
+    result.geometry = ground ? &groundPrototype : &wallPrototype;
+    result.distance = distance;
+    result.position = ray.getPoint(distance);
+    result.normal = Vector(a, b).cross(Vector(b, c)).norm();
+    return result;
+}
+
+IntersectResult Tunnel::linearIntersect(Ray &ray)
+{
+    int minId = -1;
+
+    for (int segment = 0; segment < getSegmentCount(); segment++)
+    {
+        for (int i = 0; i < getTriangleCount(segment); i++)
+        {
+            int id = getTriangleId(segment, i);
+            float distance;
+            if (intersectTriangleDistance(ray, id, distance) && distance < ray.tMax) 
+            {
+                ray.tMax = distance;
+                minId = id;
+            }
+        }
+    }
+    return (minId >= 0) ? getTriangleHitResult(ray, minId, ray.tMax) : IntersectResult(false);
+}
+
+void Tunnel::getIndexInGrid(const Point &p, int &i, int &j, int&k)
+{
+    i = (int)((p.x - grid.origin.x) / grid.cellSizeX);
+    j = (int)((p.y - grid.origin.y) / grid.cellSizeY);
+    k = (int)((p.z - grid.origin.z) / grid.cellSizeZ);
+    if (i < 0) i = 0;
+    if (j < 0) j = 0;
+    if (k < 0) k = 0;
+    if (i > grid.xLength - 1) i = grid.xLength - 1;
+    if (j > grid.yLength - 1) j = grid.yLength - 1;
+    if (k > grid.zLength - 1) k = grid.zLength - 1;
+}
+
+IntersectResult Tunnel::gridIntersect(Ray &ray)
+{
+    Point near = grid.origin;
+    Point far = grid.origin + Vector(
+        grid.cellSizeX * grid.xLength, 
+        grid.cellSizeY * grid.yLength, 
+        grid.cellSizeZ * grid.zLength);
+
+    // Current traversal state
+    int cur_i, cur_j, cur_k; // the index in the grid
+    float cur_d; // distance along the ray
+    Point cur_p; // position
+
+    // Is the origin of the ray outside of the grid?
+    if (ray.origin.x < near.x || ray.origin.x > far.x ||
+        ray.origin.y < near.y || ray.origin.y > far.y ||
+        ray.origin.z < near.z || ray.origin.z > far.z)
+    {
+        float entryDistance, exitDistance;
+        Grid sceneBox(grid.origin, Vector(
+            grid.cellSizeX * grid.xLength, 
+            grid.cellSizeY * grid.yLength, 
+            grid.cellSizeZ * grid.zLength));
+
+        if (sceneBox.intersect(ray, entryDistance, exitDistance) && entryDistance <= ray.tMax)
+        {
+            // Advance the ray to a grid boundary
+            cur_d = entryDistance;
+            cur_p = ray.getPoint(entryDistance);
+            getIndexInGrid(cur_p, cur_i, cur_j, cur_k);
+        }
+        else
+        {
+            return IntersectResult(false);
+        }
+    }
+    else // the origin of the ray is in the grid
+    {
+        cur_p = ray.origin;
+        cur_d = 0;
+        getIndexInGrid(ray.origin, cur_i, cur_j, cur_k);
     }
 
     // Start traversing the grid
+    float invDir[3] = { 1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z };
+    float cellSize[3] = { grid.cellSizeX, grid.cellSizeY, grid.cellSizeZ };
+    int length[3] = { grid.xLength, grid.yLength, grid.zLength };
+    GridWalk walk(ray, invDir, grid.origin, cellSize, length, cur_i, cur_j, cur_k);
+    Mailbox mailbox;
+    int minId = -1;
+
+    while (true)
+    {
+        // See if the ray intersects with some triangle in the current cell
+        const int *list;
+        int count = grid.cells.get(walk.cell[0], walk.cell[1], walk.cell[2], list);
+
+        for (int i = 0; i < count; i++)
+        {
+            float distance;
+            if (mailbox.check(list[i]) && 
+                intersectTriangleDistance(ray, list[i], distance) && distance < ray.tMax)
+            {
+                minId = list[i];
+                ray.tMax = distance;
+            }
+        }
+
+        // Advance to the next cell, unless the ray leaves the grid or the cell lies beyond
+        // the nearest intersection found so far. A hit outside of the current cell is kept
+        // until then, as a triangle in the cells between may be closer.
+        if (!walk.next(cur_d) || cur_d > ray.tMax)
+            break;
+    }
+
+    if (minId >= 0)
+        return getTriangleHitResult(ray, minId, ray.tMax);
+
+    return IntersectResult(false);
+}
+
+IntersectResult Tunnel::hgridIntersect(Ray &ray)
+{
+    Point near = grid.origin;
+    Point far = grid.origin + Vector(
+        grid.cellSizeX * grid.xLength, 
+        grid.cellSizeY * grid.yLength, 
+        grid.cellSizeZ * grid.zLength);
+
+    // Current traversal state in the top grid
+    int cur_i, cur_j, cur_k; // the index in the grid
+    float cur_d; // distance along the ray
+    Point cur_p; // position
+
+    // Is the origin of the ray outside of the grid?
+    if (ray.origin.x < near.x || ray.origin.x > far.x ||
+        ray.origin.y < near.y || ray.origin.y > far.y ||
+        ray.origin.z < near.z || ray.origin.z > far.z)
+    {
+        float entryDistance, exitDistance;
+        Grid sceneBox(grid.origin, Vector(
+            grid.cellSizeX * grid.xLength, 
+            grid.cellSizeY * grid.yLength, 
+            grid.cellSizeZ * grid.zLength));
+
+        if (sceneBox.intersect(ray, entryDistance, exitDistance) && entryDistance <= ray.tMax)
+        {
+            // Advance the ray to a grid boundary
+            cur_d = entryDistance;
+            cur_p = ray.getPoint(entryDistance);
+            getIndexInGrid(cur_p, cur_i, cur_j, cur_k);
+        }
+        else
+        {
+            return IntersectResult(false);
+        }
+    }
+    else // the origin of the ray is in the grid
+    {
+        cur_p = ray.origin;
+        cur_d = 0;
+        getIndexInGrid(ray.origin, cur_i, cur_j, cur_k);
+    }
+
+    // Start traversing the top grid
+    // The closest hit is kept until the ray leaves the cells that may contain a closer one,
+    // because a triangle overlapping a cell may be hit outside of it.
+    float invDir[3] = { 1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z };
+    float cellSize[3] = { grid.cellSizeX, grid.cellSizeY, grid.cellSizeZ };
+    int length[3] = { grid.xLength, grid.yLength, grid.zLength };
+    GridWalk walk(ray, invDir, grid.origin, cellSize, length, cur_i, cur_j, cur_k);
+    Mailbox mailbox;
+    int minId = -1;
+
     while (true)
     {
-        // See if the ray intersects with some triangle in the current cell
-        std::vector<Triangle *> &list = grid.get(cur_i, cur_j, cur_k);
-        IntersectResult minResult(false);
-        float minDistance = FLT_MAX;
+        // Descend into the sub-grid of the current cell
+        int index = grid.cells.getIndex(walk.cell[0], walk.cell[1], walk.cell[2]);
+        if (index >= 0)
+        {
+            subGridIntersect(ray, invDir, hgrid.subGrids[index], cur_d, mailbox, minId);
+        }
+
+        // Advance to the next cell, unless the ray leaves the grid or the cell lies beyond
+        // the nearest intersection found so far
+        if (!walk.next(cur_d) || cur_d > ray.tMax)
+            break;
+    }
+
+    if (minId >= 0)
+        return getTriangleHitResult(ray, minId, ray.tMax);
+
+    return IntersectResult(false);
+}
+
+void Tunnel::subGridIntersect(Ray &ray, const float invDir[3], const SubGrid &sub, float entryDistance, 
+    Mailbox &mailbox, int &minId)
+{
+    // The cell of the entry point
+    Point entry = ray.getPoint(entryDistance);
+    int i = (int)((entry.x - sub.origin.x) / sub.cellSize);
+    int j = (int)((entry.y - sub.origin.y) / sub.cellSize);
+    int k = (int)((entry.z - sub.origin.z) / sub.cellSize);
+    i = std::min(std::max(i, 0), sub.length - 1);
+    j = std::min(std::max(j, 0), sub.length - 1);
+    k = std::min(std::max(k, 0), sub.length - 1);
+
+    float cellSize[3] = { sub.cellSize, sub.cellSize, sub.cellSize };
+    int length[3] = { sub.length, sub.length, sub.length };
+    GridWalk walk(ray, invDir, sub.origin, cellSize, length, i, j, k);
+    float distance;
+
+    while (true)
+    {
+        // See if the ray intersects with some triangle in the current cell
+        int cell = sub.firstCell + (walk.cell[0] * sub.length + walk.cell[1]) * sub.length + walk.cell[2];
+        for (int n = hgrid.offsets[cell]; n < hgrid.offsets[cell + 1]; n++)
+        {
+            if (mailbox.check(hgrid.ids[n]) && 
+                intersectTriangleDistance(ray, hgrid.ids[n], distance) && distance < ray.tMax)
+            {
+                minId = hgrid.ids[n];
+                ray.tMax = distance;
+            }
+        }
+
+        // Leave the sub-grid, or the next cell lies beyond the nearest intersection
+        if (!walk.next(distance) || distance > ray.tMax)
+            break;
+    }
+}
+
+bool Tunnel::intersectWithWall(Ray &ray, int segment, const Point &origin, const Vector &dir, IntersectResult &result)
+{
+    if (algorithm == ConvexSimple) // linear search in the segment
+    {
+        for (int j = 0; j < blocksPerSegment; j++)
+        {
+            if (intersectWithWallBlock(ray, segment, j, result))
+            {
+                return true;
+            }
+        }
+    }
+    else // fast intersect
+    {
+        // (origin, dir) is the ray projected onto the cross section, which is the same
+        // for both directions, so a single table serves the forward and backward walk
+        float y = origin.y - origin.x * dir.y / dir.x;
+        int index = (int)(99.0f * y / height + 0.5f);
+        index = std::max(0, index);
+        index = std::min(99, index);
+
+        float fAngle = atan2(dir.y, dir.x);
+        fAngle = (fAngle < 0) ? fAngle + PI * 2 : fAngle;
+        int iAngle = (int)(fAngle / PI * 180.0f);
+        iAngle = std::max(0, iAngle);
+        iAngle = std::min(359, iAngle);
+
+        for (unsigned int j = 0; j < intersectionTableYAxis[index][iAngle].size(); j++)
+        {
+            if (intersectWithWallBlock(ray, segment, intersectionTableYAxis[index][iAngle][j], result))
+            {
+                //Utils::DbgPrint("Intersect with triangle %d / %d\n", 
+                //    j, intersectionTableYAxis[index][iAngle].size());
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Tests the triangles of a block on the wall of a segment four at a time. As the segment is
+// convex, the ray leaves it through a single triangle, so the first block hit is enough.
+bool Tunnel::intersectWithWallBlock(Ray &ray, int segment, int index, IntersectResult &result)
+{
+    float distance = ray.tMax;
+    int id = -1;
+
+    if (!procedural)
+    {
+        const TriangleBlock &block = wallBlocks[segment * blocksPerSegment + index];
+        int lane = block.intersect(ray, ray.tMin, distance);
+        id = (lane >= 0) ? block.ids[lane] : -1;
+    }
+    else
+    {
+        TriangleBlock block;
+        int first = index * TriangleBlock::SIZE;
+        int count = std::min((int)TriangleBlock::SIZE, getTriangleCount(segment) - first);
+        for (int i = 0; i < count; i++)
+        {
+            int triangleId = getTriangleId(segment, first + i);
+            block.set(i, triangleId, getTriangleRecord(triangleId));
+        }
+        int lane = block.intersect(ray, ray.tMin, distance);
+        id = (lane >= 0) ? block.ids[lane] : -1;
+    }
+
+    if (id < 0)
+    {
+        return false;
+    }
+    result = getTriangleHitResult(ray, id, distance);
+    return true;
+}
+
+IntersectResult Tunnel::fastIntersect(Ray &ray)
+{
+    RayContext &context = ray.context;
+
+    Ray advRay = ray; // the advanced ray
+    float distance; // the advanced distance
+    float travelled = 0; // the signed distance from ray.origin to advRay.origin
+
+    if (!context.inTunnel)
+    {
+        Point newOrigin;
+        Vector newDir;
+
+        // into the entrance of the tunnel
+        if (intersectWithPolygon(ray, 0, newOrigin, newDir, distance) && ray.direction.dot(nvs[0]) > 0)
+        {
+            context.inTunnel = true; // we know it will gets into the tunnel
+            context.segment = 0;
+            advRay.origin = ray.getPoint(distance);
+            advRay.direction = ray.direction;
+            travelled = distance;
+        }
+        else if (intersectWithPolygon(ray, path.size() - 1, newOrigin, newDir, distance) && 
+            ray.direction.dot(nvs[path.size() - 1]) < 0) // into the exit of the tunnel
+        {
+            context.inTunnel = true;
+            context.segment = path.size() - 2;
+            advRay.origin = ray.getPoint(distance);
+            advRay.direction = ray.direction;
+            travelled = distance;
+        }
+        else // the origin of the ray is not in the tunnel, and it does not gets into the tunnel
+        {
+            return linearIntersect(ray);
+        }
+
+        // The tunnel is entered beyond the nearest intersection found so far
+        if (travelled > ray.tMax)
+        {
+            context.inTunnel = false;
+            return IntersectResult(false);
+        }
+    }
+
+    if (context.inTunnel)
+    {
+        int N = path.size() - 1; // a path with with N segments has N + 1 nodes (range: 0 to N)
+        int begin = context.segment; // the current segment (range: 0 to N - 1)
+        // A ray along the normal of node begin is walked forward. Otherwise, as each segment of
+        // a curved path is a wedge, the ray may still head for both bounding polygons, and it
+        // is walked backward only if it does not leave through the polygon of node begin + 1
+        enum RayDir dir = Forward;
+        if (ray.direction.dot(nvs[begin]) <= 0)
+        {
+            Point newOrigin;
+            Vector newDir;
+
+            if (ray.direction.dot(nvs[begin + 1]) <= 0 || 
+                !intersectWithPolygon(advRay, begin + 1, newOrigin, newDir, distance))
+            {
+                dir = Backward;
+            }
+        }
+
+        //   segment:      0     1     2    ...    N - 1
+        //   path:      o-----o-----o-----o-----o-----o
+        //   node:      0     1     2     3    ...    N
+        //
+        // Segment i lies between node i and node i + 1. A forward ray in segment i 
+        // leaves through node i + 1, and a backward ray leaves through node i.
+        int step = (dir == Forward) ? 1 : -1;
+        int node = (dir == Forward) ? begin + 1 : begin;
+
+        for (; node >= 0 && node <= N; node += step)
+        {
+            int segment = (dir == Forward) ? node - 1 : node;
+            Point newOrigin;
+            Vector newDir;
+
+            if (!intersectWithPolygon(advRay, node, newOrigin, newDir, distance)) // intersect with wall
+            {
+                IntersectResult result;
+
+                if (intersectWithWall(ray, segment, newOrigin, newDir, result))
+                {
+                    context.segment = segment;
+                    return result;
+                }
+
+                if (algorithm == Convex)
+                {
+                    // As float point numbers are not accurate by nature, it's not a problem
+                    // when it gets here. Now advance the ray to the next polygon and try again.
+                    advRay.origin = advRay.getPoint(distance);
+                    travelled += distance;
+                }
+            }
+            else // intersect with polygon
+            {
+                advRay.origin = advRay.getPoint(distance);
+                travelled += distance;
+            }
+
+            // The nearest intersection found so far (e.g., a ball in the tunnel) lies
+            // in this segment, and the rest of the tunnel is not walked through
+            if (travelled > ray.tMax)
+            {
+                context.segment = segment;
+                return IntersectResult(false);
+            }
+        }
+
+        // The ray intersects with all the polygons on the way
+        context.inTunnel = false;
+        return IntersectResult(false);
+    }
+
+    // Just to avoid warnings. It's impossible to get here
+    return IntersectResult(false);
+}
+
+IntersectResult Tunnel::kdTreeIntersect(Ray &ray)
+{
+    // Based on the C-pseudo code in page 157
+    float a; // entry signed distance
+    float b; // exit signed distance
+    float t; // signed distance to the splitting plane
+
+    // Intersect ray with sceneBox, find the entry and exit signed distance
+    Grid sceneBox(kdMin, kdMax);
+    if (!sceneBox.intersect(ray, a, b) || a > ray.tMax)
+        return IntersectResult(false);
+
+    // Stack required for traversal to store far children
+    StackElem stack[50];
+
+    // Pointers to the far child node and current node
+    const KdNode *farChild;
+    const KdNode *currNode;
+    const KdNode *base = &nodes[0];
+    currNode = base;
+
+    // Setup initial entry point
+    int enPt = 0;
+    stack[enPt].t = a; // Set the signed distance
+
+    // Distinguish between internal and external origin
+    if (a >= 0) // a ray with external origin
+        stack[enPt].pb = ray.origin + ray.direction * a;
+    else // a ray with internal origin
+        stack[enPt].pb = ray.origin;
+
+    // Setup initial exit point in the stack
+    int exPt = 1;
+    stack[exPt].t = b;
+    stack[exPt].pb = ray.origin + ray.direction * b;
+    stack[exPt].node = NULL; // Termination flag
+
+    // Loop, traverse through the whole kd-tree
+    while (currNode != NULL)
+    {
+        // Loop until a leaf is found
+        while (currNode->axis() != NoAxis)
+        {
+            // Retrive position of splitting plane
+            float splitVal = currNode->splitPlane;
+
+            // The current axis
+            int axis = (int)currNode->axis();
+            int nextAxis = (axis + 1) % 3; // x -> y -> z -> x ...
+            int prevAxis = (axis + 2) % 3; // z -> y -> x -> z ...
+
+            if (stack[enPt].pb[axis] <= splitVal)
+            {
+                // Case N1, N2, N3, P5, Z2 and Z3
+                if (stack[exPt].pb[axis] <= splitVal)
+                {
+                    currNode = currNode + 1;
+                    continue;
+                }
+
+                // Case Z1
+                if (stack[exPt].pb[axis] == splitVal)
+                {
+                    currNode = base + currNode->rightChild();
+                    continue;
+                }
+
+                // Case N4
+                farChild = base + currNode->rightChild();
+                currNode = currNode + 1;
+            }
+            else // stack[enPt].pb[axis] > splitVal
+            {
+                // Case P1, P2, P3 and N5
+                if (splitVal < stack[exPt].pb[axis])
+                {
+                    currNode = base + currNode->rightChild();
+                    continue;
+                }
+
+                // Case P4
+                farChild = currNode + 1;
+                currNode = base + currNode->rightChild();
+            }
+            // Case P4 or N4 (traverse both children)
+
+            // Signed distance to the splitting plane
+            t = (splitVal - ray.origin[axis]) / ray.direction[axis];
+
+            // Setup the new exit point
+            int tmp = exPt++;
+            if (exPt == enPt)
+                exPt += 1;
+
+            // Push values onto the stack
+            stack[exPt].prev = tmp;
+            stack[exPt].t = t;
+            stack[exPt].node = farChild;
+            stack[exPt].pb[axis] = splitVal;
+            stack[exPt].pb[nextAxis] = ray.origin[nextAxis] + t * ray.direction[nextAxis];
+            stack[exPt].pb[prevAxis] = ray.origin[prevAxis] + t * ray.direction[prevAxis];
+        }
+
+        // Current node is the leaf, empty or full. Its triangles are tested four at a time,
+        // and only the hits in the leaf are accepted
+        int minId = -1;
+        float tMin = std::max(ray.tMin, stack[enPt].t - 0.001f);
+        float tMax = std::min(ray.tMax, stack[exPt].t + 0.001f);
+
+        const TriangleBlock *block = &kdBlocks[currNode->offset];
+        int numBlocks = TriangleBlock::numBlocks(currNode->numTriangles());
+        for (int i = 0; i < numBlocks; i++)
+        {
+            int lane = block[i].intersect(ray, tMin, tMax);
+            if (lane >= 0)
+            {
+                minId = block[i].ids[lane];
+            }
+        }
+        
+        if (minId >= 0)
+        {
+            ray.tMax = tMax;
+            return getTriangleHitResult(ray, minId, ray.tMax);
+        }
+
+        // Pop from stack
+        enPt = exPt; // The signed distance intervals are adjacent
+
+        // The remaining part of the ray lies beyond the nearest intersection found so far
+        if (stack[enPt].t > ray.tMax)
+            break;
+
+        // Retrieve the pointer to the next node,
+        // it is possible that ray traversal terminates
+        currNode = stack[exPt].node;
+
+        exPt = stack[enPt].prev;
+    }
+
+    // currNode = NULL, ray leaves the scene
+    return IntersectResult(false);
+}
+
+// Half of the surface area of a box
+static float halfArea(const Point &min, const Point &max)
+{
+    Vector size(min, max);
+    return size.x * size.y + size.y * size.z + size.z * size.x;
+}
+
+static void growBox(Point &min, Point &max, const Point &p)
+{
+    min.x = std::min(min.x, p.x);
+    min.y = std::min(min.y, p.y);
+    min.z = std::min(min.z, p.z);
+
+    max.x = std::max(max.x, p.x);
+    max.y = std::max(max.y, p.y);
+    max.z = std::max(max.z, p.z);
+}
+
+// The slab test, returns whether the ray enters the box before maxDistance
+static bool intersectBox(const Point &min, const Point &max, const Ray &ray, const float invDir[3],
+                         float maxDistance, float &distance)
+{
+    float entry = 0.0f;
+    float exit = maxDistance;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float t0 = (min[axis] - ray.origin[axis]) * invDir[axis];
+        float t1 = (max[axis] - ray.origin[axis]) * invDir[axis];
+        if (invDir[axis] < 0)
+        {
+            std::swap(t0, t1);
+        }
+
+        // A NaN (the ray lies in a face of the box) keeps the old value
+        entry = (t0 > entry) ? t0 : entry;
+        exit = (t1 < exit) ? t1 : exit;
+    }
+
+    distance = entry;
+    return entry <= exit;
+}
+
+float Tunnel::findBvhSplit(std::vector<BvhTriangle> &list, int begin, int end, const Point &min, const Point &max,
+                           const Point &centerMin, const Point &centerMax, bool parallel, int &bestAxis, int &bestBin)
+{
+    // SA: Surface area (total)
+    // SAL: Surface area of the left child
+    // SAR: Surface area of the right child
+    // Cost = KT + KI * ((SAL / SA) * NL + (SAR / SA) * NR)
+    float SA = halfArea(min, max);
+
+    // The best plane of each axis, the axes are binned in parallel at the top of the hierarchy
+    float axisCost[3];
+    int axisBin[3];
+
+    #pragma omp parallel for if (parallel)
+    for (int axis = 0; axis < 3; axis++)
+    {
+        axisCost[axis] = FLT_MAX;
+        axisBin[axis] = 0;
+
+        float extent = centerMax[axis] - centerMin[axis];
+        if (extent <= 0.0f) // all centroids lie in a plane
+            continue;
+        float scale = BVH_NUM_BINS / extent;
+
+        // Put the centroids into the bins
+        BvhBin bins[BVH_NUM_BINS];
+        for (int i = 0; i < BVH_NUM_BINS; i++)
+        {
+            bins[i].min = Point(FLT_MAX, FLT_MAX, FLT_MAX);
+            bins[i].max = Point(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+            bins[i].count = 0;
+        }
+
+        for (int i = begin; i < end; i++)
+        {
+            int bin = std::min((int)((list[i].center[axis] - centerMin[axis]) * scale), BVH_NUM_BINS - 1);
+            bins[bin].count += 1;
+            growBox(bins[bin].min, bins[bin].max, list[i].min);
+            growBox(bins[bin].min, bins[bin].max, list[i].max);
+        }
+
+        // Sweep from the right, plane #i lies between bin #(i - 1) and bin #i
+        float rightArea[BVH_NUM_BINS];
+        int rightCount[BVH_NUM_BINS];
+        Point boxMin(FLT_MAX, FLT_MAX, FLT_MAX);
+        Point boxMax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+        int count = 0;
+
+        for (int i = BVH_NUM_BINS - 1; i > 0; i--)
+        {
+            count += bins[i].count;
+            growBox(boxMin, boxMax, bins[i].min);
+            growBox(boxMin, boxMax, bins[i].max);
+            rightArea[i] = halfArea(boxMin, boxMax);
+            rightCount[i] = count;
+        }
+
+        // Sweep from the left
+        boxMin = Point(FLT_MAX, FLT_MAX, FLT_MAX);
+        boxMax = Point(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+        count = 0;
+
+        for (int i = 1; i < BVH_NUM_BINS; i++)
+        {
+            count += bins[i - 1].count;
+            growBox(boxMin, boxMax, bins[i - 1].min);
+            growBox(boxMin, boxMax, bins[i - 1].max);
+
+            // Should not split the triangles into two parts, one empty and the other full
+            if (count == 0 || rightCount[i] == 0)
+                continue;
+
+            float SAL = halfArea(boxMin, boxMax);
+            float SAR = rightArea[i];
+            float cost = KT + KI * ((SAL / SA) * count + (SAR / SA) * rightCount[i]);
+            if (cost < axisCost[axis])
+            {
+                axisCost[axis] = cost;
+                axisBin[axis] = i;
+            }
+        }
+    }
+
+    float minCost = FLT_MAX;
+    bestAxis = NoAxis;
+    bestBin = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (axisCost[axis] < minCost)
+        {
+            minCost = axisCost[axis];
+            bestAxis = axis;
+            bestBin = axisBin[axis];
+        }
+    }
+    return minCost;
+}
+
+void Tunnel::buildBvh(BvhBuildContext &context, std::vector<BvhTriangle> &list, int begin, int end, int depth)
+{
+    int index = context.nodes.size();
+    context.nodes.push_back(BvhNode());
+
+    // The bounding box of the triangles, and that of their centroids
+    Point min(FLT_MAX, FLT_MAX, FLT_MAX);
+    Point max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    Point centerMin = min;
+    Point centerMax = max;
+
+    for (int i = begin; i < end; i++)
+    {
+        growBox(min, max, list[i].min);
+        growBox(min, max, list[i].max);
+        growBox(centerMin, centerMax, list[i].center);
+    }
+    context.nodes[index].min = min;
+    context.nodes[index].max = max;
+
+    int numTriangles = end - begin;
+
+    // Leave the subtree to a job when the hierarchy is built in parallel
+    if (context.jobs != NULL && numTriangles <= context.jobCutoff)
+    {
+        BvhBuildJob *job = new BvhBuildJob;
+        job->begin = begin;
+        job->end = end;
+        job->depth = depth;
+
+        context.nodes[index].offset = -1 - (int)context.jobs->size();
+        context.nodes[index].flags = NoAxis;
+        context.jobs->push_back(job);
+        return;
+    }
+
+    // Find the best split plane
+    int axis = NoAxis;
+    int bin = 0;
+    float cost = FLT_MAX;
+
+    if (numTriangles > 1 && depth < BVH_MAX_DEPTH)
+    {
+        bool parallel = (context.jobs != NULL); // the top of the hierarchy
+        cost = findBvhSplit(list, begin, end, min, max, centerMin, centerMax, parallel, axis, bin);
+    }
+
+    // Make a leaf if splitting costs more than intersecting all the triangles
+    if (numTriangles <= 1 || depth >= BVH_MAX_DEPTH ||
+        (numTriangles <= BVH_MAX_LEAF_SIZE && cost >= KI * numTriangles))
+    {
+        context.nodes[index].offset = begin;
+        context.nodes[index].flags = ((unsigned int)numTriangles << 2) | NoAxis;
+        context.numLeaves += 1;
+        return;
+    }
+
+    // Split the triangle list
+    int mid;
+    if (axis == NoAxis) // the centroids coincide, split in the middle
+    {
+        axis = XAxis;
+        mid = (begin + end) / 2;
+    }
+    else // partition the triangles in place by the bins of their centroids
+    {
+        float scale = BVH_NUM_BINS / (centerMax[axis] - centerMin[axis]);
+        int i = begin;
+        int j = end - 1;
 
-        for (unsigned int i = 0; i < list.size(); i++)
+        while (i <= j)
         {
-            IntersectResult result = list[i]->intersect(ray);
-            if (result.hit && result.distance < minDistance)
-            {
-                minResult = result;
-                minDistance = result.distance;
-            }
+            if (std::min((int)((list[i].center[axis] - centerMin[axis]) * scale), BVH_NUM_BINS - 1) < bin)
+                i += 1;
+            else
+                std::swap(list[i], list[j--]);
         }
+        mid = i;
+    }
 
-        if (minResult.hit)
-            return minResult;
-
-        // Advance to the next cell with the 3D version of the DDA algorithm
-        // http://en.wikipedia.org/wiki/Digital_differential_analyzer_(graphics_algorithm)
-        Point p1 = grid.origin + Vector(
-            cur_i * grid.cellSizeX, 
-            cur_j * grid.cellSizeY, 
-            cur_k * grid.cellSizeZ);
-        Point p2 = grid.origin + Vector(
-            (cur_i + 1) * grid.cellSizeX, 
-            (cur_j + 1) * grid.cellSizeY, 
-            (cur_k + 1) * grid.cellSizeZ);
+    // Build the children
+    context.nodes[index].flags = axis;
+    buildBvh(context, list, begin, mid, depth + 1);
+    context.nodes[index].offset = context.nodes.size();
+    buildBvh(context, list, mid, end, depth + 1);
+}
 
-        float dx = 0; // this is not delta_x, but is distance_on_x_axis
-        float dy = 0; 
-        float dz = 0;
-        int di = 0;
-        int dj = 0;
-        int dk = 0;
+void Tunnel::mergeBvh(BvhBuildContext &top, int index, std::vector<BvhBuildJob *> &jobs)
+{
+    const BvhNode &node = top.nodes[index];
 
-        if (ray.direction.x > 0) // Plane x = p2.x
-        {
-            float cos_theta = ray.direction.x;
-            dx = (p2.x - cur_p.x) / cos_theta;
-            di = 1;
-        }
-        else // Plane x = p1.x
+    if (node.axis() == NoAxis && node.offset < 0) // the subtree of a job
+    {
+        std::vector<BvhNode> &subtree = jobs[-1 - node.offset]->context.nodes;
+        int nodeOffset = bvhNodes.size();
+        for (unsigned int i = 0; i < subtree.size(); i++)
         {
-            float cos_theta = -ray.direction.x;
-            dx = (cur_p.x - p1.x) / cos_theta;
-            di = -1;
+            bvhNodes.push_back(subtree[i]);
+            if (subtree[i].axis() != NoAxis)
+            {
+                bvhNodes.back().offset += nodeOffset;
+            }
         }
+    }
+    else if (node.axis() == NoAxis) // leaf
+    {
+        bvhNodes.push_back(node);
+    }
+    else // interior node
+    {
+        int newIndex = bvhNodes.size();
+        bvhNodes.push_back(node);
+        mergeBvh(top, index + 1, jobs);
+        bvhNodes[newIndex].offset = bvhNodes.size();
+        mergeBvh(top, node.offset, jobs);
+    }
+}
 
-        if (ray.direction.y > 0) // Plane y = p2.y
+void Tunnel::initBvh()
+{
+    Utils::PrintTickCount("Initialize BVH");
+
+    // Initialize the triangle list
+    int numIds = getTriangleId(getSegmentCount(), 0);
+    std::vector<BvhTriangle> list;
+    list.reserve(numIds);
+
+    for (int i = 0; i < getSegmentCount(); i++)
+    {
+        for (int j = 0; j < getTriangleCount(i); j++)
         {
-            float cos_theta = ray.direction.y;
-            dy = (p2.y - cur_p.y) / cos_theta;
-            dj = 1;
+            Triangle triangle;
+            BvhTriangle t;
+            t.id = getTriangleId(i, j);
+            getTriangle(t.id, triangle);
+            triangle.getBoundingBox(t.min, t.max);
+            t.center = Point(
+                (t.min.x + t.max.x) * 0.5f,
+                (t.min.y + t.max.y) * 0.5f,
+                (t.min.z + t.max.z) * 0.5f);
+            list.push_back(t);
         }
-        else // Plane y = p1.y
+    }
+
+    // Build the top of the hierarchy
+    int numThreads = omp_get_max_threads();
+    std::vector<BvhBuildJob *> jobs;
+    BvhBuildContext top;
+    top.jobs = (numThreads > 1) ? &jobs : NULL; // build serially with a single thread
+    top.jobCutoff = std::max(4096, (int)list.size() / (8 * numThreads)); // 8 jobs per thread or more
+    buildBvh(top, list, 0, list.size(), 0);
+
+    // Build the subtrees in parallel
+    #pragma omp parallel for schedule(dynamic, 1) // Enable OpenMP
+    for (int i = 0; i < (int)jobs.size(); i++)
+    {
+        BvhBuildJob *job = jobs[i];
+        buildBvh(job->context, list, job->begin, job->end, job->depth);
+    }
+
+    // Merge the subtrees into the flattened hierarchy
+    mergeBvh(top, 0, jobs);
+
+    int leaves = top.numLeaves;
+    for (unsigned int i = 0; i < jobs.size(); i++)
+    {
+        leaves += jobs[i]->context.numLeaves;
+        delete jobs[i];
+    }
+
+    // The triangles of a leaf are a range of the partitioned list, which is packed into blocks
+    // of four triangles. The offset of a leaf is then the index of its first block.
+    bvhBlocks.clear();
+    for (unsigned int i = 0; i < bvhNodes.size(); i++)
+    {
+        if (bvhNodes[i].axis() == NoAxis)
         {
-            float cos_theta = -ray.direction.y;
-            dy = (cur_p.y - p1.y) / cos_theta;
-            dj = -1;
+            int begin = bvhNodes[i].offset;
+            int count = bvhNodes[i].numTriangles();
+            bvhNodes[i].offset = bvhBlocks.size();
+            bvhBlocks.resize(bvhBlocks.size() + TriangleBlock::numBlocks(count));
+
+            for (int j = 0; j < count; j++)
+            {
+                int id = list[begin + j].id;
+                bvhBlocks[bvhNodes[i].offset + j / TriangleBlock::SIZE].set(
+                    j % TriangleBlock::SIZE, id, getTriangleRecord(id));
+            }
         }
+    }
+
+    Utils::DbgPrint("Total bvhNodes: %d (%d KB)\r\n", bvhNodes.size(), bvhNodes.size() * sizeof(BvhNode) / 1024);
+    Utils::DbgPrint("Total bvhBlocks: %d (%d KB)\r\n", bvhBlocks.size(), bvhBlocks.size() * sizeof(TriangleBlock) / 1024);
+    Utils::DbgPrint("Total jobs: %d\r\n", jobs.size());
+    Utils::DbgPrint("Total leaves: %d\r\n", leaves);
+    Utils::DbgPrint("Average Leaf Size: %d\r\n", list.size() / std::max(leaves, 1));
+}
+
+// Ordered traversal, the boxes of both children are tested and the nearer one is visited first.
+// The boxes beyond the nearest intersection found so far are skipped.
+IntersectResult Tunnel::bvhIntersect(Ray &ray)
+{
+    float invDir[3] =
+    {
+        1.0f / ray.direction.x,
+        1.0f / ray.direction.y,
+        1.0f / ray.direction.z
+    };
+
+    int minId = -1;
+    float entry;
+    if (!intersectBox(bvhNodes[0].min, bvhNodes[0].max, ray, invDir, ray.tMax, entry))
+        return IntersectResult(false);
+
+    // Stack of the far children to be visited, one for each level at most
+    BvhStackElem stack[BVH_MAX_DEPTH];
+    int stackSize = 0;
 
-        if (ray.direction.z > 0) // Plane z = p2.z
+    const BvhNode *base = &bvhNodes[0];
+    const BvhNode *currNode = base;
+
+    while (true)
+    {
+        if (currNode->axis() != NoAxis)
         {
-            float cos_theta = ray.direction.z;
-            dz = (p2.z - cur_p.z) / cos_theta;
-            dk = 1;
+            const BvhNode *left = currNode + 1;
+            const BvhNode *right = base + currNode->offset;
+            float leftEntry;
+            float rightEntry;
+            bool leftHit = intersectBox(left->min, left->max, ray, invDir, ray.tMax, leftEntry);
+            bool rightHit = intersectBox(right->min, right->max, ray, invDir, ray.tMax, rightEntry);
+
+            if (leftHit && rightHit)
+            {
+                // Visit the near child first
+                if (rightEntry < leftEntry)
+                {
+                    std::swap(left, right);
+                    std::swap(leftEntry, rightEntry);
+                }
+                stack[stackSize].node = right;
+                stack[stackSize].t = rightEntry;
+                stackSize += 1;
+                currNode = left;
+                continue;
+            }
+            else if (leftHit)
+            {
+                currNode = left;
+                continue;
+            }
+            else if (rightHit)
+            {
+                currNode = right;
+                continue;
+            }
         }
         else
         {
-            float cos_theta = -ray.direction.z;
-            dz = (cur_p.z - p1.z) / cos_theta;
-            dk = -1;
+            // Current node is a leaf, its triangles are tested four at a time
+            const TriangleBlock *block = &bvhBlocks[currNode->offset];
+            int numBlocks = TriangleBlock::numBlocks(currNode->numTriangles());
+            for (int i = 0; i < numBlocks; i++)
+            {
+                int lane = block[i].intersect(ray, ray.tMin, ray.tMax);
+                if (lane >= 0)
+                {
+                    minId = block[i].ids[lane];
+                }
+            }
         }
 
-        // Advance
-        if (dx < dy && dx < dz) // min = dx
-        {
-            cur_i += di;
-            cur_d += dx;
-            cur_p = ray.getPoint(cur_d);
-        }
-        else if (dy < dz) // min = dy
-        {
-            cur_j += dj;
-            cur_d += dy;
-            cur_p = ray.getPoint(cur_d);
-        }
-        else // min = dz
+        // Pop from stack, skip the bvhNodes entered beyond the nearest intersection
+        do
         {
-            cur_k += dk;
-            cur_d += dz;
-            cur_p = ray.getPoint(cur_d);
-        }
+            if (stackSize == 0)
+                return (minId >= 0) ? getTriangleHitResult(ray, minId, ray.tMax) : IntersectResult(false);
+            stackSize -= 1;
+        } while (stack[stackSize].t > ray.tMax);
+        currNode = stack[stackSize].node;
+    }
+}
 
-        // Leave the grid
-        if (cur_i < 0 || cur_i > grid.xLength - 1 ||
-            cur_j < 0 || cur_j > grid.yLength - 1 ||
-            cur_k < 0 || cur_k > grid.zLength - 1)
+// The slab test of a ray in a packet, returns the signed distance interval [entry, exit] of
+// the ray in the box. The direction of the ray has no zero component (RayPacket::isCoherent).
+static bool clipRayToBox(const Point &min, const Point &max, const Ray &ray, float &entry, float &exit)
+{
+    entry = 0.0f;
+    exit = FLT_MAX;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float t0 = (min[axis] - ray.origin[axis]) / ray.direction[axis];
+        float t1 = (max[axis] - ray.origin[axis]) / ray.direction[axis];
+        if (t0 > t1)
         {
-            break;
+            std::swap(t0, t1);
         }
+        entry = std::max(entry, t0);
+        exit = std::min(exit, t1);
     }
-
-    return IntersectResult(false);
+    return entry <= exit;
 }
 
-IntersectResult Tunnel::fastIntersect(Ray &ray)
+// Packet traversal of the grid, slice by slice along the major axis of the packet
+// "Ray Tracing Animated Scenes using Coherent Grid Traversal" by Ingo Wald et al.
+// The cells of a slice overlapped by the packet are bounded by the points where the rays
+// enter and leave the slice (the frustum of the packet), and the triangles in these cells
+// are tested against all the rays at once. A ray is terminated once its closest hit is
+// found in the current slice, or the rest of the ray lies beyond the closest hit.
+void Tunnel::gridIntersectPacket(RayPacket &packet, IntersectResult results[])
 {
-    RayContext &context = ray.context;
+    const int N = RayPacket::SIZE;
+    const float *origins[3] = { packet.ox, packet.oy, packet.oz };
+    const float *directions[3] = { packet.dx, packet.dy, packet.dz };
+    const float cellSize[3] = { grid.cellSizeX, grid.cellSizeY, grid.cellSizeZ };
+    const int length[3] = { grid.xLength, grid.yLength, grid.zLength };
 
-    Ray advRay = ray; // the advanced ray
-    float distance; // the advanced distance
+    Point far = grid.origin + Vector(
+        grid.cellSizeX * grid.xLength, 
+        grid.cellSizeY * grid.yLength, 
+        grid.cellSizeZ * grid.zLength);
 
-    if (!context.inTunnel)
+    // The slices are perpendicular to the major axis of the first ray
+    int k = (fabs(packet.dx[0]) > fabs(packet.dy[0])) ? 0 : 1;
+    if (fabs(packet.dz[0]) > fabs(directions[k][0]))
+        k = 2;
+    int u = (k + 1) % 3;
+    int v = (k + 2) % 3;
+    int step = (directions[k][0] > 0) ? 1 : -1;
+
+    float entry[N];
+    float exit[N];
+    float tMin[N];
+    float tMax[N];
+    float noLimit[N];
+    int minIds[N];
+    int active = 0;
+    int first = (step > 0) ? INT_MAX : -1;
+    int last = (step > 0) ? -1 : INT_MAX;
+
+    for (int i = 0; i < N; i++)
     {
-        Point newOrigin;
-        Vector newDir;
+        Ray &ray = *packet.rays[i];
+        tMin[i] = ray.tMin;
+        tMax[i] = ray.tMax;
+        noLimit[i] = FLT_MAX;
+        minIds[i] = -1;
 
-        // into the entrance of the tunnel
-        if (intersectWithPolygon(ray, 0, newOrigin, newDir, distance) && ray.direction.dot(nvs[0]) > 0)
-        {
-            context.inTunnel = true; // we know it will gets into the tunnel
-            context.segment = 0;
-            advRay.origin = ray.getPoint(distance);
-            advRay.direction = ray.direction;
-        }
-        else if (intersectWithPolygon(ray, path.size() - 1, newOrigin, newDir, distance) && 
-            ray.direction.dot(nvs[path.size() - 1]) < 0) // into the exit of the tunnel
-        {
-            context.inTunnel = true;
-            context.segment = path.size() - 2;
-            advRay.origin = ray.getPoint(distance);
-            advRay.direction = ray.direction;
-        }
-        else // the origin of the ray is not in the tunnel, and it does not gets into the tunnel
+        if (clipRayToBox(grid.origin, far, ray, entry[i], exit[i]) && entry[i] <= ray.tMax)
         {
-            return linearIntersect(ray);
+            active |= 1 << i;
+
+            // The range of slices the ray passes through
+            int s0 = (int)((ray.getPoint(entry[i])[k] - grid.origin[k]) / cellSize[k]);
+            int s1 = (int)((ray.getPoint(exit[i])[k] - grid.origin[k]) / cellSize[k]);
+            s0 = std::min(std::max(s0, 0), length[k] - 1);
+            s1 = std::min(std::max(s1, 0), length[k] - 1);
+            first = (step > 0) ? std::min(first, s0) : std::max(first, s0);
+            last = (step > 0) ? std::max(last, s1) : std::min(last, s1);
         }
     }
 
-    if (context.inTunnel)
+    for (int s = first; active != 0 && s != last + step; s += step)
     {
-        int N = path.size() - 1; // a path with with N segments has N + 1 nodes (range: 0 to N)
-        int begin = context.segment; // the current segment (range: 0 to N - 1)
-        enum RayDir dir = ray.direction.dot(nvs[begin]) > 0 ? Forward : Backward;
+        float plane0 = grid.origin[k] + s * cellSize[k];
+        float plane1 = plane0 + cellSize[k];
+
+        // The bounding rectangle of the rays in the slice
+        float uMin = FLT_MAX, uMax = -FLT_MAX;
+        float vMin = FLT_MAX, vMax = -FLT_MAX;
+        float sliceExit[N];
+        int lanes = 0;
 
-        if (dir == Forward)
+        for (int i = 0; i < N; i++)
         {
-            for (int i = begin + 1; i <= N; i++)
-            {
-                Point newOrigin;
-                Vector newDir;
+            if ((active & (1 << i)) == 0)
+                continue;
 
-                if (!intersectWithPolygon(advRay, i, newOrigin, newDir, distance)) // intersect with wall
-                {
-                    if (algorithm == ConvexSimple) // linear search in the current segment
-                    {
-                        for (unsigned int j = 0; j < surface[i - 1].size(); j++)
-                        {
-                            IntersectResult result = surface[i - 1][j]->intersect(ray);
-                            if (result.hit)
-                            {
-                                context.segment = i - 1;
-                                return result;
-                            }
-                        }
-                    }
-                    else // fast intersect
-                    {
-                        float y = newOrigin.y - newOrigin.x * newDir.y / newDir.x;
-                        int index = (int)(99.0f * y / height + 0.5f);
-                        index = std::max(0, index);
-                        index = std::min(99, index);
-
-                        float fAngle = atan2(newDir.y, newDir.x);
-                        fAngle = (fAngle < 0) ? fAngle + PI * 2 : fAngle;
-                        int iAngle = (int)(fAngle / PI * 180.0f);
-                        iAngle = std::max(0, iAngle);
-                        iAngle = std::min(359, iAngle);
-
-                        for (unsigned int j = 0; j < intersectionTableYAxis[index][iAngle].size(); j++)
-                        {
-                            int segmentIndex = intersectionTableYAxis[index][iAngle][j];
-
-                            IntersectResult result = surface[i - 1][segmentIndex]->intersect(ray);
-                            if (result.hit)
-                            {
-                                //Utils::DbgPrint("Intersect with triangle %d / %d\n", 
-                                //    j, intersectionTableYAxis[index][iAngle].size());
-                                context.segment = i - 1;
-                                return result;
-                            }
-                        }
-
-                        // As float point numbers are not accurate by nature, it's not a problem
-                        // when it gets here. Now advance the ray to the next polygon and try again.
-                        advRay.origin = advRay.getPoint(distance);
-                    }
-                }
-                else // intersect with polygon
-                {
-                    advRay.origin = advRay.getPoint(distance);
-                }
+            float t0 = (plane0 - origins[k][i]) / directions[k][i];
+            float t1 = (plane1 - origins[k][i]) / directions[k][i];
+            if (t0 > t1)
+                std::swap(t0, t1);
+            t0 = std::max(t0, entry[i]);
+            t1 = std::min(t1, exit[i]);
+
+            if (t0 > t1) // the ray does not pass through the slice
+                continue;
+
+            if (t0 > tMax[i]) // the rest of the ray lies beyond the closest hit
+            {
+                active &= ~(1 << i);
+                continue;
             }
 
-            // The ray intersects with all the polygons on the way
-            context.inTunnel = false;
-            return IntersectResult(false);
+            lanes |= 1 << i;
+            sliceExit[i] = t1;
+
+            float u0 = origins[u][i] + t0 * directions[u][i];
+            float u1 = origins[u][i] + t1 * directions[u][i];
+            float v0 = origins[v][i] + t0 * directions[v][i];
+            float v1 = origins[v][i] + t1 * directions[v][i];
+            uMin = std::min(uMin, std::min(u0, u1));
+            uMax = std::max(uMax, std::max(u0, u1));
+            vMin = std::min(vMin, std::min(v0, v1));
+            vMax = std::max(vMax, std::max(v0, v1));
         }
-        else if (dir == Backward)
+
+        if (lanes == 0)
+            continue;
+
+        // The cells overlapped by the rectangle, with a margin for the rounding errors
+        int cell[3];
+        int uBegin = (int)floor((uMin - grid.origin[u]) / cellSize[u] - 0.001f);
+        int uEnd = (int)floor((uMax - grid.origin[u]) / cellSize[u] + 0.001f);
+        int vBegin = (int)floor((vMin - grid.origin[v]) / cellSize[v] - 0.001f);
+        int vEnd = (int)floor((vMax - grid.origin[v]) / cellSize[v] + 0.001f);
+        uBegin = std::max(uBegin, 0);
+        vBegin = std::max(vBegin, 0);
+        uEnd = std::min(uEnd, length[u] - 1);
+        vEnd = std::min(vEnd, length[v] - 1);
+
+        cell[k] = s;
+        for (cell[u] = uBegin; cell[u] <= uEnd; cell[u]++)
         {
-            Utils::DbgPrint("Backward");
-#if 0
-            for (int i = begin; i >= 0; i--)
+            for (cell[v] = vBegin; cell[v] <= vEnd; cell[v]++)
             {
-                Point newOrigin;
-                Vector newDir;
-
-                if (!intersectWithPolygon(ray, i, newOrigin, newDir, distance)) // intersect with wall
+                const int *list;
+                int count = grid.cells.get(cell[0], cell[1], cell[2], list);
+                for (int j = 0; j < count; j++)
                 {
-                    if (fabs(newDir.x) > 0.707f) // use y axis
-                    {
-                        float y = newOrigin.y - newOrigin.x * newDir.y / newDir.x;
-                        int index = (int)(99.0f * y / height + 0.5f);
-                        index = std::max(0, index);
-                        index = std::min(99, index);
-
-                        float fAngle = atan2(newDir.y, newDir.x);
-                        fAngle = (fAngle < 0) ? fAngle + PI * 2 : fAngle;
-                        int iAngle = (int)(fAngle / PI * 180.0f);
-                        iAngle = std::max(0, iAngle);
-                        iAngle = std::min(359, iAngle);
-
-                        for (unsigned int j = 0; j < intersectionTableYAxis[index][iAngle].size(); j++)
-                        {
-                            int segmentIndex = intersectionTableYAxis[index][iAngle][j];
-
-                            IntersectResult result = surface[i - 1][segmentIndex]->intersect(ray);
-                            if (result.hit)
-                            {
-                                Utils::DbgPrint("Intersect with triangle %d / %d\n", 
-                                    j, intersectionTableYAxis[index][iAngle].size());
-                                context->segment = i - 1;
-                                return result;
-                            }
-                        }
-
-                        // As float point numbers are not accurate by nature, it's not a problem
-                        // when it gets here
-                    }
-                    else // use a line which parallel to x axis
+                    int hits = packet.intersect(getTriangleRecord(list[j]), lanes, tMin, noLimit, tMax);
+                    for (int i = 0; hits != 0; i++, hits >>= 1)
                     {
-                        float x = newOrigin.x + (height / 2 - newOrigin.y) * (newDir.x / newDir.y);
-                        int index = (int)((x / width + 0.5f) * 99 + 0.5f);
-                        index = std::max(0, index);
-                        index = std::min(99, index);
-
-                        float fAngle = atan2(newDir.y, newDir.x);
-                        fAngle = (fAngle < 0) ? fAngle + PI * 2 : fAngle;
-                        int iAngle = (int)(fAngle / PI * 180.0f);
-                        iAngle = std::max(0, iAngle);
-                        iAngle = std::min(359, iAngle);
-
-                        for (unsigned int j = 0; j < intersectionTableXAxis[index][iAngle].size(); j++)
-                        {
-                            int segmentIndex = intersectionTableXAxis[index][iAngle][j];
-
-                            IntersectResult result = surface[i - 1][segmentIndex]->intersect(ray);
-                            if (result.hit)
-                            {
-                                Utils::DbgPrint("Intersect with triangle %d / %d\n", 
-                                    j, intersectionTableXAxis[index][iAngle].size());
-                                context->segment = i - 1;
-                                return result;
-                            }
-                        }
+                        if (hits & 1)
+                            minIds[i] = list[j];
                     }
-
-                    advRay.origin = advRay.getPoint(distance);
-                }
-                else
-                {
-                    advRay.origin = advRay.getPoint(distance);
                 }
             }
+        }
 
-            // The ray intersects with all the polygons on the way
-            context->inTunnel = false;
-            return IntersectResult(false);
-#endif
+        // A hit in the slice is the closest one, as the slices are visited in order
+        for (int i = 0; i < N; i++)
+        {
+            if ((lanes & (1 << i)) && tMax[i] <= sliceExit[i])
+                active &= ~(1 << i);
         }
     }
 
-    // Just to avoid warnings. It's impossible to get here
-    return IntersectResult(false);
+    for (int i = 0; i < N; i++)
+    {
+        Ray &ray = *packet.rays[i];
+        if (minIds[i] >= 0)
+        {
+            ray.tMax = tMax[i];
+            results[i] = getTriangleHitResult(ray, minIds[i], tMax[i]);
+        }
+        else
+        {
+            results[i] = IntersectResult(false);
+        }
+    }
 }
 
-IntersectResult Tunnel::kdTreeIntersect(Ray &ray)
+// Packet traversal of the k-d tree
+// "Interactive Rendering with Coherent Ray Tracing" by Ingo Wald et al.
+// The rays of the packet have the same direction signs, so they visit the children of a node
+// in the same order. The packet goes down to the near child, the far child or both, depending
+// on where the active rays cross the splitting plane. A ray is inactive in a subtree if its
+// signed distance interval in it is empty, or it lies beyond the closest hit of the ray.
+void Tunnel::kdTreeIntersectPacket(RayPacket &packet, IntersectResult results[])
 {
-    // Based on the C-pseudo code in page 157
-    float a; // entry signed distance
-    float b; // exit signed distance
-    float t; // signed distance to the splitting plane
-
-    // Intersect ray with sceneBox, find the entry and exit signed distance
-    Grid sceneBox(root->min, root->max);
-    if (!sceneBox.intersect(ray, a, b))
-        return IntersectResult(false);
-
-    // Stack required for traversal to store far children
-    StackElem stack[50];
-
-    // Pointers to the far child node and current node
-    KdNode *farChild;
-    KdNode *currNode;
-    currNode = root;
+    const int N = RayPacket::SIZE;
+    const float *origins[3] = { packet.ox, packet.oy, packet.oz };
+    const float *directions[3] = { packet.dx, packet.dy, packet.dz };
+    const bool positive[3] = { packet.dx[0] > 0, packet.dy[0] > 0, packet.dz[0] > 0 };
+
+    float tNear[N];
+    float tFar[N];
+    float tMax[N];
+    float lo[N];
+    float hi[N];
+    int minIds[N];
+    int done = 0; // the lanes whose closest hit is found, or miss the tree
+
+    for (int i = 0; i < N; i++)
+    {
+        Ray &ray = *packet.rays[i];
+        tMax[i] = ray.tMax;
+        minIds[i] = -1;
 
-    // Setup initial entry point
-    int enPt = 0;
-    stack[enPt].t = a; // Set the signed distance
+        if (!clipRayToBox(kdMin, kdMax, ray, tNear[i], tFar[i]) || tNear[i] > ray.tMax)
+            done |= 1 << i;
+    }
 
-    // Distinguish between internal and external origin
-    if (a >= 0) // a ray with external origin
-        stack[enPt].pb = ray.origin + ray.direction * a;
-    else // a ray with internal origin
-        stack[enPt].pb = ray.origin;
+    KdPacketStackElem stack[KD_PACKET_STACK_SIZE];
+    int stackSize = 0;
 
-    // Setup initial exit point in the stack
-    int exPt = 1;
-    stack[exPt].t = b;
-    stack[exPt].pb = ray.origin + ray.direction * b;
-    stack[exPt].node = NULL; // Termination flag
+    const KdNode *base = &nodes[0];
+    const KdNode *currNode = base;
 
-    // Loop, traverse through the whole kd-tree
-    while (currNode != NULL)
+    while (done != RayPacket::ALL_LANES)
     {
         // Loop until a leaf is found
-        while (currNode->axis != NoAxis)
+        while (currNode->axis() != NoAxis)
         {
-            // Retrive position of splitting plane
+            int axis = (int)currNode->axis();
             float splitVal = currNode->splitPlane;
+            const KdNode *nearChild = positive[axis] ? currNode + 1 : base + currNode->rightChild();
+            const KdNode *farChild = positive[axis] ? base + currNode->rightChild() : currNode + 1;
 
-            // The current axis
-            int axis = (int)currNode->axis;
-            int nextAxis = (axis + 1) % 3; // x -> y -> z -> x ...
-            int prevAxis = (axis + 2) % 3; // z -> y -> x -> z ...
-
-            if (stack[enPt].pb[axis] <= splitVal)
+            // Signed distances to the splitting plane
+            float t[N];
+            bool toNear = false;
+            bool toFar = false;
+            for (int i = 0; i < N; i++)
             {
-                // Case N1, N2, N3, P5, Z2 and Z3
-                if (stack[exPt].pb[axis] <= splitVal)
+                t[i] = (splitVal - origins[axis][i]) / directions[axis][i];
+                if ((done & (1 << i)) == 0 && tNear[i] <= tFar[i])
                 {
-                    currNode = currNode->left;
-                    continue;
+                    toNear = toNear || tNear[i] <= t[i];
+                    toFar = toFar || t[i] <= tFar[i];
                 }
+            }
 
-                // Case Z1
-                if (stack[exPt].pb[axis] == splitVal)
+            if (toNear && toFar)
+            {
+                // Traverse both children, the far child is pushed with the rest of the intervals
+                stack[stackSize].node = farChild;
+                for (int i = 0; i < N; i++)
                 {
-                    currNode = currNode->right;
-                    continue;
+                    stack[stackSize].tNear[i] = std::max(t[i], tNear[i]);
+                    stack[stackSize].tFar[i] = tFar[i];
+                    tFar[i] = std::min(t[i], tFar[i]);
                 }
-
-                // Case N4
-                farChild = currNode->right;
-                currNode = currNode->left;
+                stackSize += 1;
+                currNode = nearChild;
             }
-            else // stack[enPt].pb[axis] > splitVal
+            else if (toFar)
             {
-                // Case P1, P2, P3 and N5
-                if (splitVal < stack[exPt].pb[axis])
-                {
-                    currNode = currNode->right;
-                    continue;
-                }
-
-                // Case P4
-                farChild = currNode->left;
-                currNode = currNode->right;
+                currNode = farChild;
+            }
+            else
+            {
+                currNode = nearChild;
             }
-            // Case P4 or N4 (traverse both children)
-
-            // Signed distance to the splitting plane
-            t = (splitVal - ray.origin[axis]) / ray.direction[axis];
-
-            // Setup the new exit point
-            int tmp = exPt++;
-            if (exPt == enPt)
-                exPt += 1;
-
-            // Push values onto the stack
-            stack[exPt].prev = tmp;
-            stack[exPt].t = t;
-            stack[exPt].node = farChild;
-            stack[exPt].pb[axis] = splitVal;
-            stack[exPt].pb[nextAxis] = ray.origin[nextAxis] + t * ray.direction[nextAxis];
-            stack[exPt].pb[prevAxis] = ray.origin[prevAxis] + t * ray.direction[prevAxis];
         }
 
         // Current node is the leaf, empty or full
-        float minDistance = FLT_MAX;
-        IntersectResult minResult(false);
-
-        for (unsigned int i = 0; i < currNode->list.size(); i++)
+        int lanes = 0;
+        for (int i = 0; i < N; i++)
         {
-            IntersectResult result = currNode->list[i]->intersect(ray);
-            if (result.hit && 
-                result.distance >= stack[enPt].t - 0.001f && 
-                result.distance <= stack[exPt].t + 0.001f &&
-                result.distance < minDistance)
+            if ((done & (1 << i)) == 0 && tNear[i] <= tFar[i] && tNear[i] <= tMax[i])
             {
-                minResult = result;
-                minDistance = result.distance;
+                lanes |= 1 << i;
+                lo[i] = std::max(tNear[i] - 0.001f, packet.rays[i]->tMin);
+                hi[i] = tFar[i] + 0.001f;
             }
         }
-        
-        if (minResult.hit)
-            return minResult;
 
-        // Pop from stack
-        enPt = exPt; // The signed distance intervals are adjacent
+        for (unsigned int j = 0; lanes != 0 && j < currNode->numTriangles(); j++)
+        {
+            const TriangleBlock &block = kdBlocks[currNode->offset + j / TriangleBlock::SIZE];
+            int lane = j % TriangleBlock::SIZE;
+            int id = block.ids[lane];
+            int hits = packet.intersect(block.getRecord(lane), lanes, lo, hi, tMax);
+
+            // Only the hits in the leaf are accepted, which are the closest ones
+            done |= hits;
+            for (int i = 0; hits != 0; i++, hits >>= 1)
+            {
+                if (hits & 1)
+                    minIds[i] = id;
+            }
+        }
 
-        // Retrieve the pointer to the next node,
-        // it is possible that ray traversal terminates
-        currNode = stack[exPt].node;
+        // Pop from stack, skip the nodes without active lanes
+        bool found = false;
+        while (!found && stackSize > 0)
+        {
+            stackSize -= 1;
+            for (int i = 0; i < N; i++)
+            {
+                tNear[i] = stack[stackSize].tNear[i];
+                tFar[i] = stack[stackSize].tFar[i];
+                if ((done & (1 << i)) == 0 && tNear[i] <= tFar[i] && tNear[i] <= tMax[i])
+                    found = true;
+            }
+            currNode = stack[stackSize].node;
+        }
 
-        exPt = stack[enPt].prev;
+        if (!found)
+            break;
     }
 
-    // currNode = NULL, ray leaves the scene
-    return IntersectResult(false);
+    for (int i = 0; i < N; i++)
+    {
+        Ray &ray = *packet.rays[i];
+        if (minIds[i] >= 0)
+        {
+            ray.tMax = tMax[i];
+            results[i] = getTriangleHitResult(ray, minIds[i], tMax[i]);
+        }
+        else
+        {
+            results[i] = IntersectResult(false);
+        }
+    }
 }
 
 IntersectResult Tunnel::intersect(Ray &ray)
 {
     if (algorithm == RegularGrid || algorithm == FlatGrid)
         return gridIntersect(ray);
+    else if (algorithm == HierarchicalGrid)
+        return hgridIntersect(ray);
     else if (algorithm == KdTreeSAH || algorithm == KdTreeStandard)
         return kdTreeIntersect(ray);
     else if (algorithm == Convex || algorithm == ConvexSimple)
         return fastIntersect(ray);
+    else if (algorithm == Bvh)
+        return bvhIntersect(ray);
     else
         return linearIntersect(ray);
 }
+
+void Tunnel::intersectPacket(RayPacket &packet, IntersectResult results[])
+{
+    // Packet traversal requires the rays to visit the cells / nodes in the same order
+    if (!packet.isCoherent())
+        Geometry::intersectPacket(packet, results);
+    else if (algorithm == RegularGrid || algorithm == FlatGrid)
+        gridIntersectPacket(packet, results);
+    else if (algorithm == KdTreeSAH || algorithm == KdTreeStandard)
+        kdTreeIntersectPacket(packet, results);
+    else
+        Geometry::intersectPacket(packet, results);
+}
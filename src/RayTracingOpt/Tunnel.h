@@ -3,14 +3,41 @@
 
 #include <vector>
 #include "Triangle.h"
+#include "TriangleBlock.h"
+#include "GridCells.h"
+#include "RayPacket.h"
 #include "Polygon.h"
+#include "Polyhedron.h"
 
 class Tunnel : public Geometry
 {
 public:
     Polygon crossSection; // the cross section at the origin
     std::vector<Point> path;
-    std::vector<std::vector<Triangle *>> surface;
+    std::vector<std::vector<Triangle *>> surface; // empty if the surface is procedural
+    std::vector<TriangleRecord> records; // the surface triangles indexed by id, built by init()
+
+    // Procedural surface
+    // ------------------------------------------------------------------------------------
+    // Instead of storing the triangles, rebuild them on the fly from the cross section and
+    // the path. The triangles of segment i connect the front polygon (at path node i) and
+    // the rear polygon (at path node i + 1), which are the cross section rotated around the
+    // y axis. How the two polygons are connected is the same for most segments, so only the
+    // distinct connection patterns are stored.
+    struct SegmentFrame
+    {
+        float cosFront, sinFront;
+        float cosRear, sinRear;
+    };
+    bool procedural;
+    std::vector<SegmentFrame> segmentFrames;
+    std::vector<short> segmentPatterns; // index in connectionPatterns, -1 if not convex
+    std::vector<std::vector<Polyhedron::ConnectionType>> connectionPatterns;
+
+    // The ground and the wall of a procedural surface. They carry the materials,
+    // and are returned as the geometry of the intersect results.
+    Triangle groundPrototype;
+    Triangle wallPrototype;
 
     // The algorithm used in tunnel-ray intersection
     enum Algorithm 
@@ -18,9 +45,14 @@ public:
         Linear = 0,
         RegularGrid = 1, FlatGrid = 2, 
         KdTreeStandard = 3, KdTreeSAH = 4, 
-        Convex = 5, ConvexSimple = 6 // the same order with the combobox items
+        Convex = 5, ConvexSimple = 6, 
+        Bvh = 7,
+        HierarchicalGrid = 8 // the same order with the combobox items
     } algorithm;
 
+    // The number of cells along the longest axis (regular grid) or each axis (flat grid)
+    int gridResolution;
+
     // whether a point on the cross section is a critical point
     enum { FLAG_NONE = 0, FLAG_CRITICAL = 1 };
 
@@ -38,12 +70,31 @@ private: // Convex polygon acceleration
     std::vector<Vector> nvs; // normal vectors of the polygons
     std::vector<EdgeParam> edgeParams;
 
+    // Maps a point / vector into the local frame of a path node, in which
+    // the node is at the origin and the polygon normal is (0, 0, -1):
+    //     x' =  cosTheta * x + sinTheta * z + tx
+    //     y' =  y + ty
+    //     z' = -sinTheta * x + cosTheta * z + tz
+    struct NodeFrame
+    {
+        float cosTheta, sinTheta;
+        float tx, ty, tz;
+        float reserved[3]; // pad to 32 bytes, two frames per cache line
+    };
+    NodeFrame *frames; // one per path node, 64-byte aligned
+
     // decide whether a point is in a convex polygon
     enum IntersectionTableResult { Hit, Partial, Miss };
     IntersectionTableResult intersectionTable[400][400];
 
 private: // Convex polyhedron acceleration
-    std::vector<int> intersectionTableYAxis[100][360];
+    std::vector<int> intersectionTableYAxis[100][360]; // the blocks of a segment in the order of testing
+
+    // The triangles of each segment packed by four, so that block i of a segment holds the
+    // triangles of the edges 2 * i and 2 * i + 1 of the cross section. A procedural surface
+    // is not stored, and its blocks are rebuilt on the fly.
+    std::vector<TriangleBlock> wallBlocks;
+    int blocksPerSegment;
     //short intersectionTableFull[100][100][360][20]; // 144 MB
 
 private: // Grid Acceleration 
@@ -58,65 +109,273 @@ private: // Grid Acceleration
         int yLength;
         int zLength;
 
-        std::vector<std::vector<Triangle *>> data;
-
-        std::vector<Triangle *> &get(int x, int y, int z)
-        {
-            return data[(x * yLength + y) * zLength + z];
-        }
+        GridCells cells; // triangle ids
     } grid;
 
+    // Two-level grid
+    // The top grid (stored in grid) has large cubic cells, and each non-empty cell is cut
+    // again into a sub-grid, whose resolution follows the number of triangles in the cell.
+    // So the cells are small near the dense parts of the walls, while the empty interior of
+    // the tunnel costs a few top cells.
+    static const float GRID_TOP_DENSITY; // the top cells for each triangle
+    static const float GRID_SUB_DENSITY; // the sub-grid cells for each triangle in a top cell
+    enum { GRID_MAX_SUB_RESOLUTION = 32 };
+
+    struct SubGrid
+    {
+        Point origin;
+        float cellSize;
+        int length;    // the cells along each axis
+        int firstCell; // the index of cell (0, 0, 0) in offsets
+    };
+
+    struct TwoLevelGrid
+    {
+        std::vector<SubGrid> subGrids; // in the order of GridCells::getIndex() of the top cells
+        std::vector<int> offsets;      // the first id of each sub-grid cell, and the end
+        std::vector<int> ids;          // the triangle ids
+    } hgrid;
+
 private: // k-d tree acceleration
 
     // The recursive ray traversal algorithm TA_rec_B for the k-d tree
     // "Heuristic Ray Shooting Algorithms" by Vlastimil Vavran (Appendix C)
 
     enum Axes { XAxis, YAxis, ZAxis, NoAxis }; // "NoAxis" denotes a leaf
+    enum KdEventType { End, Planar, Start };
+
+    // The tree is flattened into an array of 8-byte nodes in depth-first order,
+    // so the left child of an interior node is the node right after it
     struct KdNode
     {
-        std::vector<Geometry *> list; // list of enclosed objects
-        KdNode *left;  // pointer to the left child
-        KdNode *right; // pointer to the right child
-        Axes axis;         // orientation of the splitting plane
-        float splitPlane;  // position of the splitting plane
+        union
+        {
+            float splitPlane;  // position of the splitting plane (interior node)
+            int offset;        // offset of the enclosed triangles in triangleIds while building,
+                               // then index of the first block of them in kdBlocks (leaf)
+        };
+        unsigned int flags; // bits 0-1: orientation of the splitting plane, NoAxis for a leaf
+                            // bits 2-31: index of the right child (interior node),
+                            //            or the number of enclosed triangles (leaf)
 
-        Point min;
-        Point max;
+        Axes axis() const { return (Axes)(flags & 3); }
+        unsigned int rightChild() const { return flags >> 2; }
+        unsigned int numTriangles() const { return flags >> 2; }
     };
     struct StackElem
     {
-        KdNode *node;  // pointer of far child
+        const KdNode *node; // pointer of far child
         float t;           // the entry / exit signed distance
         Point pb;          // the coordinates of entry / exit point
         int prev;          // the pointer to the previous stack item
     };
-    KdNode *root;
+    std::vector<KdNode> nodes;           // nodes[0] is the root
+    std::vector<int> triangleIds;        // the enclosed triangles of all leaves, only used while building
+    std::vector<TriangleBlock> kdBlocks; // the enclosed triangles of all leaves, packed by four
+
+    // Packet traversal, each lane of the packet has its own signed distance interval
+    // [tNear, tFar] in the current node, which is empty if the lane is inactive
+    struct KdPacketStackElem
+    {
+        const KdNode *node; // the far child
+        float tNear[RayPacket::SIZE];
+        float tFar[RayPacket::SIZE];
+    };
+    enum { KD_PACKET_STACK_SIZE = 64 };
+
+    // The bounding box of the root node
+    Point kdMin;
+    Point kdMax;
+
+    // The triangles of the tunnel indexed by id, which are rebuilt temporarily
+    // as the tunnel may not store them. Only valid while building the tree.
+    Triangle *triangles;
+
+    // SAH construction in O(N log N)
+    // "On building fast kd-Trees for Ray Tracing, and on doing that in O(N log N)"
+    // by Ingo Wald and Vlastimil Havran
+    // The events of each axis are sorted only once for the root. The sorted lists of a node
+    // are split into those of its children, and only the events of the triangles overlapping
+    // both children are created and sorted again.
+    static const float KT; // cost of a traversal step
+    static const float KI; // cost of a ray-triangle intersection
+
+    enum KdSide { LeftOnly, RightOnly, Both };
+
+public: // should be exposed to the compare functions for sorting
+    struct KdEvent
+    {
+        int triangle; // triangle id
+        float position;
+        KdEventType type;
+
+        KdEvent(int triangle, float position, KdEventType type) : 
+            triangle(triangle), position(position), type(type) {}
+    };
+
+private:
+    // Parallel construction
+    // The top of the tree is built first, and the subtrees that are small enough are left to
+    // jobs. The jobs are built in parallel, each into its own node array, and then merged into
+    // the flattened tree in depth-first order. The subtree of a job is represented in the top
+    // of the tree by a placeholder leaf, whose offset is -1 - (index of the job).
+    struct KdBuildJob;
+    struct KdBuildContext
+    {
+        std::vector<KdNode> nodes;
+        std::vector<int> triangleIds;
+        std::vector<char> *sides;        // the side of each triangle in the current split (SAH only)
+        std::vector<KdBuildJob *> *jobs; // where the subtrees are left to, NULL in a job
+        unsigned int jobCutoff;          // the max number of triangles in a subtree left to a job
+        int numLeaves;
+        int leafElements;
+
+        KdBuildContext() : sides(NULL), jobs(NULL), jobCutoff(0), numLeaves(0), leafElements(0) {}
+    };
+    struct KdBuildJob
+    {
+        Point min;
+        Point max;
+        int depth;
+        std::vector<Triangle *> list;   // the enclosed triangles (median split)
+        std::vector<KdEvent> events[3]; // the sorted events (SAH)
+        KdBuildContext context;         // the subtree
+    };
+
+private: // BVH acceleration
+    enum { BVH_NUM_BINS = 16, BVH_MAX_LEAF_SIZE = 4, BVH_MAX_DEPTH = 64 };
+
+    // The hierarchy is flattened into an array of 32-byte nodes in depth-first order,
+    // so the first child of an interior node is the node right after it
+    struct BvhNode
+    {
+        Point min;  // the bounding box of the node
+        Point max;
+        int offset; // index of the second child (interior node),
+                    // or index of the first block of the enclosed triangles in bvhBlocks (leaf)
+        unsigned int flags; // bits 0-1: the split axis, NoAxis for a leaf
+                            // bits 2-31: the number of enclosed triangles (leaf)
+
+        Axes axis() const { return (Axes)(flags & 3); }
+        unsigned int numTriangles() const { return flags >> 2; }
+    };
+    std::vector<BvhNode> bvhNodes;          // bvhNodes[0] is the root
+    std::vector<TriangleBlock> bvhBlocks;   // the enclosed triangles of all leaves, packed by four
+
+    struct BvhStackElem
+    {
+        const BvhNode *node; // the far child
+        float t;             // the entry signed distance of its box
+    };
+
+    // Binned SAH construction
+    // "On fast Construction of SAH-based Bounding Volume Hierarchies" by Ingo Wald
+    // The centroids of the triangles are put into BVH_NUM_BINS bins along each axis, and only
+    // the planes between the bins are evaluated, with the costs KT and KI of the k-d tree.
+    // The triangles are partitioned in place, so those of a leaf are a range of the list.
+    struct BvhTriangle
+    {
+        Point min;    // the bounding box
+        Point max;
+        Point center; // the centroid of the bounding box
+        int id;
+    };
+    struct BvhBin
+    {
+        Point min;
+        Point max;
+        int count;
+    };
+
+    // Parallel construction, the same as the k-d tree
+    // The top of the hierarchy is built first, and the subtrees that are small enough are left
+    // to jobs. The jobs are built in parallel, each into its own node array, and then merged
+    // in depth-first order. The subtree of a job is represented in the top of the hierarchy by
+    // a placeholder leaf, whose offset is -1 - (index of the job).
+    struct BvhBuildJob;
+    struct BvhBuildContext
+    {
+        std::vector<BvhNode> nodes;
+        std::vector<BvhBuildJob *> *jobs; // where the subtrees are left to, NULL in a job
+        int jobCutoff;                    // the max number of triangles in a subtree left to a job
+        int numLeaves;
+
+        BvhBuildContext() : jobs(NULL), jobCutoff(0), numLeaves(0) {}
+    };
+    struct BvhBuildJob
+    {
+        int begin; // the range of the triangle list
+        int end;
+        int depth;
+        BvhBuildContext context; // the subtree
+    };
 
 private:
     bool intersectWithPolygon(Ray &ray, int index, Point &origin, Vector &dir, float &distance);
     bool intersectWithPolygonAtOrigin(Ray &ray, float &distance);
     bool inPolygon(const Point &p);
+    bool intersectWithWall(Ray &ray, int segment, const Point &origin, const Vector &dir, IntersectResult &result);
+    bool intersectWithWallBlock(Ray &ray, int segment, int index, IntersectResult &result);
     void getIndexInGrid(const Point &p, int &i, int &j, int&k);
+    void getVertices(int segment, int index, Point &a, Point &b, Point &c);
 
     IntersectResult linearIntersect(Ray &ray);
     IntersectResult gridIntersect(Ray &ray);
+    IntersectResult hgridIntersect(Ray &ray);
+    void subGridIntersect(Ray &ray, const float invDir[3], const SubGrid &sub, float entryDistance, 
+        Mailbox &mailbox, int &minId);
     IntersectResult fastIntersect(Ray &ray);
     //IntersectResult kdTreeLinearIntersect(Ray &ray);
     IntersectResult kdTreeIntersect(Ray &ray);
+    IntersectResult bvhIntersect(Ray &ray);
+    void gridIntersectPacket(RayPacket &packet, IntersectResult results[]);
+    void kdTreeIntersectPacket(RayPacket &packet, IntersectResult results[]);
 
+    void initRecords();
     void initConvex();
     void initGrid();
+    void initSubGrids();
+    void getSubGridBox(const SubGrid &sub, Triangle &t, CellBox &box);
     void initKdTree();
-    void buildKdTree(KdNode *node, std::vector<Triangle *> &list, int depth, int &numLeaves, int &leafElements);
-    void deleteTree(KdNode *node);
-    float split(KdNode *node, int axis, std::vector<Triangle *> &list);
-    float splitSAH(KdNode *node, std::vector<Triangle *> &list, int &bestAxis);
+    void buildKdTree(KdBuildContext &context, const Point &min, const Point &max, 
+        std::vector<Triangle *> &list, int depth);
+    void initLeaf(KdBuildContext &context, int index, std::vector<Triangle *> &list);
+    KdBuildJob *addJob(KdBuildContext &context, int index, const Point &min, const Point &max, int depth);
+    void mergeKdTree(KdBuildContext &top, int index, std::vector<KdBuildJob *> &jobs);
+    float split(int axis, std::vector<Triangle *> &list);
+    void buildKdTreeSAH(KdBuildContext &context, const Point &min, const Point &max, 
+        std::vector<KdEvent> events[3], int depth);
+    void addEvents(int id, const Point &min, const Point &max, std::vector<KdEvent> events[3]);
+    float findPlane(const Point &min, const Point &max, std::vector<KdEvent> events[3], int numTriangles, 
+        bool parallel, int &bestAxis, bool &planarLeft, float &minCost);
+    void initBvh();
+    void buildBvh(BvhBuildContext &context, std::vector<BvhTriangle> &list, int begin, int end, int depth);
+    float findBvhSplit(std::vector<BvhTriangle> &list, int begin, int end, const Point &min, const Point &max,
+        const Point &centerMin, const Point &centerMax, bool parallel, int &bestAxis, int &bestBin);
+    void mergeBvh(BvhBuildContext &top, int index, std::vector<BvhBuildJob *> &jobs);
 
 public:
     Tunnel();
     ~Tunnel();
     void init();
     virtual IntersectResult intersect(Ray &ray);
+    virtual void intersectPacket(RayPacket &packet, IntersectResult results[]);
+
+    // Triangle #index (0 <= index < getTriangleCount(segment)) of a segment is also
+    // identified by id = segment * 2 * crossSection.vertices.size() + index
+    int getSegmentCount();
+    int getTriangleCount(int segment);
+    int getTriangleId(int segment, int index);
+    void getTriangle(int id, Triangle &triangle);
+    TriangleRecord getTriangleRecord(int id);
+    IntersectResult intersectTriangle(Ray &ray, int segment, int index);
+    IntersectResult intersectTriangle(Ray &ray, int id);
+
+    // Deferred shading, used in the inner loops of the accelerators
+    // Only the signed distance of a hit is computed for each candidate triangle, and the
+    // position and the normal are computed once for the closest hit.
+    bool intersectTriangleDistance(Ray &ray, int id, float &distance);
+    IntersectResult getTriangleHitResult(Ray &ray, int id, float distance);
 };
 
 #endif
@@ -194,17 +194,36 @@ void TunnelGenerator::clear()
 }
 */
 
+short TunnelGenerator::addConnectionPattern(
+    Tunnel *tunnel, const std::vector<Polyhedron::ConnectionType> &connections)
+{
+    // There are only a few distinct patterns, a linear search is enough
+    for (unsigned int i = 0; i < tunnel->connectionPatterns.size(); i++)
+    {
+        if (tunnel->connectionPatterns[i] == connections)
+        {
+            return (short)i;
+        }
+    }
+    tunnel->connectionPatterns.push_back(connections);
+    return (short)(tunnel->connectionPatterns.size() - 1);
+}
+
 bool TunnelGenerator::create(
     float rectWidth, float rectHeight, float archHeight, // cross section attributes
     float pathRadius, float pathAngle, // path attributes
     int archSegments, int pathSegments, // tessellation attributes
-    GeometrySet &scene, Ptr<Material> groundMaterial, Ptr<Material> wallMaterial, 
-    Tunnel::Algorithm algorithm)
+    GeometrySet &scene, unsigned short groundMaterial, unsigned short wallMaterial, 
+    Tunnel::Algorithm algorithm,
+    bool procedural)
 {
     Tunnel *tunnel = new Tunnel();
     tunnel->height = rectHeight + archHeight;
     tunnel->width = rectWidth;
     tunnel->algorithm = algorithm;
+    tunnel->procedural = procedural;
+    tunnel->groundPrototype.material = groundMaterial;
+    tunnel->wallPrototype.material = wallMaterial;
 
     // 1. Create the cross section at the origin
     // ------------------------------------------------------------------------------------
@@ -261,14 +280,23 @@ bool TunnelGenerator::create(
             tunnel->path.push_back(p2);
         }
 
-        tunnel->surface.push_back(std::vector<Triangle *>());
+        if (!procedural)
+        {
+            tunnel->surface.push_back(std::vector<Triangle *>());
+        }
+    }
+
+    if (procedural)
+    {
+        tunnel->segmentFrames.resize(pathSegments);
+        tunnel->segmentPatterns.resize(pathSegments, -1);
     }
 
     // 3. Traverse the path
+    // The triangles created in parallel only copy the material indices of the scene, and
+    // each iteration writes its own segment. The only shared writes are the connection
+    // patterns, which are added in a critical section.
     #pragma omp parallel for schedule(dynamic, 1) // Enable OpenMP
-    // !!! Warning: when multi-threading is enabled, smart pointers may fail to work!
-    // !!! Make sure the smart pointer is thread-safe!
-
     for (int i = 0; i < pathSegments; i++)
     {
         //            xxx..
@@ -315,6 +343,17 @@ bool TunnelGenerator::create(
             Utils::DbgPrint("Polyhedron %d is not convex!\n", i + 1);
             // return false; // when OpenMP is enabled, there should not be returns
         }
+        else if (procedural) // 3.3 Record how to rebuild the triangles
+        {
+            Tunnel::SegmentFrame &frame = tunnel->segmentFrames[i];
+            frame.cosFront = cos(offsetAngle1);
+            frame.sinFront = sin(offsetAngle1);
+            frame.cosRear = cos(offsetAngle2);
+            frame.sinRear = sin(offsetAngle2);
+
+            #pragma omp critical
+            tunnel->segmentPatterns[i] = addConnectionPattern(tunnel, polyhedron.connections);
+        }
         else // 3.3 Add to scene
         {
             for (unsigned int j = 0; j < tunnel->crossSection.vertices.size(); j++)
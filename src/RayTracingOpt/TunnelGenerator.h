@@ -12,6 +12,7 @@ private:
     bool createPolyhedron(
         Polygon &front, Polygon &rear, Polyhedron &polyhedron,
         int &connBC, int &connAD, int &connBoth, int &connInvalid);
+    short addConnectionPattern(Tunnel *tunnel, const std::vector<Polyhedron::ConnectionType> &connections);
 
     /*
 private:
@@ -26,8 +27,9 @@ public:
         float rectWidth, float rectHeight, float archHeight, // cross section attributes
         float pathRadius, float pathAngle, // path attributes
         int archSegments, int pathSegments, // tessellation attributes
-        GeometrySet &scene, Ptr<Material> groundMaterial, Ptr<Material> wallMaterial, 
-        Tunnel::Algorithm algorithm);
+        GeometrySet &scene, unsigned short groundMaterial, unsigned short wallMaterial, 
+        Tunnel::Algorithm algorithm,
+        bool procedural = false); // rebuild the triangles on the fly instead of storing them
 };
 
 #endif
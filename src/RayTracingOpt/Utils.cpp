@@ -11,29 +11,6 @@ int Utils::GetTickCount()
     return (int)::GetTickCount();
 }
 
-void *Utils::AllocCriticalSection()
-{
-    CRITICAL_SECTION *cs = new CRITICAL_SECTION();
-    InitializeCriticalSection(cs);
-    return cs;
-}
-
-void Utils::Lock(void *cs)
-{
-    EnterCriticalSection((CRITICAL_SECTION *)cs);
-}
-
-void Utils::Unlock(void *cs)
-{
-    LeaveCriticalSection((CRITICAL_SECTION *)cs);
-}
-
-void Utils::DeleteCriticalSection(void *cs)
-{
-    ::DeleteCriticalSection((CRITICAL_SECTION *)cs);
-    delete (CRITICAL_SECTION *)cs;
-}
-
 void Utils::RegisterOutputTarget(LogCallback target)
 {
     log = target;
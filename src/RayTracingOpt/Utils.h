@@ -12,12 +12,6 @@ public:
     // Added here to avoid include <windows.h>
     static int GetTickCount();
 
-    // Added here to avoid include <windows.h>
-    static void *AllocCriticalSection();
-    static void Lock(void *cs);
-    static void Unlock(void *cs);
-    static void DeleteCriticalSection(void *cs);
-
     // Debug output
     static void RegisterOutputTarget(LogCallback target);
     static void SysDbgPrint(char *format, ...);
@@ -0,0 +1,637 @@
+#include <omp.h> // OpenMP
+#include "WavefrontRenderer.h"
+#include "Utils.h"
+#include "erand48.h"
+
+static const int MAX_DEPTH = 100; // a hard limit of depth, the same as radiance()
+
+// A 32-bit integer hash (the finalizer of MurmurHash3), which turns the index of a sample
+// into the seed of erand48(). Neighboring seeds of a linear congruential generator would
+// give almost the same first numbers.
+static unsigned int Hash(unsigned int h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+// Spreads the lower 10 bits of v to every third bit, used by the Morton code
+static unsigned int SpreadBits(unsigned int v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+void WavefrontRenderer::PathBuffer::resize(int size)
+{
+    ox.resize(size);
+    oy.resize(size);
+    oz.resize(size);
+    dx.resize(size);
+    dy.resize(size);
+    dz.resize(size);
+    wr.resize(size);
+    wg.resize(size);
+    wb.resize(size);
+    lr.resize(size);
+    lg.resize(size);
+    lb.resize(size);
+    pixel.resize(size);
+    depth.resize(size);
+    seeds.resize(size * 3);
+}
+
+void WavefrontRenderer::PathBuffer::copy(int from, PathBuffer &target, int to) const
+{
+    target.ox[to] = ox[from];
+    target.oy[to] = oy[from];
+    target.oz[to] = oz[from];
+    target.dx[to] = dx[from];
+    target.dy[to] = dy[from];
+    target.dz[to] = dz[from];
+    target.wr[to] = wr[from];
+    target.wg[to] = wg[from];
+    target.wb[to] = wb[from];
+    target.lr[to] = lr[from];
+    target.lg[to] = lg[from];
+    target.lb[to] = lb[from];
+    target.pixel[to] = pixel[from];
+    target.depth[to] = depth[from];
+    target.seeds[to * 3] = seeds[from * 3];
+    target.seeds[to * 3 + 1] = seeds[from * 3 + 1];
+    target.seeds[to * 3 + 2] = seeds[from * 3 + 2];
+}
+
+Ray WavefrontRenderer::PathBuffer::getRay(int index) const
+{
+    return Ray(Point(ox[index], oy[index], oz[index]), Vector(dx[index], dy[index], dz[index]));
+}
+
+void WavefrontRenderer::PathBuffer::setRay(int index, const Ray &ray)
+{
+    ox[index] = ray.origin.x;
+    oy[index] = ray.origin.y;
+    oz[index] = ray.origin.z;
+    dx[index] = ray.direction.x;
+    dy[index] = ray.direction.y;
+    dz[index] = ray.direction.z;
+}
+
+void WavefrontRenderer::PathBuffer::swap(PathBuffer &other)
+{
+    ox.swap(other.ox);
+    oy.swap(other.oy);
+    oz.swap(other.oz);
+    dx.swap(other.dx);
+    dy.swap(other.dy);
+    dz.swap(other.dz);
+    wr.swap(other.wr);
+    wg.swap(other.wg);
+    wb.swap(other.wb);
+    lr.swap(other.lr);
+    lg.swap(other.lg);
+    lb.swap(other.lb);
+    pixel.swap(other.pixel);
+    depth.swap(other.depth);
+    seeds.swap(other.seeds);
+}
+
+void WavefrontRenderer::HitBuffer::resize(int size)
+{
+    geometry.resize(size);
+    px.resize(size);
+    py.resize(size);
+    pz.resize(size);
+    nx.resize(size);
+    ny.resize(size);
+    nz.resize(size);
+}
+
+void WavefrontRenderer::ShadingBuffer::resize(int size)
+{
+    px.resize(size);
+    py.resize(size);
+    pz.resize(size);
+    nx.resize(size);
+    ny.resize(size);
+    nz.resize(size);
+    dx.resize(size);
+    dy.resize(size);
+    dz.resize(size);
+    lr.resize(size);
+    lg.resize(size);
+    lb.resize(size);
+    er.resize(size);
+    eg.resize(size);
+    eb.resize(size);
+}
+
+ShadingBatch WavefrontRenderer::ShadingBuffer::getBatch()
+{
+    ShadingBatch batch;
+    batch.px = &px[0];
+    batch.py = &py[0];
+    batch.pz = &pz[0];
+    batch.nx = &nx[0];
+    batch.ny = &ny[0];
+    batch.nz = &nz[0];
+    batch.dx = &dx[0];
+    batch.dy = &dy[0];
+    batch.dz = &dz[0];
+    batch.lr = &lr[0];
+    batch.lg = &lg[0];
+    batch.lb = &lb[0];
+    batch.er = &er[0];
+    batch.eg = &eg[0];
+    batch.eb = &eb[0];
+    return batch;
+}
+
+WavefrontRenderer::WavefrontRenderer(GeometrySet &scene, PerspectiveCamera &camera,
+                                     RenderSetting &setting, int width, int height, int samples,
+                                     bool sortRays)
+    : scene(scene), camera(camera), setting(setting),
+      width(width), height(height), samples(samples), sortRays(sortRays), numPaths(0), numRays(0)
+{
+    reserve(QUEUE_SIZE);
+}
+
+// Makes room for size paths, the queue grows beyond QUEUE_SIZE with the splits
+void WavefrontRenderer::reserve(int size)
+{
+    if (size <= (int)paths.pixel.size())
+        return;
+
+    paths.resize(size);
+    splitPaths.resize(size);
+    split.resize(size);
+    terminated.resize(size);
+    hits.resize(size);
+    shading.resize(size);
+    shadingIndex.resize(size);
+    if (sortRays)
+    {
+        sortedPaths.resize(size);
+        keys.resize(size);
+        sortedKeys.resize(size);
+    }
+}
+
+// Stage 1: appends the camera rays of count samples to the queue
+// The samples of a pixel are consecutive, so that the paths of a pixel are retired together.
+void WavefrontRenderer::generate(long long firstSample, int count)
+{
+    reserve(numPaths + count);
+
+    const float dx = 1.0f / height;
+    const float dy = 1.0f / height;
+
+    #pragma omp parallel for // OpenMP
+
+    for (int i = 0; i < count; i++)
+    {
+        long long k = firstSample + i;
+        int pixel = (int)(k / samples);
+        int x = pixel % width;
+        int y = pixel / width;
+        int index = numPaths + i;
+
+        unsigned int h = Hash((unsigned int)k);
+        unsigned short *Xi = &paths.seeds[index * 3];
+        Xi[0] = (unsigned short)h;
+        Xi[1] = (unsigned short)(h >> 16);
+        Xi[2] = (unsigned short)(k >> 32);
+
+        float r1 = (float)erand48(Xi);
+        float r2 = (float)erand48(Xi);
+        float sx = (x + r1) * dx;
+        float sy = 1 - (y + r2) * dy;
+
+        paths.setRay(index, camera.generateRay(sx, sy));
+        paths.wr[index] = paths.wg[index] = paths.wb[index] = 1;
+        paths.lr[index] = paths.lg[index] = paths.lb[index] = 0;
+        paths.pixel[index] = x * height + y;
+        paths.depth[index] = 0;
+    }
+    numPaths += count;
+}
+
+// Reorders the queue by the octant of the direction and the Morton code of the origin,
+// which is quantized in the bounding box of the origins
+void WavefrontRenderer::sort()
+{
+    Point min(paths.ox[0], paths.oy[0], paths.oz[0]);
+    Point max = min;
+    for (int i = 1; i < numPaths; i++)
+    {
+        min.x = (paths.ox[i] < min.x) ? paths.ox[i] : min.x;
+        min.y = (paths.oy[i] < min.y) ? paths.oy[i] : min.y;
+        min.z = (paths.oz[i] < min.z) ? paths.oz[i] : min.z;
+        max.x = (paths.ox[i] > max.x) ? paths.ox[i] : max.x;
+        max.y = (paths.oy[i] > max.y) ? paths.oy[i] : max.y;
+        max.z = (paths.oz[i] > max.z) ? paths.oz[i] : max.z;
+    }
+
+    const float cells = (float)((1 << MORTON_BITS) - 1);
+    const float sx = (max.x > min.x) ? cells / (max.x - min.x) : 0;
+    const float sy = (max.y > min.y) ? cells / (max.y - min.y) : 0;
+    const float sz = (max.z > min.z) ? cells / (max.z - min.z) : 0;
+
+    #pragma omp parallel for // OpenMP
+
+    for (int i = 0; i < numPaths; i++)
+    {
+        unsigned int octant = (paths.dx[i] < 0 ? 4 : 0) | (paths.dy[i] < 0 ? 2 : 0) | (paths.dz[i] < 0 ? 1 : 0);
+        unsigned int x = (unsigned int)((paths.ox[i] - min.x) * sx);
+        unsigned int y = (unsigned int)((paths.oy[i] - min.y) * sy);
+        unsigned int z = (unsigned int)((paths.oz[i] - min.z) * sz);
+        unsigned int morton = (SpreadBits(x) << 2) | (SpreadBits(y) << 1) | SpreadBits(z);
+        unsigned int key = (octant << (MORTON_BITS * 3)) | morton;
+        keys[i] = ((unsigned long long)key << 32) | (unsigned int)i;
+    }
+
+    // LSD radix sort of the keys, RADIX_BITS at a time
+    for (int shift = 0; shift < MORTON_BITS * 3 + 3; shift += RADIX_BITS)
+    {
+        int offsets[1 << RADIX_BITS] = { 0 };
+        for (int i = 0; i < numPaths; i++)
+        {
+            offsets[(keys[i] >> (32 + shift)) & ((1 << RADIX_BITS) - 1)]++;
+        }
+        for (int i = 0, sum = 0; i < (1 << RADIX_BITS); i++)
+        {
+            int count = offsets[i];
+            offsets[i] = sum;
+            sum += count;
+        }
+        for (int i = 0; i < numPaths; i++)
+        {
+            sortedKeys[offsets[(keys[i] >> (32 + shift)) & ((1 << RADIX_BITS) - 1)]++] = keys[i];
+        }
+        keys.swap(sortedKeys);
+    }
+
+    #pragma omp parallel for // OpenMP
+
+    for (int i = 0; i < numPaths; i++)
+    {
+        paths.copy((int)(keys[i] & 0xffffffff), sortedPaths, i);
+    }
+    paths.swap(sortedPaths);
+}
+
+// Stage 2: finds the closest hit of each path
+void WavefrontRenderer::intersect()
+{
+    #pragma omp parallel for schedule(dynamic, 256) // OpenMP
+
+    for (int i = 0; i < numPaths; i++)
+    {
+        Ray ray = paths.getRay(i);
+        IntersectResult result = scene.intersect(ray);
+        if (result.hit)
+        {
+            hits.geometry[i] = result.geometry;
+            hits.px[i] = result.position.x;
+            hits.py[i] = result.position.y;
+            hits.pz[i] = result.position.z;
+            hits.nx[i] = result.normal.x;
+            hits.ny[i] = result.normal.y;
+            hits.nz[i] = result.normal.z;
+        }
+        else
+        {
+            hits.geometry[i] = NULL;
+        }
+    }
+    numRays += numPaths;
+}
+
+// Groups the hits by material with a counting sort, then gets the local and emission
+// colors of each group with Material::shade()
+void WavefrontRenderer::evaluateMaterials()
+{
+    int numMaterials = scene.getNumMaterials();
+    materialOffsets.assign(numMaterials + 1, 0);
+    for (int i = 0; i < numPaths; i++)
+    {
+        if (hits.geometry[i] != NULL)
+            materialOffsets[hits.geometry[i]->material + 1]++;
+    }
+    for (int m = 0; m < numMaterials; m++)
+    {
+        materialOffsets[m + 1] += materialOffsets[m];
+    }
+
+    chunks.clear();
+    for (int m = 0; m < numMaterials; m++)
+    {
+        for (int begin = materialOffsets[m]; begin < materialOffsets[m + 1]; begin += SHADING_CHUNK)
+        {
+            ShadingChunk chunk;
+            chunk.material = scene.getMaterial((unsigned short)m);
+            chunk.begin = begin;
+            chunk.end = (begin + SHADING_CHUNK < materialOffsets[m + 1]) ? 
+                begin + SHADING_CHUNK : materialOffsets[m + 1];
+            chunks.push_back(chunk);
+        }
+    }
+
+    for (int i = 0; i < numPaths; i++)
+    {
+        shadingIndex[i] = (hits.geometry[i] != NULL) ? materialOffsets[hits.geometry[i]->material]++ : -1;
+    }
+
+    #pragma omp parallel for // OpenMP
+
+    for (int i = 0; i < numPaths; i++)
+    {
+        int j = shadingIndex[i];
+        if (j >= 0)
+        {
+            shading.px[j] = hits.px[i];
+            shading.py[j] = hits.py[i];
+            shading.pz[j] = hits.pz[i];
+            shading.nx[j] = hits.nx[i];
+            shading.ny[j] = hits.ny[i];
+            shading.nz[j] = hits.nz[i];
+            shading.dx[j] = paths.dx[i];
+            shading.dy[j] = paths.dy[i];
+            shading.dz[j] = paths.dz[i];
+        }
+    }
+
+    ShadingBatch batch = shading.getBatch();
+    int numChunks = (int)chunks.size();
+
+    #pragma omp parallel for schedule(dynamic, 1) // OpenMP
+
+    for (int c = 0; c < numChunks; c++)
+    {
+        chunks[c].material->shade(batch, chunks[c].begin, chunks[c].end);
+    }
+}
+
+// Stage 3: evaluates the material at the hit of each path, then replaces the ray of the
+// path with the next one, or marks the path as terminated (see radiance())
+void WavefrontRenderer::shade()
+{
+    evaluateMaterials();
+
+    #pragma omp parallel for // OpenMP
+
+    for (int i = 0; i < numPaths; i++)
+    {
+        split[i] = 0;
+        terminated[i] = (hits.geometry[i] == NULL);
+        if (terminated[i])
+            continue;
+
+        unsigned short *Xi = &paths.seeds[i * 3];
+        Ray ray = paths.getRay(i);
+        Color weight(paths.wr[i], paths.wg[i], paths.wb[i]);
+        Color color(paths.lr[i], paths.lg[i], paths.lb[i]);
+        int depth = paths.depth[i];
+
+        Material *material = scene.getMaterial(hits.geometry[i]->material);
+        Point p(hits.px[i], hits.py[i], hits.pz[i]);
+        Vector n(hits.nx[i], hits.ny[i], hits.nz[i]); // points to the outside
+        Vector nl = (n.dot(ray.direction) < 0) ? n : n * -1; // points to the ray
+        int j = shadingIndex[i];
+        Color local(shading.lr[j], shading.lg[j], shading.lb[j]);
+        Color emission(shading.er[j], shading.eg[j], shading.eb[j]);
+
+        float maxColor = (local.r + local.g + local.b) * 0.333333f;
+        bool end = false;
+
+        if (++depth > setting.maxDepth)
+            end = true;
+        else if (depth > setting.terminationDepth && !(erand48(Xi) < maxColor))
+            end = true;
+        else if (depth > MAX_DEPTH)
+            end = true;
+        else if (depth > setting.terminationDepth)
+            local = local * (1 / maxColor);
+
+        float diffusiveness = material->diffusiveness;
+        float reflectiveness = material->reflectiveness;
+        float refractiveness = material->refractiveness;
+        float p_type = end ? 0 : (float)erand48(Xi);
+
+        if (end)
+        {
+            color = color + weight.mult(emission);
+        }
+        else if (diffusiveness > 0 && p_type < diffusiveness)
+        {
+            float r1 = (float)erand48(Xi);
+            float r2 = (float)erand48(Xi);
+            float theta = 2 * PI * r1;
+            float phi = acos(r2);
+
+            Vector w = nl;
+            Vector u = (fabs(w.x) > 0.1) ?
+                Vector(0, 1, 0).cross(w).norm() : Vector(1, 0, 0).cross(w).norm();
+            Vector v = w.cross(u);
+            Vector dir = u * (cos(theta) * sin(phi)) + v * (sin(theta) * sin(phi)) + w * cos(phi);
+
+            color = color + weight.mult(emission);
+            weight = weight.mult(local);
+            ray = Ray(p, dir);
+        }
+        else if (reflectiveness > 0 &&
+            p_type >= diffusiveness &&
+            p_type <= diffusiveness + reflectiveness)
+        {
+            Vector v = ray.direction - nl * 2 * nl.dot(ray.direction);
+
+            color = color + weight.mult(emission);
+            weight = weight.mult(local);
+            ray = Ray(p, v);
+        }
+        else if (refractiveness > 0 && p_type > diffusiveness + reflectiveness)
+        {
+            Ray reflRay(p, ray.direction - n * 2 * n.dot(ray.direction));
+            bool into = n.dot(nl) > 0;
+            float nc = 1;
+            float nt = material->refractive_index;
+            float nnt = into ? nc / nt : nt / nc;
+            float ddn = ray.direction.dot(nl);
+            float cos2t = 1 - nnt * nnt * (1 - ddn * ddn);
+            if (cos2t < 0) // total internal reflection
+            {
+                color = color + weight.mult(emission);
+                weight = weight.mult(local);
+                ray = reflRay;
+            }
+            else
+            {
+                Vector tdir = (ray.direction * nnt - n * ((into ? 1 : -1) * (ddn * nnt + sqrt(cos2t)))).norm();
+                float a = nt - nc;
+                float b = nt + nc;
+                float R0 = a * a / (b * b);
+                float c = 1 - (into ? -ddn : tdir.dot(n));
+                float Re = R0 + (1 - R0) * c * c * c * c * c;
+                float Tr = 1 - Re;
+                float P = 0.25f + 0.5f * Re;
+                float RP = Re / P;
+                float TP = Tr / (1 - P);
+
+                // Neither the emission nor the local color is taken at a refraction
+                if (depth > setting.singleTracingDepth)
+                {
+                    if ((float)erand48(Xi) < P)
+                    {
+                        weight = weight * RP;
+                        ray = reflRay;
+                    }
+                    else
+                    {
+                        weight = weight * TP;
+                        ray = Ray(p, tdir);
+                    }
+                }
+                else
+                {
+                    // The refracted ray starts a second path in the same slot of splitPaths,
+                    // which gathers its own radiance from zero with a new seed
+                    Color splitWeight = weight * Tr;
+                    splitPaths.setRay(i, Ray(p, tdir));
+                    splitPaths.wr[i] = splitWeight.r;
+                    splitPaths.wg[i] = splitWeight.g;
+                    splitPaths.wb[i] = splitWeight.b;
+                    splitPaths.lr[i] = splitPaths.lg[i] = splitPaths.lb[i] = 0;
+                    splitPaths.pixel[i] = paths.pixel[i];
+                    splitPaths.depth[i] = depth;
+
+                    unsigned int h = Hash(((unsigned int)Xi[1] << 16 | Xi[0]) ^ Hash(Xi[2] + depth));
+                    splitPaths.seeds[i * 3] = (unsigned short)h;
+                    splitPaths.seeds[i * 3 + 1] = (unsigned short)(h >> 16);
+                    splitPaths.seeds[i * 3 + 2] = Xi[2];
+                    split[i] = 1;
+
+                    weight = weight * Re;
+                    ray = reflRay;
+                }
+            }
+        }
+        else
+        {
+            // Impossible to reach here
+            color = color + weight.mult(emission);
+            end = true;
+        }
+
+        paths.setRay(i, ray);
+        paths.wr[i] = weight.r;
+        paths.wg[i] = weight.g;
+        paths.wb[i] = weight.b;
+        paths.lr[i] = color.r;
+        paths.lg[i] = color.g;
+        paths.lb[i] = color.b;
+        paths.depth[i] = depth;
+        terminated[i] = end;
+    }
+}
+
+// Stage 4: adds the radiance of the terminated paths to their pixels, moves the remaining
+// paths to the front of the queue, and appends the split paths after them
+void WavefrontRenderer::compact(Color *colors)
+{
+    const float scale = 1.0f / samples;
+    int count = 0;
+    int numSplits = 0;
+
+    for (int i = 0; i < numPaths; i++)
+    {
+        numSplits += split[i];
+        if (terminated[i])
+        {
+            Color &color = colors[paths.pixel[i]];
+            color.r += paths.lr[i] * scale;
+            color.g += paths.lg[i] * scale;
+            color.b += paths.lb[i] * scale;
+        }
+        else
+        {
+            if (count != i)
+                paths.copy(i, paths, count);
+            count++;
+        }
+    }
+
+    if (numSplits > 0)
+    {
+        int oldNumPaths = numPaths;
+        reserve(count + numSplits);
+        for (int i = 0; i < oldNumPaths; i++)
+        {
+            if (split[i])
+                splitPaths.copy(i, paths, count++);
+        }
+    }
+    numPaths = count;
+}
+
+void WavefrontRenderer::render(Color *colors, ProgressCallback progress)
+{
+    const long long total = (long long)width * height * samples;
+    long long next = 0;
+
+    numPaths = 0;
+    numRays = 0;
+    for (int i = 0; i < MAX_STATS_DEPTH; i++)
+    {
+        statsRays[i] = 0;
+        statsSortTime[i] = 0;
+        statsIntersectTime[i] = 0;
+    }
+
+    while (next < total || numPaths > 0)
+    {
+        if (numPaths == 0)
+        {
+            long long count = total - next;
+            if (count > QUEUE_SIZE)
+                count = QUEUE_SIZE;
+
+            generate(next, (int)count);
+            next += count;
+            progress((int)((double)next / total * height), height);
+        }
+
+        int depth = paths.depth[0];
+        int row = (depth < MAX_STATS_DEPTH) ? depth : MAX_STATS_DEPTH - 1;
+        statsRays[row] += numPaths;
+
+        double t1 = omp_get_wtime();
+        if (sortRays && depth > 0) // the camera rays are generated in order
+            sort();
+        double t2 = omp_get_wtime();
+        intersect();
+        double t3 = omp_get_wtime();
+
+        statsSortTime[row] += t2 - t1;
+        statsIntersectTime[row] += t3 - t2;
+
+        shade();
+        compact(colors);
+    }
+
+    Utils::DbgPrint("Depth | Rays        | Sort (ns/ray) | Intersect (ns/ray)\r\n");
+    for (int i = 0; i < MAX_STATS_DEPTH; i++)
+    {
+        if (statsRays[i] > 0)
+        {
+            Utils::DbgPrint("%4d%s | %11lld | %13.1f | %18.1f\r\n", i, (i == MAX_STATS_DEPTH - 1) ? "+" : " ",
+                statsRays[i], statsSortTime[i] * 1e9 / statsRays[i], statsIntersectTime[i] * 1e9 / statsRays[i]);
+        }
+    }
+}
@@ -0,0 +1,143 @@
+#ifndef WAVEFRONT_RENDERER_H
+#define WAVEFRONT_RENDERER_H
+
+#include <vector>
+#include "Camera.h"
+#include "Color.h"
+#include "GeometrySet.h"
+#include "RenderSetting.h"
+#include "Scripts.h"
+
+// Wavefront path tracing, an alternative to the row loop of radiance() in MainWindow.cpp
+// ------------------------------------------------------------------------------------------
+// Instead of following each sample to the end of its path, a large queue of paths is
+// advanced one bounce at a time in stages:
+//     1. generate:  fill the queue with the camera rays of new samples
+//     2. intersect: find the closest hit of each path
+//     3. shade:     evaluate the materials at the hits, then extend each path with the
+//                   next ray or terminate it
+//     4. compact:   retire the terminated paths into the image, and append the second
+//                   paths of the splits at refractive surfaces
+// The paths are stored in the SoA layout. The first three stages are parallel loops over
+// the queue, and the last one is a sequential pass, which also keeps the image updates
+// free of races. The paths follow the same rules as radiance(), but each one has its own
+// random seed, so the noise differs from the row loop.
+//
+// New samples are generated when the queue is empty, so all the paths in the queue have
+// the same depth, and each pass of the stages is one bounce. With sortRays, the queue is
+// sorted before the intersection by the octant of the direction and the Morton code of
+// the origin, so that the rays traced one after another visit the same cells and nodes of
+// the accelerators. The time of the intersection is reported for each depth.
+//
+// The hits are grouped by material before the shading, and each group is evaluated by
+// Material::shade() in a loop over contiguous arrays, with one virtual call per chunk of
+// hits instead of two per hit.
+class WavefrontRenderer
+{
+private:
+    enum { QUEUE_SIZE = 1 << 16 }; // the number of samples in a wave
+    enum { MORTON_BITS = 9 };      // the bits of each axis in the sort key
+    enum { RADIX_BITS = 10 };      // the bits of a pass of the radix sort
+    enum { MAX_STATS_DEPTH = 12 }; // the deeper bounces are counted in the last row
+    enum { SHADING_CHUNK = 1024 }; // the hits shaded by a call of Material::shade()
+
+    // The paths in the SoA layout
+    struct PathBuffer
+    {
+        std::vector<float> ox, oy, oz;     // the ray of the next bounce
+        std::vector<float> dx, dy, dz;
+        std::vector<float> wr, wg, wb;     // the throughput (the weight of the next emission)
+        std::vector<float> lr, lg, lb;     // the radiance gathered so far
+        std::vector<int> pixel;            // index in the image, x * height + y
+        std::vector<int> depth;
+        std::vector<unsigned short> seeds; // the state of erand48(), three for each path
+
+        void resize(int size);
+        void copy(int from, PathBuffer &target, int to) const;
+        Ray getRay(int index) const;
+        void setRay(int index, const Ray &ray);
+        void swap(PathBuffer &other);
+    };
+
+    // The closest hits of the paths in the SoA layout
+    struct HitBuffer
+    {
+        std::vector<Geometry *> geometry; // NULL for a miss
+        std::vector<float> px, py, pz;    // the position
+        std::vector<float> nx, ny, nz;    // the normal, which points to the outside
+
+        void resize(int size);
+    };
+
+    // The hits grouped by material, the input and output of Material::shade()
+    struct ShadingBuffer
+    {
+        std::vector<float> px, py, pz;
+        std::vector<float> nx, ny, nz;
+        std::vector<float> dx, dy, dz;
+        std::vector<float> lr, lg, lb;
+        std::vector<float> er, eg, eb;
+
+        void resize(int size);
+        ShadingBatch getBatch();
+    };
+
+    // A range of the hits of a material in the shading buffer
+    struct ShadingChunk
+    {
+        Material *material;
+        int begin;
+        int end;
+    };
+
+    GeometrySet &scene;
+    PerspectiveCamera &camera;
+    RenderSetting &setting;
+    int width;
+    int height;
+    int samples;
+    bool sortRays;
+
+    int numPaths;            // the paths in the queue
+    PathBuffer paths;
+    PathBuffer splitPaths;   // the second path of a split, in the slot of the first one
+    std::vector<char> split; // whether a slot has a second path
+    std::vector<char> terminated;
+    HitBuffer hits;
+    long long numRays;       // the number of rays traced
+
+    // Sorting
+    PathBuffer sortedPaths;
+    std::vector<unsigned long long> keys; // the sort key in the upper half, the index in the lower
+    std::vector<unsigned long long> sortedKeys;
+
+    // Shading
+    ShadingBuffer shading;
+    std::vector<int> shadingIndex;        // the index of each path in the shading buffer
+    std::vector<int> materialOffsets;     // the first index of each material
+    std::vector<ShadingChunk> chunks;
+
+    // Statistics of each depth
+    long long statsRays[MAX_STATS_DEPTH];
+    double statsSortTime[MAX_STATS_DEPTH];
+    double statsIntersectTime[MAX_STATS_DEPTH];
+
+private:
+    void reserve(int size);
+    void generate(long long firstSample, int count);
+    void sort();
+    void intersect();
+    void evaluateMaterials();
+    void shade();
+    void compact(Color *colors);
+
+public:
+    WavefrontRenderer(GeometrySet &scene, PerspectiveCamera &camera, RenderSetting &setting,
+        int width, int height, int samples, bool sortRays);
+
+    // Renders the image into colors, which is indexed by x * height + y
+    void render(Color *colors, ProgressCallback progress);
+    long long getNumRays() const { return numRays; }
+};
+
+#endif
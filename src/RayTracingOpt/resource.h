@@ -23,3 +23,7 @@
 #define IDC_RENDER                              40018
 #define IDL_TUNNEL_ALGORITHM                    40019
 #define IDC_TUNNEL_ALGORITHM                    40020
+#define IDL_RENDER_MODE                         40021
+#define IDC_RENDER_MODE                         40022
+#define IDL_PRESET                              40023
+#define IDC_PRESET                              40024